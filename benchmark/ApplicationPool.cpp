@@ -1,52 +1,360 @@
-//#define USE_SERVER
-
+/*
+ * ApplicationPool benchmark.
+ *
+ * Hammers an ApplicationPool with a configurable number of threads, and reports
+ * throughput as well as latency percentiles for ApplicationPool::get() and for
+ * releasing a session. Run it from the Passenger source root. Use --help to
+ * see all options.
+ *
+ * When compiled with -DPASSENGER_USE_DUMMY_SPAWN_MANAGER, application instances
+ * are benchmark/DummyRequestHandler processes instead of Ruby processes, so that
+ * only the pool itself is measured. In that case any string can be used as an
+ * application root.
+ *
+ * The number of heap allocations (calls to operator new) in this process is
+ * reported as well. Compile with -DPASSENGER_DISABLE_SLAB_ALLOCATOR to see the
+ * allocations that SlabAllocator saves.
+ */
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <getopt.h>
+#include <sys/time.h>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#ifdef USE_SERVER
-	#include "ApplicationPoolServer.h"
-#else
-	#include "StandardApplicationPool.h"
-#endif
+#include "ApplicationPoolServer.h"
+#include "StandardApplicationPool.h"
 #include "Utils.h"
 #include "Logging.h"
+#include "InstrumentedMutex.h"
 
 using namespace std;
 using namespace boost;
 using namespace Passenger;
 
-#define TRANSACTIONS 20000
-#define CONCURRENCY 24
+typedef unsigned long long Microseconds;
+
+struct Options {
+	bool useServer;
+	unsigned int concurrency;
+	unsigned int transactions;
+	unsigned int apps;
+	vector<string> appRoots;
+	unsigned int poolSize;
+	unsigned int maxPerApp;
+	unsigned int thinkTime;
+	unsigned int holdTime;
+	string serverExecutable;
+	string spawnServer;
+	
+	Options() {
+		useServer = false;
+		concurrency = 24;
+		transactions = 20000;
+		apps = 1;
+		poolSize = 6;
+		maxPerApp = 0;
+		thinkTime = 0;
+		holdTime = 0;
+		serverExecutable = "ext/apache2/ApplicationPoolServerExecutable";
+		spawnServer = "bin/passenger-spawn-server";
+	}
+};
+
+/** Latencies measured by a single benchmark thread. */
+struct ThreadResult {
+	vector<Microseconds> getTimes;
+	vector<Microseconds> releaseTimes;
+	unsigned int errors;
+	
+	ThreadResult() {
+		errors = 0;
+	}
+};
+
+static Options options;
+static volatile unsigned long long allocations = 0;
+
+void *
+operator new(size_t size) throw(std::bad_alloc) {
+	__sync_fetch_and_add(&allocations, 1);
+	void *result = malloc(size == 0 ? 1 : size);
+	if (result == NULL) {
+		throw std::bad_alloc();
+	}
+	return result;
+}
+
+void
+operator delete(void *pointer) throw() {
+	free(pointer);
+}
+
+static Microseconds
+now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (Microseconds) tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-ApplicationPoolPtr pool;
+/**
+ * Busy-wait for the given number of microseconds, in order to simulate
+ * CPU work without giving up the time slice.
+ */
+static void
+spin(unsigned int usec) {
+	Microseconds end = now() + usec;
+	while (now() < end) {
+		// Do nothing.
+	}
+}
 
 static void
-threadMain(unsigned int times) {
+threadMain(ApplicationPoolPtr pool, unsigned int id, unsigned int times, ThreadResult *result) {
+	result->getTimes.reserve(times);
+	result->releaseTimes.reserve(times);
 	for (unsigned int i = 0; i < times; i++) {
-		Application::SessionPtr session(pool->get("test/stub/minimal-railsapp"));
-		for (int x = 0; x < 200000; x++) {
-			// Do nothing.
+		const string &appRoot = options.appRoots[(id + i) % options.appRoots.size()];
+		Microseconds begin, end;
+		
+		try {
+			begin = now();
+			Application::SessionPtr session(pool->get(appRoot));
+			end = now();
+			result->getTimes.push_back(end - begin);
+			
+			if (options.holdTime > 0) {
+				spin(options.holdTime);
+			}
+			
+			begin = now();
+			session.reset();
+			end = now();
+			result->releaseTimes.push_back(end - begin);
+		} catch (const exception &e) {
+			P_WARN("get() failed: " << e.what());
+			result->errors++;
+		}
+		
+		if (options.thinkTime > 0) {
+			usleep(options.thinkTime);
 		}
 	}
 }
 
+static Microseconds
+percentile(const vector<Microseconds> &sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	unsigned int index = (unsigned int) (p / 100.0 * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+static void
+report(const char *name, vector<Microseconds> &times) {
+	Microseconds total = 0;
+	sort(times.begin(), times.end());
+	for (vector<Microseconds>::const_iterator it(times.begin()); it != times.end(); it++) {
+		total += *it;
+	}
+	printf("%-10s count=%lu avg=%.1f p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu (usec)\n",
+		name,
+		(unsigned long) times.size(),
+		times.empty() ? 0.0 : (double) total / times.size(),
+		percentile(times, 50), percentile(times, 90),
+		percentile(times, 99), percentile(times, 99.9),
+		times.empty() ? 0ULL : times.back());
+}
+
+static void
+usage() {
+	printf("Usage: benchmark/ApplicationPool [options]\n"
+		"Options:\n"
+		"  --pool standard|server   Benchmark StandardApplicationPool directly, or\n"
+		"                           through ApplicationPoolServer. Default: standard\n"
+		"  --concurrency N          Number of benchmark threads. Default: 24\n"
+		"  --transactions N         Total number of get() calls. Default: 20000\n"
+		"  --apps N                 Number of distinct applications. Default: 1\n"
+		"  --app-root DIR           Application root to use. May be given multiple\n"
+		"                           times. Default: test/stub/minimal-railsapp\n"
+		"  --pool-size N            ApplicationPool::setMax(). Default: 6\n"
+		"  --max-per-app N          ApplicationPool::setMaxPerApp(). Default: 0\n"
+		"  --hold-time USEC         Time to hold a session (busy-wait). Default: 0\n"
+		"  --think-time USEC        Time to sleep between requests. Default: 0\n"
+		"  --server-executable FILE Default: ext/apache2/ApplicationPoolServerExecutable\n"
+		"  --spawn-server FILE      Default: bin/passenger-spawn-server\n");
+}
+
+static void
+parseOptions(int argc, char *argv[]) {
+	enum {
+		OPT_POOL = 256, OPT_CONCURRENCY, OPT_TRANSACTIONS, OPT_APPS, OPT_APP_ROOT,
+		OPT_POOL_SIZE, OPT_MAX_PER_APP, OPT_HOLD_TIME, OPT_THINK_TIME,
+		OPT_SERVER_EXECUTABLE, OPT_SPAWN_SERVER, OPT_HELP
+	};
+	static const struct option longOptions[] = {
+		{ "pool",              required_argument, NULL, OPT_POOL },
+		{ "concurrency",       required_argument, NULL, OPT_CONCURRENCY },
+		{ "transactions",      required_argument, NULL, OPT_TRANSACTIONS },
+		{ "apps",              required_argument, NULL, OPT_APPS },
+		{ "app-root",          required_argument, NULL, OPT_APP_ROOT },
+		{ "pool-size",         required_argument, NULL, OPT_POOL_SIZE },
+		{ "max-per-app",       required_argument, NULL, OPT_MAX_PER_APP },
+		{ "hold-time",         required_argument, NULL, OPT_HOLD_TIME },
+		{ "think-time",        required_argument, NULL, OPT_THINK_TIME },
+		{ "server-executable", required_argument, NULL, OPT_SERVER_EXECUTABLE },
+		{ "spawn-server",      required_argument, NULL, OPT_SPAWN_SERVER },
+		{ "help",              no_argument,       NULL, OPT_HELP },
+		{ NULL, 0, NULL, 0 }
+	};
+	int c;
+	
+	while ((c = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+		switch (c) {
+		case OPT_POOL:
+			if (strcmp(optarg, "standard") == 0) {
+				options.useServer = false;
+			} else if (strcmp(optarg, "server") == 0) {
+				options.useServer = true;
+			} else {
+				fprintf(stderr, "Invalid --pool value '%s'.\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_CONCURRENCY:
+			options.concurrency = atoi(optarg);
+			break;
+		case OPT_TRANSACTIONS:
+			options.transactions = atoi(optarg);
+			break;
+		case OPT_APPS:
+			options.apps = atoi(optarg);
+			break;
+		case OPT_APP_ROOT:
+			options.appRoots.push_back(optarg);
+			break;
+		case OPT_POOL_SIZE:
+			options.poolSize = atoi(optarg);
+			break;
+		case OPT_MAX_PER_APP:
+			options.maxPerApp = atoi(optarg);
+			break;
+		case OPT_HOLD_TIME:
+			options.holdTime = atoi(optarg);
+			break;
+		case OPT_THINK_TIME:
+			options.thinkTime = atoi(optarg);
+			break;
+		case OPT_SERVER_EXECUTABLE:
+			options.serverExecutable = optarg;
+			break;
+		case OPT_SPAWN_SERVER:
+			options.spawnServer = optarg;
+			break;
+		case 'h':
+		case OPT_HELP:
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (options.concurrency == 0 || options.apps == 0) {
+		fprintf(stderr, "--concurrency and --apps must be at least 1.\n");
+		exit(1);
+	}
+	
+	if (options.appRoots.empty()) {
+		options.appRoots.push_back("test/stub/minimal-railsapp");
+	}
+	/*
+	 * The pool identifies applications by their application root, so more
+	 * distinct applications are simulated by referring to the same directory
+	 * through different paths.
+	 */
+	unsigned int given = options.appRoots.size();
+	for (unsigned int i = given; i < options.apps; i++) {
+		string root(options.appRoots[i % given]);
+		for (unsigned int j = 0; j < i / given; j++) {
+			root.append("/.");
+		}
+		options.appRoots.push_back(root);
+	}
+}
+
 int
-main() {
-	thread_group tg;
-	#ifdef USE_SERVER
-		ApplicationPoolServer server("ext/apache2/ApplicationPoolServerExecutable",
-			"bin/passenger-spawn-server");
-		pool = server.connect();
-	#else
-		pool = ptr(new StandardApplicationPool("bin/passenger-spawn-server"));
-	#endif
-	pool->setMax(6);
+main(int argc, char *argv[]) {
+	parseOptions(argc, argv);
+	
+	shared_ptr<ApplicationPoolServer> server;
+	vector<ApplicationPoolPtr> pools;
 	
-	for (int i = 0; i < CONCURRENCY; i++) {
-		tg.create_thread(boost::bind(&threadMain, TRANSACTIONS / CONCURRENCY));
+	if (options.useServer) {
+		server = ptr(new ApplicationPoolServer(options.serverExecutable,
+			options.spawnServer));
+		// Each thread gets its own connection, just like Apache processes do.
+		for (unsigned int i = 0; i < options.concurrency; i++) {
+			pools.push_back(server->connect());
+		}
+	} else {
+		pools.push_back(ptr(new StandardApplicationPool(options.spawnServer)));
 	}
+	pools[0]->setMax(options.poolSize);
+	pools[0]->setMaxPerApp(options.maxPerApp);
 	
+	vector<ThreadResult> results(options.concurrency);
+	thread_group tg;
+	/* Warm up, so that allocations made while spawning applications and
+	 * filling caches aren't counted.
+	 */
+	for (unsigned int i = 0; i < options.appRoots.size(); i++) {
+		pools[0]->get(options.appRoots[i]);
+	}
+	unsigned long long allocationsBefore = allocations;
+	Microseconds begin = now();
+	for (unsigned int i = 0; i < options.concurrency; i++) {
+		unsigned int times = options.transactions / options.concurrency;
+		if (i < options.transactions % options.concurrency) {
+			times++;
+		}
+		tg.create_thread(boost::bind(&threadMain, pools[i % pools.size()],
+			i, times, &results[i]));
+	}
 	tg.join_all();
+	Microseconds elapsed = now() - begin;
+	unsigned long long allocationsDuring = allocations - allocationsBefore;
+	
+	vector<Microseconds> getTimes, releaseTimes;
+	unsigned int errors = 0;
+	for (vector<ThreadResult>::const_iterator it(results.begin()); it != results.end(); it++) {
+		getTimes.insert(getTimes.end(), it->getTimes.begin(), it->getTimes.end());
+		releaseTimes.insert(releaseTimes.end(), it->releaseTimes.begin(), it->releaseTimes.end());
+		errors += it->errors;
+	}
+	
+	printf("pool=%s concurrency=%u transactions=%u apps=%u pool-size=%u "
+		"max-per-app=%u hold-time=%u think-time=%u\n",
+		options.useServer ? "server" : "standard",
+		options.concurrency, options.transactions, (unsigned int) options.appRoots.size(),
+		options.poolSize, options.maxPerApp, options.holdTime, options.thinkTime);
+	printf("elapsed=%.3f sec throughput=%.1f gets/sec errors=%u\n",
+		elapsed / 1000000.0, getTimes.size() / (elapsed / 1000000.0), errors);
+	printf("heap allocations=%llu (%.2f per transaction, including the benchmark's own)\n",
+		allocationsDuring,
+		getTimes.empty() ? 0.0 : (double) allocationsDuring / getTimes.size());
+	report("get", getTimes);
+	/*
+	 * Releasing a session is dominated by waiting for the pool lock, so
+	 * its latency is an indication of lock contention. Run with
+	 * PASSENGER_LOCK_STATS=1 for detailed lock statistics.
+	 */
+	report("release", releaseTimes);
+	printf("%s", InstrumentedMutex::allStatistics().c_str());
 	return 0;
 }
-
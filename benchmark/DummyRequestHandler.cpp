@@ -1,29 +1,37 @@
+/*
+ * A minimal request handler, for use with DummySpawnManager.
+ *
+ * It speaks the same protocol as the Ruby request handlers: the listener
+ * socket is passed as standard input and the owner pipe as file descriptor 3.
+ * The handler exits when the owner pipe is closed.
+ *
+ * The request body is read and discarded.
+ */
 #include "MessageChannel.h"
 #include "Utils.cpp"
 #include "Logging.cpp"
 #include <vector>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <signal.h>
 #include <errno.h>
 
 using namespace std;
 using namespace Passenger;
 
+#define OWNER_PIPE_FD 3
+
+/**
+ * If the request contains this header, then the response body consists of
+ * that many bytes. Otherwise the request headers are echoed back.
+ */
+#define RESPONSE_SIZE_HEADER "HTTP_X_DUMMY_RESPONSE_SIZE"
+
 typedef vector< pair<string, string> > HeaderSet;
 
 static void
-readHeaders(int reader, HeaderSet &headers) {
-	string buffer;
-	char buffer2[1024 * 32];
-	buffer.reserve(1024 * 32);
-	while (true) {
-		ssize_t ret = read(reader, buffer2, sizeof(buffer2));
-		if (ret == 0) {
-			break;
-		} else {
-			buffer.append(buffer2, ret);
-		}
-	}
-	
+parseHeaders(const string &buffer, HeaderSet &headers) {
 	string::size_type start = 0;
 	string::size_type pos;
 	while (true) {
@@ -32,6 +40,9 @@ readHeaders(int reader, HeaderSet &headers) {
 			string name(buffer.substr(start, pos - start));
 			start = pos + 1;
 			pos = buffer.find('\0', start);
+			if (pos == string::npos) {
+				break;
+			}
 			string value(buffer.substr(start, pos - start));
 			start = pos + 1;
 			headers.push_back(make_pair(name, value));
@@ -42,20 +53,46 @@ readHeaders(int reader, HeaderSet &headers) {
 }
 
 static void
-processRequest(int reader, int writer) {
+discardRequestBody(int fd) {
+	char buf[1024 * 32];
+	ssize_t ret;
+	do {
+		ret = read(fd, buf, sizeof(buf));
+	} while (ret > 0 || (ret == -1 && errno == EINTR));
+}
+
+static void
+processRequest(int fd) {
+	MessageChannel channel(fd);
+	string headerData;
 	HeaderSet headers;
-	readHeaders(reader, headers);
-	close(reader);
+	
+	if (!channel.readScalar(headerData)) {
+		channel.close();
+		return;
+	}
+	parseHeaders(headerData, headers);
+	discardRequestBody(fd);
 	
 	string content;
-	content.reserve(1024 * 7);
-	content += "<b>Using C++ DummyRequestHandler</b><br>\n";
-	for (HeaderSet::const_iterator it(headers.begin()); it != headers.end(); it++) {
-		content.append("<tt>");
-		content.append(it->first);
-		content.append(" = ");
-		content.append(it->second);
-		content.append("</tt><br>\n");
+	HeaderSet::const_iterator it;
+	for (it = headers.begin(); it != headers.end(); it++) {
+		if (it->first == RESPONSE_SIZE_HEADER) {
+			break;
+		}
+	}
+	if (it != headers.end()) {
+		content.assign(atoi(it->second), 'x');
+	} else {
+		content.reserve(1024 * 7);
+		content += "<b>Using C++ DummyRequestHandler</b><br>\n";
+		for (it = headers.begin(); it != headers.end(); it++) {
+			content.append("<tt>");
+			content.append(it->first);
+			content.append(" = ");
+			content.append(it->second);
+			content.append("</tt><br>\n");
+		}
 	}
 	
 	string header;
@@ -66,36 +103,47 @@ processRequest(int reader, int writer) {
 	header.append(toString(content.size()));
 	header.append("\r\n\r\n");
 	
-	MessageChannel channel(writer);
 	channel.writeRaw(header);
 	channel.writeRaw(content);
 	channel.close();
 }
 
+/**
+ * Wait for the next connection. Returns false if the owner pipe has
+ * been closed, i.e. if we should exit.
+ */
 static bool
-acceptNextRequest(int fd) {
-	char c;
-	if (read(fd, &c, 1) == 0) {
-		return true;
+acceptNextRequest(int listenSocket) {
+	fd_set fds;
+	int ret;
+	
+	FD_ZERO(&fds);
+	FD_SET(listenSocket, &fds);
+	FD_SET(OWNER_PIPE_FD, &fds);
+	ret = select(OWNER_PIPE_FD + 1, &fds, NULL, NULL, NULL);
+	if (ret == -1) {
+		return errno == EINTR;
+	} else if (FD_ISSET(OWNER_PIPE_FD, &fds)) {
+		return false;
 	}
 	
-	MessageChannel listener(fd);
-	int fd1[2], fd2[2];
-	pipe(fd1);
-	pipe(fd2);
-	listener.writeFileDescriptor(fd1[0]);
-	listener.writeFileDescriptor(fd2[1]);
-	close(fd1[0]);
-	close(fd2[1]);
-	processRequest(fd2[0], fd1[1]);
-	return false;
+	int fd = accept(listenSocket, NULL, NULL);
+	if (fd == -1) {
+		return errno == EINTR || errno == ECONNABORTED;
+	}
+	try {
+		processRequest(fd);
+	} catch (const exception &e) {
+		close(fd);
+	}
+	return true;
 }
 
 int
 main() {
-	bool done = false;
-	while (!done) {
-		done = acceptNextRequest(STDIN_FILENO);
+	signal(SIGPIPE, SIG_IGN);
+	while (acceptNextRequest(STDIN_FILENO)) {
+		// Keep serving.
 	}
 	return 0;
 }
@@ -0,0 +1,553 @@
+/*
+ * IPC transport benchmark.
+ *
+ * Measures round trip latency and throughput of the transports that Passenger
+ * uses, or could use, for talking to other processes. Each client thread sends
+ * messages through a MessageChannel to its own echo server process, and waits
+ * for the echo. Latency histograms and percentiles are reported for every
+ * combination of transport, message size and concurrency.
+ *
+ * Transports:
+ *   socketpair        A persistent Unix socket pair.
+ *   pipe              A pair of persistent pipes.
+ *   unix              A persistent connection to a Unix socket on the filesystem.
+ *   unix-connect      A new connection to a Unix socket on the filesystem for
+ *                     every message, like a session to an application instance.
+ *   abstract          A persistent connection to a Unix socket in the abstract
+ *                     namespace (Linux only).
+ *   abstract-connect  A new connection to a Unix socket in the abstract
+ *                     namespace for every message (Linux only).
+ *   fdpass            A persistent Unix socket pair. A file descriptor is passed
+ *                     along with every message, like ApplicationPoolServer does.
+ *
+ * Use --help to see all options.
+ */
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "MessageChannel.h"
+#include "Exceptions.h"
+#include "Utils.h"
+
+using namespace std;
+using namespace boost;
+using namespace Passenger;
+
+typedef unsigned long long Microseconds;
+
+/** Number of buckets in a latency histogram. Bucket <em>i</em> counts latencies below 2^i usec. */
+#define HISTOGRAM_BUCKETS 24
+
+enum Transport {
+	SOCKETPAIR,
+	PIPE,
+	UNIX_SOCKET,
+	UNIX_SOCKET_CONNECT,
+	ABSTRACT_SOCKET,
+	ABSTRACT_SOCKET_CONNECT,
+	FD_PASSING
+};
+
+static const char *transportNames[] = {
+	"socketpair", "pipe", "unix", "unix-connect", "abstract", "abstract-connect", "fdpass"
+};
+
+#define TRANSPORT_COUNT (sizeof(transportNames) / sizeof(transportNames[0]))
+
+/**
+ * The client side and server side of a benchmark channel. For transports that
+ * connect for every message, <tt>clientReader</tt> and <tt>clientWriter</tt>
+ * are -1 and <tt>address</tt> is used instead.
+ */
+struct Endpoint {
+	Transport transport;
+	int clientReader;
+	int clientWriter;
+	struct sockaddr_un address;
+	socklen_t addressLength;
+	pid_t serverPid;
+};
+
+struct ThreadResult {
+	vector<Microseconds> latencies;
+	unsigned int errors;
+	
+	ThreadResult() {
+		errors = 0;
+	}
+};
+
+struct Options {
+	vector<Transport> transports;
+	vector<unsigned int> sizes;
+	vector<unsigned int> concurrencies;
+	unsigned int iterations;
+	bool histogram;
+	
+	Options() {
+		iterations = 10000;
+		histogram = true;
+	}
+};
+
+static Options options;
+
+static Microseconds
+now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (Microseconds) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static bool
+isConnectPerMessage(Transport transport) {
+	return transport == UNIX_SOCKET_CONNECT || transport == ABSTRACT_SOCKET_CONNECT;
+}
+
+static bool
+isListening(Transport transport) {
+	return transport == UNIX_SOCKET || transport == UNIX_SOCKET_CONNECT
+		|| transport == ABSTRACT_SOCKET || transport == ABSTRACT_SOCKET_CONNECT;
+}
+
+static void
+initAddress(Endpoint &endpoint, unsigned int id) {
+	char name[sizeof(endpoint.address.sun_path) - 1];
+	
+	snprintf(name, sizeof(name), "/tmp/passenger_ipc_benchmark.%lu.%u",
+		(unsigned long) getpid(), id);
+	name[sizeof(name) - 1] = '\0';
+	memset(&endpoint.address, 0, sizeof(endpoint.address));
+	endpoint.address.sun_family = AF_UNIX;
+	if (endpoint.transport == ABSTRACT_SOCKET || endpoint.transport == ABSTRACT_SOCKET_CONNECT) {
+		// Abstract namespace names start with a null byte.
+		endpoint.address.sun_path[0] = '\0';
+		memcpy(endpoint.address.sun_path + 1, name, strlen(name));
+		endpoint.addressLength = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+	} else {
+		strcpy(endpoint.address.sun_path, name);
+		endpoint.addressLength = sizeof(endpoint.address);
+	}
+}
+
+static int
+connectToServer(const Endpoint &endpoint) {
+	int fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		throw SystemException("Cannot create a Unix socket", errno);
+	}
+	if (::connect(fd, (const struct sockaddr *) &endpoint.address, endpoint.addressLength) == -1) {
+		int e = errno;
+		close(fd);
+		throw SystemException("Cannot connect to the echo server", e);
+	}
+	return fd;
+}
+
+/**
+ * Echo messages from <tt>reader</tt> back to <tt>writer</tt> until EOF.
+ */
+static void
+echo(Transport transport, int reader, int writer) {
+	MessageChannel input(reader), output(writer);
+	string message;
+	
+	while (input.readScalar(message)) {
+		if (transport == FD_PASSING) {
+			close(input.readFileDescriptor());
+		}
+		output.writeScalar(message);
+	}
+}
+
+static void
+serverMain(Transport transport, int reader, int writer, int listenSocket) {
+	if (listenSocket == -1) {
+		echo(transport, reader, writer);
+	} else if (isConnectPerMessage(transport)) {
+		while (true) {
+			int fd = ::accept(listenSocket, NULL, NULL);
+			if (fd == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			echo(transport, fd, fd);
+			close(fd);
+		}
+	} else {
+		int fd = ::accept(listenSocket, NULL, NULL);
+		if (fd != -1) {
+			echo(transport, fd, fd);
+		}
+	}
+}
+
+/**
+ * Fork an echo server process for the given endpoint, and set up the
+ * client side of the channel.
+ */
+static void
+startServer(Endpoint &endpoint, unsigned int id) {
+	int serverReader = -1, serverWriter = -1, listenSocket = -1;
+	int fds[2], fds2[2];
+	
+	endpoint.clientReader = -1;
+	endpoint.clientWriter = -1;
+	switch (endpoint.transport) {
+	case SOCKETPAIR:
+	case FD_PASSING:
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+			throw SystemException("Cannot create a Unix socket pair", errno);
+		}
+		endpoint.clientReader = endpoint.clientWriter = fds[0];
+		serverReader = serverWriter = fds[1];
+		break;
+	case PIPE:
+		if (pipe(fds) == -1 || pipe(fds2) == -1) {
+			throw SystemException("Cannot create a pipe", errno);
+		}
+		serverReader = fds[0];
+		endpoint.clientWriter = fds[1];
+		endpoint.clientReader = fds2[0];
+		serverWriter = fds2[1];
+		break;
+	default:
+		initAddress(endpoint, id);
+		listenSocket = ::socket(PF_UNIX, SOCK_STREAM, 0);
+		if (listenSocket == -1) {
+			throw SystemException("Cannot create a Unix socket", errno);
+		}
+		if (endpoint.address.sun_path[0] != '\0') {
+			unlink(endpoint.address.sun_path);
+		}
+		if (::bind(listenSocket, (const struct sockaddr *) &endpoint.address,
+		    endpoint.addressLength) == -1) {
+			throw SystemException("Cannot bind a Unix socket", errno);
+		}
+		if (::listen(listenSocket, 128) == -1) {
+			throw SystemException("Cannot listen on a Unix socket", errno);
+		}
+		break;
+	}
+	
+	endpoint.serverPid = fork();
+	if (endpoint.serverPid == 0) {
+		/*
+		 * Close everything except our own end of the channel, in particular
+		 * the client ends of other endpoints. Otherwise those servers
+		 * wouldn't see EOF when the client closes the channel.
+		 */
+		for (long fd = sysconf(_SC_OPEN_MAX) - 1; fd > STDERR_FILENO; fd--) {
+			if (fd != serverReader && fd != serverWriter && fd != listenSocket) {
+				close(fd);
+			}
+		}
+		try {
+			serverMain(endpoint.transport, serverReader, serverWriter, listenSocket);
+		} catch (const exception &e) {
+			fprintf(stderr, "Echo server error: %s\n", e.what());
+		}
+		_exit(0);
+	} else if (endpoint.serverPid == -1) {
+		throw SystemException("Cannot fork a new process", errno);
+	}
+	
+	if (serverReader != -1) {
+		close(serverReader);
+	}
+	if (serverWriter != -1 && serverWriter != serverReader) {
+		close(serverWriter);
+	}
+	if (listenSocket != -1) {
+		close(listenSocket);
+		if (!isConnectPerMessage(endpoint.transport)) {
+			endpoint.clientReader = endpoint.clientWriter = connectToServer(endpoint);
+		}
+	}
+}
+
+static void
+stopServer(Endpoint &endpoint) {
+	if (endpoint.clientReader != -1) {
+		close(endpoint.clientReader);
+	}
+	if (endpoint.clientWriter != -1 && endpoint.clientWriter != endpoint.clientReader) {
+		close(endpoint.clientWriter);
+	}
+	if (isConnectPerMessage(endpoint.transport)) {
+		kill(endpoint.serverPid, SIGTERM);
+	}
+	waitpid(endpoint.serverPid, NULL, 0);
+	if (isListening(endpoint.transport) && endpoint.address.sun_path[0] != '\0') {
+		unlink(endpoint.address.sun_path);
+	}
+}
+
+static void
+clientMain(Endpoint *endpoint, unsigned int size, ThreadResult *result) {
+	string message(size, 'x');
+	string reply;
+	int devnull = -1;
+	
+	result->latencies.reserve(options.iterations);
+	if (endpoint->transport == FD_PASSING) {
+		devnull = open("/dev/null", O_RDONLY);
+	}
+	for (unsigned int i = 0; i < options.iterations; i++) {
+		Microseconds begin = now();
+		try {
+			int reader = endpoint->clientReader;
+			int writer = endpoint->clientWriter;
+			if (isConnectPerMessage(endpoint->transport)) {
+				reader = writer = connectToServer(*endpoint);
+			}
+			
+			MessageChannel output(writer), input(reader);
+			output.writeScalar(message);
+			if (endpoint->transport == FD_PASSING) {
+				output.writeFileDescriptor(devnull);
+			}
+			bool ok = input.readScalar(reply);
+			if (isConnectPerMessage(endpoint->transport)) {
+				close(reader);
+			}
+			if (!ok || reply.size() != size) {
+				throw IOException("The echo server sent an invalid reply");
+			}
+		} catch (const exception &e) {
+			fprintf(stderr, "%s\n", e.what());
+			result->errors++;
+			break;
+		}
+		result->latencies.push_back(now() - begin);
+	}
+	if (devnull != -1) {
+		close(devnull);
+	}
+}
+
+static Microseconds
+percentile(const vector<Microseconds> &sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[(unsigned int) (p / 100.0 * (sorted.size() - 1) + 0.5)];
+}
+
+static void
+printHistogram(const vector<Microseconds> &sorted) {
+	unsigned int buckets[HISTOGRAM_BUCKETS];
+	unsigned int i, first = HISTOGRAM_BUCKETS, last = 0;
+	
+	memset(buckets, 0, sizeof(buckets));
+	for (vector<Microseconds>::const_iterator it(sorted.begin()); it != sorted.end(); it++) {
+		for (i = 0; i < HISTOGRAM_BUCKETS - 1 && *it >= (1ULL << i); i++) {
+			// Find the bucket.
+		}
+		buckets[i]++;
+	}
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (buckets[i] > 0) {
+			if (first == HISTOGRAM_BUCKETS) {
+				first = i;
+			}
+			last = i;
+		}
+	}
+	for (i = first; i <= last && first != HISTOGRAM_BUCKETS; i++) {
+		unsigned int width = (unsigned int) (50.0 * buckets[i] / sorted.size() + 0.5);
+		printf("    < %8llu usec %9u |%s\n", 1ULL << i, buckets[i],
+			string(width, '#').c_str());
+	}
+}
+
+static void
+runBenchmark(Transport transport, unsigned int size, unsigned int concurrency) {
+	vector<Endpoint> endpoints(concurrency);
+	vector<ThreadResult> results(concurrency);
+	thread_group tg;
+	unsigned int i;
+	
+	for (i = 0; i < concurrency; i++) {
+		endpoints[i].transport = transport;
+		startServer(endpoints[i], i);
+	}
+	
+	Microseconds begin = now();
+	for (i = 0; i < concurrency; i++) {
+		tg.create_thread(boost::bind(&clientMain, &endpoints[i], size, &results[i]));
+	}
+	tg.join_all();
+	Microseconds elapsed = now() - begin;
+	
+	for (i = 0; i < concurrency; i++) {
+		stopServer(endpoints[i]);
+	}
+	
+	vector<Microseconds> latencies;
+	unsigned int errors = 0;
+	for (i = 0; i < concurrency; i++) {
+		latencies.insert(latencies.end(), results[i].latencies.begin(),
+			results[i].latencies.end());
+		errors += results[i].errors;
+	}
+	sort(latencies.begin(), latencies.end());
+	
+	double seconds = elapsed / 1000000.0;
+	printf("%-16s size=%-7u concurrency=%-3u %10.0f msg/sec %9.2f MB/sec  "
+		"p50=%llu p90=%llu p99=%llu max=%llu usec%s\n",
+		transportNames[transport], size, concurrency,
+		latencies.size() / seconds,
+		2.0 * latencies.size() * size / seconds / (1024 * 1024),
+		percentile(latencies, 50), percentile(latencies, 90),
+		percentile(latencies, 99), latencies.empty() ? 0ULL : latencies.back(),
+		errors > 0 ? " (errors!)" : "");
+	if (options.histogram) {
+		printHistogram(latencies);
+	}
+	fflush(stdout);
+}
+
+static void
+usage() {
+	printf("Usage: benchmark/IPC [options]\n"
+		"Options:\n"
+		"  --transports LIST   Comma-separated list of transports. Default: all of\n"
+		"                      socketpair,pipe,unix,unix-connect,abstract,\n"
+		"                      abstract-connect,fdpass\n"
+		"  --sizes LIST        Comma-separated list of message sizes in bytes.\n"
+		"                      Default: 64,512,4096,65536\n"
+		"  --concurrency LIST  Comma-separated list of client thread counts.\n"
+		"                      Default: 1,4\n"
+		"  --iterations N      Round trips per client thread. Default: 10000\n"
+		"  --no-histogram      Only print the summary lines.\n");
+}
+
+static void
+parseNumbers(const char *arg, vector<unsigned int> &output) {
+	vector<string> items;
+	split(arg, ',', items);
+	output.clear();
+	for (vector<string>::const_iterator it(items.begin()); it != items.end(); it++) {
+		if (!it->empty()) {
+			output.push_back(atoi(*it));
+		}
+	}
+}
+
+static void
+parseOptions(int argc, char *argv[]) {
+	enum {
+		OPT_TRANSPORTS = 256, OPT_SIZES, OPT_CONCURRENCY, OPT_ITERATIONS,
+		OPT_NO_HISTOGRAM, OPT_HELP
+	};
+	static const struct option longOptions[] = {
+		{ "transports",   required_argument, NULL, OPT_TRANSPORTS },
+		{ "sizes",        required_argument, NULL, OPT_SIZES },
+		{ "concurrency",  required_argument, NULL, OPT_CONCURRENCY },
+		{ "iterations",   required_argument, NULL, OPT_ITERATIONS },
+		{ "no-histogram", no_argument,       NULL, OPT_NO_HISTOGRAM },
+		{ "help",         no_argument,       NULL, OPT_HELP },
+		{ NULL, 0, NULL, 0 }
+	};
+	vector<string> items;
+	unsigned int i;
+	int c;
+	
+	while ((c = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+		switch (c) {
+		case OPT_TRANSPORTS:
+			split(optarg, ',', items);
+			for (vector<string>::const_iterator it(items.begin()); it != items.end(); it++) {
+				for (i = 0; i < TRANSPORT_COUNT && *it != transportNames[i]; i++) {
+					// Find the transport.
+				}
+				if (i == TRANSPORT_COUNT) {
+					fprintf(stderr, "Unknown transport '%s'.\n", it->c_str());
+					exit(1);
+				}
+				options.transports.push_back((Transport) i);
+			}
+			break;
+		case OPT_SIZES:
+			parseNumbers(optarg, options.sizes);
+			break;
+		case OPT_CONCURRENCY:
+			parseNumbers(optarg, options.concurrencies);
+			break;
+		case OPT_ITERATIONS:
+			options.iterations = atoi(optarg);
+			break;
+		case OPT_NO_HISTOGRAM:
+			options.histogram = false;
+			break;
+		case 'h':
+		case OPT_HELP:
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	
+	if (options.transports.empty()) {
+		for (i = 0; i < TRANSPORT_COUNT; i++) {
+			#ifndef __linux__
+				if (i == ABSTRACT_SOCKET || i == ABSTRACT_SOCKET_CONNECT) {
+					continue;
+				}
+			#endif
+			options.transports.push_back((Transport) i);
+		}
+	}
+	if (options.sizes.empty()) {
+		options.sizes.push_back(64);
+		options.sizes.push_back(512);
+		options.sizes.push_back(4096);
+		options.sizes.push_back(65536);
+	}
+	if (options.concurrencies.empty()) {
+		options.concurrencies.push_back(1);
+		options.concurrencies.push_back(4);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	parseOptions(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+	
+	try {
+		for (unsigned int t = 0; t < options.transports.size(); t++) {
+			for (unsigned int s = 0; s < options.sizes.size(); s++) {
+				for (unsigned int c = 0; c < options.concurrencies.size(); c++) {
+					runBenchmark(options.transports[t], options.sizes[s],
+						options.concurrencies[c]);
+				}
+			}
+		}
+	} catch (const exception &e) {
+		fprintf(stderr, "*** %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
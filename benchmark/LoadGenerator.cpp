@@ -0,0 +1,788 @@
+/*
+ * HTTP load generator.
+ *
+ * Sends HTTP requests to a web server, typically a local Apache with Phusion
+ * Passenger serving one of the test applications, and reports throughput and
+ * latency percentiles. Latencies are recorded in HDR-style histograms, which
+ * have a constant relative precision of about 0.1% over the entire range.
+ *
+ * Two modes are supported:
+ *
+ *   closed  --concurrency users each send a request, wait for the response,
+ *           optionally think for a while, and repeat. The request rate is
+ *           determined by the server's speed.
+ *   open    Requests are sent at a fixed rate (--rate), using at most
+ *           --concurrency connections at the same time, regardless of how
+ *           fast the server responds.
+ *
+ * A load generator that waits for the server before sending the next request
+ * doesn't measure the requests that should have been sent while the server
+ * was stalled ("coordinated omission"), and thus reports latencies that are
+ * far too optimistic. Therefore two histograms are kept:
+ *
+ *   service time  The time between sending a request and receiving the
+ *                 complete response.
+ *   latency       Corrected for coordinated omission. In open mode, this is
+ *                 the time between the moment the request was supposed to be
+ *                 sent according to the schedule and receiving the complete
+ *                 response. In closed mode, it's the service time histogram
+ *                 with samples added for the requests that would have been
+ *                 sent every --expected-interval microseconds during a long
+ *                 response (default: the mean service time plus think time).
+ *
+ * The request mix is given with --url, or with --url-file for weighted mixes
+ * and uploads. A URL file contains one request per line:
+ *
+ *   WEIGHT METHOD PATH [BODY_SIZE]
+ *
+ * See benchmark/railsapp.urls for an example. POST and PUT requests without a
+ * body size use --upload-size.
+ *
+ * Example, for test/stub/railsapp deployed on http://railsapp.local/:
+ *
+ *   benchmark/LoadGenerator --host railsapp.local --address 127.0.0.1 \
+ *       --mode open --rate 200 --duration 60 --warmup 10 \
+ *       --url-file benchmark/railsapp.urls --hgrm latency.hgrm
+ *
+ * The file given by --hgrm contains the corrected latency distribution in
+ * the HdrHistogram percentile format (in milliseconds), which can be plotted
+ * with HdrHistogram's plotting tools. Use --help to see all options.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+using namespace boost;
+
+typedef unsigned long long Microseconds;
+
+/**
+ * A histogram with logarithmic buckets that are each subdivided into
+ * SUB_BUCKETS / 2 linear sub-buckets, just like HdrHistogram with 3
+ * significant digits. Values are in microseconds, and values larger than
+ * MAX_VALUE are recorded as MAX_VALUE.
+ */
+class Histogram {
+private:
+	static const unsigned int SUB_BUCKET_BITS = 11;
+	static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static const unsigned int HALF_SUB_BUCKETS = SUB_BUCKETS / 2;
+	static const unsigned int MAX_SHIFT = 22;
+	
+	vector<unsigned long long> counts;
+	unsigned long long totalCount;
+	Microseconds minValue;
+	Microseconds maxValue;
+	
+	static unsigned int highestBit(Microseconds value) {
+		unsigned int result = 0;
+		while (value >>= 1) {
+			result++;
+		}
+		return result;
+	}
+	
+	static unsigned int indexOf(Microseconds value) {
+		if (value < SUB_BUCKETS) {
+			return value;
+		} else {
+			unsigned int shift = highestBit(value) - (SUB_BUCKET_BITS - 1);
+			return SUB_BUCKETS + (shift - 1) * HALF_SUB_BUCKETS
+				+ (value >> shift) - HALF_SUB_BUCKETS;
+		}
+	}
+	
+	/** Returns the largest value that is recorded in the given bucket. */
+	static Microseconds valueOf(unsigned int index) {
+		if (index < SUB_BUCKETS) {
+			return index;
+		} else {
+			unsigned int shift = (index - SUB_BUCKETS) / HALF_SUB_BUCKETS + 1;
+			Microseconds sub = (index - SUB_BUCKETS) % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+			return ((sub + 1) << shift) - 1;
+		}
+	}
+
+public:
+	static const Microseconds MAX_VALUE = (1ULL << (SUB_BUCKET_BITS + MAX_SHIFT)) - 1;
+	
+	Histogram()
+		: counts(SUB_BUCKETS + MAX_SHIFT * HALF_SUB_BUCKETS, 0)
+	{
+		totalCount = 0;
+		minValue = 0;
+		maxValue = 0;
+	}
+	
+	void record(Microseconds value, unsigned long long count = 1) {
+		if (value > MAX_VALUE) {
+			value = MAX_VALUE;
+		}
+		counts[indexOf(value)] += count;
+		if (totalCount == 0 || value < minValue) {
+			minValue = value;
+		}
+		if (value > maxValue) {
+			maxValue = value;
+		}
+		totalCount += count;
+	}
+	
+	void add(const Histogram &other) {
+		for (unsigned int i = 0; i < counts.size(); i++) {
+			counts[i] += other.counts[i];
+		}
+		if (other.totalCount > 0) {
+			if (totalCount == 0 || other.minValue < minValue) {
+				minValue = other.minValue;
+			}
+			if (other.maxValue > maxValue) {
+				maxValue = other.maxValue;
+			}
+		}
+		totalCount += other.totalCount;
+	}
+	
+	/**
+	 * Returns a copy of this histogram, corrected for coordinated omission:
+	 * for every value that's larger than <tt>expectedInterval</tt>, values
+	 * are added for the samples that would have been taken every
+	 * <tt>expectedInterval</tt> usec in the meantime.
+	 */
+	Histogram correctedCopy(Microseconds expectedInterval) const {
+		Histogram result;
+		for (unsigned int i = 0; i < counts.size(); i++) {
+			if (counts[i] == 0) {
+				continue;
+			}
+			Microseconds value = (valueOf(i) > maxValue) ? maxValue : valueOf(i);
+			result.record(value, counts[i]);
+			if (expectedInterval == 0) {
+				continue;
+			}
+			for (Microseconds missing = value - min(value, expectedInterval);
+			     missing >= expectedInterval;
+			     missing -= expectedInterval) {
+				result.record(missing, counts[i]);
+			}
+		}
+		return result;
+	}
+	
+	unsigned long long count() const {
+		return totalCount;
+	}
+	
+	Microseconds max() const {
+		return maxValue;
+	}
+	
+	double mean() const {
+		double total = 0;
+		for (unsigned int i = 0; i < counts.size(); i++) {
+			if (counts[i] > 0) {
+				total += (double) std::min(valueOf(i), maxValue) * counts[i];
+			}
+		}
+		return (totalCount == 0) ? 0.0 : total / totalCount;
+	}
+	
+	double stddev() const {
+		double m = mean();
+		double total = 0;
+		for (unsigned int i = 0; i < counts.size(); i++) {
+			if (counts[i] > 0) {
+				double d = std::min(valueOf(i), maxValue) - m;
+				total += d * d * counts[i];
+			}
+		}
+		return (totalCount == 0) ? 0.0 : sqrt(total / totalCount);
+	}
+	
+	Microseconds valueAtPercentile(double percentile) const {
+		if (totalCount == 0) {
+			return 0;
+		}
+		unsigned long long target = (unsigned long long) ceil(percentile / 100.0 * totalCount);
+		unsigned long long seen = 0;
+		if (target == 0) {
+			target = 1;
+		}
+		for (unsigned int i = 0; i < counts.size(); i++) {
+			seen += counts[i];
+			if (seen >= target) {
+				return std::min(valueOf(i), maxValue);
+			}
+		}
+		return maxValue;
+	}
+	
+	unsigned long long countAtOrBelow(Microseconds value) const {
+		unsigned long long result = 0;
+		unsigned int last = indexOf(std::min(value, MAX_VALUE));
+		for (unsigned int i = 0; i <= last; i++) {
+			result += counts[i];
+		}
+		return result;
+	}
+	
+	/**
+	 * Writes the percentile distribution in the format of HdrHistogram's
+	 * outputPercentileDistribution(), with values in milliseconds.
+	 */
+	void writePercentileDistribution(FILE *f) const {
+		const unsigned int ticksPerHalfDistance = 5;
+		double percentile = 0;
+		
+		fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+			"1/(1-Percentile)");
+		while (totalCount > 0) {
+			Microseconds value = valueAtPercentile(percentile);
+			unsigned long long count = countAtOrBelow(value);
+			double fraction = (double) count / totalCount;
+			if (count == totalCount) {
+				fprintf(f, "%12.3f %14.12f %10llu\n", value / 1000.0, 1.0, count);
+				break;
+			}
+			fprintf(f, "%12.3f %14.12f %10llu %14.2f\n", value / 1000.0, fraction,
+				count, 1 / (1 - fraction));
+			
+			// Report more percentiles as we get closer to 100%.
+			double halfDistance = pow(2.0, floor(log(100.0 / (100.0 - percentile)) / log(2.0)) + 1);
+			percentile += 100.0 / (halfDistance * ticksPerHalfDistance);
+			if (percentile < fraction * 100) {
+				percentile = fraction * 100;
+			}
+		}
+		fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / 1000.0,
+			stddev() / 1000.0);
+		fprintf(f, "#[Max     = %12.3f, Total count    = %12llu]\n", maxValue / 1000.0,
+			totalCount);
+		fprintf(f, "#[Buckets = %12u, SubBuckets     = %12u]\n", MAX_SHIFT + 1, SUB_BUCKETS);
+	}
+};
+
+const Microseconds Histogram::MAX_VALUE;
+
+/** A request in the request mix. */
+struct RequestType {
+	unsigned int weight;
+	string method;
+	string path;
+	unsigned int bodySize;
+	/** The request header, excluding the body. */
+	string header;
+};
+
+struct Options {
+	bool openLoop;
+	string host;
+	string address;
+	unsigned int port;
+	unsigned int concurrency;
+	double rate;
+	unsigned int duration;
+	unsigned int warmup;
+	unsigned int thinkTime;
+	Microseconds expectedInterval;
+	unsigned int uploadSize;
+	unsigned int timeout;
+	vector<RequestType> requestTypes;
+	string hgrmFile;
+	
+	Options() {
+		openLoop = false;
+		host = "localhost";
+		port = 80;
+		concurrency = 10;
+		rate = 100;
+		duration = 30;
+		warmup = 0;
+		thinkTime = 0;
+		expectedInterval = 0;
+		uploadSize = 1024 * 64;
+		timeout = 60;
+	}
+};
+
+/** The results of a single benchmark thread. */
+struct ThreadResult {
+	Histogram latency;
+	Histogram serviceTime;
+	map<int, unsigned long long> statusCodes;
+	unsigned long long errors;
+	unsigned long long bytesReceived;
+	
+	ThreadResult() {
+		errors = 0;
+		bytesReceived = 0;
+	}
+};
+
+static Options options;
+static struct sockaddr_storage serverAddress;
+static socklen_t serverAddressLength;
+static vector<unsigned int> weightTable;
+static string uploadBody;
+static Microseconds startTime;
+static Microseconds warmupEnd;
+static Microseconds endTime;
+static volatile unsigned long long nextRequest = 0;
+
+static Microseconds
+now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (Microseconds) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+sleepUntil(Microseconds time) {
+	Microseconds current = now();
+	while (current < time) {
+		usleep(time - current);
+		current = now();
+	}
+}
+
+static bool
+writeFully(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t ret = write(fd, data, size);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+/**
+ * Perform a single request over a new connection. Returns the HTTP status
+ * code, or -1 if an error occurred.
+ */
+static int
+performRequest(const RequestType &type, ThreadResult *result) {
+	int fd = socket(serverAddress.ss_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	
+	struct timeval tv;
+	tv.tv_sec = options.timeout;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	int optval = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	
+	if (::connect(fd, (const struct sockaddr *) &serverAddress, serverAddressLength) == -1
+	 || !writeFully(fd, type.header.data(), type.header.size())
+	 || !writeFully(fd, uploadBody.data(), type.bodySize)) {
+		close(fd);
+		return -1;
+	}
+	
+	// The request contains "Connection: close", so read until EOF.
+	char buf[1024 * 16];
+	char statusLine[16];
+	size_t statusLineSize = 0;
+	ssize_t ret;
+	do {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret > 0) {
+			result->bytesReceived += ret;
+			size_t n = std::min((size_t) ret, sizeof(statusLine) - 1 - statusLineSize);
+			memcpy(statusLine + statusLineSize, buf, n);
+			statusLineSize += n;
+		}
+	} while (ret > 0 || (ret == -1 && errno == EINTR));
+	close(fd);
+	
+	statusLine[statusLineSize] = '\0';
+	if (ret == -1 || strncmp(statusLine, "HTTP/", 5) != 0 || strchr(statusLine, ' ') == NULL) {
+		return -1;
+	}
+	return atoi(strchr(statusLine, ' ') + 1);
+}
+
+/** Pick the request type for the given request number from the weighted mix. */
+static const RequestType &
+pickRequestType(unsigned long long number) {
+	// A multiplicative hash spreads the types evenly, but not in a fixed order.
+	unsigned long long slot = (number * 2654435761ULL) % weightTable.size();
+	return options.requestTypes[weightTable[slot]];
+}
+
+static void
+threadMain(unsigned int id, ThreadResult *result) {
+	unsigned long long number = id;
+	
+	while (true) {
+		Microseconds intendedStart;
+		
+		if (options.openLoop) {
+			number = __sync_fetch_and_add(&nextRequest, 1);
+			intendedStart = startTime + (Microseconds) (number * 1000000.0 / options.rate);
+			if (intendedStart >= endTime) {
+				break;
+			}
+			sleepUntil(intendedStart);
+		} else {
+			intendedStart = now();
+			if (intendedStart >= endTime) {
+				break;
+			}
+			number += options.concurrency;
+		}
+		
+		Microseconds begin = now();
+		int status = performRequest(pickRequestType(number), result);
+		Microseconds end = now();
+		
+		if (intendedStart >= warmupEnd) {
+			if (status == -1) {
+				result->errors++;
+			} else {
+				result->statusCodes[status]++;
+				result->serviceTime.record(end - begin);
+				result->latency.record(end - intendedStart);
+			}
+		}
+		
+		if (!options.openLoop && options.thinkTime > 0) {
+			usleep(options.thinkTime);
+		}
+	}
+}
+
+static void
+report(const char *name, const Histogram &histogram) {
+	printf("%-13s count=%llu mean=%.1f p50=%llu p90=%llu p99=%llu p99.9=%llu "
+		"p99.99=%llu max=%llu (usec)\n",
+		name, histogram.count(), histogram.mean(),
+		histogram.valueAtPercentile(50), histogram.valueAtPercentile(90),
+		histogram.valueAtPercentile(99), histogram.valueAtPercentile(99.9),
+		histogram.valueAtPercentile(99.99), histogram.max());
+}
+
+static void
+addRequestType(unsigned int weight, const string &method, const string &path, int bodySize) {
+	RequestType type;
+	type.weight = weight;
+	type.method = method;
+	type.path = path;
+	if (bodySize >= 0) {
+		type.bodySize = bodySize;
+	} else if (method == "POST" || method == "PUT") {
+		type.bodySize = options.uploadSize;
+	} else {
+		type.bodySize = 0;
+	}
+	options.requestTypes.push_back(type);
+}
+
+static void
+loadURLFile(const char *filename) {
+	ifstream f(filename);
+	string line;
+	unsigned int lineNumber = 0;
+	
+	if (!f) {
+		fprintf(stderr, "Cannot open URL file '%s'.\n", filename);
+		exit(1);
+	}
+	while (getline(f, line)) {
+		lineNumber++;
+		if (line.empty() || line[0] == '#' || line.find_first_not_of(" \t") == string::npos) {
+			continue;
+		}
+		
+		istringstream stream(line);
+		unsigned int weight;
+		string method, path;
+		int bodySize = -1;
+		if (!(stream >> weight >> method >> path) || weight == 0) {
+			fprintf(stderr, "%s:%u: expected 'WEIGHT METHOD PATH [BODY_SIZE]'.\n",
+				filename, lineNumber);
+			exit(1);
+		}
+		stream >> bodySize;
+		addRequestType(weight, method, path, bodySize);
+	}
+}
+
+/** Resolve the server address and build the request headers. */
+static void
+prepare() {
+	struct addrinfo hints, *res;
+	string address(options.address.empty() ? options.host : options.address);
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int ret = getaddrinfo(address.c_str(), NULL, &hints, &res);
+	if (ret != 0) {
+		fprintf(stderr, "Cannot resolve '%s': %s\n", address.c_str(), gai_strerror(ret));
+		exit(1);
+	}
+	memcpy(&serverAddress, res->ai_addr, res->ai_addrlen);
+	serverAddressLength = res->ai_addrlen;
+	freeaddrinfo(res);
+	if (serverAddress.ss_family == AF_INET) {
+		((struct sockaddr_in *) &serverAddress)->sin_port = htons(options.port);
+	} else {
+		((struct sockaddr_in6 *) &serverAddress)->sin6_port = htons(options.port);
+	}
+	
+	unsigned int maxBodySize = 0;
+	for (unsigned int i = 0; i < options.requestTypes.size(); i++) {
+		RequestType &type = options.requestTypes[i];
+		stringstream header;
+		
+		header << type.method << " " << type.path << " HTTP/1.1\r\n";
+		header << "Host: " << options.host << "\r\n";
+		header << "User-Agent: Passenger LoadGenerator\r\n";
+		header << "Connection: close\r\n";
+		if (type.bodySize > 0 || type.method == "POST" || type.method == "PUT") {
+			header << "Content-Type: application/octet-stream\r\n";
+			header << "Content-Length: " << type.bodySize << "\r\n";
+		}
+		header << "\r\n";
+		type.header = header.str();
+		
+		maxBodySize = std::max(maxBodySize, type.bodySize);
+		for (unsigned int j = 0; j < type.weight; j++) {
+			weightTable.push_back(i);
+		}
+	}
+	uploadBody.assign(maxBodySize, 'x');
+}
+
+static void
+usage() {
+	printf("Usage: benchmark/LoadGenerator [options]\n"
+		"Options:\n"
+		"  --host NAME              Value of the Host header, and the server to connect\n"
+		"                           to if --address isn't given. Default: localhost\n"
+		"  --address ADDRESS        Server address to connect to.\n"
+		"  --port N                 Default: 80\n"
+		"  --mode closed|open       Closed-loop or open-loop mode. Default: closed\n"
+		"  --concurrency N          Number of users (closed mode) or maximum number of\n"
+		"                           concurrent connections (open mode). Default: 10\n"
+		"  --rate N                 Requests per second (open mode). Default: 100\n"
+		"  --duration SEC           Default: 30\n"
+		"  --warmup SEC             Ignore results of the first SEC seconds. Default: 0\n"
+		"  --think-time USEC        Time between requests of a user (closed mode).\n"
+		"                           Default: 0\n"
+		"  --expected-interval USEC Expected interval between requests of a user, for\n"
+		"                           coordinated omission correction (closed mode).\n"
+		"                           Default: mean service time + think time\n"
+		"  --url PATH               GET the given path. May be given multiple times.\n"
+		"                           Default: /\n"
+		"  --url-file FILE          Load a weighted request mix from FILE.\n"
+		"  --upload-size BYTES      Body size of POST and PUT requests in the URL file\n"
+		"                           that don't specify one. Default: 65536\n"
+		"  --timeout SEC            Socket timeout. Default: 60\n"
+		"  --hgrm FILE              Write the corrected latency distribution to FILE.\n");
+}
+
+static void
+parseOptions(int argc, char *argv[]) {
+	enum {
+		OPT_HOST = 256, OPT_ADDRESS, OPT_PORT, OPT_MODE, OPT_CONCURRENCY, OPT_RATE,
+		OPT_DURATION, OPT_WARMUP, OPT_THINK_TIME, OPT_EXPECTED_INTERVAL, OPT_URL,
+		OPT_URL_FILE, OPT_UPLOAD_SIZE, OPT_TIMEOUT, OPT_HGRM, OPT_HELP
+	};
+	static const struct option longOptions[] = {
+		{ "host",              required_argument, NULL, OPT_HOST },
+		{ "address",           required_argument, NULL, OPT_ADDRESS },
+		{ "port",              required_argument, NULL, OPT_PORT },
+		{ "mode",              required_argument, NULL, OPT_MODE },
+		{ "concurrency",       required_argument, NULL, OPT_CONCURRENCY },
+		{ "rate",              required_argument, NULL, OPT_RATE },
+		{ "duration",          required_argument, NULL, OPT_DURATION },
+		{ "warmup",            required_argument, NULL, OPT_WARMUP },
+		{ "think-time",        required_argument, NULL, OPT_THINK_TIME },
+		{ "expected-interval", required_argument, NULL, OPT_EXPECTED_INTERVAL },
+		{ "url",               required_argument, NULL, OPT_URL },
+		{ "url-file",          required_argument, NULL, OPT_URL_FILE },
+		{ "upload-size",       required_argument, NULL, OPT_UPLOAD_SIZE },
+		{ "timeout",           required_argument, NULL, OPT_TIMEOUT },
+		{ "hgrm",              required_argument, NULL, OPT_HGRM },
+		{ "help",              no_argument,       NULL, OPT_HELP },
+		{ NULL, 0, NULL, 0 }
+	};
+	vector<string> urlFiles;
+	int c;
+	
+	while ((c = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+		switch (c) {
+		case OPT_HOST:
+			options.host = optarg;
+			break;
+		case OPT_ADDRESS:
+			options.address = optarg;
+			break;
+		case OPT_PORT:
+			options.port = atoi(optarg);
+			break;
+		case OPT_MODE:
+			if (strcmp(optarg, "closed") == 0) {
+				options.openLoop = false;
+			} else if (strcmp(optarg, "open") == 0) {
+				options.openLoop = true;
+			} else {
+				fprintf(stderr, "Invalid --mode value '%s'.\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_CONCURRENCY:
+			options.concurrency = atoi(optarg);
+			break;
+		case OPT_RATE:
+			options.rate = atof(optarg);
+			break;
+		case OPT_DURATION:
+			options.duration = atoi(optarg);
+			break;
+		case OPT_WARMUP:
+			options.warmup = atoi(optarg);
+			break;
+		case OPT_THINK_TIME:
+			options.thinkTime = atoi(optarg);
+			break;
+		case OPT_EXPECTED_INTERVAL:
+			options.expectedInterval = atoll(optarg);
+			break;
+		case OPT_URL:
+			addRequestType(1, "GET", optarg, 0);
+			break;
+		case OPT_URL_FILE:
+			// Loaded later, so that --upload-size may come after --url-file.
+			urlFiles.push_back(optarg);
+			break;
+		case OPT_UPLOAD_SIZE:
+			options.uploadSize = atoi(optarg);
+			break;
+		case OPT_TIMEOUT:
+			options.timeout = atoi(optarg);
+			break;
+		case OPT_HGRM:
+			options.hgrmFile = optarg;
+			break;
+		case 'h':
+		case OPT_HELP:
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	for (unsigned int i = 0; i < urlFiles.size(); i++) {
+		loadURLFile(urlFiles[i].c_str());
+	}
+	if (options.requestTypes.empty()) {
+		addRequestType(1, "GET", "/", 0);
+	}
+	if (options.concurrency == 0 || options.rate <= 0 || options.duration <= options.warmup) {
+		fprintf(stderr, "--concurrency and --rate must be positive, and --duration "
+			"must be larger than --warmup.\n");
+		exit(1);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	parseOptions(argc, argv);
+	prepare();
+	signal(SIGPIPE, SIG_IGN);
+	
+	vector<ThreadResult> results(options.concurrency);
+	thread_group tg;
+	startTime = now();
+	warmupEnd = startTime + (Microseconds) options.warmup * 1000000;
+	endTime = startTime + (Microseconds) options.duration * 1000000;
+	for (unsigned int i = 0; i < options.concurrency; i++) {
+		tg.create_thread(boost::bind(&threadMain, i, &results[i]));
+	}
+	tg.join_all();
+	double measured = (options.duration - options.warmup);
+	
+	ThreadResult total;
+	for (vector<ThreadResult>::const_iterator it(results.begin()); it != results.end(); it++) {
+		total.latency.add(it->latency);
+		total.serviceTime.add(it->serviceTime);
+		total.errors += it->errors;
+		total.bytesReceived += it->bytesReceived;
+		map<int, unsigned long long>::const_iterator sit;
+		for (sit = it->statusCodes.begin(); sit != it->statusCodes.end(); sit++) {
+			total.statusCodes[sit->first] += sit->second;
+		}
+	}
+	
+	Histogram latency;
+	if (options.openLoop) {
+		latency = total.latency;
+	} else {
+		Microseconds interval = options.expectedInterval;
+		if (interval == 0) {
+			interval = (Microseconds) total.serviceTime.mean() + options.thinkTime;
+		}
+		latency = total.serviceTime.correctedCopy(interval);
+	}
+	
+	if (options.openLoop) {
+		printf("mode=open rate=%.1f concurrency=%u duration=%u warmup=%u\n",
+			options.rate, options.concurrency, options.duration, options.warmup);
+	} else {
+		printf("mode=closed concurrency=%u think-time=%u duration=%u warmup=%u\n",
+			options.concurrency, options.thinkTime, options.duration, options.warmup);
+	}
+	printf("requests=%llu errors=%llu throughput=%.1f requests/sec received=%llu bytes\n",
+		total.serviceTime.count(), total.errors,
+		total.serviceTime.count() / measured, total.bytesReceived);
+	map<int, unsigned long long>::const_iterator it;
+	for (it = total.statusCodes.begin(); it != total.statusCodes.end(); it++) {
+		printf("status %d: %llu\n", it->first, it->second);
+	}
+	report("latency", latency);
+	report("service time", total.serviceTime);
+	
+	if (!options.hgrmFile.empty()) {
+		FILE *f = fopen(options.hgrmFile.c_str(), "w");
+		if (f == NULL) {
+			fprintf(stderr, "Cannot write to '%s': %s\n", options.hgrmFile.c_str(),
+				strerror(errno));
+			return 1;
+		}
+		latency.writePercentileDistribution(f);
+		fclose(f);
+	}
+	return 0;
+}
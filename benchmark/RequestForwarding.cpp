@@ -0,0 +1,281 @@
+/*
+ * Request forwarding benchmark.
+ *
+ * Measures the C++ side of forwarding a request to an application, without
+ * Apache: header serialization, connecting a session through the pool, sending
+ * the request body and reading the response. It uses the same code paths as
+ * Hooks::handleRequest(), against benchmark/DummyRequestHandler instances, so
+ * this program must be compiled with -DPASSENGER_USE_DUMMY_SPAWN_MANAGER and
+ * run from the Passenger source root. Use --help to see all options.
+ */
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "StandardApplicationPool.h"
+#include "Utils.h"
+#include "Logging.h"
+
+using namespace std;
+using namespace boost;
+using namespace Passenger;
+
+#ifndef PASSENGER_USE_DUMMY_SPAWN_MANAGER
+	#error "This benchmark must be compiled with -DPASSENGER_USE_DUMMY_SPAWN_MANAGER."
+#endif
+
+typedef unsigned long long Microseconds;
+
+struct Options {
+	unsigned int concurrency;
+	unsigned int requests;
+	unsigned int poolSize;
+	unsigned int headers;
+	unsigned int bodySize;
+	unsigned int responseSize;
+	
+	Options() {
+		concurrency = 4;
+		requests = 20000;
+		poolSize = 4;
+		headers = 10;
+		bodySize = 0;
+		responseSize = 1024;
+	}
+};
+
+struct ThreadResult {
+	unsigned int completed;
+	unsigned int errors;
+	unsigned long long bytesReceived;
+	
+	ThreadResult() {
+		completed = 0;
+		errors = 0;
+		bytesReceived = 0;
+	}
+};
+
+static Options options;
+static ApplicationPoolPtr pool;
+
+static Microseconds
+now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (Microseconds) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static Microseconds
+cpuTime() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (Microseconds) usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec
+		+ (Microseconds) usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+}
+
+/**
+ * Build a header set that resembles the one Hooks::sendHeaders() creates for
+ * a typical request: the standard CGI variables plus <tt>options.headers</tt>
+ * HTTP headers.
+ */
+static void
+addHeaders(string &buffer, const string &bodySize) {
+	appendHeader(buffer, "SERVER_SOFTWARE", "Apache/2.2.8 (Unix)");
+	appendHeader(buffer, "SERVER_PROTOCOL", "HTTP/1.1");
+	appendHeader(buffer, "SERVER_NAME",     "www.example.com");
+	appendHeader(buffer, "SERVER_ADMIN",    "webmaster@example.com");
+	appendHeader(buffer, "SERVER_ADDR",     "127.0.0.1");
+	appendHeader(buffer, "SERVER_PORT",     "80");
+	appendHeader(buffer, "REMOTE_ADDR",     "127.0.0.1");
+	appendHeader(buffer, "REMOTE_PORT",     "51234");
+	appendHeader(buffer, "REQUEST_METHOD",  options.bodySize > 0 ? "POST" : "GET");
+	appendHeader(buffer, "REQUEST_URI",     "/benchmark?foo=bar");
+	appendHeader(buffer, "QUERY_STRING",    "foo=bar");
+	appendHeader(buffer, "DOCUMENT_ROOT",   "/var/www/benchmark/public");
+	appendHeader(buffer, "PATH_INFO",       "/benchmark");
+	if (options.bodySize > 0) {
+		appendHeader(buffer, "CONTENT_TYPE",   "application/octet-stream");
+		appendHeader(buffer, "CONTENT_LENGTH", bodySize.c_str());
+	}
+	appendHeader(buffer, "HTTP_X_DUMMY_RESPONSE_SIZE",
+		toString(options.responseSize).c_str());
+	for (unsigned int i = 0; i < options.headers; i++) {
+		string name("HTTP_X_BENCHMARK_HEADER_");
+		name.append(toString(i));
+		appendHeader(buffer, name.c_str(),
+			"Lorem ipsum dolor sit amet, consectetur adipisicing elit");
+	}
+}
+
+static void
+threadMain(unsigned int times, ThreadResult *result) {
+	string body(options.bodySize, 'x');
+	string bodySize(toString(options.bodySize));
+	char buf[1024 * 32];
+	
+	for (unsigned int i = 0; i < times; i++) {
+		try {
+			Application::SessionPtr session(pool->get("benchmark"));
+			
+			string headers;
+			headers.reserve(1024 * 4);
+			addHeaders(headers, bodySize);
+			terminateHeaders(headers);
+			session->sendHeaders(headers);
+			
+			// Send the body in blocks, like Hooks::sendRequestBody() does.
+			for (unsigned int pos = 0; pos < body.size(); pos += sizeof(buf)) {
+				unsigned int size = body.size() - pos;
+				if (size > sizeof(buf)) {
+					size = sizeof(buf);
+				}
+				session->sendBodyBlock(body.data() + pos, size);
+			}
+			session->shutdownWriter();
+			
+			int fd = session->getStream();
+			ssize_t ret;
+			do {
+				ret = InterruptableCalls::read(fd, buf, sizeof(buf));
+				if (ret > 0) {
+					result->bytesReceived += ret;
+				}
+			} while (ret > 0);
+			if (ret == -1) {
+				throw SystemException("Cannot read the response", errno);
+			}
+			result->completed++;
+		} catch (const exception &e) {
+			P_WARN("Request failed: " << e.what());
+			result->errors++;
+		}
+	}
+}
+
+static void
+usage() {
+	printf("Usage: benchmark/RequestForwarding [options]\n"
+		"Options:\n"
+		"  --concurrency N     Number of benchmark threads. Default: 4\n"
+		"  --requests N        Total number of requests. Default: 20000\n"
+		"  --pool-size N       Number of DummyRequestHandler instances. Default: 4\n"
+		"  --headers N         Number of HTTP headers per request, in addition to\n"
+		"                      the CGI variables. Default: 10\n"
+		"  --body-size BYTES   Request body size. Default: 0\n"
+		"  --response-size BYTES  Response body size. Default: 1024\n");
+}
+
+static void
+parseOptions(int argc, char *argv[]) {
+	enum {
+		OPT_CONCURRENCY = 256, OPT_REQUESTS, OPT_POOL_SIZE, OPT_HEADERS,
+		OPT_BODY_SIZE, OPT_RESPONSE_SIZE, OPT_HELP
+	};
+	static const struct option longOptions[] = {
+		{ "concurrency",   required_argument, NULL, OPT_CONCURRENCY },
+		{ "requests",      required_argument, NULL, OPT_REQUESTS },
+		{ "pool-size",     required_argument, NULL, OPT_POOL_SIZE },
+		{ "headers",       required_argument, NULL, OPT_HEADERS },
+		{ "body-size",     required_argument, NULL, OPT_BODY_SIZE },
+		{ "response-size", required_argument, NULL, OPT_RESPONSE_SIZE },
+		{ "help",          no_argument,       NULL, OPT_HELP },
+		{ NULL, 0, NULL, 0 }
+	};
+	int c;
+	
+	while ((c = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+		switch (c) {
+		case OPT_CONCURRENCY:
+			options.concurrency = atoi(optarg);
+			break;
+		case OPT_REQUESTS:
+			options.requests = atoi(optarg);
+			break;
+		case OPT_POOL_SIZE:
+			options.poolSize = atoi(optarg);
+			break;
+		case OPT_HEADERS:
+			options.headers = atoi(optarg);
+			break;
+		case OPT_BODY_SIZE:
+			options.bodySize = atoi(optarg);
+			break;
+		case OPT_RESPONSE_SIZE:
+			options.responseSize = atoi(optarg);
+			break;
+		case 'h':
+		case OPT_HELP:
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (options.concurrency == 0) {
+		fprintf(stderr, "--concurrency must be at least 1.\n");
+		exit(1);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	parseOptions(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+	
+	pool = ptr(new StandardApplicationPool(""));
+	pool->setMax(options.poolSize);
+	
+	// Spawn all instances up front, so that spawning is not measured.
+	{
+		vector<Application::SessionPtr> sessions;
+		for (unsigned int i = 0; i < options.poolSize; i++) {
+			sessions.push_back(pool->get("benchmark"));
+		}
+	}
+	
+	vector<ThreadResult> results(options.concurrency);
+	thread_group tg;
+	Microseconds beginCpu = cpuTime();
+	Microseconds begin = now();
+	for (unsigned int i = 0; i < options.concurrency; i++) {
+		unsigned int times = options.requests / options.concurrency;
+		if (i < options.requests % options.concurrency) {
+			times++;
+		}
+		tg.create_thread(boost::bind(&threadMain, times, &results[i]));
+	}
+	tg.join_all();
+	Microseconds elapsed = now() - begin;
+	Microseconds cpu = cpuTime() - beginCpu;
+	
+	unsigned int completed = 0, errors = 0;
+	unsigned long long bytesReceived = 0;
+	for (vector<ThreadResult>::const_iterator it(results.begin()); it != results.end(); it++) {
+		completed += it->completed;
+		errors += it->errors;
+		bytesReceived += it->bytesReceived;
+	}
+	
+	printf("concurrency=%u requests=%u pool-size=%u headers=%u body-size=%u response-size=%u\n",
+		options.concurrency, options.requests, options.poolSize, options.headers,
+		options.bodySize, options.responseSize);
+	printf("elapsed=%.3f sec completed=%u errors=%u received=%llu bytes\n",
+		elapsed / 1000000.0, completed, errors, bytesReceived);
+	printf("throughput=%.1f requests/sec\n", completed / (elapsed / 1000000.0));
+	/*
+	 * This is the CPU time spent by this process, i.e. by the forwarding side
+	 * only. The DummyRequestHandler processes are not our children, so their
+	 * CPU time is not included.
+	 */
+	printf("cpu=%.3f sec (%.1f usec/request)\n", cpu / 1000000.0,
+		completed == 0 ? 0.0 : (double) cpu / completed);
+	return 0;
+}
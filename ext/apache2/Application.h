@@ -22,11 +22,13 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
 #include <string>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <ctime>
@@ -35,6 +37,8 @@
 #include "MessageChannel.h"
 #include "Exceptions.h"
 #include "Logging.h"
+#include "Utils.h"
+#include "SlabAllocator.h"
 
 namespace Passenger {
 
@@ -48,6 +52,16 @@ using namespace boost;
  */
 class Application {
 public:
+	/** The type of socket on which an application instance accepts connections. */
+	enum SocketType {
+		/** A Unix socket on the filesystem. */
+		UNIX_SOCKET,
+		/** A Unix socket on the abstract namespace. */
+		ABSTRACT_UNIX_SOCKET,
+		/** A TCP socket. The socket name is in the form of "host:port". */
+		TCP_SOCKET
+	};
+	
 	class Session;
 	/** Convenient alias for Session smart pointer. */
 	typedef shared_ptr<Session> SessionPtr;
@@ -72,8 +86,11 @@ public:
 	 *     This is done by destroying the Session object.
 	 *
 	 * A usage example is shown in Application::connect(). 
+	 *
+	 * A Session is created for every request, so Session objects are allocated
+	 * with SlabAllocator. Implementations should be wrapped with slabPtr().
 	 */
-	class Session {
+	class Session: public SlabAllocated {
 	public:
 		/**
 		 * Implementing classes might throw arbitrary exceptions.
@@ -205,9 +222,9 @@ public:
 		virtual pid_t getPid() const = 0;
 	};
 
-private:
 	/**
-	 * A "standard" implementation of Session.
+	 * A "standard" implementation of Session, which owns a connection
+	 * to an application instance.
 	 */
 	class StandardSession: public Session {
 	protected:
@@ -272,12 +289,136 @@ private:
 			return pid;
 		}
 	};
+	
+	/**
+	 * The maximum number of spare connections that are kept per instance.
+	 * See replenishSpareConnections().
+	 */
+	static const unsigned int MAX_SPARE_CONNECTIONS = 1;
 
+	/**
+	 * The maximum time that connecting to an instance that listens on a TCP
+	 * socket may take, in milliseconds. Such instances are usually on
+	 * other hosts, which may be down.
+	 */
+	static const unsigned int TCP_CONNECT_TIMEOUT = 5000;
+
+private:
 	string appRoot;
 	pid_t pid;
 	string listenSocketName;
-	bool usingAbstractNamespace;
+	SocketType socketType;
 	int ownerPipe;
+	/** The address of a Unix listener socket, computed once by the constructor. */
+	struct sockaddr_un unixAddress;
+	
+	/**
+	 * Connections to this instance that haven't been handed out yet, in the
+	 * order in which they were made. This is a ring buffer of
+	 * <tt>spareCount</tt> elements, starting at <tt>spareHead</tt>.
+	 */
+	mutable int spareConnections[MAX_SPARE_CONNECTIONS];
+	mutable unsigned int spareHead;
+	mutable unsigned int spareCount;
+	/**
+	 * Protects the spare connections. It's also held while connecting, so
+	 * that connections are handed out in the order in which the instance
+	 * accepts them.
+	 */
+	mutable boost::mutex spareConnectionsLock;
+	mutable volatile int replenishScheduled;
+	
+	static void makeUnixAddress(struct sockaddr_un &address, const string &socketName,
+	                            SocketType socketType) {
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (socketType == ABSTRACT_UNIX_SOCKET) {
+			strncpy(address.sun_path + 1, socketName.c_str(),
+				sizeof(address.sun_path) - 1);
+			address.sun_path[0] = '\0';
+		} else if (socketType == UNIX_SOCKET) {
+			strncpy(address.sun_path, socketName.c_str(),
+				sizeof(address.sun_path));
+		}
+		address.sun_path[sizeof(address.sun_path) - 1] = '\0';
+	}
+	
+	void initialize() {
+		makeUnixAddress(unixAddress, listenSocketName, socketType);
+		spareHead = 0;
+		spareCount = 0;
+		replenishScheduled = 0;
+	}
+	
+	int connectToUnixServer() const {
+		return connectToUnixServer(unixAddress, listenSocketName, socketType);
+	}
+	
+	static int connectToUnixServer(const struct sockaddr_un &unixAddress,
+	                               const string &listenSocketName,
+	                               SocketType socketType) {
+		int fd, ret;
+		
+		do {
+			fd = socket(PF_UNIX, SOCK_STREAM, 0);
+		} while (fd == -1 && errno == EINTR);
+		if (fd == -1) {
+			throw SystemException("Cannot create a new unconnected Unix socket", errno);
+		}
+		
+		do {
+			ret = ::connect(fd, (const sockaddr *) &unixAddress, sizeof(unixAddress));
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			int e = errno;
+			string message("Cannot connect to Unix socket '");
+			message.append(listenSocketName);
+			if (socketType == ABSTRACT_UNIX_SOCKET) {
+				message.append("' on the abstract namespace");
+			} else {
+				message.append("'");
+			}
+			do {
+				ret = close(fd);
+			} while (ret == -1 && errno == EINTR);
+			throw SystemException(message, e);
+		}
+		return fd;
+	}
+	
+	/**
+	 * Take the oldest spare connection, skipping connections that the
+	 * instance has closed, e.g. because it crashed. Such connections are
+	 * readable (end-of-file), while a live instance never writes anything
+	 * before it has received a request. Must be called with
+	 * <tt>spareConnectionsLock</tt> held.
+	 *
+	 * @return A connection, or -1 if there are no usable spare connections.
+	 */
+	int takeSpareConnection() const {
+		while (spareCount > 0) {
+			int fd = spareConnections[spareHead];
+			struct pollfd pfd;
+			int ret;
+			
+			spareHead = (spareHead + 1) % MAX_SPARE_CONNECTIONS;
+			spareCount--;
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			do {
+				ret = poll(&pfd, 1, 0);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == 0) {
+				return fd;
+			}
+			do {
+				ret = close(fd);
+			} while (ret == -1 && errno == EINTR);
+		}
+		return -1;
+	}
+
 
 public:
 	/**
@@ -299,20 +440,56 @@ public:
 		appRoot = theAppRoot;
 		this->pid = pid;
 		this->listenSocketName = listenSocketName;
-		this->usingAbstractNamespace = usingAbstractNamespace;
+		socketType = usingAbstractNamespace ? ABSTRACT_UNIX_SOCKET : UNIX_SOCKET;
 		this->ownerPipe = ownerPipe;
+		initialize();
+		P_TRACE(3, "Application " << this << ": created.");
+	}
+	
+	/**
+	 * Construct a new Application object, which may listen on any type
+	 * of socket.
+	 *
+	 * @param theAppRoot The application root of an application.
+	 * @param pid The process ID of this application instance. For instances
+	 *            on other hosts, this is the PID on that host.
+	 * @param listenSocketName The name of the listener socket of this application
+	 *        instance. Its format depends on <tt>socketType</tt>.
+	 * @param socketType The type of the listener socket.
+	 * @param ownerPipe The owner pipe of this application instance, or -1
+	 *        if the instance's life time is managed by something else, e.g.
+	 *        if it runs on another host.
+	 * @post getAppRoot() == theAppRoot && getPid() == pid
+	 */
+	Application(const string &theAppRoot, pid_t pid, const string &listenSocketName,
+	            SocketType socketType, int ownerPipe) {
+		appRoot = theAppRoot;
+		this->pid = pid;
+		this->listenSocketName = listenSocketName;
+		this->socketType = socketType;
+		this->ownerPipe = ownerPipe;
+		initialize();
 		P_TRACE(3, "Application " << this << ": created.");
 	}
 	
 	virtual ~Application() {
 		int ret;
 		
+		// Close the spare connections first, so that an instance which
+		// is waiting for a request on one of them notices the owner pipe.
+		while (spareCount > 0) {
+			do {
+				ret = close(spareConnections[spareHead]);
+			} while (ret == -1 && errno == EINTR);
+			spareHead = (spareHead + 1) % MAX_SPARE_CONNECTIONS;
+			spareCount--;
+		}
 		if (ownerPipe != -1) {
 			do {
 				ret = close(ownerPipe);
 			} while (ret == -1 && errno == EINTR);
 		}
-		if (!usingAbstractNamespace) {
+		if (socketType == UNIX_SOCKET) {
 			do {
 				ret = unlink(listenSocketName.c_str());
 			} while (ret == -1 && errno == EINTR);
@@ -324,7 +501,7 @@ public:
 	 * Returns the application root for this application. See the constructor
 	 * for information about the application root.
 	 */
-	string getAppRoot() const {
+	const string &getAppRoot() const {
 		return appRoot;
 	}
 	
@@ -335,6 +512,18 @@ public:
 		return pid;
 	}
 	
+	/**
+	 * Returns the name of the socket on which this application instance
+	 * accepts connections. See the constructor for its format.
+	 */
+	const string &getListenSocketName() const {
+		return listenSocketName;
+	}
+	
+	SocketType getSocketType() const {
+		return socketType;
+	}
+	
 	/**
 	 * Connect to this application instance with the purpose of sending
 	 * a request to the application. Once connected, a new session will
@@ -384,36 +573,91 @@ public:
 	 * @throws IOException Something went wrong during the connection process.
 	 */
 	SessionPtr connect(const function<void()> &closeCallback) const {
-		int fd, ret;
+		int fd;
 		
-		do {
-			fd = socket(PF_UNIX, SOCK_STREAM, 0);
-		} while (fd == -1 && errno == EINTR);
-		if (fd == -1) {
-			throw SystemException("Cannot create a new unconnected Unix socket", errno);
+		if (socketType == TCP_SOCKET) {
+			fd = connectToTcpServer(listenSocketName, TCP_CONNECT_TIMEOUT);
+		} else {
+			boost::mutex::scoped_lock l(spareConnectionsLock);
+			fd = takeSpareConnection();
+			if (fd == -1) {
+				fd = connectToUnixServer();
+			}
 		}
 		
-		struct sockaddr_un addr;
-		addr.sun_family = AF_UNIX;
-		if (usingAbstractNamespace) {
-			strncpy(addr.sun_path + 1, listenSocketName.c_str(), sizeof(addr.sun_path) - 1);
-			addr.sun_path[0] = '\0';
+		return slabPtr(new StandardSession(pid, closeCallback, fd));
+	}
+	
+	/**
+	 * Connect to the listener socket of an application instance, without
+	 * creating an Application object. Use this for instances that are owned
+	 * by another process: an Application object owns the instance's Unix
+	 * socket, and removes it when it's destroyed.
+	 *
+	 * @return The connection's file descriptor.
+	 * @throws SystemException Something went wrong during the connection process.
+	 * @throws IOException Something went wrong during the connection process.
+	 */
+	static int connectToInstance(const string &socketName, SocketType socketType) {
+		if (socketType == TCP_SOCKET) {
+			return connectToTcpServer(socketName, TCP_CONNECT_TIMEOUT);
 		} else {
-			strncpy(addr.sun_path, listenSocketName.c_str(), sizeof(addr.sun_path));
+			struct sockaddr_un address;
+			makeUnixAddress(address, socketName, socketType);
+			return connectToUnixServer(address, socketName, socketType);
 		}
-		addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
-		do {
-			ret = ::connect(fd, (const sockaddr *) &addr, sizeof(addr));
-		} while (ret == -1 && errno == EINTR);
-		if (ret == -1) {
-			int e = errno;
-			string message("Cannot connect to Unix socket '");
-			message.append(listenSocketName);
-			message.append("' on the abstract namespace");
-			throw SystemException(message, e);
+	}
+	
+	/**
+	 * Returns whether this instance keeps spare connections. Only instances
+	 * that listen on a Unix socket do; connections over the network may be
+	 * dropped by firewalls when they're idle.
+	 */
+	bool usesSpareConnections() const {
+		return socketType != TCP_SOCKET;
+	}
+	
+	/**
+	 * Connect to this instance until it has MAX_SPARE_CONNECTIONS spare
+	 * connections, which connect() hands out before making new ones. The
+	 * instance accepts a connection as soon as it's idle, so handing out a
+	 * spare connection saves both the connect() call and the time the
+	 * instance needs to accept it. Errors are ignored: if the instance can't
+	 * be connected to, then the next connect() call will find out.
+	 *
+	 * This is meant to be called from a background thread; see
+	 * scheduleReplenish().
+	 */
+	void replenishSpareConnections() const {
+		__sync_lock_release(&replenishScheduled);
+		if (!usesSpareConnections()) {
+			return;
 		}
 		
-		return ptr(new StandardSession(pid, closeCallback, fd));
+		boost::mutex::scoped_lock l(spareConnectionsLock);
+		while (spareCount < MAX_SPARE_CONNECTIONS) {
+			int fd;
+			try {
+				fd = connectToUnixServer();
+			} catch (const SystemException &e) {
+				P_TRACE(2, "Cannot create a spare connection to " <<
+					listenSocketName << ": " << e.sys());
+				break;
+			}
+			spareConnections[(spareHead + spareCount) % MAX_SPARE_CONNECTIONS] = fd;
+			spareCount++;
+		}
+	}
+	
+	/**
+	 * Marks this instance as needing replenishSpareConnections().
+	 *
+	 * @return False if it was already marked, i.e. if the caller doesn't
+	 *         need to schedule a call to replenishSpareConnections().
+	 */
+	bool scheduleReplenish() const {
+		return usesSpareConnections()
+		    && __sync_lock_test_and_set(&replenishScheduled, 1) == 0;
 	}
 };
 
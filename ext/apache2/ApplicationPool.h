@@ -22,8 +22,10 @@
 
 #include <boost/shared_ptr.hpp>
 #include <sys/types.h>
+#include <vector>
 
 #include "Application.h"
+#include "PendingGet.h"
 
 namespace Passenger {
 
@@ -88,6 +90,16 @@ using namespace boost;
  */
 class ApplicationPool {
 public:
+	/**
+	 * The priority class of a get() request. When several requests wait for
+	 * room in the pool, those with a higher priority are served first.
+	 */
+	enum Priority {
+		LOW_PRIORITY = 0,
+		NORMAL_PRIORITY = 1,
+		HIGH_PRIORITY = 2
+	};
+	
 	virtual ~ApplicationPool() {};
 	
 	/**
@@ -111,6 +123,11 @@ public:
 	 * @param spawnMethod The spawn method to use. Either "smart" or "conservative".
  	 *                    See the Ruby class SpawnManager for details.
  	 * @param appType The application type. Either "rails" or "rack".
+	 * @param traceId The trace ID of the request for which the session is
+	 *                needed. If not empty, the time spent waiting in the pool
+	 *                and spawning is logged with this ID.
+	 * @param priority The request's priority class. Only matters if the
+	 *                 request has to wait for an instance in the pool.
 	 * @return A session object.
 	 * @throw SpawnException An attempt was made to spawn a new application instance, but that attempt failed.
 	 * @throw BusyException The application pool is too busy right now, and cannot
@@ -125,7 +142,74 @@ public:
 	 */
 	virtual Application::SessionPtr get(const string &appRoot, bool lowerPrivilege = true,
 		const string &lowestUser = "nobody", const string &environment = "production",
-		const string &spawnMethod = "smart", const string &appType = "rails") = 0;
+		const string &spawnMethod = "smart", const string &appType = "rails",
+		const string &traceId = "", Priority priority = NORMAL_PRIORITY) = 0;
+	
+	/**
+	 * Open <tt>count</tt> sessions with the application specified by
+	 * <tt>appRoot</tt> at once. The parameters have the same meaning as
+	 * those of get(). Sessions may be opened with the same instance.
+	 *
+	 * The default implementation calls get() <tt>count</tt> times. Other
+	 * implementations may be more efficient: ApplicationPoolServer's client
+	 * needs only one round trip to the server.
+	 *
+	 * @throw SpawnException
+	 * @throw BusyException
+	 * @throw IOException
+	 * @throw thread_interrupted
+	 * @note If one of the sessions cannot be opened, then the sessions that
+	 *       have already been opened are closed, and an exception is thrown.
+	 * @note The sessions are opened one after another, so <tt>count</tt>
+	 *       shouldn't exceed the number of sessions that the pool can hand
+	 *       out at the same time, or this method blocks until other sessions
+	 *       are closed, which may be never. StandardApplicationPool rejects
+	 *       such requests with a BusyException instead.
+	 */
+	virtual vector<Application::SessionPtr> getMultiple(unsigned int count,
+		const string &appRoot, bool lowerPrivilege = true,
+		const string &lowestUser = "nobody", const string &environment = "production",
+		const string &spawnMethod = "smart", const string &appType = "rails",
+		const string &traceId = "", Priority priority = NORMAL_PRIORITY) {
+		vector<Application::SessionPtr> result;
+		result.reserve(count);
+		for (unsigned int i = 0; i < count; i++) {
+			result.push_back(get(appRoot, lowerPrivilege, lowestUser,
+				environment, spawnMethod, appType, traceId, priority));
+		}
+		return result;
+	}
+	
+	/**
+	 * Start opening a session with the application specified by
+	 * <tt>appRoot</tt>, without waiting for it. The parameters have the
+	 * same meaning as those of get(). The returned PendingGet's file
+	 * descriptor becomes readable when the session has been opened, or
+	 * when get() would have thrown an exception, so that an event-driven
+	 * caller can wait for many pending gets without a thread per get.
+	 *
+	 * The default implementation calls get(), and thus blocks; it returns
+	 * a PendingGet that's already ready. StandardApplicationPool only blocks
+	 * for as long as it takes to hand out an idle instance, and queues the
+	 * get otherwise.
+	 *
+	 * @throw boost::thread_resource_error The PendingGet's file descriptor
+	 *        cannot be created.
+	 * @note Errors that get() would throw are thrown by PendingGet::get().
+	 */
+	virtual PendingGetPtr getAsync(const string &appRoot, bool lowerPrivilege = true,
+		const string &lowestUser = "nobody", const string &environment = "production",
+		const string &spawnMethod = "smart", const string &appType = "rails",
+		const string &traceId = "", Priority priority = NORMAL_PRIORITY) {
+		SettablePendingGetPtr result(new SettablePendingGet());
+		try {
+			result->setSession(get(appRoot, lowerPrivilege, lowestUser,
+				environment, spawnMethod, appType, traceId, priority));
+		} catch (const exception &e) {
+			result->setException(e);
+		}
+		return result;
+	}
 	
 	/**
 	 * Clear all application instances that are currently in the pool.
@@ -137,6 +221,29 @@ public:
 	
 	virtual void setMaxIdleTime(unsigned int seconds) = 0;
 	
+	/**
+	 * Add an application instance that listens on a TCP socket, usually on
+	 * another host, to the pool. Requests for <tt>appRoot</tt> will from now
+	 * on be forwarded to the remote instances of that application, instead
+	 * of to locally spawned instances. The pool doesn't manage the life time
+	 * of remote instances; they're only removed by removeRemoteInstance().
+	 *
+	 * Adding an instance that's already in the pool has no effect.
+	 *
+	 * @param appRoot The application root of the application that the
+	 *                instance belongs to.
+	 * @param address The instance's address, in the form of "host:port".
+	 *                IPv6 addresses must be enclosed in brackets.
+	 */
+	virtual void addRemoteInstance(const string &appRoot, const string &address) = 0;
+	
+	/**
+	 * Remove a remote instance that was added with addRemoteInstance().
+	 * Sessions that are already open are not affected. Removing an instance
+	 * that isn't in the pool has no effect.
+	 */
+	virtual void removeRemoteInstance(const string &appRoot, const string &address) = 0;
+	
 	/**
 	 * Set a hard limit on the number of application instances that this ApplicationPool
 	 * may spawn. The exact behavior depends on the used algorithm, and is not specified by
@@ -173,6 +280,38 @@ public:
 	 */
 	virtual void setMaxPerApp(unsigned int max) = 0;
 	
+	/**
+	 * Set limits on the number of get() requests that may be queued, i.e. that
+	 * wait until an application instance becomes available. Requests beyond
+	 * these limits fail immediately with a BusyException, instead of tying up
+	 * the caller. A value of 0 means no limit.
+	 *
+	 * @param maxPerApp The maximum number of queued requests per application.
+	 * @param maxTotal The maximum number of queued requests for all applications.
+	 * @param maxTime The maximum number of seconds that a request may wait
+	 *                for room in the pool.
+	 */
+	virtual void setRequestQueueLimits(unsigned int maxPerApp, unsigned int maxTotal,
+	                                   unsigned int maxTime) = 0;
+	
+	/**
+	 * Set the share of the pool that the given application is entitled to,
+	 * relative to the other applications. When the pool is full, an
+	 * application may only take an idle instance away from another one if
+	 * that one has more instances per unit of weight, and never below its
+	 * guaranteed minimum. The minimum is also reserved for the application:
+	 * other applications can't spawn into it, and idle instances aren't
+	 * cleaned below it.
+	 *
+	 * Applications without a share have a minimum of 0 and a weight of 1.
+	 *
+	 * @param minInstances The number of instances that are guaranteed
+	 *                     to the application.
+	 * @param weight The application's weight. Must be at least 1.
+	 */
+	virtual void setAppShare(const string &appRoot, unsigned int minInstances,
+	                         unsigned int weight) = 0;
+	
 	/**
 	 * Get the process ID of the spawn server that is used.
 	 *
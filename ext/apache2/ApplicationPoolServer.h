@@ -22,11 +22,18 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
+
+#include <string>
+#include <list>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <cstdio>
 #include <cstdlib>
 #include <limits.h>
@@ -40,6 +47,8 @@
 #include "Exceptions.h"
 #include "Logging.h"
 #include "System.h"
+#include "InstrumentedMutex.h"
+#include "SharedInstanceTable.h"
 
 namespace Passenger {
 
@@ -124,10 +133,21 @@ using namespace boost;
  * server through that socket. The server will then create a new socket pair, and pass one of
  * them back. This new socket pair represents the newly established connection.
  *
+ * <h3>Shared instance table</h3>
+ * Optionally, the server publishes its application instances in a SharedInstanceTable.
+ * The table is created by the ApplicationPoolServer constructor, so Apache worker
+ * processes inherit it. A client first tries to reserve an idle instance in the table
+ * and connect to it directly, which saves the round trip to the server and the
+ * "close" message. Only if there's no idle instance (or if the application must be
+ * restarted) does it ask the server, which spawns instances and shuts them down.
+ *
  * @ingroup Support
  */
 class ApplicationPoolServer {
 private:
+	/** The maximum number of session IDs in a single "close" message. */
+	static const unsigned int MAX_CLOSE_BATCH_SIZE = 256;
+	
 	/**
 	 * Contains data shared between RemoteSession and Client.
 	 * Since RemoteSession and Client have different life times, i.e. one may be
@@ -142,14 +162,81 @@ private:
 		 */
 		int server;
 		
-		boost::mutex lock;
+		InstrumentedMutex lock;
+		
+		/**
+		 * The IDs of destroyed sessions, for which a "close" message
+		 * hasn't been sent yet. When many sessions are destroyed at once,
+		 * they queue their IDs here before waiting for <tt>lock</tt>, and
+		 * whichever thread gets the lock first sends all queued IDs in a
+		 * single message. Protected by <tt>pendingClosesLock</tt>.
+		 */
+		vector<int> pendingCloses;
+		boost::mutex pendingClosesLock;
+		
+		/**
+		 * Whether the reply to a getAsync() call hasn't been read yet.
+		 * No other replies can be read until it has. Protected by <tt>lock</tt>.
+		 */
+		bool getPending;
+		
+		SharedData(): lock("ApplicationPoolServer client") {
+			getPending = false;
+		}
+		
+		/**
+		 * @pre <tt>lock</tt> is held.
+		 * @throws IOException A getAsync() call is pending.
+		 */
+		void checkNoPendingGet() const {
+			if (getPending) {
+				throw IOException("Cannot send a command to the ApplicationPool "
+					"server while the reply to a getAsync() call hasn't been read.");
+			}
+		}
 		
 		~SharedData() {
 			int ret;
+			if (InstrumentedMutex::statisticsEnabled()) {
+				P_WARN("Lock statistics for this ApplicationPoolServer client:\n" <<
+					lock.statistics());
+			}
 			do {
 				ret = close(server);
 			} while (ret == -1 && errno == EINTR);
 		}
+		
+		/**
+		 * Append "close" messages for all queued session IDs to the given
+		 * buffer, and clear the queue.
+		 *
+		 * @pre <tt>lock</tt> is held.
+		 */
+		void appendPendingCloses(string &buffer) {
+			vector<int> ids;
+			list<string> args;
+			
+			{
+				boost::mutex::scoped_lock l(pendingClosesLock);
+				if (pendingCloses.empty()) {
+					return;
+				}
+				ids.swap(pendingCloses);
+			}
+			for (vector<int>::const_iterator it = ids.begin(); it != ids.end(); it++) {
+				if (args.empty()) {
+					args.push_back("close");
+				}
+				args.push_back(toString(*it));
+				if (args.size() > MAX_CLOSE_BATCH_SIZE) {
+					MessageChannel::appendMessage(buffer, args);
+					args.clear();
+				}
+			}
+			if (!args.empty()) {
+				MessageChannel::appendMessage(buffer, args);
+			}
+		}
 	};
 	
 	typedef shared_ptr<SharedData> SharedDataPtr;
@@ -172,9 +259,19 @@ private:
 		}
 		
 		virtual ~RemoteSession() {
+			string buffer;
+			
 			closeStream();
-			boost::mutex::scoped_lock(data->lock);
-			MessageChannel(data->server).write("close", toString(id).c_str(), NULL);
+			{
+				boost::mutex::scoped_lock l(data->pendingClosesLock);
+				data->pendingCloses.push_back(id);
+			}
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			// Our ID may already have been sent by another thread.
+			data->appendPendingCloses(buffer);
+			if (!buffer.empty()) {
+				MessageChannel(data->server).writeRaw(buffer);
+			}
 		}
 		
 		virtual int getStream() const {
@@ -221,6 +318,111 @@ private:
 		}
 	};
 	
+	/**
+	 * Read the server's reply to a "get" command, or to one of the
+	 * sessions requested by a "getMultiple" command.
+	 *
+	 * @pre <tt>data->lock</tt> is held.
+	 */
+	static Application::SessionPtr readGetReply(const SharedDataPtr &data,
+	                                            MessageChannel &channel) {
+		vector<string> args;
+		int stream;
+		bool result;
+		
+		try {
+			result = channel.read(args);
+		} catch (const SystemException &e) {
+			throw SystemException("Could not read a message from "
+				"the ApplicationPool server", e.code());
+		}
+		if (!result) {
+			throw IOException("The ApplicationPool server unexpectedly "
+				"closed the connection.");
+		}
+		if (args[0] == "ok") {
+			stream = channel.readFileDescriptor();
+			return slabPtr(new RemoteSession(data,
+				atoi(args[1]), atoi(args[2]), stream));
+		} else if (args[0] == "SpawnException") {
+			if (args[2] == "true") {
+				string errorPage;
+				
+				if (!channel.readScalar(errorPage)) {
+					throw IOException("The ApplicationPool server "
+						"unexpectedly closed the connection.");
+				}
+				throw SpawnException(args[1], errorPage);
+			} else {
+				throw SpawnException(args[1]);
+			}
+		} else if (args[0] == "BusyException") {
+			throw BusyException(args[1]);
+		} else if (args[0] == "IOException") {
+			throw IOException(args[1]);
+		} else {
+			throw IOException("The ApplicationPool server returned "
+				"an unknown message: " + toString(args));
+		}
+	}
+	
+	/**
+	 * The PendingGet of a "get" command that has been sent to the server,
+	 * and whose reply hasn't been read yet. Its file descriptor is the
+	 * connection with the server, which becomes readable when the reply
+	 * arrives.
+	 */
+	class RemotePendingGet: public PendingGet {
+	private:
+		SharedDataPtr data;
+		bool done;
+		
+	public:
+		RemotePendingGet(const SharedDataPtr &data) {
+			this->data = data;
+			done = false;
+		}
+		
+		virtual ~RemotePendingGet() {
+			if (!done) {
+				// Read the reply, so that the connection can be used again.
+				try {
+					get();
+				} catch (...) {
+					// Ignore; the caller doesn't want the session anyway.
+				}
+			}
+		}
+		
+		virtual int getFd() const {
+			return data->server;
+		}
+		
+		virtual bool isReady() {
+			struct pollfd pfd;
+			pfd.fd = data->server;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			return done || poll(&pfd, 1, 0) > 0;
+		}
+		
+		virtual Application::SessionPtr get() {
+			this_thread::disable_syscall_interruption dsi;
+			MessageChannel channel(data->server);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			
+			done = true;
+			try {
+				Application::SessionPtr session(readGetReply(data, channel));
+				data->getPending = false;
+				return session;
+			} catch (...) {
+				data->getPending = false;
+				throw;
+			}
+		}
+	};
+	
 	/**
 	 * An ApplicationPool implementation that works together with ApplicationPoolServer.
 	 * It doesn't do much by itself, its job is mostly to forward queries/commands to
@@ -232,42 +434,110 @@ private:
 		// We access the shared data via a normal pointer, for performance.
 		SharedDataPtr dataSmartPointer;
 		SharedData *data;
+		SharedInstanceTablePtr sharedTable;
+		
+		/**
+		 * Whether the given application has a restart.txt, in which case
+		 * the server must handle the request, so that it restarts the
+		 * application.
+		 */
+		static bool restartRequested(const string &appRoot) {
+			char restartFile[PATH_MAX];
+			struct stat buf;
+			int ret;
+			
+			snprintf(restartFile, sizeof(restartFile), "%s/tmp/restart.txt",
+				appRoot.c_str());
+			do {
+				ret = stat(restartFile, &buf);
+			} while (ret == -1 && errno == EINTR);
+			return ret == 0;
+		}
+		
+		/**
+		 * Open a session with an idle instance in the shared instance table,
+		 * without asking the server.
+		 *
+		 * @return The session, or a NULL pointer if there's no idle instance
+		 *         or if the server must handle the request.
+		 */
+		Application::SessionPtr getDirectly(const string &appRoot) {
+			SharedInstanceTable::Instance instance;
+			
+			if (sharedTable == NULL || restartRequested(appRoot)
+			 || !sharedTable->reserve(appRoot, instance)) {
+				return Application::SessionPtr();
+			}
+			try {
+				// Don't create an Application object: it would remove the
+				// instance's socket file when it's destroyed.
+				int fd = Application::connectToInstance(instance.socketName,
+					instance.socketType);
+				return slabPtr(new Application::StandardSession(instance.pid,
+					boost::bind(&SharedInstanceTable::releaseReservation,
+						sharedTable, instance.handle),
+					fd));
+			} catch (const exception &e) {
+				// The instance is probably exiting. The server finds
+				// out by itself when it connects to it.
+				sharedTable->releaseReservation(instance.handle);
+				P_DEBUG("Cannot connect to " << appRoot << " (PID " <<
+					instance.pid << ") directly: " << e.what());
+				return Application::SessionPtr();
+			}
+		}
 		
 	public:
 		/**
 		 * Create a new Client.
 		 *
 		 * @param sock The newly established socket connection with the ApplicationPoolServer.
+		 * @param sharedTable The table in which the server publishes its
+		 *            instances, or NULL if it doesn't.
 		 */
-		Client(int sock) {
+		Client(int sock, const SharedInstanceTablePtr &sharedTable = SharedInstanceTablePtr()) {
 			dataSmartPointer = ptr(new SharedData());
 			data = dataSmartPointer.get();
 			data->server = sock;
+			this->sharedTable = sharedTable;
 		}
 		
 		virtual void clear() {
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			channel.write("clear", NULL);
 		}
 		
 		virtual void setMaxIdleTime(unsigned int seconds) {
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			channel.write("setMaxIdleTime", toString(seconds).c_str(), NULL);
 		}
 		
+		virtual void addRemoteInstance(const string &appRoot, const string &address) {
+			MessageChannel channel(data->server);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			channel.write("addRemoteInstance", appRoot.c_str(), address.c_str(), NULL);
+		}
+		
+		virtual void removeRemoteInstance(const string &appRoot, const string &address) {
+			MessageChannel channel(data->server);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			channel.write("removeRemoteInstance", appRoot.c_str(), address.c_str(), NULL);
+		}
+		
 		virtual void setMax(unsigned int max) {
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			channel.write("setMax", toString(max).c_str(), NULL);
 		}
 		
 		virtual unsigned int getActive() const {
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			vector<string> args;
 			
+			data->checkNoPendingGet();
 			channel.write("getActive", NULL);
 			channel.read(args);
 			return atoi(args[0].c_str());
@@ -275,9 +545,10 @@ private:
 		
 		virtual unsigned int getCount() const {
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			vector<string> args;
 			
+			data->checkNoPendingGet();
 			channel.write("getCount", NULL);
 			channel.read(args);
 			return atoi(args[0].c_str());
@@ -285,94 +556,212 @@ private:
 		
 		virtual void setMaxPerApp(unsigned int max) {
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			channel.write("setMaxPerApp", toString(max).c_str(), NULL);
 		}
 		
+		virtual void setRequestQueueLimits(unsigned int maxPerApp, unsigned int maxTotal,
+		                                   unsigned int maxTime) {
+			MessageChannel channel(data->server);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			channel.write("setRequestQueueLimits", toString(maxPerApp).c_str(),
+				toString(maxTotal).c_str(), toString(maxTime).c_str(), NULL);
+		}
+		
+		virtual void setAppShare(const string &appRoot, unsigned int minInstances,
+		                         unsigned int weight) {
+			MessageChannel channel(data->server);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			channel.write("setAppShare", appRoot.c_str(),
+				toString(minInstances).c_str(), toString(weight).c_str(), NULL);
+		}
+		
 		virtual pid_t getSpawnServerPid() const {
 			this_thread::disable_syscall_interruption dsi;
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			vector<string> args;
 			
+			data->checkNoPendingGet();
 			channel.write("getSpawnServerPid", NULL);
 			channel.read(args);
 			return atoi(args[0].c_str());
 		}
 		
+		/**
+		 * Send a "get" or "getMultiple" command, preceded by "close" messages
+		 * for any queued session IDs, with a single write.
+		 *
+		 * @pre <tt>data->lock</tt> is held.
+		 */
+		void sendGetCommand(list<string> &args, const string &appRoot,
+		                    bool lowerPrivilege, const string &lowestUser,
+		                    const string &environment, const string &spawnMethod,
+		                    const string &appType, const string &traceId,
+		                    Priority priority) {
+			string buffer;
+			
+			args.push_back(appRoot);
+			args.push_back((lowerPrivilege) ? "true" : "false");
+			args.push_back(lowestUser);
+			args.push_back(environment);
+			args.push_back(spawnMethod);
+			args.push_back(appType);
+			args.push_back(traceId);
+			args.push_back(toString((int) priority));
+			data->appendPendingCloses(buffer);
+			MessageChannel::appendMessage(buffer, args);
+			try {
+				MessageChannel(data->server).writeRaw(buffer);
+			} catch (const SystemException &) {
+				throw IOException("The ApplicationPool server exited unexpectedly.");
+			}
+		}
+		
 		virtual Application::SessionPtr get(
 			const string &appRoot,
 			bool lowerPrivilege = true,
 			const string &lowestUser = "nobody",
 			const string &environment = "production",
 			const string &spawnMethod = "smart",
-			const string &appType = "rails"
+			const string &appType = "rails",
+			const string &traceId = "",
+			Priority priority = NORMAL_PRIORITY
 		) {
 			this_thread::disable_syscall_interruption dsi;
+			Application::SessionPtr session(getDirectly(appRoot));
+			if (session != NULL) {
+				if (!traceId.empty()) {
+					P_DEBUG("Trace " << traceId << ": shared instance table, PID " <<
+						session->getPid());
+				}
+				return session;
+			}
+			
 			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			vector<string> args;
-			int stream;
-			bool result;
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			list<string> args;
 			
-			try {
-				channel.write("get", appRoot.c_str(),
-					(lowerPrivilege) ? "true" : "false",
-					lowestUser.c_str(),
-					environment.c_str(),
-					spawnMethod.c_str(),
-					appType.c_str(),
-					NULL);
-			} catch (const SystemException &) {
-				throw IOException("The ApplicationPool server exited unexpectedly.");
+			data->checkNoPendingGet();
+			args.push_back("get");
+			sendGetCommand(args, appRoot, lowerPrivilege, lowestUser,
+				environment, spawnMethod, appType, traceId, priority);
+			return readGetReply(dataSmartPointer, channel);
+		}
+		
+		virtual vector<Application::SessionPtr> getMultiple(
+			unsigned int count,
+			const string &appRoot,
+			bool lowerPrivilege = true,
+			const string &lowestUser = "nobody",
+			const string &environment = "production",
+			const string &spawnMethod = "smart",
+			const string &appType = "rails",
+			const string &traceId = "",
+			Priority priority = NORMAL_PRIORITY
+		) {
+			this_thread::disable_syscall_interruption dsi;
+			MessageChannel channel(data->server);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			vector<Application::SessionPtr> result;
+			list<string> args;
+			
+			if (count == 0) {
+				return result;
 			}
+			data->checkNoPendingGet();
+			args.push_back("getMultiple");
+			args.push_back(toString(count));
+			sendGetCommand(args, appRoot, lowerPrivilege, lowestUser,
+				environment, spawnMethod, appType, traceId, priority);
+			result.reserve(count);
 			try {
-				result = channel.read(args);
-			} catch (const SystemException &e) {
-				throw SystemException("Could not read a message from "
-					"the ApplicationPool server", e.code());
-			}
-			if (!result) {
-				throw IOException("The ApplicationPool server unexpectedly "
-					"closed the connection.");
-			}
-			if (args[0] == "ok") {
-				stream = channel.readFileDescriptor();
-				return ptr(new RemoteSession(dataSmartPointer,
-					atoi(args[1]), atoi(args[2]), stream));
-			} else if (args[0] == "SpawnException") {
-				if (args[2] == "true") {
-					string errorPage;
-					
-					if (!channel.readScalar(errorPage)) {
-						throw IOException("The ApplicationPool server "
-							"unexpectedly closed the connection.");
-					}
-					throw SpawnException(args[1], errorPage);
-				} else {
-					throw SpawnException(args[1]);
+				// The server stops replying after the first failure.
+				for (unsigned int i = 0; i < count; i++) {
+					result.push_back(readGetReply(dataSmartPointer, channel));
 				}
-			} else if (args[0] == "BusyException") {
-				throw BusyException(args[1]);
-			} else if (args[0] == "IOException") {
-				throw IOException(args[1]);
-			} else {
-				throw IOException("The ApplicationPool server returned "
-					"an unknown message: " + toString(args));
+			} catch (...) {
+				// The sessions' destructors need the lock.
+				l.unlock();
+				result.clear();
+				throw;
 			}
+			return result;
+		}
+		
+		/**
+		 * Sends a "get" command to the server, without waiting for the reply.
+		 * No other commands that read a reply may be sent until the returned
+		 * PendingGet's get() has been called, or until it's destroyed.
+		 */
+		virtual PendingGetPtr getAsync(
+			const string &appRoot,
+			bool lowerPrivilege = true,
+			const string &lowestUser = "nobody",
+			const string &environment = "production",
+			const string &spawnMethod = "smart",
+			const string &appType = "rails",
+			const string &traceId = "",
+			Priority priority = NORMAL_PRIORITY
+		) {
+			this_thread::disable_syscall_interruption dsi;
+			Application::SessionPtr session(getDirectly(appRoot));
+			if (session != NULL) {
+				SettablePendingGetPtr result(new SettablePendingGet());
+				result->setSession(session);
+				return result;
+			}
+			
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			list<string> args;
+			
+			data->checkNoPendingGet();
+			args.push_back("get");
+			sendGetCommand(args, appRoot, lowerPrivilege, lowestUser,
+				environment, spawnMethod, appType, traceId, priority);
+			data->getPending = true;
+			return ptr(new RemotePendingGet(dataSmartPointer));
 		}
 	};
 	
 	
 	static const int SERVER_SOCKET_FD = 3;
+	static const int SHARED_TABLE_FD = 4;
 	
 	string m_serverExecutable;
 	string m_spawnServerCommand;
 	string m_logFile;
 	string m_rubyCommand;
 	string m_user;
+	string m_spawnAgents;
+	string m_spawnAgentSecretFile;
+	string m_clusterSelf;
+	string m_clusterNodes;
+	unsigned int m_clusterReplicas;
+	string m_clusterApps;
+	string m_clusterSecretFile;
+	string m_clusterUser;
+	bool m_numaPlacement;
+	unsigned int m_threadStackSize;
+	unsigned int m_idleThreads;
+	string m_cgroupRoot;
+	unsigned int m_appCpuWeight;
+	unsigned int m_appMemoryLimit;
+	bool m_transparentHugepages;
 	string statusReportFIFO;
 	
+	/**
+	 * The table in which the server publishes its instances, or NULL if
+	 * it doesn't. It's passed to the server as SHARED_TABLE_FD.
+	 */
+	SharedInstanceTablePtr sharedTable;
+	
+	/**
+	 * The Unix socket on which the ApplicationPool server exports its
+	 * metrics. It's created by the server process itself.
+	 */
+	string metricsSocketFilename;
+	
 	/**
 	 * The PID of the ApplicationPool server process. If no server process
 	 * is running, then <tt>serverPid == 0</tt>.
@@ -438,6 +827,9 @@ private:
 			InterruptableCalls::kill(serverPid, SIGTERM);
 			InterruptableCalls::waitpid(serverPid, NULL, 0);
 		}
+		do {
+			ret = unlink(metricsSocketFilename.c_str());
+		} while (ret == -1 && errno == EINTR);
 		
 		serverSocket = -1;
 		serverPid = 0;
@@ -464,13 +856,25 @@ private:
 		}
 		
 		createStatusReportFIFO();
+		metricsSocketFilename = "/tmp/passenger_metrics." +
+			toString(getpid()) + ".socket";
 		
 		pid = InterruptableCalls::fork();
 		if (pid == 0) { // Child process.
-			dup2(fds[0], SERVER_SOCKET_FD);
+			int lastFd = SERVER_SOCKET_FD;
+			if (sharedTable != NULL) {
+				// Move the table out of the way first, in case it
+				// happens to be SERVER_SOCKET_FD.
+				int tableFd = fcntl(sharedTable->getFd(), F_DUPFD, SHARED_TABLE_FD + 1);
+				dup2(fds[0], SERVER_SOCKET_FD);
+				dup2(tableFd, SHARED_TABLE_FD);
+				lastFd = SHARED_TABLE_FD;
+			} else {
+				dup2(fds[0], SERVER_SOCKET_FD);
+			}
 			
 			// Close all unnecessary file descriptors
-			for (long i = sysconf(_SC_OPEN_MAX) - 1; i > SERVER_SOCKET_FD; i--) {
+			for (long i = sysconf(_SC_OPEN_MAX) - 1; i > lastFd; i--) {
 				close(i);
 			}
 			
@@ -488,6 +892,23 @@ private:
 				m_rubyCommand.c_str(),
 				m_user.c_str(),
 				statusReportFIFO.c_str(),
+				metricsSocketFilename.c_str(),
+				m_spawnAgents.c_str(),
+				m_spawnAgentSecretFile.c_str(),
+				m_clusterSelf.c_str(),
+				m_clusterNodes.c_str(),
+				toString(m_clusterReplicas).c_str(),
+				m_clusterApps.c_str(),
+				m_clusterSecretFile.c_str(),
+				m_clusterUser.c_str(),
+				m_numaPlacement ? "true" : "false",
+				m_transparentHugepages ? "true" : "false",
+				toString(m_threadStackSize).c_str(),
+				toString(m_idleThreads).c_str(),
+				m_cgroupRoot.c_str(),
+				toString(m_appCpuWeight).c_str(),
+				toString(m_appMemoryLimit).c_str(),
+				(sharedTable != NULL) ? "true" : "false",
 				NULL);
 			int e = errno;
 			fprintf(stderr, "*** Passenger ERROR: Cannot execute %s: %s (%d)\n",
@@ -545,6 +966,46 @@ public:
 	 *             running as root. If the empty string is given, or if
 	 *             the <tt>user</tt> is not a valid username, then
 	 *             the spawn manager will be run as the current user.
+	 * @param spawnAgents A comma-separated list of the addresses of the spawn
+	 *             agents to spawn applications with. If empty, applications
+	 *             are spawned locally. See SpawnManager.
+	 * @param spawnAgentSecretFile The file that contains the secret that the
+	 *             spawn agents expect. Like <tt>clusterSecretFile</tt>, it's
+	 *             read by the server.
+	 * @param clusterSelf The address (host:port) on which this server accepts
+	 *             requests from other cluster nodes. If empty, this server
+	 *             isn't a member of a cluster.
+	 * @param clusterNodes A comma-separated list of the addresses of the other
+	 *             cluster nodes.
+	 * @param clusterReplicas The number of cluster nodes that each application
+	 *             is placed on. See StandardApplicationPool::setCluster().
+	 * @param clusterApps A comma-separated list of the application roots of
+	 *             the applications that are shared among the cluster nodes.
+	 * @param clusterSecretFile The file that contains the secret with which
+	 *             cluster nodes authenticate each other. It's read by the
+	 *             server, so that the secret doesn't show up in its arguments.
+	 * @param clusterUser The user that applications fall back to if they're
+	 *             spawned for another cluster node, and lowering their
+	 *             privileges to their owner fails.
+	 * @param numaPlacement Whether to pin application instances to NUMA
+	 *             nodes. See StandardApplicationPool::setNumaTopology().
+	 * @param transparentHugepages Whether the spawn server should use
+	 *             transparent hugepages for the preloaded framework heap.
+	 * @param threadStackSize The stack size, in KB, of the threads that
+	 *             serve ApplicationPool clients.
+	 * @param idleThreads The number of idle client threads that the server
+	 *             keeps around, so that new clients can be served without
+	 *             creating a thread. See ThreadPool.
+	 * @param cgroupRoot The directory of the control group in which each
+	 *             application gets its own group. If empty, applications
+	 *             aren't placed in control groups. See CgroupManager.
+	 * @param appCpuWeight The CPU weight of each application's control group,
+	 *             or 0 for the kernel's default.
+	 * @param appMemoryLimit The memory limit, in MB, of each application's
+	 *             control group, or 0 for no limit.
+	 * @param useSharedTable Whether the server should publish its instances
+	 *             in a shared memory segment, through which clients can
+	 *             open sessions without asking the server. See SharedInstanceTable.
 	 * @throws SystemException An error occured while trying to setup the spawn server
 	 *            or the server socket.
 	 * @throws IOException The specified log file could not be opened.
@@ -553,14 +1014,49 @@ public:
 	             const string &spawnServerCommand,
 	             const string &logFile = "",
 	             const string &rubyCommand = "ruby",
-	             const string &user = "")
+	             const string &user = "",
+	             const string &spawnAgents = "",
+	             const string &spawnAgentSecretFile = "",
+	             const string &clusterSelf = "",
+	             const string &clusterNodes = "",
+	             unsigned int clusterReplicas = 1,
+	             const string &clusterApps = "",
+	             const string &clusterSecretFile = "",
+	             const string &clusterUser = "nobody",
+	             bool numaPlacement = false,
+	             bool transparentHugepages = false,
+	             unsigned int threadStackSize = 128,
+	             unsigned int idleThreads = 16,
+	             const string &cgroupRoot = "",
+	             unsigned int appCpuWeight = 0,
+	             unsigned int appMemoryLimit = 0,
+	             bool useSharedTable = false)
 	: m_serverExecutable(serverExecutable),
 	  m_spawnServerCommand(spawnServerCommand),
 	  m_logFile(logFile),
 	  m_rubyCommand(rubyCommand),
-	  m_user(user) {
+	  m_user(user),
+	  m_spawnAgents(spawnAgents),
+	  m_spawnAgentSecretFile(spawnAgentSecretFile),
+	  m_clusterSelf(clusterSelf),
+	  m_clusterNodes(clusterNodes),
+	  m_clusterReplicas(clusterReplicas),
+	  m_clusterApps(clusterApps),
+	  m_clusterSecretFile(clusterSecretFile),
+	  m_clusterUser(clusterUser),
+	  m_numaPlacement(numaPlacement),
+	  m_threadStackSize(threadStackSize),
+	  m_idleThreads(idleThreads),
+	  m_cgroupRoot(cgroupRoot),
+	  m_appCpuWeight(appCpuWeight),
+	  m_appMemoryLimit(appMemoryLimit),
+	  m_transparentHugepages(transparentHugepages) {
 		serverSocket = -1;
 		serverPid = 0;
+		if (useSharedTable) {
+			sharedTable = ptr(new SharedInstanceTable(
+				SharedInstanceTable::DEFAULT_CAPACITY));
+		}
 		this_thread::disable_syscall_interruption dsi;
 		restartServer();
 	}
@@ -614,7 +1110,7 @@ public:
 			channel.writeRaw("x", 1);
 			
 			clientConnection = channel.readFileDescriptor();
-			return ptr(new Client(clientConnection));
+			return ptr(new Client(clientConnection, sharedTable));
 		} catch (const SystemException &e) {
 			throw SystemException("Could not connect to the ApplicationPool server", e.code());
 		} catch (const IOException &e) {
@@ -40,6 +40,11 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string>
@@ -53,6 +58,15 @@
 #include "Logging.h"
 #include "System.h"
 #include "Exceptions.h"
+#include "InstrumentedMutex.h"
+#include "MemorySampler.h"
+#include "Metrics.h"
+#include "FlightRecorder.h"
+#include "SlabAllocator.h"
+#include "NumaTopology.h"
+#include "ThreadPool.h"
+#include "CgroupManager.h"
+#include "SharedInstanceTable.h"
 
 
 using namespace boost;
@@ -64,6 +78,13 @@ class Client;
 typedef shared_ptr<Client> ClientPtr;
 
 #define SERVER_SOCKET_FD 3
+#define SHARED_TABLE_FD 4
+
+/**
+ * Sending this signal to the ApplicationPool server makes it write the
+ * contents of the flight recorder to the log.
+ */
+#define FLIGHT_RECORDER_DUMP_SIGNAL SIGUSR1
 
 
 /*****************************************
@@ -73,6 +94,15 @@ typedef shared_ptr<Client> ClientPtr;
 class Server {
 private:
 	friend class Client;
+	
+	static const unsigned int MEMORY_SAMPLE_INTERVAL = 10; // In seconds.
+	static const unsigned int MEMORY_SAMPLE_HISTORY = 60;
+	/** The number of most recent pool events to show in status reports. */
+	static const unsigned int STATUS_REPORT_EVENTS = 50;
+	/** How often to check whether somebody wants a status report, in microseconds. */
+	static const unsigned int STATUS_REPORT_POLL_INTERVAL = 200000;
+	static const unsigned int CLUSTER_THREAD_STACK_SIZE = 1024 * 128;
+	static const unsigned int RELAY_BUFFER_SIZE = 1024 * 16;
 
 	int serverSocket;
 	StandardApplicationPool pool;
@@ -80,6 +110,66 @@ private:
 	boost::mutex lock;
 	string statusReportFIFO;
 	shared_ptr<Thread> statusReportThread;
+	MemorySampler memorySampler;
+	string metricsSocketFilename;
+	int metricsSocket;
+	shared_ptr<Thread> metricsThread;
+	string clusterSelf;
+	/** The secret that other cluster nodes must send before their requests. */
+	string clusterSecret;
+	/** The user that applications fall back to when serving other cluster nodes. */
+	string clusterUser;
+	int clusterSocket;
+	shared_ptr<Thread> clusterThread;
+	/** Connections from other cluster nodes that are currently being served. */
+	set<int> clusterConnections;
+	condition clusterConnectionsChanged;
+	/**
+	 * The threads that serve clients and cluster connections. Declared last,
+	 * so that it's destroyed first: its destructor waits until all tasks,
+	 * which may still use the other members, are done.
+	 */
+	ThreadPool threadPool;
+	
+	/**
+	 * Returns the processes whose memory usage should be sampled:
+	 * all application instances and the spawn server.
+	 */
+	map<pid_t, string> getProcessesToSample() {
+		map<pid_t, string> result(pool.getApplicationPids());
+		pid_t spawnServerPid = pool.getSpawnServerPid();
+		if (spawnServerPid != 0) {
+			result[spawnServerPid] = "Passenger spawn server";
+		}
+		return result;
+	}
+	
+	/**
+	 * Open the status report FIFO for writing. Opening a FIFO blocks until
+	 * somebody opens it for reading, and that can't be waited for with
+	 * poll(), so we check periodically instead, in an interruptable way.
+	 *
+	 * @return The opened FIFO, or NULL if it cannot be opened.
+	 * @throws boost::thread_interrupted
+	 */
+	FILE *openStatusReportFIFO() {
+		while (true) {
+			int fd = open(statusReportFIFO.c_str(), O_WRONLY | O_NONBLOCK);
+			if (fd != -1) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+				FILE *f = fdopen(fd, "w");
+				if (f == NULL) {
+					InterruptableCalls::close(fd);
+				}
+				return f;
+			} else if (errno == ENXIO) {
+				// There's no reader yet.
+				InterruptableCalls::usleep(STATUS_REPORT_POLL_INTERVAL);
+			} else if (errno != EINTR) {
+				return NULL;
+			}
+		}
+	}
 	
 	void statusReportThreadMain() {
 		try {
@@ -96,23 +186,266 @@ private:
 					break;
 				}
 				
-				FILE *f = InterruptableCalls::fopen(statusReportFIFO.c_str(), "w");
+				FILE *f = openStatusReportFIFO();
 				if (f == NULL) {
 					break;
 				}
 				
 				string report(pool.toString());
+				report.append(memorySampler.toString());
+				report.append(FlightRecorder::global().toString(STATUS_REPORT_EVENTS));
+				report.append(InstrumentedMutex::allStatistics());
 				fwrite(report.c_str(), 1, report.size(), f);
 				InterruptableCalls::fclose(f);
 				
 				// Prevent sending too much data at once.
-				sleep(1);
+				InterruptableCalls::usleep(1000000);
 			}
 		} catch (const boost::thread_interrupted &) {
 			P_TRACE(2, "Status report thread interrupted.");
 		}
 	}
 	
+	/**
+	 * Create the Unix socket on which metrics are exported. Failure is not
+	 * fatal: metrics are merely unavailable.
+	 */
+	void createMetricsSocket() {
+		struct sockaddr_un addr;
+		int ret;
+		
+		if (metricsSocketFilename.size() >= sizeof(addr.sun_path)) {
+			P_WARN("Metrics socket filename '" << metricsSocketFilename <<
+				"' is too long; metrics will not be exported.");
+			return;
+		}
+		
+		metricsSocket = ::socket(PF_UNIX, SOCK_STREAM, 0);
+		if (metricsSocket == -1) {
+			int e = errno;
+			P_WARN("Cannot create the metrics socket: " << strerror(e) <<
+				" (" << e << ")");
+			return;
+		}
+		
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, metricsSocketFilename.c_str());
+		do {
+			ret = unlink(metricsSocketFilename.c_str());
+		} while (ret == -1 && errno == EINTR);
+		
+		if (::bind(metricsSocket, (const struct sockaddr *) &addr, sizeof(addr)) == -1
+		 || chmod(metricsSocketFilename.c_str(), S_IRUSR | S_IWUSR) == -1
+		 || ::listen(metricsSocket, 16) == -1) {
+			int e = errno;
+			P_WARN("Cannot listen on the metrics socket '" << metricsSocketFilename <<
+				"': " << strerror(e) << " (" << e << ")");
+			InterruptableCalls::close(metricsSocket);
+			metricsSocket = -1;
+		}
+	}
+	
+	/**
+	 * Sends the metrics, in the Prometheus text exposition format, to
+	 * everybody who connects to the metrics socket, then closes the
+	 * connection.
+	 */
+	void metricsThreadMain() {
+		try {
+			while (!this_thread::interruption_requested()) {
+				int fd = InterruptableCalls::accept(metricsSocket, NULL, NULL);
+				if (fd == -1) {
+					if (errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+						InterruptableCalls::usleep(10000);
+						continue;
+					}
+					break;
+				}
+				
+				string report(MetricsRegistry::global().toString());
+				const char *data = report.data();
+				size_t remaining = report.size();
+				while (remaining > 0) {
+					ssize_t ret = InterruptableCalls::write(fd, data, remaining);
+					if (ret == -1) {
+						break;
+					}
+					data += ret;
+					remaining -= ret;
+				}
+				InterruptableCalls::close(fd);
+			}
+		} catch (const boost::thread_interrupted &) {
+			P_TRACE(2, "Metrics thread interrupted.");
+		}
+	}
+	
+	/**
+	 * Accepts connections from other cluster nodes, which forward get()
+	 * requests for applications that are placed on this node. Each
+	 * connection is served by its own thread.
+	 */
+	void clusterThreadMain() {
+		try {
+			while (!this_thread::interruption_requested()) {
+				int fd = InterruptableCalls::accept(clusterSocket, NULL, NULL);
+				if (fd == -1) {
+					if (errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+						InterruptableCalls::usleep(10000);
+						continue;
+					}
+					break;
+				}
+				
+				int optval = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+				{
+					boost::mutex::scoped_lock l(lock);
+					clusterConnections.insert(fd);
+				}
+				try {
+					// The destructor waits until all cluster
+					// connections are closed.
+					threadPool.run(bind(&Server::clusterConnectionMain, this, fd));
+				} catch (const thread_resource_error &) {
+					P_WARN("Cannot create a thread for a cluster connection.");
+					closeClusterConnection(fd);
+				}
+			}
+		} catch (const boost::thread_interrupted &) {
+			P_TRACE(2, "Cluster thread interrupted.");
+		}
+	}
+	
+	/**
+	 * Serves a get() request that was forwarded by another cluster node: opens
+	 * a session with a local instance, replies in the same format as the
+	 * ApplicationPool server protocol (minus the session ID and the file
+	 * descriptor), and then relays the connection to the session stream.
+	 *
+	 * The request is only served if it's preceded by the cluster secret,
+	 * and if the application is shared among the cluster nodes. It's always
+	 * spawned with lowered privileges, falling back to clusterUser.
+	 */
+	void clusterConnectionMain(int fd) {
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		MessageChannel channel(fd);
+		vector<string> args;
+		Application::SessionPtr session;
+		
+		try {
+			bool authenticated = channel.read(args) && args.size() == 2
+				&& args[0] == "secret" && secretsEqual(args[1], clusterSecret);
+			
+			// Read the request even if the secret is wrong: closing the
+			// connection with unread data would reset it, and the error
+			// message might not arrive.
+			if (channel.read(args) && args.size() == 7 && args[0] == "get") {
+				int priority = atoi(args[6]);
+				
+				if (priority < ApplicationPool::LOW_PRIORITY) {
+					priority = ApplicationPool::LOW_PRIORITY;
+				} else if (priority > ApplicationPool::HIGH_PRIORITY) {
+					priority = ApplicationPool::HIGH_PRIORITY;
+				}
+				try {
+					if (!authenticated) {
+						P_WARN("Refused a cluster request with a wrong secret.");
+						throw IOException("Wrong cluster secret.");
+					} else if (!pool.isClusterApp(args[1])) {
+						P_WARN("Refused a cluster request for application '" <<
+							args[1] << "', which isn't shared with other cluster nodes.");
+						throw IOException("Application '" + args[1] +
+							"' isn't shared with other cluster nodes.");
+					}
+					session = pool.getLocal(args[1], true, clusterUser,
+						args[2], args[3], args[4], args[5],
+						(ApplicationPool::Priority) priority);
+				} catch (const SpawnException &e) {
+					if (e.hasErrorPage()) {
+						channel.write("SpawnException", e.what(), "true", NULL);
+						channel.writeScalar(e.getErrorPage());
+					} else {
+						channel.write("SpawnException", e.what(), "false", NULL);
+					}
+				} catch (const BusyException &e) {
+					channel.write("BusyException", e.what(), NULL);
+				} catch (const IOException &e) {
+					channel.write("IOException", e.what(), NULL);
+				}
+				if (session != NULL) {
+					channel.write("ok", toString(session->getPid()).c_str(), NULL);
+					relay(fd, session->getStream());
+				}
+			}
+		} catch (const exception &e) {
+			P_TRACE(2, "Error while serving a cluster connection: " << e.what());
+		}
+		session.reset();
+		closeClusterConnection(fd);
+	}
+	
+	void closeClusterConnection(int fd) {
+		// Close while holding the lock, so that the destructor can't
+		// shut down another socket which happens to reuse this file
+		// descriptor number.
+		boost::mutex::scoped_lock l(lock);
+		InterruptableCalls::close(fd);
+		clusterConnections.erase(fd);
+		clusterConnectionsChanged.notify_all();
+	}
+	
+	/**
+	 * Copy data in both directions between the two given sockets, until
+	 * both directions have reached end-of-file. End-of-file on one socket
+	 * is forwarded to the other socket by shutting down its writer side.
+	 *
+	 * @throws SystemException Something went wrong while relaying.
+	 */
+	static void relay(int a, int b) {
+		struct pollfd fds[2];
+		char buf[RELAY_BUFFER_SIZE];
+		unsigned int open = 2;
+		
+		fds[0].fd = a;
+		fds[1].fd = b;
+		fds[0].events = fds[1].events = POLLIN;
+		while (open > 0) {
+			if (InterruptableCalls::poll(fds, 2, -1) == -1) {
+				throw SystemException("Cannot poll the relayed sockets", errno);
+			}
+			for (unsigned int i = 0; i < 2; i++) {
+				if (fds[i].fd == -1 || fds[i].revents == 0) {
+					continue;
+				}
+				int other = (i == 0) ? b : a;
+				ssize_t ret = InterruptableCalls::read(fds[i].fd, buf, sizeof(buf));
+				if (ret == -1) {
+					throw SystemException("Cannot read from a relayed socket", errno);
+				} else if (ret == 0) {
+					InterruptableCalls::shutdown(other, SHUT_WR);
+					// poll() ignores negative file descriptors.
+					fds[i].fd = -1;
+					open--;
+				} else {
+					MessageChannel(other).writeRaw(buf, ret);
+				}
+			}
+		}
+	}
+	
+	void deleteMetricsSocket() {
+		if (metricsSocket != -1) {
+			int ret;
+			InterruptableCalls::close(metricsSocket);
+			do {
+				ret = unlink(metricsSocketFilename.c_str());
+			} while (ret == -1 && errno == EINTR);
+		}
+	}
+	
 	void deleteStatusReportFIFO() {
 		if (!statusReportFIFO.empty()) {
 			int ret;
@@ -129,12 +462,72 @@ public:
 	       const string &logFile,
 	       const string &rubyCommand,
 	       const string &user,
-	       const string &statusReportFIFO)
-		: pool(spawnServerCommand, logFile, rubyCommand, user) {
+	       const string &statusReportFIFO,
+	       const string &metricsSocketFilename,
+	       const vector<string> &spawnAgents,
+	       const string &spawnAgentSecretFile,
+	       const string &clusterSelf,
+	       const vector<string> &clusterNodes,
+	       unsigned int clusterReplicas,
+	       const vector<string> &clusterApps,
+	       const string &clusterSecretFile,
+	       const string &clusterUser,
+	       bool numaPlacement,
+	       unsigned int threadStackSize,
+	       unsigned int idleThreads,
+	       const string &cgroupRoot,
+	       unsigned int appCpuWeight,
+	       unsigned int appMemoryLimit,
+	       bool useSharedTable)
+		: pool(spawnServerCommand, logFile, rubyCommand, user, spawnAgents,
+		       spawnAgents.empty() ? string() : readSecretFile(spawnAgentSecretFile)),
+		  memorySampler(bind(&Server::getProcessesToSample, this),
+		                MEMORY_SAMPLE_INTERVAL, MEMORY_SAMPLE_HISTORY),
+		  threadPool(threadStackSize * 1024, idleThreads, idleThreads) {
 		
 		Passenger::setLogLevel(logLevel);
 		this->serverSocket = serverSocket;
 		this->statusReportFIFO = statusReportFIFO;
+		this->metricsSocketFilename = metricsSocketFilename;
+		this->clusterSelf = clusterSelf;
+		this->clusterUser = clusterUser;
+		metricsSocket = -1;
+		clusterSocket = -1;
+		if (!clusterSelf.empty()) {
+			clusterSecret = readSecretFile(clusterSecretFile);
+			pool.setCluster(clusterSelf, clusterNodes,
+				set<string>(clusterApps.begin(), clusterApps.end()),
+				clusterSecret, clusterReplicas);
+		}
+		if (numaPlacement) {
+			NumaTopology topology(NumaTopology::detect());
+			if (topology.size() < 2) {
+				P_DEBUG("NUMA placement is enabled, but this machine has " <<
+					topology.size() << " NUMA node(s) with CPUs; disabling it.");
+			}
+			pool.setNumaTopology(topology);
+		}
+		if (!cgroupRoot.empty()) {
+			CgroupManagerPtr cgroups(new CgroupManager(cgroupRoot, appCpuWeight,
+				(unsigned long long) appMemoryLimit * 1024 * 1024));
+			try {
+				cgroups->setup();
+				pool.setCgroups(cgroups);
+			} catch (const exception &e) {
+				P_WARN("Cannot set up the control group " << cgroupRoot <<
+					"; applications won't be placed in control groups: " <<
+					e.what());
+			}
+		}
+		if (useSharedTable) {
+			try {
+				pool.setSharedInstanceTable(SharedInstanceTablePtr(
+					SharedInstanceTable::attach(SHARED_TABLE_FD)));
+			} catch (const exception &e) {
+				P_WARN("Cannot use the shared instance table; all sessions " <<
+					"will be opened through this server: " << e.what());
+			}
+		}
 	}
 	
 	~Server() {
@@ -148,6 +541,28 @@ public:
 		if (statusReportThread != NULL) {
 			statusReportThread->interruptAndJoin();
 		}
+		if (metricsThread != NULL) {
+			metricsThread->interruptAndJoin();
+		}
+		deleteMetricsSocket();
+		if (clusterThread != NULL) {
+			clusterThread->interruptAndJoin();
+		}
+		if (clusterSocket != -1) {
+			InterruptableCalls::close(clusterSocket);
+		}
+		{
+			// Wake up the cluster connection threads, and wait
+			// until they're done with the pool.
+			boost::mutex::scoped_lock l(lock);
+			set<int>::const_iterator it;
+			for (it = clusterConnections.begin(); it != clusterConnections.end(); it++) {
+				::shutdown(*it, SHUT_RDWR);
+			}
+			while (!clusterConnections.empty()) {
+				clusterConnectionsChanged.wait(l);
+			}
+		}
 		
 		// Wait for all clients to disconnect.
 		set<ClientPtr> clientsCopy;
@@ -184,8 +599,6 @@ public:
  */
 class Client {
 private:
-	static const int CLIENT_THREAD_STACK_SIZE = 1024 * 128;
-
 	/** The Server that this Client object belongs to. */
 	Server &server;
 	
@@ -193,28 +606,66 @@ private:
 	int fd;
 	MessageChannel channel;
 	
-	/** The thread which handles the client connection. */
-	Thread *thr;
+	/** The thread pool task which handles the client connection. */
+	ThreadPool::TaskPtr task;
 	
 	/**
 	 * Maps session ID to sessions created by ApplicationPool::get(). Session IDs
 	 * are sent back to the ApplicationPool client. This allows the ApplicationPool
 	 * client to tell us which of the multiple sessions it wants to close, later on.
 	 */
-	map<int, Application::SessionPtr> sessions;
+	map< int, Application::SessionPtr, less<int>,
+		SlabStlAllocator< pair<const int, Application::SessionPtr> > > sessions;
 	
 	/** Last used session ID. */
 	int lastSessionID;
 	
-	void processGet(const vector<string> &args) {
-		Application::SessionPtr session;
+	/**
+	 * The counters of the commands that this client sent, by command name,
+	 * so that counting a command doesn't take the registry's lock.
+	 */
+	map<string, Counter *> commandCounters;
+	
+	Counter &commandCounter(const string &command) {
+		Counter *&counter(commandCounters[command]);
+		if (counter == NULL) {
+			counter = &MetricsRegistry::global().counter(
+				"passenger_pool_server_commands_total",
+				"Number of commands received from ApplicationPool clients.",
+				MetricsRegistry::label("command", command));
+		}
+		return *counter;
+	}
+	
+	static Gauge &clientsGauge() {
+		return MetricsRegistry::global().gauge("passenger_pool_server_clients",
+			"Number of connected ApplicationPool clients.");
+	}
+	
+	/**
+	 * Open <tt>count</tt> sessions with the pool, using the get() arguments
+	 * that start at <tt>args[offset]</tt>, and send the result to the client:
+	 * one get() reply per session, or the error if the sessions could not
+	 * be opened.
+	 */
+	void openSessions(const vector<string> &args, unsigned int offset, unsigned int count) {
+		vector<Application::SessionPtr> result;
 		bool failed = false;
 		
 		try {
-			session = server.pool.get(args[1], args[2] == "true", args[3],
-				args[4], args[5], args[6]);
-			sessions[lastSessionID] = session;
-			lastSessionID++;
+			if (count == 1) {
+				result.push_back(server.pool.get(args[offset],
+					args[offset + 1] == "true",
+					args[offset + 2], args[offset + 3], args[offset + 4],
+					args[offset + 5], args[offset + 6],
+					(ApplicationPool::Priority) atoi(args[offset + 7])));
+			} else {
+				result = server.pool.getMultiple(count, args[offset],
+					args[offset + 1] == "true",
+					args[offset + 2], args[offset + 3], args[offset + 4],
+					args[offset + 5], args[offset + 6],
+					(ApplicationPool::Priority) atoi(args[offset + 7]));
+			}
 		} catch (const SpawnException &e) {
 			this_thread::disable_syscall_interruption dsi;
 			
@@ -231,6 +682,7 @@ private:
 			failed = true;
 		} catch (const BusyException &e) {
 			this_thread::disable_syscall_interruption dsi;
+			FlightRecorder::global().record(FlightRecorder::BUSY, args[offset]);
 			channel.write("BusyException", e.what(), NULL);
 			failed = true;
 		} catch (const IOException &e) {
@@ -238,8 +690,16 @@ private:
 			channel.write("IOException", e.what(), NULL);
 			failed = true;
 		}
-		if (!failed) {
-			this_thread::disable_syscall_interruption dsi;
+		if (failed) {
+			return;
+		}
+		
+		this_thread::disable_syscall_interruption dsi;
+		vector<Application::SessionPtr>::iterator it;
+		for (it = result.begin(); it != result.end(); it++) {
+			Application::SessionPtr &session(*it);
+			sessions[lastSessionID] = session;
+			lastSessionID++;
 			try {
 				channel.write("ok", toString(session->getPid()).c_str(),
 					toString(lastSessionID - 1).c_str(), NULL);
@@ -254,8 +714,27 @@ private:
 		}
 	}
 	
+	void processGet(const vector<string> &args) {
+		openSessions(args, 1, 1);
+	}
+	
+	/**
+	 * Open several sessions for the same application in one go, with
+	 * ApplicationPool::getMultiple(). The reply consists of one get() reply
+	 * per session, or of the error if the sessions could not be opened.
+	 */
+	void processGetMultiple(const vector<string> &args) {
+		unsigned int count = atoi(args[1]);
+		if (count > 0) {
+			openSessions(args, 2, count);
+		}
+	}
+	
+	/** Close one or more sessions. */
 	void processClose(const vector<string> &args) {
-		sessions.erase(atoi(args[1]));
+		for (vector<string>::size_type i = 1; i < args.size(); i++) {
+			sessions.erase(atoi(args[i]));
+		}
 	}
 	
 	void processClear(const vector<string> &args) {
@@ -270,6 +749,14 @@ private:
 		server.pool.setMax(atoi(args[1]));
 	}
 	
+	void processAddRemoteInstance(const vector<string> &args) {
+		server.pool.addRemoteInstance(args[1], args[2]);
+	}
+	
+	void processRemoveRemoteInstance(const vector<string> &args) {
+		server.pool.removeRemoteInstance(args[1], args[2]);
+	}
+	
 	void processGetActive(const vector<string> &args) {
 		channel.write(toString(server.pool.getActive()).c_str(), NULL);
 	}
@@ -282,6 +769,14 @@ private:
 		server.pool.setMaxPerApp(maxPerApp);
 	}
 	
+	void processSetRequestQueueLimits(const vector<string> &args) {
+		server.pool.setRequestQueueLimits(atoi(args[1]), atoi(args[2]), atoi(args[3]));
+	}
+	
+	void processSetAppShare(const vector<string> &args) {
+		server.pool.setAppShare(args[1], atoi(args[2]), atoi(args[3]));
+	}
+	
 	void processGetSpawnServerPid(const vector<string> &args) {
 		channel.write(toString(server.pool.getSpawnServerPid()).c_str(), NULL);
 	}
@@ -318,9 +813,11 @@ private:
 				P_TRACE(4, "Client " << this << ": received message: " <<
 					toString(args));
 				
-				if (args[0] == "get" && args.size() == 7) {
+				if (args[0] == "get" && args.size() == 9) {
 					processGet(args);
-				} else if (args[0] == "close" && args.size() == 2) {
+				} else if (args[0] == "getMultiple" && args.size() == 10) {
+					processGetMultiple(args);
+				} else if (args[0] == "close" && args.size() >= 2) {
 					processClose(args);
 				} else if (args[0] == "clear" && args.size() == 1) {
 					processClear(args);
@@ -328,18 +825,27 @@ private:
 					processSetMaxIdleTime(args);
 				} else if (args[0] == "setMax" && args.size() == 2) {
 					processSetMax(args);
+				} else if (args[0] == "addRemoteInstance" && args.size() == 3) {
+					processAddRemoteInstance(args);
+				} else if (args[0] == "removeRemoteInstance" && args.size() == 3) {
+					processRemoveRemoteInstance(args);
 				} else if (args[0] == "getActive" && args.size() == 1) {
 					processGetActive(args);
 				} else if (args[0] == "getCount" && args.size() == 1) {
 					processGetCount(args);
 				} else if (args[0] == "setMaxPerApp" && args.size() == 2) {
 					processSetMaxPerApp(atoi(args[1]));
+				} else if (args[0] == "setRequestQueueLimits" && args.size() == 4) {
+					processSetRequestQueueLimits(args);
+				} else if (args[0] == "setAppShare" && args.size() == 4) {
+					processSetAppShare(args);
 				} else if (args[0] == "getSpawnServerPid" && args.size() == 1) {
 					processGetSpawnServerPid(args);
 				} else {
 					processUnknownMessage(args);
 					break;
 				}
+				commandCounter(args[0]).increment();
 				args.clear();
 			}
 		} catch (const boost::thread_interrupted &) {
@@ -371,12 +877,13 @@ public:
 		: server(the_server),
 		  fd(connection),
 		  channel(connection) {
-		thr = NULL;
 		lastSessionID = 0;
+		clientsGauge().increment();
 	}
 	
 	/**
-	 * Start the thread for handling the connection with this client.
+	 * Start handling the connection with this client, in one of the
+	 * server's pooled threads.
 	 *
 	 * @param self The iterator of this Client object inside the server's
 	 *        <tt>clients</tt> set. This is used to remove itself from
@@ -384,29 +891,25 @@ public:
 	 *        connection.
 	 */
 	void start(const weak_ptr<Client> self) {
-		thr = new Thread(
-			bind(&Client::threadMain, this, self),
-			CLIENT_THREAD_STACK_SIZE
-		);
+		task = server.threadPool.run(bind(&Client::threadMain, this, self));
 	}
 	
 	~Client() {
 		this_thread::disable_syscall_interruption dsi;
 		this_thread::disable_interruption di;
 		
-		if (thr != NULL && thr->get_id() != this_thread::get_id()) {
-			thr->interruptAndJoin();
-			delete thr;
+		if (task != NULL) {
+			// Returns immediately if we're being destroyed by the task itself.
+			server.threadPool.interruptAndWait(task);
 		}
 		InterruptableCalls::close(fd);
+		clientsGauge().decrement();
 	}
 };
 
 
 int
 Server::start() {
-	setupSyscallInterruptionSupport();
-	
 	try {
 		if (!statusReportFIFO.empty()) {
 			statusReportThread = ptr(
@@ -415,6 +918,35 @@ Server::start() {
 					1024 * 128
 				)
 			);
+			// The memory samples are only used for status reports.
+			memorySampler.start();
+		}
+		if (!metricsSocketFilename.empty()) {
+			createMetricsSocket();
+			if (metricsSocket != -1) {
+				metricsThread = ptr(
+					new Thread(
+						bind(&Server::metricsThreadMain, this),
+						1024 * 128
+					)
+				);
+			}
+		}
+		
+		if (!clusterSelf.empty()) {
+			try {
+				clusterSocket = createTcpServer(clusterSelf);
+				clusterThread = ptr(
+					new Thread(
+						bind(&Server::clusterThreadMain, this),
+						CLUSTER_THREAD_STACK_SIZE
+					)
+				);
+			} catch (const exception &e) {
+				P_WARN("Cannot listen on the cluster address " << clusterSelf <<
+					"; other cluster nodes will serve the applications that "
+					"are placed on this node themselves: " << e.what());
+			}
 		}
 		
 		while (!this_thread::interruption_requested()) {
@@ -459,16 +991,83 @@ Server::start() {
 	return 0;
 }
 
+/**
+ * Called when SIGINT is received, which the web server sends to ask for a
+ * shutdown. The handler is installed without SA_RESTART, so it makes the main
+ * thread's blocking read fail with EINTR, which InterruptableCalls turns into
+ * boost::thread_interrupted. Other threads wait for their interruption
+ * channels instead, and simply retry.
+ */
+static void
+shutdownSignalHandler(int sig) {
+	// Nothing to do.
+}
+
+/**
+ * Waits for FLIGHT_RECORDER_DUMP_SIGNAL, and dumps the flight recorder every
+ * time it's received. The signal is blocked in all other threads.
+ */
+static void
+flightRecorderDumpThreadMain() {
+	sigset_t signals;
+	int sig;
+	
+	sigemptyset(&signals);
+	sigaddset(&signals, FLIGHT_RECORDER_DUMP_SIGNAL);
+	while (sigwait(&signals, &sig) == 0) {
+		P_WARN("Flight recorder dump requested (PID " << getpid() << "):\n" <<
+			FlightRecorder::global().toString());
+	}
+}
+
 int
 main(int argc, char *argv[]) {
+	int ret;
+	sigset_t signals;
+	
+	/* Block the dump signal before any other threads are created, so that
+	 * it's only received by the dump thread.
+	 */
+	sigemptyset(&signals);
+	sigaddset(&signals, FLIGHT_RECORDER_DUMP_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	signal(SIGINT, shutdownSignalHandler);
+	siginterrupt(SIGINT, 1);
+	
+	startAsyncLogging();
 	try {
+		// Detached; it doesn't use any state that's destroyed before exit.
+		delete new Thread(&flightRecorderDumpThreadMain, 1024 * 64);
+		
+		vector<string> spawnAgents, clusterNodes, clusterApps;
+		if (*argv[8] != '\0') {
+			split(argv[8], ',', spawnAgents);
+		}
+		if (*argv[11] != '\0') {
+			split(argv[11], ',', clusterNodes);
+		}
+		if (*argv[13] != '\0') {
+			split(argv[13], ',', clusterApps);
+		}
+		if (strcmp(argv[17], "true") == 0) {
+			// Inherited by the spawn server, which is started by the pool.
+			setenv("PASSENGER_TRANSPARENT_HUGEPAGES", "1", 1);
+		}
+		
 		Server server(SERVER_SOCKET_FD, atoi(argv[1]),
-			argv[2], argv[3], argv[4], argv[5], argv[6]);
-		return server.start();
+			argv[2], argv[3], argv[4], argv[5], argv[6], argv[7],
+			spawnAgents, argv[9], argv[10], clusterNodes, atoi(argv[12]),
+			clusterApps, argv[14], argv[15],
+			strcmp(argv[16], "true") == 0, atoi(argv[18]), atoi(argv[19]),
+			argv[20], atoi(argv[21]), atoi(argv[22]),
+			strcmp(argv[23], "true") == 0);
+		ret = server.start();
 	} catch (const exception &e) {
 		P_ERROR(e.what());
-		return 1;
+		ret = 1;
 	}
+	stopAsyncLogging();
+	return ret;
 }
 
 #endif /* _PASSENGER_APPLICATION_POOL_SERVER_EXECUTABLE_H_ */
@@ -0,0 +1,308 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_CGROUP_MANAGER_H_
+#define _PASSENGER_CGROUP_MANAGER_H_
+
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Exceptions.h"
+#include "Logging.h"
+#include "Utils.h"
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+/**
+ * Places application instances in per-application control groups, in a
+ * cgroup v2 hierarchy, so that a single runaway application can't use up
+ * all CPU time and memory of the host.
+ *
+ * All groups are children of a root group, e.g.
+ * <tt>/sys/fs/cgroup/passenger</tt>, which is created by setup() if necessary.
+ * The parent of the root group must have the <tt>cpu</tt> and <tt>memory</tt>
+ * controllers enabled in its <tt>cgroup.subtree_control</tt>, and the
+ * ApplicationPool server must be allowed to write to it (usually this means
+ * running as root, or having the root group delegated to our user).
+ *
+ * Each application's group gets the same CPU weight and memory limit. Groups
+ * aren't removed when an application's instances exit, but are reused when
+ * the application is spawned again. The groups' statistics can be read back with getStats(), which the pool uses
+ * to decide which instances to evict and whether to spawn more instances.
+ *
+ * Memory that a process allocated before it was moved into a group stays
+ * charged to its old group, so spawned instances should join their group
+ * themselves, right after they're forked and before they load the
+ * application: the spawn server is told the root group through the
+ * <tt>PASSENGER_CGROUP_ROOT</tt> environment variable, and derives each
+ * application's group from it like getGroupDir() does. The group must have
+ * been set up with prepare() by then.
+ *
+ * Nothing in this class depends on the directory being a real cgroupfs
+ * mount, so it can be tested with an ordinary directory.
+ *
+ * This class is thread-safe.
+ *
+ * @ingroup Support
+ */
+class CgroupManager {
+public:
+	/** The statistics of an application's group. */
+	struct Stats {
+		/** The memory usage of the group, in bytes. */
+		unsigned long long memoryCurrent;
+		/** The memory limit of the group, in bytes, or 0 if there's none. */
+		unsigned long long memoryMax;
+		/** The total CPU time used by the group, in microseconds. */
+		unsigned long long cpuUsage;
+		/** The total time that the group was throttled, in microseconds. */
+		unsigned long long cpuThrottled;
+		/** The number of processes that were killed because the group ran out of memory. */
+		unsigned long long oomKills;
+		
+		Stats() {
+			memoryCurrent = 0;
+			memoryMax = 0;
+			cpuUsage = 0;
+			cpuThrottled = 0;
+			oomKills = 0;
+		}
+		
+		/**
+		 * Whether the group's memory usage is close to its limit, i.e. at
+		 * least <tt>percentage</tt> percent of it.
+		 */
+		bool nearMemoryLimit(unsigned int percentage = 90) const {
+			return memoryMax != 0 && memoryCurrent >= memoryMax / 100 * percentage;
+		}
+	};
+
+private:
+	string root;
+	unsigned int cpuWeight;
+	unsigned long long memoryLimit;
+	
+	/**
+	 * Write a string to a cgroup interface file, in a single write() call
+	 * as the kernel expects.
+	 *
+	 * @throws SystemException
+	 */
+	static void writeFile(const string &filename, const string &value) {
+		int fd, ret;
+		
+		do {
+			fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		} while (fd == -1 && errno == EINTR);
+		if (fd == -1) {
+			throw SystemException("Cannot open " + filename + " for writing", errno);
+		}
+		do {
+			ret = write(fd, value.c_str(), value.size());
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			int e = errno;
+			close(fd);
+			throw SystemException("Cannot write '" + value + "' to " + filename, e);
+		}
+		close(fd);
+	}
+	
+	/**
+	 * Read the first line of the given file.
+	 *
+	 * @return Whether the file could be read.
+	 */
+	static bool readLine(const string &filename, string &line) {
+		ifstream file(filename.c_str());
+		return getline(file, line);
+	}
+	
+	/**
+	 * Read the value of the given key from a flat-keyed cgroup file such as
+	 * <tt>cpu.stat</tt>, which has a "key value" pair on every line.
+	 */
+	static unsigned long long readKey(const string &filename, const char *key) {
+		ifstream file(filename.c_str());
+		string name;
+		unsigned long long value;
+		
+		while (file >> name >> value) {
+			if (name == key) {
+				return value;
+			}
+		}
+		return 0;
+	}
+
+public:
+	/**
+	 * Create a new CgroupManager. Call setup() before placing any processes.
+	 *
+	 * @param root The directory of the root group.
+	 * @param cpuWeight The CPU weight of each application's group, between
+	 *                  1 and 10000, or 0 to leave it at the kernel's default
+	 *                  (100).
+	 * @param memoryLimit The memory limit of each application's group, in
+	 *                    bytes, or 0 for no limit.
+	 */
+	CgroupManager(const string &root, unsigned int cpuWeight = 0,
+	              unsigned long long memoryLimit = 0) {
+		this->root = root;
+		this->cpuWeight = cpuWeight;
+		this->memoryLimit = memoryLimit;
+	}
+	
+	/**
+	 * Create the root group if it doesn't exist, and enable the controllers
+	 * that we need for its children.
+	 *
+	 * @throws SystemException The root group cannot be created, or the
+	 *         controllers cannot be enabled.
+	 * @throws IOException The root group isn't part of a cgroup v2 hierarchy.
+	 */
+	void setup() {
+		struct stat buf;
+		
+		if (mkdir(root.c_str(), 0755) == -1 && errno != EEXIST) {
+			throw SystemException("Cannot create the control group " + root, errno);
+		}
+		if (stat((root + "/cgroup.controllers").c_str(), &buf) == -1) {
+			throw IOException("The directory " + root + " is not a control "
+				"group in a cgroup v2 hierarchy.");
+		}
+		writeFile(root + "/cgroup.subtree_control", "+memory");
+		if (cpuWeight != 0) {
+			writeFile(root + "/cgroup.subtree_control", "+cpu");
+		}
+	}
+	
+	const string &getRoot() const {
+		return root;
+	}
+	
+	/**
+	 * Returns the directory of the given application's group. Characters
+	 * other than letters, digits, '.' and '_' in the application root are
+	 * escaped as "%XX", so that every application has its own group.
+	 */
+	string getGroupDir(const string &appRoot) const {
+		static const char hex[] = "0123456789ABCDEF";
+		string result(root);
+		
+		result.append("/app-");
+		for (string::size_type i = 0; i < appRoot.size(); i++) {
+			unsigned char c = appRoot[i];
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+			 || (c >= '0' && c <= '9') || c == '.' || c == '_') {
+				result.append(1, c);
+			} else {
+				result.append(1, '%');
+				result.append(1, hex[c >> 4]);
+				result.append(1, hex[c & 0xF]);
+			}
+		}
+		return result;
+	}
+	
+	/**
+	 * Create the given application's group if necessary, and apply its CPU
+	 * weight and memory limit. They're (re)applied every time, so that
+	 * configuration changes take effect for groups that were created by an
+	 * earlier server.
+	 *
+	 * @throws SystemException
+	 */
+	void prepare(const string &appRoot) const {
+		string dir(getGroupDir(appRoot));
+		
+		if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+			throw SystemException("Cannot create the control group " + dir, errno);
+		}
+		if (cpuWeight != 0) {
+			writeFile(dir + "/cpu.weight", toString(cpuWeight));
+		}
+		writeFile(dir + "/memory.max",
+			(memoryLimit == 0) ? string("max") : toString(memoryLimit));
+	}
+	
+	/**
+	 * Move the given process into the given application's group, which
+	 * must have been set up with prepare().
+	 *
+	 * @throws SystemException
+	 */
+	void addProcess(const string &appRoot, pid_t pid) const {
+		writeFile(getGroupDir(appRoot) + "/cgroup.procs", toString(pid));
+	}
+	
+	/**
+	 * Move the given process into the given application's group, creating
+	 * and setting up the group with prepare() first.
+	 *
+	 * @throws SystemException
+	 */
+	void attach(const string &appRoot, pid_t pid) const {
+		prepare(appRoot);
+		addProcess(appRoot, pid);
+	}
+	
+	/**
+	 * Read the statistics of the given application's group.
+	 *
+	 * @return Whether the group exists.
+	 */
+	bool getStats(const string &appRoot, Stats &stats) const {
+		string dir(getGroupDir(appRoot));
+		string line;
+		
+		if (!readLine(dir + "/memory.current", line)) {
+			return false;
+		}
+		stats.memoryCurrent = strtoull(line.c_str(), NULL, 10);
+		if (readLine(dir + "/memory.max", line) && line != "max") {
+			stats.memoryMax = strtoull(line.c_str(), NULL, 10);
+		} else {
+			stats.memoryMax = 0;
+		}
+		stats.cpuUsage = readKey(dir + "/cpu.stat", "usage_usec");
+		stats.cpuThrottled = readKey(dir + "/cpu.stat", "throttled_usec");
+		stats.oomKills = readKey(dir + "/memory.events", "oom_kill");
+		return true;
+	}
+};
+
+typedef shared_ptr<CgroupManager> CgroupManagerPtr;
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_CGROUP_MANAGER_H_ */
@@ -20,6 +20,7 @@
 #include <apr_strings.h>
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include "Configuration.h"
 #include "Utils.h"
 
@@ -29,8 +30,12 @@ extern "C" module AP_MODULE_DECLARE_DATA passenger_module;
 
 #define DEFAULT_LOG_LEVEL 0
 #define DEFAULT_MAX_POOL_SIZE 6
+#define DEFAULT_CLUSTER_REPLICAS 1
 #define DEFAULT_POOL_IDLE_TIME 300
 #define DEFAULT_MAX_INSTANCES_PER_APP 0
+#define DEFAULT_POOL_SERVER_THREAD_STACK_SIZE 128
+#define DEFAULT_POOL_SERVER_IDLE_THREADS 16
+#define DEFAULT_MAX_REQUEST_QUEUE_SIZE 100
 
 
 template<typename T> static apr_status_t
@@ -65,6 +70,7 @@ passenger_config_create_dir(apr_pool_t *p, char *dirspec) {
 	config->railsEnv = NULL;
 	config->rackEnv = NULL;
 	config->spawnMethod = DirConfig::SM_UNSET;
+	config->requestPriorityHeader = NULL;
 	return config;
 }
 
@@ -90,6 +96,11 @@ passenger_config_merge_dir(apr_pool_t *p, void *basev, void *addv) {
 	config->railsEnv = (add->railsEnv == NULL) ? base->railsEnv : add->railsEnv;
 	config->rackEnv = (add->rackEnv == NULL) ? base->rackEnv : add->rackEnv;
 	config->spawnMethod = (add->spawnMethod == DirConfig::SM_UNSET) ? base->spawnMethod : add->spawnMethod;
+	config->requestPriorities = base->requestPriorities;
+	for (map<string, string>::const_iterator it(add->requestPriorities.begin()); it != add->requestPriorities.end(); it++) {
+		config->requestPriorities[it->first] = it->second;
+	}
+	config->requestPriorityHeader = (add->requestPriorityHeader == NULL) ? base->requestPriorityHeader : add->requestPriorityHeader;
 	return config;
 }
 
@@ -108,6 +119,32 @@ passenger_config_create_server(apr_pool_t *p, server_rec *s) {
 	config->userSwitching = true;
 	config->userSwitchingSpecified = false;
 	config->defaultUser = NULL;
+	config->spawnAgentSecretFile = NULL;
+	config->clusterSelf = NULL;
+	config->clusterReplicas = DEFAULT_CLUSTER_REPLICAS;
+	config->clusterReplicasSpecified = false;
+	config->clusterSecretFile = NULL;
+	config->numaPlacement = false;
+	config->numaPlacementSpecified = false;
+	config->transparentHugepages = false;
+	config->transparentHugepagesSpecified = false;
+	config->poolServerThreadStackSize = DEFAULT_POOL_SERVER_THREAD_STACK_SIZE;
+	config->poolServerThreadStackSizeSpecified = false;
+	config->poolServerIdleThreads = DEFAULT_POOL_SERVER_IDLE_THREADS;
+	config->poolServerIdleThreadsSpecified = false;
+	config->cgroupRoot = NULL;
+	config->appCpuWeight = 0;
+	config->appCpuWeightSpecified = false;
+	config->appMemoryLimit = 0;
+	config->appMemoryLimitSpecified = false;
+	config->maxRequestQueueSize = DEFAULT_MAX_REQUEST_QUEUE_SIZE;
+	config->maxRequestQueueSizeSpecified = false;
+	config->maxTotalQueuedRequests = 0;
+	config->maxTotalQueuedRequestsSpecified = false;
+	config->maxRequestQueueTime = 0;
+	config->maxRequestQueueTimeSpecified = false;
+	config->sharedInstanceTable = false;
+	config->sharedInstanceTableSpecified = false;
 	return config;
 }
 
@@ -129,6 +166,44 @@ passenger_config_merge_server(apr_pool_t *p, void *basev, void *addv) {
 	config->userSwitching = (add->userSwitchingSpecified) ? add->userSwitching : base->userSwitching;
 	config->userSwitchingSpecified = base->userSwitchingSpecified || add->userSwitchingSpecified;
 	config->defaultUser = (add->defaultUser == NULL) ? base->defaultUser : add->defaultUser;
+	config->remoteInstances.insert(base->remoteInstances.begin(), base->remoteInstances.end());
+	config->remoteInstances.insert(add->remoteInstances.begin(), add->remoteInstances.end());
+	config->appShares = base->appShares;
+	for (map< string, pair<unsigned int, unsigned int> >::const_iterator it(add->appShares.begin()); it != add->appShares.end(); it++) {
+		config->appShares[it->first] = it->second;
+	}
+	config->spawnAgents.insert(base->spawnAgents.begin(), base->spawnAgents.end());
+	config->spawnAgents.insert(add->spawnAgents.begin(), add->spawnAgents.end());
+	config->spawnAgentSecretFile = (add->spawnAgentSecretFile == NULL) ? base->spawnAgentSecretFile : add->spawnAgentSecretFile;
+	config->clusterSelf = (add->clusterSelf == NULL) ? base->clusterSelf : add->clusterSelf;
+	config->clusterNodes.insert(base->clusterNodes.begin(), base->clusterNodes.end());
+	config->clusterNodes.insert(add->clusterNodes.begin(), add->clusterNodes.end());
+	config->clusterReplicas = (add->clusterReplicasSpecified) ? add->clusterReplicas : base->clusterReplicas;
+	config->clusterReplicasSpecified = base->clusterReplicasSpecified || add->clusterReplicasSpecified;
+	config->clusterApps.insert(base->clusterApps.begin(), base->clusterApps.end());
+	config->clusterApps.insert(add->clusterApps.begin(), add->clusterApps.end());
+	config->clusterSecretFile = (add->clusterSecretFile == NULL) ? base->clusterSecretFile : add->clusterSecretFile;
+	config->numaPlacement = (add->numaPlacementSpecified) ? add->numaPlacement : base->numaPlacement;
+	config->numaPlacementSpecified = base->numaPlacementSpecified || add->numaPlacementSpecified;
+	config->transparentHugepages = (add->transparentHugepagesSpecified) ? add->transparentHugepages : base->transparentHugepages;
+	config->transparentHugepagesSpecified = base->transparentHugepagesSpecified || add->transparentHugepagesSpecified;
+	config->poolServerThreadStackSize = (add->poolServerThreadStackSizeSpecified) ? add->poolServerThreadStackSize : base->poolServerThreadStackSize;
+	config->poolServerThreadStackSizeSpecified = base->poolServerThreadStackSizeSpecified || add->poolServerThreadStackSizeSpecified;
+	config->poolServerIdleThreads = (add->poolServerIdleThreadsSpecified) ? add->poolServerIdleThreads : base->poolServerIdleThreads;
+	config->poolServerIdleThreadsSpecified = base->poolServerIdleThreadsSpecified || add->poolServerIdleThreadsSpecified;
+	config->cgroupRoot = (add->cgroupRoot == NULL) ? base->cgroupRoot : add->cgroupRoot;
+	config->appCpuWeight = (add->appCpuWeightSpecified) ? add->appCpuWeight : base->appCpuWeight;
+	config->appCpuWeightSpecified = base->appCpuWeightSpecified || add->appCpuWeightSpecified;
+	config->appMemoryLimit = (add->appMemoryLimitSpecified) ? add->appMemoryLimit : base->appMemoryLimit;
+	config->appMemoryLimitSpecified = base->appMemoryLimitSpecified || add->appMemoryLimitSpecified;
+	config->sharedInstanceTable = (add->sharedInstanceTableSpecified) ? add->sharedInstanceTable : base->sharedInstanceTable;
+	config->sharedInstanceTableSpecified = base->sharedInstanceTableSpecified || add->sharedInstanceTableSpecified;
+	config->maxRequestQueueSize = (add->maxRequestQueueSizeSpecified) ? add->maxRequestQueueSize : base->maxRequestQueueSize;
+	config->maxRequestQueueSizeSpecified = base->maxRequestQueueSizeSpecified || add->maxRequestQueueSizeSpecified;
+	config->maxTotalQueuedRequests = (add->maxTotalQueuedRequestsSpecified) ? add->maxTotalQueuedRequests : base->maxTotalQueuedRequests;
+	config->maxTotalQueuedRequestsSpecified = base->maxTotalQueuedRequestsSpecified || add->maxTotalQueuedRequestsSpecified;
+	config->maxRequestQueueTime = (add->maxRequestQueueTimeSpecified) ? add->maxRequestQueueTime : base->maxRequestQueueTime;
+	config->maxRequestQueueTimeSpecified = base->maxRequestQueueTimeSpecified || add->maxRequestQueueTimeSpecified;
 	return config;
 }
 
@@ -151,6 +226,37 @@ passenger_config_merge_all_servers(apr_pool_t *pool, server_rec *main_server) {
 		final->userSwitching = (config->userSwitchingSpecified) ? config->userSwitching : final->userSwitching;
 		final->userSwitchingSpecified = final->userSwitchingSpecified || config->userSwitchingSpecified;
 		final->defaultUser = (final->defaultUser != NULL) ? final->defaultUser : config->defaultUser;
+		final->remoteInstances.insert(config->remoteInstances.begin(), config->remoteInstances.end());
+		final->appShares.insert(config->appShares.begin(), config->appShares.end());
+		final->spawnAgents.insert(config->spawnAgents.begin(), config->spawnAgents.end());
+		final->spawnAgentSecretFile = (final->spawnAgentSecretFile != NULL) ? final->spawnAgentSecretFile : config->spawnAgentSecretFile;
+		final->clusterSelf = (final->clusterSelf != NULL) ? final->clusterSelf : config->clusterSelf;
+		final->clusterNodes.insert(config->clusterNodes.begin(), config->clusterNodes.end());
+		final->clusterReplicas = (final->clusterReplicasSpecified) ? final->clusterReplicas : config->clusterReplicas;
+		final->clusterReplicasSpecified = final->clusterReplicasSpecified || config->clusterReplicasSpecified;
+		final->clusterApps.insert(config->clusterApps.begin(), config->clusterApps.end());
+		final->clusterSecretFile = (final->clusterSecretFile != NULL) ? final->clusterSecretFile : config->clusterSecretFile;
+		final->numaPlacement = (config->numaPlacementSpecified) ? config->numaPlacement : final->numaPlacement;
+		final->numaPlacementSpecified = final->numaPlacementSpecified || config->numaPlacementSpecified;
+		final->transparentHugepages = (config->transparentHugepagesSpecified) ? config->transparentHugepages : final->transparentHugepages;
+		final->transparentHugepagesSpecified = final->transparentHugepagesSpecified || config->transparentHugepagesSpecified;
+		final->poolServerThreadStackSize = (final->poolServerThreadStackSizeSpecified) ? final->poolServerThreadStackSize : config->poolServerThreadStackSize;
+		final->poolServerThreadStackSizeSpecified = final->poolServerThreadStackSizeSpecified || config->poolServerThreadStackSizeSpecified;
+		final->poolServerIdleThreads = (final->poolServerIdleThreadsSpecified) ? final->poolServerIdleThreads : config->poolServerIdleThreads;
+		final->poolServerIdleThreadsSpecified = final->poolServerIdleThreadsSpecified || config->poolServerIdleThreadsSpecified;
+		final->cgroupRoot = (final->cgroupRoot != NULL) ? final->cgroupRoot : config->cgroupRoot;
+		final->appCpuWeight = (final->appCpuWeightSpecified) ? final->appCpuWeight : config->appCpuWeight;
+		final->appCpuWeightSpecified = final->appCpuWeightSpecified || config->appCpuWeightSpecified;
+		final->appMemoryLimit = (final->appMemoryLimitSpecified) ? final->appMemoryLimit : config->appMemoryLimit;
+		final->appMemoryLimitSpecified = final->appMemoryLimitSpecified || config->appMemoryLimitSpecified;
+		final->sharedInstanceTable = (config->sharedInstanceTableSpecified) ? config->sharedInstanceTable : final->sharedInstanceTable;
+		final->sharedInstanceTableSpecified = final->sharedInstanceTableSpecified || config->sharedInstanceTableSpecified;
+		final->maxRequestQueueSize = (final->maxRequestQueueSizeSpecified) ? final->maxRequestQueueSize : config->maxRequestQueueSize;
+		final->maxRequestQueueSizeSpecified = final->maxRequestQueueSizeSpecified || config->maxRequestQueueSizeSpecified;
+		final->maxTotalQueuedRequests = (final->maxTotalQueuedRequestsSpecified) ? final->maxTotalQueuedRequests : config->maxTotalQueuedRequests;
+		final->maxTotalQueuedRequestsSpecified = final->maxTotalQueuedRequestsSpecified || config->maxTotalQueuedRequestsSpecified;
+		final->maxRequestQueueTime = (final->maxRequestQueueTimeSpecified) ? final->maxRequestQueueTime : config->maxRequestQueueTime;
+		final->maxRequestQueueTimeSpecified = final->maxRequestQueueTimeSpecified || config->maxRequestQueueTimeSpecified;
 	}
 	for (s = main_server; s != NULL; s = s->next) {
 		ServerConfig *config = (ServerConfig *) ap_get_module_config(s->module_config, &passenger_module);
@@ -269,6 +375,320 @@ cmd_passenger_default_user(cmd_parms *cmd, void *dummy, const char *arg) {
 	return NULL;
 }
 
+static const char *
+cmd_passenger_request_priority(cmd_parms *cmd, void *pcfg, const char *uriPrefix, const char *priority) {
+	DirConfig *config = (DirConfig *) pcfg;
+	if (strcmp(priority, "low") != 0 && strcmp(priority, "normal") != 0
+	 && strcmp(priority, "high") != 0) {
+		return "The priority class for PassengerRequestPriority must be 'low', 'normal' or 'high'.";
+	}
+	config->requestPriorities[uriPrefix] = priority;
+	return NULL;
+}
+
+static const char *
+cmd_passenger_request_priority_header(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	config->requestPriorityHeader = arg;
+	return NULL;
+}
+
+static const char *
+cmd_passenger_remote_instance(cmd_parms *cmd, void *dummy, const char *appRoot, const char *address) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	if (strchr(address, ':') == NULL) {
+		return "The address given to PassengerRemoteInstance must be in the form of host:port.";
+	} else {
+		config->remoteInstances.insert(make_pair(string(appRoot), string(address)));
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_app_share(cmd_parms *cmd, void *dummy, const char *appRoot,
+                        const char *minInstances, const char *weight) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *minEnd, *weightEnd;
+	long int minResult, weightResult;
+	
+	minResult = strtol(minInstances, &minEnd, 10);
+	weightResult = strtol(weight, &weightEnd, 10);
+	if (*minEnd != '\0' || *weightEnd != '\0') {
+		return "Invalid number specified for PassengerAppShare.";
+	} else if (minResult < 0) {
+		return "The minimum number of instances given to PassengerAppShare must be at least 0.";
+	} else if (weightResult < 1) {
+		return "The weight given to PassengerAppShare must be at least 1.";
+	} else {
+		config->appShares[appRoot] = make_pair((unsigned int) minResult,
+			(unsigned int) weightResult);
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_spawn_agent(cmd_parms *cmd, void *dummy, const char *address) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	if (strchr(address, ':') == NULL) {
+		return "The address given to PassengerSpawnAgent must be in the form of host:port.";
+	} else if (strchr(address, ',') != NULL) {
+		return "The address given to PassengerSpawnAgent may not contain commas.";
+	} else {
+		config->spawnAgents.insert(address);
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_spawn_agent_secret_file(cmd_parms *cmd, void *dummy, const char *filename) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	config->spawnAgentSecretFile = filename;
+	return NULL;
+}
+
+static const char *
+cmd_passenger_cluster_node(cmd_parms *cmd, void *dummy, const char *address) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	if (strchr(address, ':') == NULL) {
+		return "The address given to PassengerClusterNode must be in the form of host:port.";
+	} else if (strchr(address, ',') != NULL) {
+		return "The address given to PassengerClusterNode may not contain commas.";
+	} else {
+		config->clusterNodes.insert(address);
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_cluster_self(cmd_parms *cmd, void *dummy, const char *address) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	if (strchr(address, ':') == NULL) {
+		return "The address given to PassengerClusterSelf must be in the form of host:port.";
+	} else if (strchr(address, ',') != NULL) {
+		return "The address given to PassengerClusterSelf may not contain commas.";
+	} else {
+		config->clusterSelf = address;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_cluster_replicas(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerClusterReplicas.";
+	} else if (result <= 0) {
+		return "Value for PassengerClusterReplicas must be greater than 0.";
+	} else {
+		config->clusterReplicas = (unsigned int) result;
+		config->clusterReplicasSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_cluster_app(cmd_parms *cmd, void *dummy, const char *appRoot) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	if (strchr(appRoot, ',') != NULL) {
+		return "The application root given to PassengerClusterApp may not contain commas.";
+	} else {
+		config->clusterApps.insert(appRoot);
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_cluster_secret_file(cmd_parms *cmd, void *dummy, const char *filename) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	config->clusterSecretFile = filename;
+	return NULL;
+}
+
+static const char *
+cmd_passenger_numa_placement(cmd_parms *cmd, void *pcfg, int arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	config->numaPlacement = arg;
+	config->numaPlacementSpecified = true;
+	return NULL;
+}
+
+static const char *
+cmd_passenger_transparent_hugepages(cmd_parms *cmd, void *pcfg, int arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	config->transparentHugepages = arg;
+	config->transparentHugepagesSpecified = true;
+	return NULL;
+}
+
+static const char *
+cmd_passenger_shared_instance_table(cmd_parms *cmd, void *pcfg, int arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	config->sharedInstanceTable = arg;
+	config->sharedInstanceTableSpecified = true;
+	return NULL;
+}
+
+static const char *
+cmd_passenger_max_request_queue_size(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMaxRequestQueueSize.";
+	} else if (result < 0) {
+		return "Value for PassengerMaxRequestQueueSize must be at least 0.";
+	} else {
+		config->maxRequestQueueSize = (unsigned int) result;
+		config->maxRequestQueueSizeSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_max_total_queued_requests(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMaxTotalQueuedRequests.";
+	} else if (result < 0) {
+		return "Value for PassengerMaxTotalQueuedRequests must be at least 0.";
+	} else {
+		config->maxTotalQueuedRequests = (unsigned int) result;
+		config->maxTotalQueuedRequestsSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_max_request_queue_time(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMaxRequestQueueTime.";
+	} else if (result < 0) {
+		return "Value for PassengerMaxRequestQueueTime must be at least 0.";
+	} else {
+		config->maxRequestQueueTime = (unsigned int) result;
+		config->maxRequestQueueTimeSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_pool_server_thread_stack_size(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerPoolServerThreadStackSize.";
+	} else if (result < 64) {
+		return "Value for PassengerPoolServerThreadStackSize must be at least 64.";
+	} else {
+		config->poolServerThreadStackSize = (unsigned int) result;
+		config->poolServerThreadStackSizeSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_pool_server_idle_threads(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerPoolServerIdleThreads.";
+	} else if (result < 0) {
+		return "Value for PassengerPoolServerIdleThreads must be at least 0.";
+	} else {
+		config->poolServerIdleThreads = (unsigned int) result;
+		config->poolServerIdleThreadsSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_cgroup_root(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	if (*arg != '/') {
+		return "The directory given to PassengerCgroupRoot must be an absolute path.";
+	} else {
+		config->cgroupRoot = arg;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_app_cpu_weight(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerAppCpuWeight.";
+	} else if (result < 1 || result > 10000) {
+		return "Value for PassengerAppCpuWeight must be between 1 and 10000.";
+	} else {
+		config->appCpuWeight = (unsigned int) result;
+		config->appCpuWeightSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_app_memory_limit(cmd_parms *cmd, void *dummy, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerAppMemoryLimit.";
+	} else if (result < 0) {
+		return "Value for PassengerAppMemoryLimit must be at least 0.";
+	} else {
+		config->appMemoryLimit = (unsigned int) result;
+		config->appMemoryLimitSpecified = true;
+		return NULL;
+	}
+}
+
 
 /*************************************************
  * Rails-specific settings
@@ -407,6 +827,116 @@ const command_rec passenger_commands[] = {
 		NULL,
 		RSRC_CONF,
 		"Whether to enable user switching support."),
+	AP_INIT_TAKE2("PassengerRemoteInstance",
+		(Take1Func) cmd_passenger_remote_instance,
+		NULL,
+		RSRC_CONF,
+		"An instance of the given application that runs on another host, at the given host:port."),
+	AP_INIT_TAKE3("PassengerAppShare",
+		(Take1Func) cmd_passenger_app_share,
+		NULL,
+		RSRC_CONF,
+		"The guaranteed minimum number of instances and the weight of the given application."),
+	AP_INIT_TAKE1("PassengerSpawnAgent",
+		(Take1Func) cmd_passenger_spawn_agent,
+		NULL,
+		RSRC_CONF,
+		"A spawn agent, at the given host:port, to spawn applications with."),
+	AP_INIT_TAKE1("PassengerSpawnAgentSecretFile",
+		(Take1Func) cmd_passenger_spawn_agent_secret_file,
+		NULL,
+		RSRC_CONF,
+		"The file with the secret that the spawn agents expect."),
+	AP_INIT_TAKE1("PassengerClusterNode",
+		(Take1Func) cmd_passenger_cluster_node,
+		NULL,
+		RSRC_CONF,
+		"Another Passenger cluster node, at the given host:port, to share applications with."),
+	AP_INIT_TAKE1("PassengerClusterSelf",
+		(Take1Func) cmd_passenger_cluster_self,
+		NULL,
+		RSRC_CONF,
+		"The host:port on which this Passenger cluster node accepts requests from the other nodes."),
+	AP_INIT_TAKE1("PassengerClusterReplicas",
+		(Take1Func) cmd_passenger_cluster_replicas,
+		NULL,
+		RSRC_CONF,
+		"The number of Passenger cluster nodes that each application is placed on."),
+	AP_INIT_TAKE1("PassengerClusterApp",
+		(Take1Func) cmd_passenger_cluster_app,
+		NULL,
+		RSRC_CONF,
+		"An application, given by its application root, to share with the other Passenger cluster nodes."),
+	AP_INIT_TAKE1("PassengerClusterSecretFile",
+		(Take1Func) cmd_passenger_cluster_secret_file,
+		NULL,
+		RSRC_CONF,
+		"The file with the secret with which Passenger cluster nodes authenticate each other."),
+	AP_INIT_FLAG("PassengerNumaPlacement",
+		(Take1Func) cmd_passenger_numa_placement,
+		NULL,
+		RSRC_CONF,
+		"Whether to pin application instances to NUMA nodes."),
+	AP_INIT_FLAG("PassengerTransparentHugepages",
+		(Take1Func) cmd_passenger_transparent_hugepages,
+		NULL,
+		RSRC_CONF,
+		"Whether to use transparent hugepages for the preloaded framework heap."),
+	AP_INIT_TAKE1("PassengerPoolServerThreadStackSize",
+		(Take1Func) cmd_passenger_pool_server_thread_stack_size,
+		NULL,
+		RSRC_CONF,
+		"The stack size, in KB, of the threads that serve the web server processes."),
+	AP_INIT_TAKE1("PassengerPoolServerIdleThreads",
+		(Take1Func) cmd_passenger_pool_server_idle_threads,
+		NULL,
+		RSRC_CONF,
+		"The number of idle threads that are kept around for serving new web server processes."),
+	AP_INIT_TAKE1("PassengerCgroupRoot",
+		(Take1Func) cmd_passenger_cgroup_root,
+		NULL,
+		RSRC_CONF,
+		"The cgroup v2 directory in which each application gets its own control group."),
+	AP_INIT_TAKE1("PassengerAppCpuWeight",
+		(Take1Func) cmd_passenger_app_cpu_weight,
+		NULL,
+		RSRC_CONF,
+		"The CPU weight of each application's control group."),
+	AP_INIT_TAKE1("PassengerAppMemoryLimit",
+		(Take1Func) cmd_passenger_app_memory_limit,
+		NULL,
+		RSRC_CONF,
+		"The memory limit, in MB, of each application's control group."),
+	AP_INIT_FLAG("PassengerSharedInstanceTable",
+		(Take1Func) cmd_passenger_shared_instance_table,
+		NULL,
+		RSRC_CONF,
+		"Whether web server processes connect to idle application instances without asking the ApplicationPool server."),
+	AP_INIT_TAKE1("PassengerMaxRequestQueueSize",
+		(Take1Func) cmd_passenger_max_request_queue_size,
+		NULL,
+		RSRC_CONF,
+		"The maximum number of requests that may be queued for a single application."),
+	AP_INIT_TAKE1("PassengerMaxTotalQueuedRequests",
+		(Take1Func) cmd_passenger_max_total_queued_requests,
+		NULL,
+		RSRC_CONF,
+		"The maximum number of requests that may be queued for all applications together."),
+	AP_INIT_TAKE1("PassengerMaxRequestQueueTime",
+		(Take1Func) cmd_passenger_max_request_queue_time,
+		NULL,
+		RSRC_CONF,
+		"The maximum number of seconds that a request may wait for room in the application pool."),
+	AP_INIT_TAKE2("PassengerRequestPriority",
+		(Take1Func) cmd_passenger_request_priority,
+		NULL,
+		RSRC_CONF,
+		"The priority class of requests whose URI starts with the given prefix."),
+	AP_INIT_TAKE1("PassengerRequestPriorityHeader",
+		(Take1Func) cmd_passenger_request_priority_header,
+		NULL,
+		RSRC_CONF,
+		"The request header that may override a request's priority class."),
 	AP_INIT_TAKE1("PassengerDefaultUser",
 		(Take1Func) cmd_passenger_default_user,
 		NULL,
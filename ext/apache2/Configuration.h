@@ -35,7 +35,9 @@
 
 #ifdef __cplusplus
 	#include <set>
+	#include <map>
 	#include <string>
+	#include <utility>
 
 	namespace Passenger {
 	
@@ -73,6 +75,14 @@
 			enum SpawnMethod { SM_UNSET, SM_SMART, SM_CONSERVATIVE };
 			/** The Rails spawn method to use. */
 			SpawnMethod spawnMethod;
+			
+			/** The priority classes ("low", "normal" or "high") of requests,
+			 * by URI prefix. The longest matching prefix wins. */
+			std::map<std::string, std::string> requestPriorities;
+			
+			/** The request header that may override the priority class.
+			 * NULL means the option is not specified. */
+			const char *requestPriorityHeader;
 		};
 		
 		/**
@@ -123,6 +133,129 @@
 			 * fails or is disabled. NULL means the option is not specified.
 			 */
 			const char *defaultUser;
+			
+			/** Application instances on other hosts, as (application root,
+			 * "host:port") pairs. */
+			std::set< std::pair<std::string, std::string> > remoteInstances;
+			
+			/** The shares of the pool that applications are entitled to, as
+			 * (guaranteed minimum number of instances, weight) pairs, by
+			 * application root. */
+			std::map< std::string, std::pair<unsigned int, unsigned int> > appShares;
+			
+			/** The addresses ("host:port") of the spawn agents to spawn
+			 * applications with. If empty, applications are spawned locally. */
+			std::set<std::string> spawnAgents;
+			
+			/** The file that contains the secret that the spawn agents expect,
+			 * or NULL if it's not specified. */
+			const char *spawnAgentSecretFile;
+			
+			/** The cluster address ("host:port") of this ApplicationPool
+			 * server. NULL means that this server isn't a cluster member. */
+			const char *clusterSelf;
+			
+			/** The cluster addresses ("host:port") of the other cluster nodes. */
+			std::set<std::string> clusterNodes;
+			
+			/** The number of cluster nodes that each application is placed on. */
+			unsigned int clusterReplicas;
+			
+			/** Whether the clusterReplicas option was explicitly specified in
+			 * this server config. */
+			bool clusterReplicasSpecified;
+			
+			/** The application roots of the applications that are shared
+			 * among the cluster nodes. */
+			std::set<std::string> clusterApps;
+			
+			/** The file that contains the secret with which the cluster nodes
+			 * authenticate each other, or NULL if it's not specified. */
+			const char *clusterSecretFile;
+			
+			/** Whether application instances are pinned to NUMA nodes. */
+			bool numaPlacement;
+			
+			/** Whether the numaPlacement option was explicitly specified in
+			 * this server config. */
+			bool numaPlacementSpecified;
+			
+			/** Whether the spawn server enables transparent hugepages for
+			 * the preloaded framework heap. */
+			bool transparentHugepages;
+			
+			/** Whether the transparentHugepages option was explicitly
+			 * specified in this server config. */
+			bool transparentHugepagesSpecified;
+			
+			/** The stack size, in KB, of the ApplicationPool server's
+			 * client threads. */
+			unsigned int poolServerThreadStackSize;
+			
+			/** Whether the poolServerThreadStackSize option was explicitly
+			 * specified in this server config. */
+			bool poolServerThreadStackSizeSpecified;
+			
+			/** The number of idle client threads that the ApplicationPool
+			 * server keeps around. */
+			unsigned int poolServerIdleThreads;
+			
+			/** Whether the poolServerIdleThreads option was explicitly
+			 * specified in this server config. */
+			bool poolServerIdleThreadsSpecified;
+			
+			/** The control group in which each application gets its own
+			 * group. NULL means that applications aren't placed in control
+			 * groups. */
+			const char *cgroupRoot;
+			
+			/** The CPU weight of each application's control group, or 0
+			 * for the kernel's default. */
+			unsigned int appCpuWeight;
+			
+			/** Whether the appCpuWeight option was explicitly specified in
+			 * this server config. */
+			bool appCpuWeightSpecified;
+			
+			/** The memory limit, in MB, of each application's control group,
+			 * or 0 for no limit. */
+			unsigned int appMemoryLimit;
+			
+			/** Whether the appMemoryLimit option was explicitly specified in
+			 * this server config. */
+			bool appMemoryLimitSpecified;
+			
+			/** Whether Apache processes open sessions through the shared
+			 * instance table. */
+			bool sharedInstanceTable;
+			
+			/** Whether the sharedInstanceTable option was explicitly
+			 * specified in this server config. */
+			bool sharedInstanceTableSpecified;
+			
+			/** The maximum number of requests that may be queued for a single
+			 * application. 0 means no limit. */
+			unsigned int maxRequestQueueSize;
+			
+			/** Whether the maxRequestQueueSize option was explicitly specified in
+			 * this server config. */
+			bool maxRequestQueueSizeSpecified;
+			
+			/** The maximum number of requests that may be queued for all
+			 * applications together. 0 means no limit. */
+			unsigned int maxTotalQueuedRequests;
+			
+			/** Whether the maxTotalQueuedRequests option was explicitly specified in
+			 * this server config. */
+			bool maxTotalQueuedRequestsSpecified;
+			
+			/** The maximum number of seconds that a request may wait for room
+			 * in the application pool. 0 means no limit. */
+			unsigned int maxRequestQueueTime;
+			
+			/** Whether the maxRequestQueueTime option was explicitly specified in
+			 * this server config. */
+			bool maxRequestQueueTimeSpecified;
 		};
 	}
 
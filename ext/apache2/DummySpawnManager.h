@@ -20,19 +20,36 @@
 #ifndef _PASSENGER_DUMMY_SPAWN_MANAGER_H_
 #define _PASSENGER_DUMMY_SPAWN_MANAGER_H_
 
-// TODO: make this path not hardcoded
-#define DUMMY_REQUEST_HANDLER_EXECUTABLE "/home/hongli/Projects/passenger/benchmark/DummyRequestHandler"
+/**
+ * The DummyRequestHandler executable to spawn. This path is relative to the
+ * current working directory, so programs that use DummySpawnManager should
+ * be run from the Passenger source root. Define this macro on the compiler
+ * command line to override it.
+ */
+#ifndef DUMMY_REQUEST_HANDLER_EXECUTABLE
+	#define DUMMY_REQUEST_HANDLER_EXECUTABLE "benchmark/DummyRequestHandler"
+#endif
 
 #include <string>
 
+#include <boost/thread/mutex.hpp>
+
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <cstdio>
+#include <cstring>
 #include <unistd.h>
 #include <errno.h>
 
 #include "Application.h"
+#include "MessageChannel.h"
 #include "Exceptions.h"
+#include "System.h"
+#include "Logging.h"
+#include "CgroupManager.h"
 
 namespace Passenger {
 
@@ -52,25 +69,135 @@ using namespace std;
  *
  * Of course, don't forget to compile benchmark/DummyRequestHandler!
  *
+ * <h2>Implementation details</h2>
+ * The listener socket is created by DummySpawnManager itself, on the filesystem,
+ * and is passed to the request handler as its standard input. The reader end of
+ * the owner pipe is passed as file descriptor 3. The request handler is
+ * double-forked so that we don't have to reap it; its PID is sent back to
+ * us through a pipe.
+ *
  * @ingroup Support
  */
 class DummySpawnManager {
+private:
+	static const int OWNER_PIPE_FD = 3;
+	
+	boost::mutex lock;
+	unsigned int counter;
+	CgroupManagerPtr cgroups;
+	
+	/**
+	 * Create a Unix socket on the filesystem, which the request handler will
+	 * use to listen for new connections.
+	 *
+	 * @throws SystemException
+	 */
+	int createListenSocket(string &filename) {
+		struct sockaddr_un addr;
+		char name[sizeof(addr.sun_path)];
+		int fd;
+		
+		{
+			boost::mutex::scoped_lock l(lock);
+			snprintf(name, sizeof(name), "/tmp/passenger_dummy.%lu.%u",
+				(unsigned long) getpid(), counter);
+			name[sizeof(name) - 1] = '\0';
+			counter++;
+		}
+		filename = name;
+		
+		fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1) {
+			throw SystemException("Cannot create a Unix socket", errno);
+		}
+		
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, name, sizeof(addr.sun_path));
+		addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
+		unlink(name);
+		if (::bind(fd, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
+			int e = errno;
+			InterruptableCalls::close(fd);
+			throw SystemException(string("Cannot bind Unix socket '") + name + "'", e);
+		}
+		if (::listen(fd, 50) == -1) {
+			int e = errno;
+			InterruptableCalls::close(fd);
+			unlink(name);
+			throw SystemException(string("Cannot listen on Unix socket '") + name + "'", e);
+		}
+		return fd;
+	}
+	
 public:
-	ApplicationPtr spawn(const string &appRoot, const string &user = "", const string &group = "") {
-		int fds[2];
+	DummySpawnManager() {
+		counter = 0;
+	}
+	
+	ApplicationPtr spawn(
+		const string &appRoot,
+		bool lowerPrivilege = true,
+		const string &lowestUser = "nobody",
+		const string &environment = "production",
+		const string &spawnMethod = "smart",
+		const string &appType = "rails"
+	) {
+		this_thread::disable_syscall_interruption dsi;
+		string socketName, procsFile;
+		int listenSocket, ownerPipe[2], pidPipe[2];
 		pid_t pid;
+		CgroupManagerPtr cgroups;
 		
-		if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
-			throw SystemException("Cannot create a Unix socket", errno);
+		{
+			boost::mutex::scoped_lock l(lock);
+			cgroups = this->cgroups;
+		}
+		if (cgroups != NULL) {
+			try {
+				cgroups->prepare(appRoot);
+				procsFile = cgroups->getGroupDir(appRoot) + "/cgroup.procs";
+			} catch (const SystemException &e) {
+				P_WARN("Cannot set up the control group of " << appRoot <<
+					": " << e.what());
+			}
+		}
+		
+		listenSocket = createListenSocket(socketName);
+		if (pipe(ownerPipe) == -1) {
+			int e = errno;
+			InterruptableCalls::close(listenSocket);
+			unlink(socketName.c_str());
+			throw SystemException("Cannot create a pipe", e);
+		}
+		if (pipe(pidPipe) == -1) {
+			int e = errno;
+			InterruptableCalls::close(listenSocket);
+			InterruptableCalls::close(ownerPipe[0]);
+			InterruptableCalls::close(ownerPipe[1]);
+			unlink(socketName.c_str());
+			throw SystemException("Cannot create a pipe", e);
 		}
-		pid = fork();
+		
+		pid = InterruptableCalls::fork();
 		if (pid == 0) {
 			pid = fork();
 			if (pid == 0) {
-				dup2(fds[0], STDIN_FILENO);
-				close(fds[0]);
-				close(fds[1]);
-				execlp(DUMMY_REQUEST_HANDLER_EXECUTABLE, DUMMY_REQUEST_HANDLER_EXECUTABLE, NULL);
+				if (!procsFile.empty()) {
+					// Join the control group before the handler is loaded.
+					char buf[32];
+					int fd = open(procsFile.c_str(), O_WRONLY);
+					if (fd != -1) {
+						snprintf(buf, sizeof(buf), "%lu", (unsigned long) getpid());
+						write(fd, buf, strlen(buf));
+						close(fd);
+					}
+				}
+				dup2(listenSocket, STDIN_FILENO);
+				dup2(ownerPipe[0], OWNER_PIPE_FD);
+				for (long i = sysconf(_SC_OPEN_MAX) - 1; i > OWNER_PIPE_FD; i--) {
+					close(i);
+				}
+				execlp(DUMMY_REQUEST_HANDLER_EXECUTABLE, DUMMY_REQUEST_HANDLER_EXECUTABLE, (char *) 0);
 				int e = errno;
 				fprintf(stderr, "Unable to run %s: %s\n", DUMMY_REQUEST_HANDLER_EXECUTABLE, strerror(e));
 				fflush(stderr);
@@ -80,19 +207,64 @@ public:
 				fflush(stderr);
 				_exit(1);
 			} else {
+				write(pidPipe[1], &pid, sizeof(pid));
 				_exit(0);
 			}
 		} else if (pid == -1) {
-			close(fds[0]);
-			close(fds[1]);
-			throw SystemException("Cannot fork a new process", errno);
+			int e = errno;
+			InterruptableCalls::close(listenSocket);
+			InterruptableCalls::close(ownerPipe[0]);
+			InterruptableCalls::close(ownerPipe[1]);
+			InterruptableCalls::close(pidPipe[0]);
+			InterruptableCalls::close(pidPipe[1]);
+			unlink(socketName.c_str());
+			throw SystemException("Cannot fork a new process", e);
 		} else {
-			close(fds[0]);
-			waitpid(pid, NULL, 0);
-			return ApplicationPtr(new Application(appRoot, pid, fds[1]));
+			pid_t handlerPid;
+			bool gotPid;
+			
+			InterruptableCalls::close(listenSocket);
+			InterruptableCalls::close(ownerPipe[0]);
+			InterruptableCalls::close(pidPipe[1]);
+			InterruptableCalls::waitpid(pid, NULL, 0);
+			try {
+				gotPid = MessageChannel(pidPipe[0]).readRaw(&handlerPid, sizeof(handlerPid));
+			} catch (...) {
+				InterruptableCalls::close(pidPipe[0]);
+				InterruptableCalls::close(ownerPipe[1]);
+				unlink(socketName.c_str());
+				throw;
+			}
+			InterruptableCalls::close(pidPipe[0]);
+			if (!gotPid) {
+				InterruptableCalls::close(ownerPipe[1]);
+				unlink(socketName.c_str());
+				throw SpawnException("Could not spawn " DUMMY_REQUEST_HANDLER_EXECUTABLE);
+			}
+			
+			if (!procsFile.empty()) {
+				// In case the handler couldn't join its group itself.
+				try {
+					cgroups->addProcess(appRoot, handlerPid);
+				} catch (const SystemException &e) {
+					P_WARN("Cannot place " << appRoot << " (PID " << handlerPid <<
+						") in its control group: " << e.what());
+				}
+			}
+			return ApplicationPtr(new Application(appRoot, handlerPid,
+				socketName, false, ownerPipe[1]));
 		}
 	}
 	
+	void reload(const string &appRoot) {
+		// Nothing to reload.
+	}
+	
+	void setCgroups(const CgroupManagerPtr &cgroups) {
+		boost::mutex::scoped_lock l(lock);
+		this->cgroups = cgroups;
+	}
+	
 	pid_t getServerPid() const {
 		return 0;
 	}
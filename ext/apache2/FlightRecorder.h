@@ -0,0 +1,282 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_FLIGHT_RECORDER_H_
+#define _PASSENGER_FLIGHT_RECORDER_H_
+
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+
+namespace Passenger {
+
+using namespace std;
+
+/**
+ * An always-on, in-memory ring buffer of the most recent ApplicationPool
+ * events, for post-mortem analysis of problems such as spawn storms.
+ *
+ * Recording an event doesn't lock anything and doesn't allocate memory: it
+ * claims a slot with an atomic increment and copies a few fields into it.
+ * When the buffer is full, the oldest events are overwritten. Each slot has
+ * a sequence number, so that a reader can detect (and skip) slots that are
+ * being overwritten while it reads them.
+ *
+ * Use FlightRecorder::global() for the recorder whose contents are shown
+ * by the ApplicationPool server.
+ *
+ * @ingroup Support
+ */
+class FlightRecorder {
+public:
+	enum EventType {
+		/** An ApplicationPool::get() call succeeded. */
+		GET,
+		/** An application instance is about to be spawned. */
+		SPAWN_START,
+		/** An application instance has been spawned. */
+		SPAWN_END,
+		/** An application instance could not be spawned. */
+		SPAWN_ERROR,
+		/** An idle instance was shut down to make room for another application. */
+		EVICT,
+		/** An application was restarted through restart.txt. */
+		RESTART,
+		/** An instance could not be connected to, and was removed from the pool. */
+		CONNECT_FAILURE,
+		/** An idle instance was shut down by the cleaner thread. */
+		IDLE_CLEANUP,
+		/** A get() request was rejected because the pool was too busy. */
+		BUSY
+	};
+	
+	/** The maximum length of the application key that is stored with an event. */
+	static const unsigned int APP_KEY_SIZE = 64;
+	
+	/** A copy of a recorded event. */
+	struct Event {
+		/** The value of the monotonic clock when the event occurred, in microseconds. */
+		unsigned long long time;
+		EventType type;
+		/** The PID of the application instance involved, or 0 if not applicable. */
+		pid_t pid;
+		/** A duration in microseconds, or 0 if not applicable. */
+		unsigned long long duration;
+		/**
+		 * The application key, e.g. the application root. Longer keys are
+		 * truncated at the front, because the end of a path is more
+		 * distinctive than its beginning.
+		 */
+		char app[APP_KEY_SIZE];
+	};
+
+private:
+	struct Slot {
+		/**
+		 * 0 while the slot is being written to, and the event's position
+		 * in the stream of events plus 1 once it's been written.
+		 */
+		volatile unsigned long long sequence;
+		Event event;
+	};
+	
+	Slot *slots;
+	unsigned int mask;
+	volatile unsigned long long nextPosition;
+	
+	FlightRecorder(const FlightRecorder &);
+	FlightRecorder &operator=(const FlightRecorder &);
+	
+	static const char *typeName(EventType type) {
+		switch (type) {
+		case GET:
+			return "get";
+		case SPAWN_START:
+			return "spawn_start";
+		case SPAWN_END:
+			return "spawn_end";
+		case SPAWN_ERROR:
+			return "spawn_error";
+		case EVICT:
+			return "evict";
+		case RESTART:
+			return "restart";
+		case CONNECT_FAILURE:
+			return "connect_failure";
+		case IDLE_CLEANUP:
+			return "idle_cleanup";
+		case BUSY:
+			return "busy";
+		default:
+			return "unknown";
+		}
+	}
+
+public:
+	/**
+	 * Returns the current value of the monotonic clock, in microseconds.
+	 * Falls back to the wall clock on systems without a monotonic clock.
+	 */
+	static unsigned long long now() {
+		#ifdef CLOCK_MONOTONIC
+			struct timespec ts;
+			if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+				return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+			}
+		#endif
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+	
+	/**
+	 * Returns the process-wide flight recorder. It's never destroyed, so that
+	 * detached threads may still record events while the program exits.
+	 */
+	static FlightRecorder &global() {
+		static FlightRecorder *recorder = new FlightRecorder();
+		return *recorder;
+	}
+	
+	/**
+	 * Create a new FlightRecorder.
+	 *
+	 * @param capacity The number of events to keep. Will be rounded up
+	 *                 to a power of 2.
+	 */
+	FlightRecorder(unsigned int capacity = 4096) {
+		unsigned int size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		slots = new Slot[size];
+		memset(slots, 0, sizeof(Slot) * size);
+		mask = size - 1;
+		nextPosition = 0;
+	}
+	
+	~FlightRecorder() {
+		delete[] slots;
+	}
+	
+	/**
+	 * Returns the number of events that this recorder can hold.
+	 */
+	unsigned int capacity() const {
+		return mask + 1;
+	}
+	
+	/**
+	 * Record an event. This is thread-safe and lock-free.
+	 */
+	void record(EventType type, const string &app, pid_t pid = 0,
+	            unsigned long long duration = 0) {
+		unsigned long long position = __sync_fetch_and_add(&nextPosition, 1);
+		Slot &slot(slots[position & mask]);
+		
+		slot.sequence = 0;
+		__sync_synchronize();
+		slot.event.time = now();
+		slot.event.type = type;
+		slot.event.pid = pid;
+		slot.event.duration = duration;
+		if (app.size() < APP_KEY_SIZE) {
+			memcpy(slot.event.app, app.c_str(), app.size() + 1);
+		} else {
+			memcpy(slot.event.app, app.c_str() + app.size() - APP_KEY_SIZE + 1,
+				APP_KEY_SIZE);
+		}
+		__sync_synchronize();
+		slot.sequence = position + 1;
+	}
+	
+	/**
+	 * Returns a copy of the recorded events, oldest first. Events that are
+	 * being written to while this method runs are skipped.
+	 *
+	 * @param max The maximum number of (most recent) events to return,
+	 *            or 0 to return all of them.
+	 */
+	vector<Event> getEvents(unsigned int max = 0) const {
+		unsigned long long end = __sync_fetch_and_add(
+			const_cast<volatile unsigned long long *>(&nextPosition), 0);
+		unsigned long long begin = 0;
+		unsigned long long count = capacity();
+		vector<Event> result;
+		
+		if (max != 0 && max < count) {
+			count = max;
+		}
+		if (end > count) {
+			begin = end - count;
+		}
+		result.reserve(end - begin);
+		for (unsigned long long i = begin; i < end; i++) {
+			const Slot &slot(slots[i & mask]);
+			Event event;
+			
+			if (slot.sequence != i + 1) {
+				continue;
+			}
+			__sync_synchronize();
+			memcpy(&event, (const void *) &slot.event, sizeof(Event));
+			__sync_synchronize();
+			if (slot.sequence == i + 1) {
+				result.push_back(event);
+			}
+		}
+		return result;
+	}
+	
+	/**
+	 * Returns a textual report of the recorded events, oldest first. Times
+	 * are relative to now, in seconds, and durations are in microseconds.
+	 *
+	 * @param max The maximum number of (most recent) events to show,
+	 *            or 0 to show all of them.
+	 */
+	string toString(unsigned int max = 0) const {
+		vector<Event> events(getEvents(max));
+		unsigned long long currentTime = now();
+		stringstream result;
+		
+		result << "----------- Recent pool events -----------" << endl;
+		for (vector<Event>::const_iterator it = events.begin(); it != events.end(); it++) {
+			unsigned long long ago = (currentTime > it->time) ? currentTime - it->time : 0;
+			char buf[128];
+			
+			snprintf(buf, sizeof(buf), "-%llu.%06llus  %-16s PID: %-8lu  Duration: %-10llu  ",
+				ago / 1000000, ago % 1000000, typeName(it->type),
+				(unsigned long) it->pid, it->duration);
+			result << buf << it->app << endl;
+		}
+		result << endl;
+		return result.str();
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_FLIGHT_RECORDER_H_ */
@@ -0,0 +1,192 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_HASH_RING_H_
+#define _PASSENGER_HASH_RING_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+
+namespace Passenger {
+
+using namespace std;
+
+/**
+ * A consistent hash ring, which maps keys (e.g. application roots) to one or
+ * more nodes (e.g. the addresses of ApplicationPool servers).
+ *
+ * Each node is placed on the ring at a number of pseudo-random positions
+ * ("virtual nodes"), so that keys are spread evenly over the nodes. Adding
+ * or removing a node only moves the keys that are owned by that node; all
+ * other keys keep their owners.
+ *
+ * The ring is deterministic: two HashRings with the same nodes map every key
+ * to the same nodes, regardless of the order in which the nodes were added.
+ * This allows independent processes to agree on the owners of a key without
+ * communicating.
+ *
+ * This class is not thread-safe, but it is safe to call the const methods
+ * from multiple threads if the ring isn't modified at the same time.
+ *
+ * @ingroup Support
+ */
+class HashRing {
+public:
+	/** The default number of positions of each node on the ring. */
+	static const unsigned int DEFAULT_VIRTUAL_NODES = 160;
+
+private:
+	typedef map<unsigned long long, string> Ring;
+	
+	Ring ring;
+	vector<string> nodes;
+	unsigned int virtualNodes;
+
+public:
+	/**
+	 * Returns the 64-bit FNV-1a hash of the given data, with an extra
+	 * avalanche step so that similar strings end up far apart on the ring.
+	 */
+	static unsigned long long hash(const string &data) {
+		unsigned long long h = 14695981039346656037ULL;
+		for (string::size_type i = 0; i < data.size(); i++) {
+			h ^= (unsigned char) data[i];
+			h *= 1099511628211ULL;
+		}
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h;
+	}
+	
+	/**
+	 * Create a new, empty HashRing.
+	 *
+	 * @param virtualNodes The number of positions of each node on the ring.
+	 */
+	HashRing(unsigned int virtualNodes = DEFAULT_VIRTUAL_NODES) {
+		this->virtualNodes = virtualNodes;
+	}
+	
+	/**
+	 * Add a node to the ring. Does nothing if the node is already on the ring.
+	 */
+	void add(const string &node) {
+		if (find(nodes.begin(), nodes.end(), node) != nodes.end()) {
+			return;
+		}
+		nodes.push_back(node);
+		for (unsigned int i = 0; i < virtualNodes; i++) {
+			char suffix[16];
+			snprintf(suffix, sizeof(suffix), "#%u", i);
+			unsigned long long position = hash(node + suffix);
+			Ring::iterator it(ring.find(position));
+			
+			// In the unlikely case of a collision, the smallest node name
+			// wins, so that the outcome doesn't depend on the insertion order.
+			if (it == ring.end() || node < it->second) {
+				ring[position] = node;
+			}
+		}
+	}
+	
+	/**
+	 * Remove a node from the ring. Does nothing if the node isn't on the ring.
+	 */
+	void remove(const string &node) {
+		vector<string>::iterator nit(find(nodes.begin(), nodes.end(), node));
+		if (nit == nodes.end()) {
+			return;
+		}
+		nodes.erase(nit);
+		ring.clear();
+		
+		vector<string> remaining(nodes);
+		nodes.clear();
+		for (vector<string>::iterator it = remaining.begin(); it != remaining.end(); it++) {
+			add(*it);
+		}
+	}
+	
+	bool empty() const {
+		return nodes.empty();
+	}
+	
+	/** Returns the nodes on the ring, in the order in which they were added. */
+	const vector<string> &getNodes() const {
+		return nodes;
+	}
+	
+	/**
+	 * Returns the owners of the given key: the first <tt>count</tt> distinct
+	 * nodes that follow the key's position on the ring, in ring order. If
+	 * there are fewer than <tt>count</tt> nodes, then all nodes are returned.
+	 */
+	vector<string> getNodes(const string &key, unsigned int count) const {
+		vector<string> result;
+		
+		if (ring.empty() || count == 0) {
+			return result;
+		}
+		if (count > nodes.size()) {
+			count = nodes.size();
+		}
+		
+		Ring::const_iterator it(ring.lower_bound(hash(key)));
+		while (result.size() < count) {
+			if (it == ring.end()) {
+				it = ring.begin();
+			}
+			if (find(result.begin(), result.end(), it->second) == result.end()) {
+				result.push_back(it->second);
+			}
+			it++;
+		}
+		return result;
+	}
+	
+	/**
+	 * Returns the primary owner of the given key, or an empty string if the
+	 * ring is empty.
+	 */
+	string getNode(const string &key) const {
+		vector<string> result(getNodes(key, 1));
+		if (result.empty()) {
+			return "";
+		} else {
+			return result[0];
+		}
+	}
+	
+	/**
+	 * Checks whether <tt>node</tt> is one of the first <tt>count</tt>
+	 * owners of the given key.
+	 */
+	bool owns(const string &node, const string &key, unsigned int count) const {
+		vector<string> owners(getNodes(key, count));
+		return find(owners.begin(), owners.end(), node) != owners.end();
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_HASH_RING_H_ */
@@ -273,6 +273,11 @@ public:
  */
 class Hooks {
 private:
+	static apr_status_t stopLogging(void *arg) {
+		stopAsyncLogging();
+		return APR_SUCCESS;
+	}
+	
 	struct Container {
 		Application::SessionPtr session;
 		
@@ -328,6 +333,16 @@ private:
 	}
 	
 	int reportBusyException(request_rec *r) {
+		ServerConfig *config = getServerConfig(r->server);
+		unsigned int retryAfter = config->maxRequestQueueTime;
+		
+		// Tell well-behaved clients to come back after about as long as
+		// a queued request would have waited.
+		if (retryAfter == 0) {
+			retryAfter = 1;
+		}
+		apr_table_setn(r->err_headers_out, "Retry-After",
+			apr_psprintf(r->pool, "%u", retryAfter));
 		ap_custom_response(r, HTTP_SERVICE_UNAVAILABLE,
 			"This website is too busy right now.  Please try again later.");
 		return HTTP_SERVICE_UNAVAILABLE;
@@ -375,6 +390,73 @@ private:
 		return lookupName(r->subprocess_env, name);
 	}
 	
+	/**
+	 * Returns the trace ID of the given request: the one in the X-Request-Id
+	 * header if the client or a proxy server sent a valid one, otherwise the
+	 * one that mod_unique_id generated, otherwise a newly generated one.
+	 *
+	 * The trace ID is also stored in the request notes, so that it can be
+	 * logged with <tt>%{PASSENGER_TRACE_ID}n</tt> in a LogFormat.
+	 */
+	const char *determineTraceId(request_rec *r) {
+		const char *traceId = lookupHeader(r, "X-Request-Id");
+		if (traceId == NULL || !isValidTraceId(traceId)) {
+			traceId = lookupEnv(r, "UNIQUE_ID");
+			if (traceId == NULL || !isValidTraceId(traceId)) {
+				traceId = apr_pstrdup(r->pool, generateTraceId().c_str());
+			}
+		}
+		apr_table_setn(r->notes, "PASSENGER_TRACE_ID", traceId);
+		return traceId;
+	}
+	
+	/**
+	 * Parse a priority class name: "low", "normal" or "high".
+	 *
+	 * @return Whether the name is valid.
+	 */
+	static bool parsePriority(const char *name, ApplicationPool::Priority &priority) {
+		if (strcasecmp(name, "low") == 0) {
+			priority = ApplicationPool::LOW_PRIORITY;
+		} else if (strcasecmp(name, "normal") == 0) {
+			priority = ApplicationPool::NORMAL_PRIORITY;
+		} else if (strcasecmp(name, "high") == 0) {
+			priority = ApplicationPool::HIGH_PRIORITY;
+		} else {
+			return false;
+		}
+		return true;
+	}
+	
+	/**
+	 * Determine the priority class of the request: the value of the
+	 * PassengerRequestPriorityHeader header if the request has a valid one,
+	 * otherwise the class of the longest PassengerRequestPriority prefix
+	 * that the URI starts with.
+	 */
+	ApplicationPool::Priority determinePriority(request_rec *r, DirConfig *config) {
+		ApplicationPool::Priority priority = ApplicationPool::NORMAL_PRIORITY;
+		
+		if (config->requestPriorityHeader != NULL) {
+			const char *value = lookupHeader(r, config->requestPriorityHeader);
+			if (value != NULL && parsePriority(value, priority)) {
+				return priority;
+			}
+		}
+		
+		map<string, string>::const_iterator it;
+		string::size_type longest = 0;
+		for (it = config->requestPriorities.begin(); it != config->requestPriorities.end(); it++) {
+			const string &prefix(it->first);
+			if (prefix.size() >= longest
+			 && strncmp(r->uri, prefix.c_str(), prefix.size()) == 0) {
+				parsePriority(it->second.c_str(), priority);
+				longest = prefix.size();
+			}
+		}
+		return priority;
+	}
+	
 	// This code is a duplicate of what's in util_script.c.  We can't use
 	// r->unparsed_uri because it gets changed if there was a redirect.
 	char *originalURI(request_rec *r) {
@@ -407,7 +489,8 @@ private:
 		}
 	}
 	
-	apr_status_t sendHeaders(request_rec *r, Application::SessionPtr &session, const char *baseURI) {
+	apr_status_t sendHeaders(request_rec *r, Application::SessionPtr &session, const char *baseURI,
+	                         const char *traceId) {
 		apr_table_t *headers;
 		headers = apr_table_make(r->pool, 40);
 		if (headers == NULL) {
@@ -434,6 +517,11 @@ private:
 		addHeader(headers, "CONTENT_TYPE",    lookupHeader(r, "Content-type"));
 		addHeader(headers, "DOCUMENT_ROOT",   ap_document_root(r));
 		addHeader(headers, "PATH_INFO",       r->parsed_uri.path);
+		addHeader(headers, "PASSENGER_TRACE_ID", traceId);
+		if (getLogLevel() >= 1) {
+			// Tell the request handler to log its own timings as well.
+			addHeader(headers, "PASSENGER_LOG_TRACE", "true");
+		}
 		
 		// Set HTTP headers.
 		const apr_array_header_t *hdrs_arr;
@@ -465,37 +553,9 @@ private:
     		hdrs = (apr_table_entry_t*) hdrs_arr->elts;
     		buffer.reserve(1024 * 4);
 		for (i = 0; i < hdrs_arr->nelts; ++i) {
-			buffer.append(hdrs[i].key);
-			buffer.append(1, '\0');
-			buffer.append(hdrs[i].val);
-			buffer.append(1, '\0');
-		}
-		
-		/*
-		 * If the last header value is an empty string, then the buffer
-		 * will end with "\0\0". For example, if 'SSLOptions +ExportCertData'
-		 * is set, and there's no client certificate, and 'SSL_CLIENT_CERT'
-		 * is the last header, then the buffer will end with:
-		 *
-		 *   "SSL_CLIENT_CERT\0\0"
-		 *
-		 * The data in the buffer will be processed by the RequestHandler class,
-		 * which is implemented in Ruby. But it uses Hash[*data.split("\0")] to
-		 * unserialize the data. Unfortunately String#split will not transform
-		 * the trailing "\0\0" into an empty string:
-		 *
-		 *   "SSL_CLIENT_CERT\0\0".split("\0")
-		 *   # => desired result: ["SSL_CLIENT_CERT", ""]
-		 *   # => actual result:  ["SSL_CLIENT_CERT"]
-		 *
-		 * When that happens, Hash[..] will raise an ArgumentError because
-		 * data.split("\0") does not return an array with a length that is a
-		 * multiple of 2.
-		 *
-		 * So here, we add a dummy header to prevent situations like that from
-		 * happening.
-		 */
-		buffer.append("_\0_\0", 4);
+			appendHeader(buffer, hdrs[i].key, hdrs[i].val);
+		}
+		terminateHeaders(buffer);
 		
 		session->sendHeaders(buffer);
 		return APR_SUCCESS;
@@ -561,8 +621,8 @@ public:
 		P_DEBUG("Initializing Phusion Passenger...");
 		ap_add_version_component(pconf, "Phusion_Passenger/" PASSENGER_VERSION);
 		
-		const char *ruby, *user;
-		string applicationPoolServerExe, spawnServer;
+		const char *ruby, *user, *clusterUser;
+		string applicationPoolServerExe, spawnServer, spawnAgents, clusterNodes, clusterApps;
 		
 		ruby = (config->ruby != NULL) ? config->ruby : DEFAULT_RUBY_COMMAND;
 		if (config->userSwitching) {
@@ -572,6 +632,7 @@ public:
 		} else {
 			user = "nobody";
 		}
+		clusterUser = (config->defaultUser != NULL) ? config->defaultUser : "nobody";
 		
 		if (config->root == NULL) {
 			throw ConfigurationException("The 'PassengerRoot' configuration option "
@@ -597,22 +658,97 @@ public:
 			throw FileNotFoundException(message);
 		}
 		
+		set<string>::const_iterator it;
+		for (it = config->spawnAgents.begin(); it != config->spawnAgents.end(); it++) {
+			if (!spawnAgents.empty()) {
+				spawnAgents.append(",");
+			}
+			spawnAgents.append(*it);
+		}
+		if (!config->spawnAgents.empty() && config->spawnAgentSecretFile == NULL) {
+			throw ConfigurationException("The 'PassengerSpawnAgent' option is "
+				"specified, but 'PassengerSpawnAgentSecretFile' is not. Please "
+				"specify the file with the secret that the spawn agents expect.");
+		}
+		if (config->spawnAgentSecretFile != NULL && !fileExists(config->spawnAgentSecretFile)) {
+			string message("The Passenger spawn agent secret file, '");
+			message.append(config->spawnAgentSecretFile);
+			message.append("', does not exist.");
+			throw FileNotFoundException(message);
+		}
+		if (config->clusterSelf == NULL && !config->clusterNodes.empty()) {
+			throw ConfigurationException("The 'PassengerClusterNode' option is "
+				"specified, but 'PassengerClusterSelf' is not. Please specify "
+				"the address on which this server accepts requests from the "
+				"other cluster nodes.");
+		}
+		if (config->clusterSelf != NULL && config->clusterSecretFile == NULL) {
+			throw ConfigurationException("The 'PassengerClusterSelf' option is "
+				"specified, but 'PassengerClusterSecretFile' is not. Please "
+				"specify the file with the secret with which the cluster nodes "
+				"authenticate each other.");
+		}
+		if (config->clusterSecretFile != NULL && !fileExists(config->clusterSecretFile)) {
+			string message("The Passenger cluster secret file, '");
+			message.append(config->clusterSecretFile);
+			message.append("', does not exist.");
+			throw FileNotFoundException(message);
+		}
+		for (it = config->clusterNodes.begin(); it != config->clusterNodes.end(); it++) {
+			if (!clusterNodes.empty()) {
+				clusterNodes.append(",");
+			}
+			clusterNodes.append(*it);
+		}
+		for (it = config->clusterApps.begin(); it != config->clusterApps.end(); it++) {
+			if (!clusterApps.empty()) {
+				clusterApps.append(",");
+			}
+			clusterApps.append(*it);
+		}
+		
 		applicationPoolServer = ptr(
 			new ApplicationPoolServer(
 				applicationPoolServerExe, spawnServer, "",
-				ruby, user)
+				ruby, user, spawnAgents,
+				(config->spawnAgentSecretFile != NULL) ? config->spawnAgentSecretFile : "",
+				(config->clusterSelf != NULL) ? config->clusterSelf : "",
+				clusterNodes, config->clusterReplicas, clusterApps,
+				(config->clusterSecretFile != NULL) ? config->clusterSecretFile : "",
+				clusterUser,
+				config->numaPlacement, config->transparentHugepages,
+				config->poolServerThreadStackSize,
+				config->poolServerIdleThreads,
+				(config->cgroupRoot != NULL) ? config->cgroupRoot : "",
+				config->appCpuWeight, config->appMemoryLimit,
+				config->sharedInstanceTable)
 		);
 	}
 	
 	void initChild(apr_pool_t *pchild, server_rec *s) {
 		ServerConfig *config = getServerConfig(s);
 		
+		startAsyncLogging();
+		apr_pool_cleanup_register(pchild, NULL, stopLogging, apr_pool_cleanup_null);
 		try {
 			applicationPool = applicationPoolServer->connect();
 			applicationPoolServer->detach();
 			applicationPool->setMax(config->maxPoolSize);
 			applicationPool->setMaxPerApp(config->maxInstancesPerApp);
 			applicationPool->setMaxIdleTime(config->poolIdleTime);
+			applicationPool->setRequestQueueLimits(config->maxRequestQueueSize,
+				config->maxTotalQueuedRequests, config->maxRequestQueueTime);
+			
+			set< pair<string, string> >::const_iterator it;
+			for (it = config->remoteInstances.begin(); it != config->remoteInstances.end(); it++) {
+				applicationPool->addRemoteInstance(it->first, it->second);
+			}
+			
+			map< string, pair<unsigned int, unsigned int> >::const_iterator sit;
+			for (sit = config->appShares.begin(); sit != config->appShares.end(); sit++) {
+				applicationPool->setAppShare(sit->first, sit->second.first,
+					sit->second.second);
+			}
 		} catch (const thread_interrupted &) {
 			P_TRACE(3, "A system call was interrupted during initialization of "
 				"an Apache child process. Apache is probably restarting or "
@@ -654,6 +790,9 @@ public:
 			Application::SessionPtr session;
 			bool expectingUploadData;
 			shared_ptr<TempFile> uploadData;
+			const char *traceId = determineTraceId(r);
+			apr_time_t begin = apr_time_now();
+			apr_time_t sessionReady = 0;
 			
 			expectingUploadData = ap_should_client_block(r);
 			if (expectingUploadData && atol(lookupHeader(r, "Content-Length"))
@@ -695,8 +834,11 @@ public:
 				session = applicationPool->get(
 					canonicalizePath(mapper.getPublicDirectory() + "/.."),
 					true, defaultUser, environment, spawnMethod,
-					mapper.getApplicationTypeString());
-				P_TRACE(3, "Forwarding " << r->uri << " to PID " << session->getPid());
+					mapper.getApplicationTypeString(), traceId,
+					determinePriority(r, config));
+				sessionReady = apr_time_now();
+				P_TRACE(3, "Forwarding " << r->uri << " to PID " << session->getPid() <<
+					" (trace " << traceId << ")");
 			} catch (const SpawnException &e) {
 				if (e.hasErrorPage()) {
 					ap_set_content_type(r, "text/html; charset=utf-8");
@@ -710,7 +852,7 @@ public:
 			} catch (const BusyException &e) {
 				return reportBusyException(r);
 			}
-			sendHeaders(r, session, mapper.getBaseURI());
+			sendHeaders(r, session, mapper.getBaseURI(), traceId);
 			if (expectingUploadData) {
 				if (uploadData != NULL) {
 					sendRequestBody(r, session, uploadData);
@@ -734,6 +876,10 @@ public:
 
 			ap_scan_script_header_err_brigade(r, bb, NULL);
 			ap_pass_brigade(r->output_filters, bb);
+			P_DEBUG("Trace " << traceId << ": " << r->uri << " forwarded to PID " <<
+				session->getPid() << ", session acquired after " <<
+				(sessionReady - begin) << "us, completed after " <<
+				(apr_time_now() - begin) << "us");
 			
 			Container *container = new Container();
 			container->session = session;
@@ -0,0 +1,384 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_INSTRUMENTED_MUTEX_H_
+#define _PASSENGER_INSTRUMENTED_MUTEX_H_
+
+#include <boost/thread/mutex.hpp>
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace Passenger {
+
+using namespace std;
+
+#define _P_LOCK_SITE_STRINGIFY2(x) #x
+#define _P_LOCK_SITE_STRINGIFY(x) _P_LOCK_SITE_STRINGIFY2(x)
+
+/**
+ * Identifies the current source location as a lock call site, for use with
+ * InstrumentedMutex::scoped_lock.
+ */
+#define P_LOCK_SITE (__FILE__ ":" _P_LOCK_SITE_STRINGIFY(__LINE__))
+
+/**
+ * A mutex which can record contention statistics: the number of acquisitions,
+ * wait time and hold time histograms, and the call sites that held the lock
+ * the longest.
+ *
+ * Instrumentation is enabled at run time by setting the environment variable
+ * <tt>PASSENGER_LOCK_STATS</tt>, and applies to mutexes that are created
+ * afterwards. If it's disabled, an InstrumentedMutex behaves exactly like a
+ * <tt>boost::mutex</tt>, at the cost of one extra branch per operation.
+ *
+ * Statistics are protected by the mutex itself: they're only modified by the
+ * thread that holds the lock.
+ *
+ * InstrumentedMutex is compatible with <tt>boost::condition</tt>. Use
+ * InstrumentedMutex::scoped_lock instead of <tt>boost::unique_lock</tt> in
+ * order to record call sites:
+ * @code
+ *   InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+ * @endcode
+ *
+ * @ingroup Support
+ */
+class InstrumentedMutex {
+public:
+	/**
+	 * A scoped lock which tells the mutex where it was locked from. The call
+	 * site is also passed to the mutex when the lock is re-acquired, e.g.
+	 * after waiting on a condition variable.
+	 */
+	class scoped_lock {
+	private:
+		InstrumentedMutex &mutex;
+		const char *site;
+		bool locked;
+		
+		scoped_lock(const scoped_lock &);
+		scoped_lock &operator=(const scoped_lock &);
+	public:
+		explicit scoped_lock(InstrumentedMutex &m, const char *site = NULL)
+			: mutex(m)
+		{
+			this->site = site;
+			locked = false;
+			lock();
+		}
+		
+		scoped_lock(InstrumentedMutex &m, boost::defer_lock_t, const char *site = NULL)
+			: mutex(m)
+		{
+			this->site = site;
+			locked = false;
+		}
+		
+		~scoped_lock() {
+			if (locked) {
+				unlock();
+			}
+		}
+		
+		void lock() {
+			mutex.lock(site);
+			locked = true;
+		}
+		
+		bool try_lock() {
+			locked = mutex.try_lock(site);
+			return locked;
+		}
+		
+		void unlock() {
+			locked = false;
+			mutex.unlock();
+		}
+		
+		bool owns_lock() const {
+			return locked;
+		}
+	};
+
+private:
+	typedef unsigned long long Microseconds;
+	
+	/** Number of histogram buckets. Bucket <em>i</em> counts durations below 2^i usec. */
+	static const unsigned int BUCKETS = 20;
+	
+	struct SiteStats {
+		unsigned long long count;
+		Microseconds totalHold;
+		Microseconds maxHold;
+		
+		SiteStats() {
+			count = 0;
+			totalHold = 0;
+			maxHold = 0;
+		}
+	};
+	
+	struct Histogram {
+		unsigned long long buckets[BUCKETS];
+		Microseconds total;
+		Microseconds max;
+		
+		Histogram() {
+			memset(buckets, 0, sizeof(buckets));
+			total = 0;
+			max = 0;
+		}
+		
+		void add(Microseconds value) {
+			unsigned int i;
+			for (i = 0; i < BUCKETS - 1 && value >= (1ULL << i); i++) {
+				// Find the bucket.
+			}
+			buckets[i]++;
+			total += value;
+			if (value > max) {
+				max = value;
+			}
+		}
+		
+		void print(stringstream &result) const {
+			for (unsigned int i = 0; i < BUCKETS; i++) {
+				if (buckets[i] > 0) {
+					result << " <" << (1ULL << i) << "us:" << buckets[i];
+				}
+			}
+		}
+	};
+	
+	typedef map<const char *, SiteStats> SiteMap;
+	
+	boost::mutex mutex;
+	const char *name;
+	bool instrumented;
+	
+	unsigned long long acquisitions;
+	unsigned long long contentions;
+	Histogram waitTimes;
+	Histogram holdTimes;
+	SiteMap sites;
+	const char *holder;
+	Microseconds acquiredAt;
+	
+	static Microseconds now() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (Microseconds) tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+	
+	static boost::mutex &registryLock() {
+		static boost::mutex lock;
+		return lock;
+	}
+	
+	static set<InstrumentedMutex *> &registry() {
+		static set<InstrumentedMutex *> mutexes;
+		return mutexes;
+	}
+	
+	static bool compareSites(const pair<string, SiteStats> &a, const pair<string, SiteStats> &b) {
+		return a.second.maxHold > b.second.maxHold;
+	}
+	
+	void acquired(const char *site, Microseconds waitTime) {
+		acquisitions++;
+		if (waitTime > 0) {
+			contentions++;
+		}
+		waitTimes.add(waitTime);
+		holder = (site == NULL) ? "(unknown)" : site;
+		acquiredAt = now();
+	}
+	
+	void initialize(const char *name, bool instrumented) {
+		this->name = name;
+		this->instrumented = instrumented;
+		acquisitions = 0;
+		contentions = 0;
+		holder = NULL;
+		acquiredAt = 0;
+		if (instrumented) {
+			boost::mutex::scoped_lock l(registryLock());
+			registry().insert(this);
+		}
+	}
+
+public:
+	/**
+	 * Returns whether newly created mutexes are instrumented.
+	 */
+	static bool statisticsEnabled() {
+		static bool enabled = getenv("PASSENGER_LOCK_STATS") != NULL
+			&& *getenv("PASSENGER_LOCK_STATS") != '\0';
+		return enabled;
+	}
+	
+	/**
+	 * Returns the statistics of all instrumented mutexes in this process,
+	 * or an empty string if instrumentation is disabled.
+	 */
+	static string allStatistics() {
+		if (!statisticsEnabled()) {
+			return "";
+		}
+		
+		boost::mutex::scoped_lock l(registryLock());
+		set<InstrumentedMutex *>::iterator it;
+		string result("----------- Lock statistics -----------\n");
+		for (it = registry().begin(); it != registry().end(); it++) {
+			result.append((*it)->statistics());
+		}
+		return result;
+	}
+	
+	/**
+	 * Create a new mutex.
+	 *
+	 * @param name A name which identifies this mutex in statistics reports.
+	 *             Must be a string literal.
+	 */
+	InstrumentedMutex(const char *name = "(anonymous)") {
+		initialize(name, statisticsEnabled());
+	}
+	
+	/**
+	 * Create a new mutex, which is instrumented or not regardless of whether
+	 * <tt>PASSENGER_LOCK_STATS</tt> is set.
+	 */
+	InstrumentedMutex(const char *name, bool instrumented) {
+		initialize(name, instrumented);
+	}
+	
+	~InstrumentedMutex() {
+		if (instrumented) {
+			boost::mutex::scoped_lock l(registryLock());
+			registry().erase(this);
+		}
+	}
+	
+	bool isInstrumented() const {
+		return instrumented;
+	}
+	
+	void lock(const char *site = NULL) {
+		if (!instrumented) {
+			mutex.lock();
+		} else if (mutex.try_lock()) {
+			acquired(site, 0);
+		} else {
+			Microseconds begin = now();
+			mutex.lock();
+			Microseconds waitTime = now() - begin;
+			acquired(site, (waitTime == 0) ? 1 : waitTime);
+		}
+	}
+	
+	bool try_lock(const char *site = NULL) {
+		if (!mutex.try_lock()) {
+			return false;
+		}
+		if (instrumented) {
+			acquired(site, 0);
+		}
+		return true;
+	}
+	
+	void unlock() {
+		if (instrumented) {
+			Microseconds holdTime = now() - acquiredAt;
+			SiteStats &stats(sites[holder]);
+			holdTimes.add(holdTime);
+			stats.count++;
+			stats.totalHold += holdTime;
+			if (holdTime > stats.maxHold) {
+				stats.maxHold = holdTime;
+			}
+		}
+		mutex.unlock();
+	}
+	
+	/**
+	 * Returns a textual report of this mutex's statistics. This locks the
+	 * mutex, so it must not be called while holding it.
+	 */
+	string statistics() {
+		if (!instrumented) {
+			return "";
+		}
+		
+		boost::mutex::scoped_lock l(mutex);
+		stringstream result;
+		
+		result << name << ": acquisitions=" << acquisitions <<
+			" contended=" << contentions <<
+			" total_wait=" << waitTimes.total << "us" <<
+			" max_wait=" << waitTimes.max << "us" <<
+			" total_hold=" << holdTimes.total << "us" <<
+			" max_hold=" << holdTimes.max << "us" << endl;
+		result << "  wait:";
+		waitTimes.print(result);
+		result << endl;
+		result << "  hold:";
+		holdTimes.print(result);
+		result << endl;
+		
+		/* Call sites are keyed by pointer, but the same site may appear
+		 * under multiple pointers if it's in a header that's compiled
+		 * into multiple object files. So merge them by name.
+		 */
+		map<string, SiteStats> merged;
+		for (SiteMap::const_iterator it = sites.begin(); it != sites.end(); it++) {
+			const char *basename = strrchr(it->first, '/');
+			SiteStats &stats(merged[(basename == NULL) ? it->first : basename + 1]);
+			stats.count += it->second.count;
+			stats.totalHold += it->second.totalHold;
+			stats.maxHold = max(stats.maxHold, it->second.maxHold);
+		}
+		vector< pair<string, SiteStats> > sorted(merged.begin(), merged.end());
+		sort(sorted.begin(), sorted.end(), compareSites);
+		result << "  longest holders:" << endl;
+		for (unsigned int i = 0; i < sorted.size() && i < 5; i++) {
+			char buf[200];
+			snprintf(buf, sizeof(buf), "    %-45s count=%llu avg=%lluus max=%lluus",
+				sorted[i].first.c_str(), sorted[i].second.count,
+				sorted[i].second.totalHold / sorted[i].second.count,
+				sorted[i].second.maxHold);
+			result << buf << endl;
+		}
+		return result.str();
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_INSTRUMENTED_MUTEX_H_ */
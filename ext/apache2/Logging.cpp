@@ -19,6 +19,16 @@
  */
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/bind.hpp>
+#include <pthread.h>
+#include <unistd.h>
 #include "Logging.h"
 
 namespace Passenger {
@@ -27,6 +37,322 @@ unsigned int _logLevel = 0;
 ostream *_logStream = &cerr;
 ostream *_debugStream = &cerr;
 
+/** Messages up to this size are stored inside a ring buffer slot. */
+#define LOG_RECORD_INLINE_SIZE 240
+
+namespace {
+
+/**
+ * A slot in the asynchronous logging ring buffer.
+ */
+struct LogRecord {
+	/**
+	 * Used for synchronization between the producers and the logging thread.
+	 * See AsyncLogger::enqueue().
+	 */
+	volatile unsigned long sequence;
+	ostream *stream;
+	const char *file;
+	unsigned int line;
+	struct timeval time;
+	unsigned int size;
+	/** If the message doesn't fit in <tt>data</tt>, then it's stored here. */
+	char *overflow;
+	char data[LOG_RECORD_INLINE_SIZE];
+};
+
+/**
+ * Formats log record headers, caching the formatted date and time until
+ * the second changes.
+ */
+class LogHeaderFormatter {
+private:
+	time_t cachedTime;
+	char datetime[60];
+public:
+	LogHeaderFormatter() {
+		cachedTime = (time_t) -1;
+		datetime[0] = '\0';
+	}
+	
+	void format(ostream &stream, pid_t pid, const char *file, unsigned int line,
+	            const struct timeval &tv) {
+		if (tv.tv_sec != cachedTime) {
+			time_t the_time = tv.tv_sec;
+			struct tm the_tm;
+			localtime_r(&the_time, &the_tm);
+			strftime(datetime, sizeof(datetime), "%x %H:%M:%S", &the_tm);
+			cachedTime = tv.tv_sec;
+		}
+		stream << "[ pid=" << pid << " file=" << file << ":" << line <<
+			" time=" << datetime << "." << (tv.tv_usec / 1000) << " ]:" <<
+			"\n  ";
+	}
+};
+
+/**
+ * A bounded multi-producer single-consumer ring buffer of log records,
+ * plus the thread which consumes them. The ring buffer uses the algorithm
+ * by Dmitry Vyukov: each slot has a sequence number which tells producers
+ * and the consumer whether the slot is free or filled.
+ *
+ * When the ring buffer is empty, the logging thread sleeps until a producer
+ * wakes it up. Producers only take the wakeup mutex while the logging thread
+ * is sleeping.
+ */
+class AsyncLogger {
+private:
+	LogRecord *records;
+	unsigned long mask;
+	volatile unsigned long enqueuePos;
+	unsigned long dequeuePos;
+	volatile unsigned long long dropped;
+	volatile bool done;
+	/** Whether the logging thread is (about to start) waiting for records. */
+	volatile bool sleeping;
+	boost::mutex wakeupLock;
+	boost::condition wakeupCond;
+	pid_t pid;
+	boost::thread *thr;
+	
+	LogHeaderFormatter formatter;
+	unsigned long long reportedDropped;
+	
+	/**
+	 * Write all records that are currently in the ring buffer.
+	 * Returns whether anything was written.
+	 */
+	bool drain() {
+		bool wroteLogStream = false, wroteDebugStream = false;
+		
+		while (true) {
+			LogRecord &record(records[dequeuePos & mask]);
+			if (record.sequence != dequeuePos + 1) {
+				break;
+			}
+			__sync_synchronize();
+			
+			ostream *stream = record.stream;
+			formatter.format(*stream, pid, record.file, record.line, record.time);
+			if (record.overflow != NULL) {
+				stream->write(record.overflow, record.size);
+				free(record.overflow);
+				record.overflow = NULL;
+			} else {
+				stream->write(record.data, record.size);
+			}
+			*stream << '\n';
+			wroteLogStream = wroteLogStream || stream == _logStream;
+			wroteDebugStream = wroteDebugStream || stream == _debugStream;
+			
+			__sync_synchronize();
+			record.sequence = dequeuePos + mask + 1;
+			dequeuePos++;
+		}
+		
+		unsigned long long currentDropped = dropped;
+		if (currentDropped != reportedDropped && _logStream != 0) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			formatter.format(*_logStream, pid, __FILE__, __LINE__, tv);
+			*_logStream << (currentDropped - reportedDropped) <<
+				" log records were dropped because the log buffer was full\n";
+			reportedDropped = currentDropped;
+			wroteLogStream = true;
+		}
+		
+		if (wroteLogStream) {
+			_logStream->flush();
+		}
+		if (wroteDebugStream && _debugStream != _logStream) {
+			_debugStream->flush();
+		}
+		return wroteLogStream || wroteDebugStream;
+	}
+	
+	/**
+	 * Wait until a producer has put a record in the ring buffer, or
+	 * until the logger is being destroyed.
+	 */
+	void waitForRecords() {
+		boost::mutex::scoped_lock l(wakeupLock);
+		sleeping = true;
+		// Pairs with the barrier in wakeUp(): either the producer sees
+		// that we're sleeping, or we see its record.
+		__sync_synchronize();
+		while (!done && records[dequeuePos & mask].sequence != dequeuePos + 1) {
+			wakeupCond.wait(l);
+		}
+		sleeping = false;
+	}
+	
+	void wakeUp() {
+		__sync_synchronize();
+		if (sleeping) {
+			boost::mutex::scoped_lock l(wakeupLock);
+			wakeupCond.notify_one();
+		}
+	}
+	
+	void threadMain() {
+		while (!done) {
+			if (!drain()) {
+				waitForRecords();
+			}
+		}
+		drain();
+	}
+	
+public:
+	AsyncLogger(unsigned int capacity) {
+		unsigned long size = 2;
+		while (size < capacity) {
+			size *= 2;
+		}
+		records = new LogRecord[size];
+		for (unsigned long i = 0; i < size; i++) {
+			records[i].sequence = i;
+			records[i].overflow = NULL;
+		}
+		mask = size - 1;
+		enqueuePos = 0;
+		dequeuePos = 0;
+		dropped = 0;
+		reportedDropped = 0;
+		done = false;
+		sleeping = false;
+		pid = getpid();
+		thr = new boost::thread(boost::bind(&AsyncLogger::threadMain, this));
+	}
+	
+	~AsyncLogger() {
+		done = true;
+		{
+			boost::mutex::scoped_lock l(wakeupLock);
+			wakeupCond.notify_one();
+		}
+		thr->join();
+		delete thr;
+		delete[] records;
+	}
+	
+	pid_t getPid() const {
+		return pid;
+	}
+	
+	unsigned long long getDropped() const {
+		return dropped;
+	}
+	
+	/**
+	 * Put a record in the ring buffer. Returns false if the ring
+	 * buffer is full.
+	 */
+	bool enqueue(ostream *stream, const char *file, unsigned int line,
+	             const struct timeval &tv, const string &message) {
+		LogRecord *record;
+		unsigned long pos = enqueuePos;
+		
+		while (true) {
+			record = &records[pos & mask];
+			long diff = (long) (record->sequence - pos);
+			if (diff == 0) {
+				if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos + 1)) {
+					break;
+				}
+				pos = enqueuePos;
+			} else if (diff < 0) {
+				__sync_fetch_and_add(&dropped, 1);
+				return false;
+			} else {
+				pos = enqueuePos;
+			}
+		}
+		__sync_synchronize();
+		
+		record->stream = stream;
+		record->file = file;
+		record->line = line;
+		record->time = tv;
+		record->size = message.size();
+		if (message.size() <= LOG_RECORD_INLINE_SIZE) {
+			memcpy(record->data, message.data(), message.size());
+		} else {
+			record->overflow = (char *) malloc(message.size());
+			if (record->overflow != NULL) {
+				memcpy(record->overflow, message.data(), message.size());
+			} else {
+				record->size = LOG_RECORD_INLINE_SIZE;
+				memcpy(record->data, message.data(), LOG_RECORD_INLINE_SIZE);
+			}
+		}
+		
+		__sync_synchronize();
+		record->sequence = pos + 1;
+		wakeUp();
+		return true;
+	}
+};
+
+struct LogBuffer {
+	ostringstream stream;
+	ios_base::fmtflags flags;
+	
+	LogBuffer() {
+		flags = stream.flags();
+	}
+};
+
+AsyncLogger * volatile asyncLogger = NULL;
+/**
+ * The number of threads that may be using <tt>asyncLogger</tt>, per epoch.
+ * A thread registers itself in the current epoch before it reads
+ * <tt>asyncLogger</tt>. stopAsyncLogging() clears the pointer, starts a new
+ * epoch, and waits until the threads of the previous epoch are done before
+ * it deletes the logger. Threads that keep logging register themselves in
+ * the new epoch, so they can't hold up stopAsyncLogging().
+ */
+volatile unsigned int asyncLoggerUsers[2] = { 0, 0 };
+volatile unsigned int asyncLoggerEpoch = 0;
+bool atforkHandlerInstalled = false;
+boost::thread_specific_ptr<LogBuffer> logBuffer;
+
+/**
+ * Gives access to the asynchronous logger for as long as this object is alive.
+ */
+class AsyncLoggerAccess {
+private:
+	unsigned int epoch;
+public:
+	AsyncLogger *logger;
+	
+	AsyncLoggerAccess() {
+		while (true) {
+			epoch = __sync_fetch_and_add(&asyncLoggerEpoch, 0);
+			__sync_fetch_and_add(&asyncLoggerUsers[epoch], 1);
+			if (__sync_fetch_and_add(&asyncLoggerEpoch, 0) == epoch) {
+				break;
+			}
+			__sync_fetch_and_sub(&asyncLoggerUsers[epoch], 1);
+		}
+		logger = asyncLogger;
+	}
+	
+	~AsyncLoggerAccess() {
+		__sync_fetch_and_sub(&asyncLoggerUsers[epoch], 1);
+	}
+};
+
+/**
+ * The threads that were using the logger don't exist in a forked child.
+ */
+void resetAsyncLoggerUsers() {
+	asyncLoggerUsers[0] = 0;
+	asyncLoggerUsers[1] = 0;
+}
+
+} // anonymous namespace
+
 unsigned int
 getLogLevel() {
 	return _logLevel;
@@ -56,5 +382,79 @@ setDebugFile(const char *logFile) {
 	#endif
 }
 
+ostream &
+_prepareLogEntry() {
+	LogBuffer *buffer = logBuffer.get();
+	if (buffer == NULL) {
+		buffer = new LogBuffer();
+		logBuffer.reset(buffer);
+	} else {
+		buffer->stream.str("");
+		buffer->stream.clear();
+		buffer->stream.flags(buffer->flags);
+	}
+	return buffer->stream;
+}
+
+void
+_writeLogEntry(ostream *stream, const char *file, unsigned int line) {
+	AsyncLoggerAccess access;
+	AsyncLogger *logger = access.logger;
+	string message(logBuffer->stream.str());
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	if (logger != NULL && logger->getPid() == getpid()) {
+		logger->enqueue(stream, file, line, tv, message);
+	} else {
+		LogHeaderFormatter formatter;
+		formatter.format(*stream, getpid(), file, line, tv);
+		*stream << message << endl;
+	}
+}
+
+void
+startAsyncLogging(unsigned int capacity) {
+	if (!atforkHandlerInstalled) {
+		pthread_atfork(NULL, NULL, resetAsyncLoggerUsers);
+		atforkHandlerInstalled = true;
+	}
+	if (asyncLogger == NULL || asyncLogger->getPid() != getpid()) {
+		AsyncLogger *logger = new AsyncLogger(capacity);
+		__sync_synchronize();
+		asyncLogger = logger;
+	}
+}
+
+void
+stopAsyncLogging() {
+	AsyncLogger *logger = asyncLogger;
+	if (logger != NULL && logger->getPid() == getpid()) {
+		unsigned int oldEpoch = asyncLoggerEpoch;
+		
+		asyncLogger = NULL;
+		__sync_synchronize();
+		asyncLoggerEpoch = 1 - oldEpoch;
+		__sync_synchronize();
+		// Threads that read the pointer before it was cleared may still
+		// be enqueueing records. Wait until they're done.
+		while (__sync_fetch_and_add(&asyncLoggerUsers[oldEpoch], 0) != 0) {
+			usleep(1000);
+		}
+		delete logger;
+	}
+}
+
+unsigned long long
+getDroppedLogRecords() {
+	AsyncLoggerAccess access;
+	AsyncLogger *logger = access.logger;
+	if (logger != NULL) {
+		return logger->getDropped();
+	} else {
+		return 0;
+	}
+}
+
 } // namespace Passenger
 
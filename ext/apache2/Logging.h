@@ -38,22 +38,57 @@ unsigned int getLogLevel();
 void setLogLevel(unsigned int value);
 void setDebugFile(const char *logFile = NULL);
 
+/**
+ * Start a background thread which writes log records to the log streams.
+ * From now on, logging in this process only formats the message and puts it in
+ * a lock-free ring buffer, so that the logging thread doesn't have to wait for
+ * the time to be formatted or for the stream to be written to. If the ring
+ * buffer is full then the record is dropped, and the number of dropped records
+ * will be logged later.
+ *
+ * Logging in child processes that are forked afterwards is still synchronous.
+ * Does nothing if asynchronous logging is already started.
+ *
+ * @param capacity The number of records that the ring buffer can hold. Will be
+ *                 rounded up to a power of 2.
+ */
+void startAsyncLogging(unsigned int capacity = 4096);
+
+/**
+ * Write all pending log records, and stop the background thread that was started
+ * by startAsyncLogging(). Logging will be synchronous again. Waits for threads
+ * that are logging at the same time, so it's safe to call while other threads
+ * still log.
+ */
+void stopAsyncLogging();
+
+/**
+ * Returns the number of log records that have been dropped because the
+ * asynchronous logging ring buffer was full.
+ */
+unsigned long long getDroppedLogRecords();
+
+/**
+ * Returns this thread's log message buffer, after clearing it. Used by
+ * the logging macros; do not use directly.
+ */
+ostream &_prepareLogEntry();
+
+/**
+ * Write the message in this thread's log message buffer to the given stream,
+ * either directly or through the asynchronous logging thread. Used by
+ * the logging macros; do not use directly.
+ */
+void _writeLogEntry(ostream *stream, const char *file, unsigned int line);
+
 /**
  * Write the given expression to the log stream.
  */
 #define P_LOG(expr) \
 	do { \
 		if (Passenger::_logStream != 0) { \
-			time_t the_time = time(NULL); \
-			struct tm *the_tm = localtime(&the_time); \
-			char datetime_buf[60]; \
-			struct timeval tv; \
-			strftime(datetime_buf, sizeof(datetime_buf), "%x %H:%M:%S", the_tm); \
-			gettimeofday(&tv, NULL); \
-			*Passenger::_logStream << \
-				"[ pid=" << getpid() << " file=" << __FILE__ << ":" << __LINE__ << \
-				" time=" << datetime_buf << "." << (tv.tv_usec / 1000) << " ]:" << \
-				"\n  " << expr << std::endl; \
+			Passenger::_prepareLogEntry() << expr; \
+			Passenger::_writeLogEntry(Passenger::_logStream, __FILE__, __LINE__); \
 		} \
 	} while (false)
 
@@ -80,16 +115,8 @@ void setDebugFile(const char *logFile = NULL);
 		do { \
 			if (Passenger::_logLevel >= level) { \
 				if (Passenger::_debugStream != 0) { \
-					time_t the_time = time(NULL); \
-					struct tm *the_tm = localtime(&the_time); \
-					char datetime_buf[60]; \
-					struct timeval tv; \
-					strftime(datetime_buf, sizeof(datetime_buf), "%x %H:%M:%S", the_tm); \
-					gettimeofday(&tv, NULL); \
-					*Passenger::_debugStream << \
-						"[ pid=" << getpid() << " file=" << __FILE__ << ":" << __LINE__ << \
-						" time=" << datetime_buf << "." << (tv.tv_usec / 1000) << " ]:" << \
-						"\n  " << expr << std::endl; \
+					Passenger::_prepareLogEntry() << expr; \
+					Passenger::_writeLogEntry(Passenger::_debugStream, __FILE__, __LINE__); \
 				} \
 			} \
 		} while (false)
@@ -0,0 +1,384 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_MEMORY_SAMPLER_H_
+#define _PASSENGER_MEMORY_SAMPLER_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <string>
+#include <sstream>
+#include <map>
+#include <deque>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include "System.h"
+#include "Logging.h"
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+/**
+ * Memory usage of a single process, in kilobytes.
+ *
+ * @ingroup Support
+ */
+struct MemoryUsage {
+	/** Virtual memory size. */
+	unsigned long vmSize;
+	/** Resident set size. */
+	unsigned long rss;
+	/**
+	 * Proportional set size: the resident set size, with every shared page
+	 * divided by the number of processes that share it. 0 if unknown.
+	 */
+	unsigned long pss;
+	/** Private dirty memory, i.e. memory that is not shared with other processes. */
+	unsigned long privateDirty;
+	
+	MemoryUsage() {
+		vmSize = 0;
+		rss = 0;
+		pss = 0;
+		privateDirty = 0;
+	}
+};
+
+/**
+ * Parse a Linux <tt>/proc/(pid)/smaps</tt> or <tt>/proc/(pid)/smaps_rollup</tt>
+ * file, and add up the Rss, Pss and Private_Dirty fields of all mappings into
+ * <tt>usage</tt>.
+ *
+ * smaps files of large processes can contain tens of thousands of lines, so
+ * this reads the file in large blocks and only looks at the fields that
+ * we're interested in, without allocating memory.
+ *
+ * @return Whether the file could be read.
+ * @ingroup Support
+ */
+inline bool
+parseSmaps(const char *filename, MemoryUsage &usage) {
+	int fd;
+	do {
+		fd = open(filename, O_RDONLY);
+	} while (fd == -1 && errno == EINTR);
+	if (fd == -1) {
+		return false;
+	}
+	
+	unsigned long rss = 0, pss = 0, privateDirty = 0;
+	char buf[1024 * 32];
+	size_t used = 0;
+	ssize_t ret;
+	bool eof = false;
+	
+	while (!eof) {
+		do {
+			ret = read(fd, buf + used, sizeof(buf) - used - 1);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			close(fd);
+			return false;
+		} else if (ret == 0) {
+			eof = true;
+			if (used == 0) {
+				break;
+			}
+			// Terminate the last line if it doesn't end with a newline.
+			buf[used] = '\n';
+			used++;
+		} else {
+			used += ret;
+		}
+		
+		char *line = buf;
+		char *end = buf + used;
+		char *newline;
+		while ((newline = (char *) memchr(line, '\n', end - line)) != NULL) {
+			*newline = '\0';
+			if (strncmp(line, "Rss:", 4) == 0) {
+				rss += strtoul(line + 4, NULL, 10);
+			} else if (strncmp(line, "Pss:", 4) == 0) {
+				pss += strtoul(line + 4, NULL, 10);
+			} else if (strncmp(line, "Private_Dirty:", 14) == 0) {
+				privateDirty += strtoul(line + 14, NULL, 10);
+			}
+			line = newline + 1;
+		}
+		
+		// Move the partial line, if any, to the beginning of the buffer.
+		used = end - line;
+		if (used == sizeof(buf) - 1) {
+			// Absurdly long line; ignore it.
+			used = 0;
+		} else if (used > 0) {
+			memmove(buf, line, used);
+		}
+	}
+	close(fd);
+	
+	usage.rss = rss;
+	usage.pss = pss;
+	usage.privateDirty = privateDirty;
+	return true;
+}
+
+/**
+ * Determine the memory usage of the given process.
+ *
+ * The virtual memory size and resident set size are read from
+ * <tt>/proc/(pid)/statm</tt>, which is cheap. PSS and private dirty memory are
+ * read from <tt>/proc/(pid)/smaps_rollup</tt> if the kernel supports it, and
+ * from <tt>/proc/(pid)/smaps</tt> otherwise.
+ *
+ * @return Whether the process's memory usage could be determined. This is
+ *         false if the process doesn't exist (anymore), if we're not allowed
+ *         to inspect it, or if this isn't Linux.
+ * @ingroup Support
+ */
+inline bool
+readMemoryUsage(pid_t pid, MemoryUsage &usage) {
+	char filename[64];
+	FILE *f;
+	unsigned long size, resident;
+	int ret;
+	
+	snprintf(filename, sizeof(filename), "/proc/%lu/statm", (unsigned long) pid);
+	f = InterruptableCalls::fopen(filename, "r");
+	if (f == NULL) {
+		return false;
+	}
+	ret = fscanf(f, "%lu %lu", &size, &resident);
+	InterruptableCalls::fclose(f);
+	if (ret != 2) {
+		return false;
+	}
+	
+	unsigned long pageSize = sysconf(_SC_PAGESIZE) / 1024;
+	usage.vmSize = size * pageSize;
+	usage.rss = resident * pageSize;
+	
+	snprintf(filename, sizeof(filename), "/proc/%lu/smaps_rollup", (unsigned long) pid);
+	if (!parseSmaps(filename, usage)) {
+		snprintf(filename, sizeof(filename), "/proc/%lu/smaps", (unsigned long) pid);
+		parseSmaps(filename, usage);
+	}
+	return true;
+}
+
+/**
+ * Periodically samples the memory usage of a set of processes, and keeps a
+ * history of the samples of each process.
+ *
+ * The processes to sample are determined by a callback, which is called once
+ * per sampling round. Processes that are no longer returned by the callback
+ * are forgotten.
+ *
+ * This class is fully thread-safe.
+ *
+ * @ingroup Support
+ */
+class MemorySampler {
+public:
+	/** A callback which returns the PIDs to sample, mapped to descriptions. */
+	typedef function<map<pid_t, string> ()> ProcessLister;
+	
+	/** A single sample. */
+	struct Sample {
+		time_t time;
+		MemoryUsage usage;
+	};
+	
+	/** The samples of a single process, oldest first. */
+	struct Process {
+		pid_t pid;
+		string description;
+		deque<Sample> samples;
+	};
+	
+	typedef shared_ptr<Process> ProcessPtr;
+
+private:
+	static const int SAMPLER_THREAD_STACK_SIZE = 1024 * 128;
+	
+	typedef map<pid_t, ProcessPtr> ProcessMap;
+	
+	ProcessLister lister;
+	unsigned int interval;
+	unsigned int historySize;
+	mutable boost::mutex lock;
+	ProcessMap processes;
+	Thread *thr;
+	
+	void threadMain() {
+		try {
+			while (!this_thread::interruption_requested()) {
+				sample();
+				InterruptableCalls::usleep((useconds_t) interval * 1000000);
+			}
+		} catch (const boost::thread_interrupted &) {
+			P_TRACE(2, "Memory sampler thread interrupted.");
+		}
+	}
+	
+	static unsigned long peakPrivateDirty(const deque<Sample> &samples) {
+		unsigned long result = 0;
+		deque<Sample>::const_iterator it;
+		for (it = samples.begin(); it != samples.end(); it++) {
+			if (it->usage.privateDirty > result) {
+				result = it->usage.privateDirty;
+			}
+		}
+		return result;
+	}
+
+public:
+	/**
+	 * Create a new MemorySampler. The sampler thread isn't started until
+	 * start() is called.
+	 *
+	 * @param lister Returns the processes to sample.
+	 * @param interval The sampling interval, in seconds.
+	 * @param historySize The maximum number of samples to keep per process.
+	 */
+	MemorySampler(const ProcessLister &lister, unsigned int interval = 10,
+	              unsigned int historySize = 60)
+		: lister(lister)
+	{
+		this->interval = interval;
+		this->historySize = historySize;
+		thr = NULL;
+	}
+	
+	~MemorySampler() {
+		if (thr != NULL) {
+			this_thread::disable_syscall_interruption dsi;
+			thr->interruptAndJoin();
+			delete thr;
+		}
+	}
+	
+	/**
+	 * Start the sampler thread.
+	 */
+	void start() {
+		thr = new Thread(bind(&MemorySampler::threadMain, this),
+			SAMPLER_THREAD_STACK_SIZE);
+	}
+	
+	/**
+	 * Sample the memory usage of all processes once. This is normally
+	 * called by the sampler thread, but may also be called directly.
+	 */
+	void sample() {
+		map<pid_t, string> pids(lister());
+		map<pid_t, string>::const_iterator it;
+		ProcessMap newProcesses;
+		time_t now = time(NULL);
+		
+		/* Reading smaps files can take a while, so we do that without
+		 * holding the lock, and only merge the results under the lock.
+		 */
+		for (it = pids.begin(); it != pids.end(); it++) {
+			Sample sample;
+			sample.time = now;
+			if (readMemoryUsage(it->first, sample.usage)) {
+				ProcessPtr process(new Process());
+				process->pid = it->first;
+				process->description = it->second;
+				process->samples.push_back(sample);
+				newProcesses[it->first] = process;
+			}
+		}
+		
+		boost::mutex::scoped_lock l(lock);
+		ProcessMap::iterator pit;
+		for (pit = newProcesses.begin(); pit != newProcesses.end(); pit++) {
+			ProcessMap::iterator old(processes.find(pit->first));
+			if (old != processes.end()) {
+				deque<Sample> &samples(old->second->samples);
+				samples.push_back(pit->second->samples.back());
+				while (samples.size() > historySize) {
+					samples.pop_front();
+				}
+				pit->second->samples.swap(samples);
+			}
+		}
+		processes.swap(newProcesses);
+	}
+	
+	/**
+	 * Returns the sample history of the given process, or a null pointer if
+	 * that process hasn't been sampled. The returned object is a copy.
+	 */
+	ProcessPtr getProcess(pid_t pid) const {
+		boost::mutex::scoped_lock l(lock);
+		ProcessMap::const_iterator it(processes.find(pid));
+		if (it == processes.end()) {
+			return ProcessPtr();
+		} else {
+			return ProcessPtr(new Process(*it->second));
+		}
+	}
+	
+	/**
+	 * Returns a textual report of the last sample of every process, as well
+	 * as the peak private dirty memory within the sample history. Sizes
+	 * are in kilobytes. The report is parsed by passenger-memory-stats.
+	 */
+	string toString() const {
+		boost::mutex::scoped_lock l(lock);
+		stringstream result;
+		ProcessMap::const_iterator it;
+		
+		result << "----------- Memory usage -----------" << endl;
+		for (it = processes.begin(); it != processes.end(); it++) {
+			const Process *process = it->second.get();
+			const MemoryUsage &usage(process->samples.back().usage);
+			char buf[256];
+			
+			snprintf(buf, sizeof(buf),
+				"PID: %-8lu  VMSize: %-8lu  RSS: %-8lu  PSS: %-8lu  "
+				"Private: %-8lu  Peak private: %-8lu  Samples: %-4u  ",
+				(unsigned long) process->pid, usage.vmSize, usage.rss,
+				usage.pss, usage.privateDirty,
+				peakPrivateDirty(process->samples),
+				(unsigned int) process->samples.size());
+			result << buf << process->description << endl;
+		}
+		result << endl;
+		return result.str();
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_MEMORY_SAMPLER_H_ */
@@ -146,22 +146,33 @@ public:
 	 * @see read(), write(const char *, ...)
 	 */
 	void write(const list<string> &args) {
-		list<string>::const_iterator it;
 		string data;
+		appendMessage(data, args);
+		writeRaw(data);
+	}
+	
+	/**
+	 * Append an array message, in the format that write() sends it, to the
+	 * given buffer. This allows one to send several messages with a single
+	 * writeRaw() call.
+	 *
+	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
+	 * @see write(const list<string> &)
+	 */
+	static void appendMessage(string &buffer, const list<string> &args) {
+		list<string>::const_iterator it;
 		uint16_t dataSize = 0;
 
 		for (it = args.begin(); it != args.end(); it++) {
 			dataSize += it->size() + 1;
 		}
-		data.reserve(dataSize + sizeof(dataSize));
+		buffer.reserve(buffer.size() + dataSize + sizeof(dataSize));
 		dataSize = htons(dataSize);
-		data.append((const char *) &dataSize, sizeof(dataSize));
+		buffer.append((const char *) &dataSize, sizeof(dataSize));
 		for (it = args.begin(); it != args.end(); it++) {
-			data.append(*it);
-			data.append(1, DELIMITER);
+			buffer.append(*it);
+			buffer.append(1, DELIMITER);
 		}
-		
-		writeRaw(data);
 	}
 	
 	/**
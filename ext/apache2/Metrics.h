@@ -0,0 +1,441 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_METRICS_H_
+#define _PASSENGER_METRICS_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <string>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <cstdio>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+/**
+ * A monotonically increasing counter. All operations are atomic.
+ *
+ * @ingroup Support
+ */
+class Counter {
+private:
+	volatile unsigned long long value;
+
+public:
+	Counter() {
+		value = 0;
+	}
+	
+	void increment(unsigned long long amount = 1) {
+		__sync_fetch_and_add(&value, amount);
+	}
+	
+	unsigned long long get() {
+		return __sync_fetch_and_add(&value, 0);
+	}
+};
+
+/**
+ * A value that can go up and down. All operations are atomic.
+ *
+ * @ingroup Support
+ */
+class Gauge {
+private:
+	volatile long long value;
+
+public:
+	Gauge() {
+		value = 0;
+	}
+	
+	void set(long long newValue) {
+		long long old;
+		do {
+			old = value;
+		} while (!__sync_bool_compare_and_swap(&value, old, newValue));
+	}
+	
+	void increment(long long amount = 1) {
+		__sync_fetch_and_add(&value, amount);
+	}
+	
+	void decrement(long long amount = 1) {
+		__sync_fetch_and_sub(&value, amount);
+	}
+	
+	long long get() {
+		return __sync_fetch_and_add(&value, 0);
+	}
+};
+
+/**
+ * A latency histogram with fixed buckets, ranging from 1 millisecond to
+ * 1 minute. All operations are atomic, but a concurrent reader may see a
+ * bucket count that's inconsistent with the total count.
+ *
+ * @ingroup Support
+ */
+class LatencyHistogram {
+public:
+	/** Number of buckets, excluding the implicit +Inf bucket. */
+	static const unsigned int BUCKETS = 15;
+	
+	/** The upper bounds of the buckets, in microseconds. */
+	static unsigned long long upperBound(unsigned int bucket) {
+		static const unsigned long long bounds[BUCKETS] = {
+			1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+			500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+		};
+		return bounds[bucket];
+	}
+
+private:
+	Counter buckets[BUCKETS + 1];
+	Counter sum;
+
+public:
+	/**
+	 * Record a duration, in microseconds.
+	 */
+	void observe(unsigned long long usec) {
+		unsigned int i = 0;
+		while (i < BUCKETS && usec > upperBound(i)) {
+			i++;
+		}
+		buckets[i].increment();
+		sum.increment(usec);
+	}
+	
+	/** Returns the number of values in the given bucket (not cumulative). */
+	unsigned long long getBucket(unsigned int bucket) {
+		return buckets[bucket].get();
+	}
+	
+	/** Returns the sum of all recorded values, in microseconds. */
+	unsigned long long getSum() {
+		return sum.get();
+	}
+	
+	unsigned long long getCount() {
+		unsigned long long result = 0;
+		for (unsigned int i = 0; i <= BUCKETS; i++) {
+			result += buckets[i].get();
+		}
+		return result;
+	}
+};
+
+/**
+ * A registry of named metrics, which can be exported in the Prometheus text
+ * exposition format.
+ *
+ * Metrics are identified by a name and an optional set of labels, formatted
+ * with label(), e.g. <tt>app="/webapps/foo"</tt>. A metric is created the
+ * first time it's requested, and lives as long as the registry. References
+ * returned by counter(), gauge() and histogram() thus stay valid, and can be
+ * cached by the caller.
+ *
+ * Collectors are callbacks that are called right before the metrics are
+ * exported. They're useful for gauges that are cheaper to compute on demand
+ * than to keep up to date, such as the number of application instances in
+ * a pool. Collectors are called without holding the registry's lock, so they
+ * may create metrics. removeCollector() waits until the collector is no longer
+ * running, so the object that it belongs to may be destroyed afterwards.
+ *
+ * This class is fully thread-safe. Use MetricsRegistry::global() for the
+ * registry that is exported by the ApplicationPool server.
+ *
+ * @ingroup Support
+ */
+class MetricsRegistry {
+public:
+	typedef function<void ()> Collector;
+
+private:
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+	
+	struct Family {
+		Type type;
+		const char *help;
+		map< string, shared_ptr<Counter> > counters;
+		map< string, shared_ptr<Gauge> > gauges;
+		map< string, shared_ptr<LatencyHistogram> > histograms;
+	};
+	
+	boost::mutex lock;
+	/** Held while collectors run. Always locked before <tt>lock</tt>. */
+	boost::mutex collectLock;
+	map<string, Family> families;
+	map<unsigned int, Collector> collectors;
+	unsigned int lastCollectorId;
+	
+	Family &family(const char *name, const char *help, Type type) {
+		map<string, Family>::iterator it(families.find(name));
+		if (it == families.end()) {
+			Family &f(families[name]);
+			f.type = type;
+			f.help = help;
+			return f;
+		} else {
+			return it->second;
+		}
+	}
+	
+	static void appendLabels(stringstream &out, const string &labels, const char *extra = NULL) {
+		if (!labels.empty() || extra != NULL) {
+			out << "{" << labels;
+			if (!labels.empty() && extra != NULL) {
+				out << ",";
+			}
+			if (extra != NULL) {
+				out << extra;
+			}
+			out << "}";
+		}
+	}
+	
+	static void formatSeconds(stringstream &out, unsigned long long usec) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%llu.%06llu", usec / 1000000, usec % 1000000);
+		out << buf;
+	}
+
+public:
+	MetricsRegistry() {
+		lastCollectorId = 0;
+	}
+	
+	/**
+	 * Returns the process-wide registry. It's never destroyed, so that
+	 * objects with static storage duration, such as pools that unregister
+	 * their collectors, may still use it while the program exits.
+	 */
+	static MetricsRegistry &global() {
+		static MetricsRegistry *registry = new MetricsRegistry();
+		return *registry;
+	}
+	
+	/**
+	 * Format a label for use in a metric's label set, e.g.
+	 * <tt>label("app", "/foo")</tt> returns <tt>app="/foo"</tt>.
+	 * Multiple labels can be joined with commas.
+	 */
+	static string label(const char *name, const string &value) {
+		string result(name);
+		result.append("=\"");
+		for (string::size_type i = 0; i < value.size(); i++) {
+			switch (value[i]) {
+			case '\\':
+				result.append("\\\\");
+				break;
+			case '"':
+				result.append("\\\"");
+				break;
+			case '\n':
+				result.append("\\n");
+				break;
+			default:
+				result.append(1, value[i]);
+			}
+		}
+		result.append("\"");
+		return result;
+	}
+	
+	/**
+	 * Returns the counter with the given name and labels.
+	 *
+	 * @param name The metric name. Counter names should end with "_total".
+	 * @param help A description of the metric. Must be a string literal.
+	 */
+	Counter &counter(const char *name, const char *help, const string &labels = "") {
+		boost::mutex::scoped_lock l(lock);
+		shared_ptr<Counter> &c(family(name, help, COUNTER).counters[labels]);
+		if (c == NULL) {
+			c.reset(new Counter());
+		}
+		return *c;
+	}
+	
+	/**
+	 * Returns the gauge with the given name and labels.
+	 *
+	 * @param help A description of the metric. Must be a string literal.
+	 */
+	Gauge &gauge(const char *name, const char *help, const string &labels = "") {
+		boost::mutex::scoped_lock l(lock);
+		shared_ptr<Gauge> &g(family(name, help, GAUGE).gauges[labels]);
+		if (g == NULL) {
+			g.reset(new Gauge());
+		}
+		return *g;
+	}
+	
+	/**
+	 * Returns the latency histogram with the given name and labels.
+	 *
+	 * @param name The metric name. Should end with "_seconds", because
+	 *             histograms are exported in seconds.
+	 * @param help A description of the metric. Must be a string literal.
+	 */
+	LatencyHistogram &histogram(const char *name, const char *help, const string &labels = "") {
+		boost::mutex::scoped_lock l(lock);
+		shared_ptr<LatencyHistogram> &h(family(name, help, HISTOGRAM).histograms[labels]);
+		if (h == NULL) {
+			h.reset(new LatencyHistogram());
+		}
+		return *h;
+	}
+	
+	/**
+	 * Set all gauges with the given name to 0. Collectors can use this to
+	 * reset per-application gauges of applications that no longer exist,
+	 * before setting the gauges of the applications that do.
+	 */
+	void resetGauges(const char *name) {
+		boost::mutex::scoped_lock l(lock);
+		map<string, Family>::iterator it(families.find(name));
+		if (it != families.end()) {
+			map< string, shared_ptr<Gauge> >::iterator git;
+			for (git = it->second.gauges.begin(); git != it->second.gauges.end(); git++) {
+				git->second->set(0);
+			}
+		}
+	}
+	
+	/**
+	 * Register a collector.
+	 *
+	 * @return An ID which can be passed to removeCollector().
+	 */
+	unsigned int addCollector(const Collector &collector) {
+		boost::mutex::scoped_lock l(lock);
+		lastCollectorId++;
+		collectors[lastCollectorId] = collector;
+		return lastCollectorId;
+	}
+	
+	/**
+	 * Unregister a collector. If the collector is running, then this method
+	 * waits until it's done. So it may not be called from a collector, or
+	 * while holding a lock that collectors take.
+	 */
+	void removeCollector(unsigned int id) {
+		boost::mutex::scoped_lock cl(collectLock);
+		boost::mutex::scoped_lock l(lock);
+		collectors.erase(id);
+	}
+	
+	/**
+	 * Run all collectors, and return all metrics in the Prometheus text
+	 * exposition format.
+	 */
+	string toString() {
+		{
+			boost::mutex::scoped_lock cl(collectLock);
+			vector<Collector> collectorsCopy;
+			{
+				boost::mutex::scoped_lock l(lock);
+				map<unsigned int, Collector>::const_iterator it;
+				for (it = collectors.begin(); it != collectors.end(); it++) {
+					collectorsCopy.push_back(it->second);
+				}
+			}
+			for (unsigned int i = 0; i < collectorsCopy.size(); i++) {
+				collectorsCopy[i]();
+			}
+		}
+		
+		boost::mutex::scoped_lock l(lock);
+		stringstream out;
+		map<string, Family>::iterator it;
+		for (it = families.begin(); it != families.end(); it++) {
+			const string &name(it->first);
+			Family &f(it->second);
+			
+			out << "# HELP " << name << " " << f.help << "\n";
+			switch (f.type) {
+			case COUNTER: {
+				out << "# TYPE " << name << " counter\n";
+				map< string, shared_ptr<Counter> >::iterator cit;
+				for (cit = f.counters.begin(); cit != f.counters.end(); cit++) {
+					out << name;
+					appendLabels(out, cit->first);
+					out << " " << cit->second->get() << "\n";
+				}
+				break;
+			}
+			case GAUGE: {
+				out << "# TYPE " << name << " gauge\n";
+				map< string, shared_ptr<Gauge> >::iterator git;
+				for (git = f.gauges.begin(); git != f.gauges.end(); git++) {
+					out << name;
+					appendLabels(out, git->first);
+					out << " " << git->second->get() << "\n";
+				}
+				break;
+			}
+			case HISTOGRAM: {
+				out << "# TYPE " << name << " histogram\n";
+				map< string, shared_ptr<LatencyHistogram> >::iterator hit;
+				for (hit = f.histograms.begin(); hit != f.histograms.end(); hit++) {
+					LatencyHistogram &h(*hit->second);
+					unsigned long long cumulative = 0;
+					for (unsigned int i = 0; i <= LatencyHistogram::BUCKETS; i++) {
+						stringstream le;
+						if (i < LatencyHistogram::BUCKETS) {
+							le << "le=\"";
+							formatSeconds(le, LatencyHistogram::upperBound(i));
+							le << "\"";
+						} else {
+							le << "le=\"+Inf\"";
+						}
+						cumulative += h.getBucket(i);
+						out << name << "_bucket";
+						appendLabels(out, hit->first, le.str().c_str());
+						out << " " << cumulative << "\n";
+					}
+					out << name << "_sum";
+					appendLabels(out, hit->first);
+					out << " ";
+					formatSeconds(out, h.getSum());
+					out << "\n";
+					out << name << "_count";
+					appendLabels(out, hit->first);
+					out << " " << cumulative << "\n";
+				}
+				break;
+			}
+			}
+		}
+		return out.str();
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_METRICS_H_ */
@@ -0,0 +1,248 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_NUMA_TOPOLOGY_H_
+#define _PASSENGER_NUMA_TOPOLOGY_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#ifdef __linux__
+	#include <sched.h>
+	#include <sys/syscall.h>
+#endif
+
+#include "Exceptions.h"
+#include "Logging.h"
+#include "Utils.h"
+
+namespace Passenger {
+
+using namespace std;
+
+/**
+ * The NUMA nodes of this machine and the CPUs that belong to them, as
+ * reported by Linux in <tt>/sys/devices/system/node</tt>. Used to pin
+ * application instances to a single node, so that they don't migrate
+ * between nodes and lose their caches and local memory.
+ *
+ * On systems without NUMA support, or with a single node, the topology is
+ * empty and placement is pointless. A fake topology can be used for testing
+ * by passing another directory to detect(), with the same layout as the
+ * sysfs one: a <tt>nodeN/cpulist</tt> file for each node.
+ *
+ * @ingroup Support
+ */
+class NumaTopology {
+public:
+	struct Node {
+		/** The node number, as used by the kernel. */
+		unsigned int id;
+		vector<unsigned int> cpus;
+	};
+
+private:
+	vector<Node> nodes;
+	
+	#ifdef __linux__
+		static void setAffinity(pid_t tid, const cpu_set_t &cpus) {
+			if (sched_setaffinity(tid, sizeof(cpus), &cpus) == -1 && errno != ESRCH) {
+				throw SystemException("Cannot set the CPU affinity of process "
+					+ toString(tid), errno);
+			}
+		}
+	#endif
+
+public:
+	/**
+	 * Parse a CPU list in the kernel's format, e.g. <tt>"0-3,8,10-11"</tt>.
+	 *
+	 * @return Whether the list is valid.
+	 */
+	static bool parseCpuList(const string &list, vector<unsigned int> &cpus) {
+		vector<string> ranges;
+		vector<string>::const_iterator it;
+		
+		split(list, ',', ranges);
+		for (it = ranges.begin(); it != ranges.end(); it++) {
+			const char *begin = it->c_str();
+			char *end;
+			unsigned long first, last;
+			
+			if (it->empty() || *it == "\n") {
+				continue;
+			}
+			first = last = strtoul(begin, &end, 10);
+			if (end == begin) {
+				return false;
+			}
+			if (*end == '-') {
+				begin = end + 1;
+				last = strtoul(begin, &end, 10);
+				if (end == begin || last < first) {
+					return false;
+				}
+			}
+			if (*end != '\0' && *end != '\n') {
+				return false;
+			}
+			for (unsigned long cpu = first; cpu <= last; cpu++) {
+				cpus.push_back(cpu);
+			}
+		}
+		return true;
+	}
+	
+	/**
+	 * Read the topology from the given sysfs directory. Nodes without CPUs
+	 * (memory-only nodes) are skipped. Returns an empty topology if the
+	 * directory doesn't exist.
+	 */
+	static NumaTopology detect(const string &directory = "/sys/devices/system/node") {
+		NumaTopology result;
+		DIR *dir = opendir(directory.c_str());
+		struct dirent *entry;
+		
+		if (dir == NULL) {
+			return result;
+		}
+		while ((entry = readdir(dir)) != NULL) {
+			const char *name = entry->d_name;
+			char *end;
+			Node node;
+			
+			if (strncmp(name, "node", 4) != 0 || name[4] == '\0') {
+				continue;
+			}
+			node.id = strtoul(name + 4, &end, 10);
+			if (*end != '\0') {
+				continue;
+			}
+			
+			ifstream file((directory + "/" + name + "/cpulist").c_str());
+			string list;
+			if (!getline(file, list) || !parseCpuList(list, node.cpus)) {
+				P_WARN("Cannot parse the CPU list of NUMA node " << node.id);
+				continue;
+			}
+			if (!node.cpus.empty()) {
+				result.add(node);
+			}
+		}
+		closedir(dir);
+		return result;
+	}
+	
+	/** Adds a node, keeping the nodes sorted by ID. */
+	void add(const Node &node) {
+		vector<Node>::iterator it(nodes.begin());
+		while (it != nodes.end() && it->id < node.id) {
+			it++;
+		}
+		nodes.insert(it, node);
+	}
+	
+	/** Returns the number of nodes with CPUs. */
+	unsigned int size() const {
+		return nodes.size();
+	}
+	
+	/**
+	 * Returns the node with the given index, which is between 0 and
+	 * <tt>size() - 1</tt>. This isn't necessarily the node's ID.
+	 */
+	const Node &getNode(unsigned int index) const {
+		return nodes[index];
+	}
+	
+	/**
+	 * Pin all threads of the given process to the CPUs of the node with
+	 * the given index, and move its memory to that node. Memory that the
+	 * process allocates afterwards is placed on that node by the kernel's
+	 * default local allocation policy, because the process only runs there.
+	 *
+	 * Moving memory is best-effort: it requires <tt>migrate_pages()</tt>,
+	 * and pages that are shared with other processes (e.g. copy-on-write
+	 * pages of a preloaded framework) are left where they are. This is a
+	 * no-op on systems other than Linux.
+	 *
+	 * @throws SystemException The CPU affinity cannot be set.
+	 */
+	void pin(pid_t pid, unsigned int index) const {
+		#ifdef __linux__
+			const Node &node(nodes[index]);
+			cpu_set_t cpus;
+			vector<unsigned int>::const_iterator it;
+			
+			CPU_ZERO(&cpus);
+			for (it = node.cpus.begin(); it != node.cpus.end(); it++) {
+				if (*it < CPU_SETSIZE) {
+					CPU_SET(*it, &cpus);
+				}
+			}
+			
+			string taskDir("/proc/" + toString(pid) + "/task");
+			DIR *dir = opendir(taskDir.c_str());
+			if (dir == NULL) {
+				setAffinity(pid, cpus);
+			} else {
+				struct dirent *entry;
+				try {
+					while ((entry = readdir(dir)) != NULL) {
+						if (entry->d_name[0] != '.') {
+							setAffinity(atoi(entry->d_name), cpus);
+						}
+					}
+				} catch (...) {
+					closedir(dir);
+					throw;
+				}
+				closedir(dir);
+			}
+			
+			#ifdef SYS_migrate_pages
+				unsigned long fromNodes[16], toNodes[16];
+				const unsigned int bits = sizeof(unsigned long) * 8;
+				
+				if (node.id < sizeof(toNodes) * 8) {
+					memset(fromNodes, 0xff, sizeof(fromNodes));
+					memset(toNodes, 0, sizeof(toNodes));
+					toNodes[node.id / bits] |= 1UL << (node.id % bits);
+					if (syscall(SYS_migrate_pages, pid, sizeof(toNodes) * 8,
+					            fromNodes, toNodes) == -1) {
+						P_DEBUG("Cannot move the memory of process " << pid <<
+							" to NUMA node " << node.id << ": " <<
+							strerror(errno));
+					}
+				}
+			#endif
+		#endif
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_NUMA_TOPOLOGY_H_ */
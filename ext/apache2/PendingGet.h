@@ -0,0 +1,195 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_PENDING_GET_H_
+#define _PASSENGER_PENDING_GET_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+#include <string>
+#include <typeinfo>
+
+
+#include "Application.h"
+#include "Exceptions.h"
+#include "System.h"
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+/**
+ * The result of ApplicationPool::getAsync(): a session that will be opened,
+ * or the reason why it couldn't be.
+ *
+ * Event-driven callers wait for the file descriptor returned by getFd() to
+ * become readable, e.g. with poll() or epoll, together with all their
+ * other file descriptors. Once it's readable (or once isReady() returns
+ * true), get() returns the session without blocking.
+ *
+ * @ingroup Support
+ */
+class PendingGet {
+public:
+	virtual ~PendingGet() {}
+	
+	/**
+	 * Returns a file descriptor that becomes readable when the result is
+	 * available. The caller must not read from it or close it.
+	 */
+	virtual int getFd() const = 0;
+	
+	/**
+	 * Checks whether the result is available, i.e. whether get() won't
+	 * block. This never blocks.
+	 */
+	virtual bool isReady() = 0;
+	
+	/**
+	 * Returns the opened session, waiting for it if necessary. This may
+	 * only be called once.
+	 *
+	 * @throws SpawnException
+	 * @throws BusyException
+	 * @throws IOException
+	 * @throws SystemException
+	 * @throws boost::thread_interrupted
+	 */
+	virtual Application::SessionPtr get() = 0;
+};
+
+typedef shared_ptr<PendingGet> PendingGetPtr;
+
+/**
+ * A PendingGet whose result is set by another thread, or right away.
+ *
+ * The exception that is passed to setException() is copied by type and
+ * message, because exceptions can't be transported between threads.
+ * Exceptions other than SpawnException, BusyException and SystemException
+ * are rethrown by get() as IOException.
+ *
+ * This class is thread-safe.
+ *
+ * @ingroup Support
+ */
+class SettablePendingGet: public PendingGet {
+private:
+	enum ErrorType { NO_ERROR, SPAWN_ERROR, BUSY_ERROR, SYSTEM_ERROR, IO_ERROR };
+	
+	boost::mutex lock;
+	condition readyChanged;
+	/** Readable once the result has been set. */
+	InterruptionChannel channel;
+	bool ready;
+	Application::SessionPtr session;
+	ErrorType errorType;
+	string errorMessage;
+	string errorPage;
+	bool hasErrorPage;
+	int errorCode;
+	
+	void setReady() {
+		ready = true;
+		readyChanged.notify_all();
+		channel.interrupt();
+	}
+
+public:
+	/**
+	 * @throws boost::thread_resource_error The file descriptor cannot be created.
+	 */
+	SettablePendingGet() {
+		ready = false;
+		errorType = NO_ERROR;
+		hasErrorPage = false;
+		errorCode = 0;
+	}
+	
+	virtual int getFd() const {
+		return channel.getFd();
+	}
+	
+	virtual bool isReady() {
+		boost::mutex::scoped_lock l(lock);
+		return ready;
+	}
+	
+	void setSession(const Application::SessionPtr &session) {
+		boost::mutex::scoped_lock l(lock);
+		this->session = session;
+		setReady();
+	}
+	
+	void setException(const exception &e) {
+		boost::mutex::scoped_lock l(lock);
+		if (const SpawnException *spawne = dynamic_cast<const SpawnException *>(&e)) {
+			errorType = SPAWN_ERROR;
+			hasErrorPage = spawne->hasErrorPage();
+			if (hasErrorPage) {
+				errorPage = spawne->getErrorPage();
+			}
+			errorMessage = e.what();
+		} else if (dynamic_cast<const BusyException *>(&e) != NULL) {
+			errorType = BUSY_ERROR;
+			errorMessage = e.what();
+		} else if (const SystemException *syse = dynamic_cast<const SystemException *>(&e)) {
+			errorType = SYSTEM_ERROR;
+			errorMessage = syse->brief();
+			errorCode = syse->code();
+		} else {
+			errorType = IO_ERROR;
+			errorMessage = e.what();
+		}
+		setReady();
+	}
+	
+	virtual Application::SessionPtr get() {
+		boost::mutex::scoped_lock l(lock);
+		while (!ready) {
+			readyChanged.wait(l);
+		}
+		switch (errorType) {
+		case SPAWN_ERROR:
+			if (hasErrorPage) {
+				throw SpawnException(errorMessage, errorPage);
+			} else {
+				throw SpawnException(errorMessage);
+			}
+		case BUSY_ERROR:
+			throw BusyException(errorMessage);
+		case SYSTEM_ERROR:
+			throw SystemException(errorMessage, errorCode);
+		case IO_ERROR:
+			throw IOException(errorMessage);
+		default:
+			Application::SessionPtr result(session);
+			session.reset();
+			return result;
+		}
+	}
+};
+
+typedef shared_ptr<SettablePendingGet> SettablePendingGetPtr;
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_PENDING_GET_H_ */
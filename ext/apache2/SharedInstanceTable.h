@@ -0,0 +1,547 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_SHARED_INSTANCE_TABLE_H_
+#define _PASSENGER_SHARED_INSTANCE_TABLE_H_
+
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "Application.h"
+#include "Exceptions.h"
+#include "System.h"
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+/**
+ * A table of application instances in a shared memory segment, through which
+ * Apache worker processes can reserve an idle instance and connect to it
+ * directly, without a round trip to the ApplicationPool server.
+ *
+ * The ApplicationPool server stays in charge of the instances' life times:
+ * it publishes every instance that it spawns, and retires it before shutting
+ * it down. Worker processes only reserve and release the instances that are
+ * published. A worker that can't reserve an idle instance asks the server
+ * as usual, which spawns an instance or waits for one to become idle.
+ *
+ * The table doesn't use any locks, so a worker process that crashes can't
+ * leave it locked. Each slot has a single 64-bit word that holds a
+ * generation number (high 32 bits) and a session count (low 32 bits). A
+ * slot is published if and only if its generation is odd. Publishing and
+ * retiring a slot increments its generation, so an operation on a slot
+ * that has been retired in the meantime fails or has no effect. Only one
+ * process (the server) may publish and retire slots.
+ *
+ * A worker process that crashes while it holds a reservation would leave
+ * the instance busy forever. Therefore each slot also records the PID of
+ * the worker that reserves it, and the server periodically calls
+ * reclaim(), which releases the reservations of workers that have exited.
+ *
+ * The segment is created before Apache forks its worker processes, which
+ * inherit the mapping, and is passed to the server process by file descriptor.
+ *
+ * @ingroup Support
+ */
+class SharedInstanceTable {
+public:
+	/** The maximum length of an application root, including the terminating null. */
+	static const unsigned int APP_ROOT_SIZE = 256;
+	/** The maximum length of a socket name, including the terminating null. */
+	static const unsigned int SOCKET_NAME_SIZE = 108;
+	static const unsigned int DEFAULT_CAPACITY = 256;
+	
+	/** Identifies a published instance. */
+	struct Handle {
+		/** The slot index, or -1 if this handle doesn't refer to anything. */
+		int slot;
+		unsigned int generation;
+		
+		Handle() {
+			slot = -1;
+			generation = 0;
+		}
+		
+		bool valid() const {
+			return slot != -1;
+		}
+	};
+	
+	/** A copy of a published instance's description. */
+	struct Instance {
+		Handle handle;
+		pid_t pid;
+		Application::SocketType socketType;
+		char socketName[SOCKET_NAME_SIZE];
+	};
+
+private:
+	static const unsigned int MAGIC = 0x50534954;
+	
+	struct Header {
+		unsigned int magic;
+		unsigned int capacity;
+		/** Used to spread reservations over the slots. */
+		volatile unsigned int nextScan;
+		/** The number of successful reserve() calls. */
+		volatile unsigned long long reservations;
+		/** The number of failed reserve() calls. */
+		volatile unsigned long long misses;
+	};
+	
+	struct Slot {
+		volatile unsigned long long word;
+		/** When a session with this instance was last closed by a worker process. */
+		volatile time_t lastUsed;
+		/**
+		 * The PID of the worker process that is reserving this instance or
+		 * holds its reservation, or 0. A worker sets this before it adds its
+		 * session and clears it after it removes its session, so that
+		 * reclaim() can tell whether a dead worker still holds a session.
+		 */
+		volatile pid_t reservedBy;
+		unsigned int appRootHash;
+		pid_t pid;
+		int socketType;
+		char appRoot[APP_ROOT_SIZE];
+		char socketName[SOCKET_NAME_SIZE];
+	};
+	
+	int fd;
+	size_t size;
+	Header *header;
+	Slot *slots;
+	
+	SharedInstanceTable() {
+		fd = -1;
+		size = 0;
+		header = NULL;
+		slots = NULL;
+	}
+	
+	SharedInstanceTable(const SharedInstanceTable &);
+	SharedInstanceTable &operator=(const SharedInstanceTable &);
+	
+	static unsigned int generationOf(unsigned long long word) {
+		return (unsigned int) (word >> 32);
+	}
+	
+	static unsigned int sessionsOf(unsigned long long word) {
+		return (unsigned int) (word & 0xffffffffULL);
+	}
+	
+	static unsigned long long makeWord(unsigned int generation, unsigned int sessions) {
+		return ((unsigned long long) generation << 32) | sessions;
+	}
+	
+	static unsigned int hash(const char *str) {
+		// FNV-1a
+		unsigned int result = 2166136261U;
+		for (; *str != '\0'; str++) {
+			result = (result ^ (unsigned char) *str) * 16777619U;
+		}
+		return result;
+	}
+	
+	static size_t sizeFor(unsigned int capacity) {
+		return sizeof(Header) + sizeof(Slot) * capacity;
+	}
+	
+	void mapSegment(size_t size) {
+		void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (memory == MAP_FAILED) {
+			throw SystemException("Cannot map the shared instance table", errno);
+		}
+		this->size = size;
+		header = (Header *) memory;
+		slots = (Slot *) (header + 1);
+	}
+	
+	unsigned long long load(const Slot &slot) const {
+		return __sync_fetch_and_add(const_cast<volatile unsigned long long *>(&slot.word), 0);
+	}
+	
+	/**
+	 * Remove a session from the given slot, if it still has the given
+	 * generation. Returns whether a session was removed.
+	 */
+	static bool removeSession(Slot &slot, unsigned int generation) {
+		unsigned long long word;
+		do {
+			word = __sync_fetch_and_add(&slot.word, 0);
+			if (generationOf(word) != generation || sessionsOf(word) == 0) {
+				return false;
+			}
+		} while (!__sync_bool_compare_and_swap(&slot.word, word, word - 1));
+		return true;
+	}
+	
+	static bool processExists(pid_t pid) {
+		return kill(pid, 0) == 0 || errno != ESRCH;
+	}
+
+public:
+	/**
+	 * Create a new, empty table in a shared memory segment, which is backed
+	 * by a deleted temporary file.
+	 *
+	 * @throws SystemException Something went wrong.
+	 */
+	explicit SharedInstanceTable(unsigned int capacity) {
+		char filename[] = "/tmp/passenger_instances.XXXXXX";
+		int ret;
+		
+		fd = mkstemp(filename);
+		if (fd == -1) {
+			throw SystemException("Cannot create a shared memory file", errno);
+		}
+		// Only the ApplicationPool server needs the file descriptor, and
+		// it gets a copy that isn't closed on exec.
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		// The file only serves to get a file descriptor.
+		do {
+			ret = unlink(filename);
+		} while (ret == -1 && errno == EINTR);
+		do {
+			ret = ftruncate(fd, sizeFor(capacity));
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			int e = errno;
+			InterruptableCalls::close(fd);
+			throw SystemException("Cannot resize the shared memory file", e);
+		}
+		try {
+			mapSegment(sizeFor(capacity));
+		} catch (...) {
+			InterruptableCalls::close(fd);
+			throw;
+		}
+		memset(header, 0, size);
+		header->magic = MAGIC;
+		header->capacity = capacity;
+	}
+	
+	/**
+	 * Attach to a table that was created by another process, and passed
+	 * to this process as a file descriptor. The returned object takes
+	 * ownership of the file descriptor.
+	 *
+	 * @throws SystemException Something went wrong.
+	 * @throws IOException The file descriptor doesn't refer to a table.
+	 */
+	static SharedInstanceTable *attach(int fd) {
+		auto_ptr<SharedInstanceTable> table(new SharedInstanceTable());
+		struct stat buf;
+		
+		table->fd = fd;
+		if (fstat(fd, &buf) == -1) {
+			throw SystemException("Cannot stat the shared instance table", errno);
+		}
+		if ((size_t) buf.st_size < sizeof(Header)) {
+			throw IOException("The shared instance table is truncated");
+		}
+		table->mapSegment(buf.st_size);
+		if (table->header->magic != MAGIC
+		 || sizeFor(table->header->capacity) > table->size) {
+			throw IOException("The file descriptor doesn't refer to a "
+				"shared instance table");
+		}
+		return table.release();
+	}
+	
+	~SharedInstanceTable() {
+		if (header != NULL) {
+			munmap(header, size);
+		}
+		if (fd != -1) {
+			InterruptableCalls::close(fd);
+		}
+	}
+	
+	int getFd() const {
+		return fd;
+	}
+	
+	unsigned int capacity() const {
+		return header->capacity;
+	}
+	
+	/**
+	 * Retire all published instances. The server calls this when it
+	 * starts, to forget about the instances of a previous server process.
+	 */
+	void reset() {
+		for (unsigned int i = 0; i < header->capacity; i++) {
+			Handle handle;
+			handle.slot = i;
+			handle.generation = generationOf(load(slots[i]));
+			retire(handle);
+		}
+	}
+	
+	/**
+	 * Publish an application instance, so that worker processes can reserve it.
+	 * Only instances that listen on a Unix socket can be published.
+	 *
+	 * @return A handle to the published instance, which is invalid if
+	 *         the table is full, or if the instance can't be published.
+	 */
+	Handle publish(const string &appRoot, pid_t pid, const string &socketName,
+	               Application::SocketType socketType) {
+		Handle handle;
+		
+		if (socketType == Application::TCP_SOCKET || appRoot.size() >= APP_ROOT_SIZE
+		 || socketName.size() >= SOCKET_NAME_SIZE) {
+			return handle;
+		}
+		for (unsigned int i = 0; i < header->capacity; i++) {
+			Slot &slot(slots[i]);
+			unsigned long long word = load(slot);
+			unsigned int generation = generationOf(word);
+			
+			if (generation % 2 == 1) {
+				continue;
+			}
+			memcpy(slot.appRoot, appRoot.c_str(), appRoot.size() + 1);
+			memcpy(slot.socketName, socketName.c_str(), socketName.size() + 1);
+			slot.appRootHash = hash(slot.appRoot);
+			slot.pid = pid;
+			slot.socketType = socketType;
+			slot.lastUsed = 0;
+			slot.reservedBy = 0;
+			if (__sync_bool_compare_and_swap(&slot.word, word,
+			                                 makeWord(generation + 1, 0))) {
+				handle.slot = i;
+				handle.generation = generation + 1;
+				return handle;
+			}
+		}
+		return handle;
+	}
+	
+	/**
+	 * Retire a published instance. Worker processes can't reserve it anymore,
+	 * and releasing a reservation of it has no effect. Does nothing if the
+	 * instance has already been retired.
+	 */
+	void retire(const Handle &handle) {
+		if (!handle.valid()) {
+			return;
+		}
+		
+		Slot &slot(slots[handle.slot]);
+		unsigned long long word;
+		do {
+			word = load(slot);
+			if (generationOf(word) != handle.generation || handle.generation % 2 == 0) {
+				return;
+			}
+		} while (!__sync_bool_compare_and_swap(&slot.word, word,
+		                                       makeWord(handle.generation + 1, 0)));
+	}
+	
+	/**
+	 * Reserve an idle instance of the given application, i.e. one without
+	 * any sessions. The reservation counts as a session, and must be
+	 * released with releaseReservation() by the same process when the
+	 * session is closed.
+	 *
+	 * @return Whether an idle instance was found.
+	 */
+	bool reserve(const string &appRoot, Instance &instance) {
+		if (appRoot.size() >= APP_ROOT_SIZE) {
+			return false;
+		}
+		
+		unsigned int appRootHash = hash(appRoot.c_str());
+		unsigned int start = __sync_fetch_and_add(&header->nextScan, 1);
+		for (unsigned int i = 0; i < header->capacity; i++) {
+			unsigned int index = (start + i) % header->capacity;
+			Slot &slot(slots[index]);
+			unsigned long long word = load(slot);
+			
+			if (generationOf(word) % 2 == 0 || sessionsOf(word) != 0
+			 || slot.appRootHash != appRootHash
+			 || strcmp(slot.appRoot, appRoot.c_str()) != 0) {
+				continue;
+			}
+			// Claim the slot first, so that our session can be reclaimed
+			// if we crash after adding it.
+			if (!__sync_bool_compare_and_swap(&slot.reservedBy, 0, getpid())) {
+				continue;
+			}
+			instance.pid = slot.pid;
+			instance.socketType = (Application::SocketType) slot.socketType;
+			memcpy(instance.socketName, slot.socketName, SOCKET_NAME_SIZE);
+			instance.socketName[SOCKET_NAME_SIZE - 1] = '\0';
+			// If the slot was retired while we copied its contents,
+			// then its generation has changed and this fails.
+			if (__sync_bool_compare_and_swap(&slot.word, word, word + 1)) {
+				instance.handle.slot = index;
+				instance.handle.generation = generationOf(word);
+				__sync_fetch_and_add(&header->reservations, 1);
+				return true;
+			}
+			__sync_bool_compare_and_swap(&slot.reservedBy, getpid(), 0);
+		}
+		__sync_fetch_and_add(&header->misses, 1);
+		return false;
+	}
+	
+	/**
+	 * Add a session to a published instance, regardless of whether it's
+	 * idle. The server calls this for the sessions that it opens itself,
+	 * so that worker processes don't reserve instances that are busy.
+	 */
+	void acquire(const Handle &handle) {
+		if (!handle.valid()) {
+			return;
+		}
+		
+		Slot &slot(slots[handle.slot]);
+		unsigned long long word;
+		do {
+			word = load(slot);
+			if (generationOf(word) != handle.generation) {
+				return;
+			}
+		} while (!__sync_bool_compare_and_swap(&slot.word, word, word + 1));
+	}
+	
+	/**
+	 * Remove a session that was added by acquire(). Does nothing if the
+	 * instance has been retired in the meantime.
+	 */
+	void release(const Handle &handle) {
+		if (!handle.valid()) {
+			return;
+		}
+		removeSession(slots[handle.slot], handle.generation);
+	}
+	
+	/**
+	 * Release a reservation that this process made with reserve(). Does
+	 * nothing if the instance has been retired in the meantime.
+	 */
+	void releaseReservation(const Handle &handle) {
+		if (!handle.valid()) {
+			return;
+		}
+		
+		Slot &slot(slots[handle.slot]);
+		if (removeSession(slot, handle.generation)) {
+			slot.lastUsed = time(NULL);
+			__sync_bool_compare_and_swap(&slot.reservedBy, getpid(), 0);
+		}
+	}
+	
+	/**
+	 * Release the reservation of a published instance if the worker
+	 * process that holds it has exited without releasing it.
+	 *
+	 * @param ownSessions The number of sessions that the caller has
+	 *                    added to the instance with acquire(). The caller
+	 *                    must not acquire or release sessions meanwhile.
+	 * @return Whether a reservation was released.
+	 */
+	bool reclaim(const Handle &handle, unsigned int ownSessions) {
+		if (!handle.valid()) {
+			return false;
+		}
+		
+		Slot &slot(slots[handle.slot]);
+		pid_t pid = slot.reservedBy;
+		if (pid == 0 || processExists(pid)) {
+			return false;
+		}
+		
+		// As long as the dead worker's claim is in place, no other worker
+		// can reserve the instance, so the session count can only change
+		// if the instance is retired. The worker may have exited before it
+		// added its session, or after it removed it: only the sessions
+		// beyond our own can be the worker's.
+		bool released = false;
+		unsigned long long word = load(slot);
+		if (generationOf(word) == handle.generation && sessionsOf(word) > ownSessions) {
+			released = __sync_bool_compare_and_swap(&slot.word, word, word - 1);
+		}
+		__sync_bool_compare_and_swap(&slot.reservedBy, pid, 0);
+		return released;
+	}
+	
+	/**
+	 * Returns the number of sessions of a published instance, including
+	 * reservations, or 0 if it has been retired.
+	 */
+	unsigned int getSessions(const Handle &handle) const {
+		if (!handle.valid()) {
+			return 0;
+		}
+		
+		unsigned long long word = load(slots[handle.slot]);
+		if (generationOf(word) == handle.generation) {
+			return sessionsOf(word);
+		} else {
+			return 0;
+		}
+	}
+	
+	/**
+	 * Returns when a worker process last released a reservation of the
+	 * given instance, or 0 if that never happened.
+	 */
+	time_t getLastUsed(const Handle &handle) const {
+		if (handle.valid()) {
+			return slots[handle.slot].lastUsed;
+		} else {
+			return 0;
+		}
+	}
+	
+	/** Returns the number of successful reserve() calls, in all processes. */
+	unsigned long long getReservations() const {
+		return __sync_fetch_and_add(&header->reservations, 0);
+	}
+	
+	/** Returns the number of failed reserve() calls, in all processes. */
+	unsigned long long getMisses() const {
+		return __sync_fetch_and_add(&header->misses, 0);
+	}
+};
+
+typedef shared_ptr<SharedInstanceTable> SharedInstanceTablePtr;
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_SHARED_INSTANCE_TABLE_H_ */
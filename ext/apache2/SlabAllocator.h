@@ -0,0 +1,344 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_SLAB_ALLOCATOR_H_
+#define _PASSENGER_SLAB_ALLOCATOR_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/checked_delete.hpp>
+
+#include <new>
+#include <cstddef>
+#include <cstdlib>
+#include <sched.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+/**
+ * A thread-safe allocator for small objects that are created and destroyed
+ * at a high rate, such as the objects that are allocated for every
+ * ApplicationPool session.
+ *
+ * Memory is carved out of large slabs, and blocks are grouped in size
+ * classes with a granularity of 16 bytes. Freed blocks are put on the free
+ * list of their size class, from which they're reused by later allocations,
+ * so that once the peak number of live objects has been reached, allocating
+ * and freeing no longer calls malloc() at all. Each size class is protected
+ * by its own spin lock, which is only held for a few instructions. Slabs
+ * are never returned to the system, so memory usage is bounded by the peak
+ * number of simultaneously live objects.
+ *
+ * Requests that are larger than MAX_SIZE are passed on to operator new.
+ *
+ * Define <tt>PASSENGER_DISABLE_SLAB_ALLOCATOR</tt> to make all allocations
+ * go through operator new, e.g. when debugging with Valgrind or for
+ * comparison in benchmarks.
+ *
+ * Use SlabAllocator::global() to obtain the process-wide allocator. Objects
+ * are usually not allocated directly, but through SlabAllocated,
+ * SlabStlAllocator or slabPtr().
+ *
+ * @ingroup Support
+ */
+class SlabAllocator {
+public:
+	/** The size classes' granularity, which is also the alignment of all blocks. */
+	static const size_t GRANULARITY = 16;
+	/** The size of the largest block that's allocated from a slab. */
+	static const size_t MAX_SIZE = 512;
+	/** The approximate size of a slab. */
+	static const size_t SLAB_SIZE = 1024 * 16;
+
+private:
+	static const unsigned int SIZE_CLASSES = MAX_SIZE / GRANULARITY;
+	
+	struct Block {
+		Block *next;
+	};
+	
+	struct SizeClass {
+		volatile int spinLock;
+		Block *freeList;
+		size_t slabs;
+	};
+	
+	SizeClass sizeClasses[SIZE_CLASSES];
+	
+	static void lock(SizeClass &sizeClass) {
+		while (__sync_lock_test_and_set(&sizeClass.spinLock, 1)) {
+			sched_yield();
+		}
+	}
+	
+	static void unlock(SizeClass &sizeClass) {
+		__sync_lock_release(&sizeClass.spinLock);
+	}
+	
+	/**
+	 * Allocate a new slab for the given size class, and put all of its
+	 * blocks except the first one on the size class's free list.
+	 * Must be called with the size class locked.
+	 */
+	static Block *grow(SizeClass &sizeClass, size_t blockSize) {
+		size_t count = SLAB_SIZE / blockSize;
+		char *slab = (char *) malloc(count * blockSize);
+		if (slab == NULL) {
+			return NULL;
+		}
+		for (size_t i = 1; i < count; i++) {
+			Block *block = (Block *) (slab + i * blockSize);
+			block->next = sizeClass.freeList;
+			sizeClass.freeList = block;
+		}
+		sizeClass.slabs++;
+		return (Block *) slab;
+	}
+	
+	SlabAllocator(const SlabAllocator &);
+	SlabAllocator &operator=(const SlabAllocator &);
+
+public:
+	SlabAllocator() {
+		for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+			sizeClasses[i].spinLock = 0;
+			sizeClasses[i].freeList = NULL;
+			sizeClasses[i].slabs = 0;
+		}
+	}
+	
+	/**
+	 * Returns the process-wide allocator. It's never destroyed, so that
+	 * objects may still be freed while static objects are being destroyed.
+	 */
+	static SlabAllocator &global() {
+		static SlabAllocator *allocator = new SlabAllocator();
+		return *allocator;
+	}
+	
+	/**
+	 * Allocate a block of at least the given size.
+	 *
+	 * @throws std::bad_alloc
+	 */
+	void *allocate(size_t size) {
+		#ifdef PASSENGER_DISABLE_SLAB_ALLOCATOR
+			return ::operator new(size);
+		#else
+			if (size == 0 || size > MAX_SIZE) {
+				return ::operator new(size);
+			}
+			
+			unsigned int index = (size - 1) / GRANULARITY;
+			SizeClass &sizeClass(sizeClasses[index]);
+			Block *block;
+			
+			lock(sizeClass);
+			block = sizeClass.freeList;
+			if (block != NULL) {
+				sizeClass.freeList = block->next;
+			} else {
+				block = grow(sizeClass, (index + 1) * GRANULARITY);
+			}
+			unlock(sizeClass);
+			if (block == NULL) {
+				throw bad_alloc();
+			}
+			return block;
+		#endif
+	}
+	
+	/**
+	 * Free a block that was allocated with allocate().
+	 *
+	 * @param size The size that was passed to allocate().
+	 */
+	void deallocate(void *pointer, size_t size) {
+		#ifdef PASSENGER_DISABLE_SLAB_ALLOCATOR
+			::operator delete(pointer);
+		#else
+			if (pointer == NULL) {
+				return;
+			} else if (size == 0 || size > MAX_SIZE) {
+				::operator delete(pointer);
+				return;
+			}
+			
+			SizeClass &sizeClass(sizeClasses[(size - 1) / GRANULARITY]);
+			Block *block = (Block *) pointer;
+			
+			lock(sizeClass);
+			block->next = sizeClass.freeList;
+			sizeClass.freeList = block;
+			unlock(sizeClass);
+		#endif
+	}
+	
+	/**
+	 * Returns the number of bytes in slabs, i.e. the amount of memory that
+	 * this allocator has obtained from the system.
+	 */
+	size_t getSlabMemory() {
+		size_t result = 0;
+		for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+			size_t blockSize = (i + 1) * GRANULARITY;
+			lock(sizeClasses[i]);
+			result += sizeClasses[i].slabs * (SLAB_SIZE / blockSize) * blockSize;
+			unlock(sizeClasses[i]);
+		}
+		return result;
+	}
+};
+
+/**
+ * Classes that derive from SlabAllocated are allocated with the global
+ * SlabAllocator when created with <tt>new</tt>. This also applies to
+ * subclasses, provided that the destructor is virtual.
+ *
+ * @ingroup Support
+ */
+class SlabAllocated {
+public:
+	static void *operator new(size_t size) {
+		return SlabAllocator::global().allocate(size);
+	}
+	
+	static void operator delete(void *pointer, size_t size) {
+		SlabAllocator::global().deallocate(pointer, size);
+	}
+};
+
+/**
+ * An STL-compatible allocator which allocates from the global SlabAllocator.
+ * Use it for node-based containers whose nodes are created and destroyed on
+ * hot paths, such as <tt>std::list</tt> and <tt>std::map</tt>.
+ *
+ * @ingroup Support
+ */
+template<typename T>
+class SlabStlAllocator {
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	
+	template<typename U>
+	struct rebind {
+		typedef SlabStlAllocator<U> other;
+	};
+	
+	SlabStlAllocator() { }
+	
+	template<typename U>
+	SlabStlAllocator(const SlabStlAllocator<U> &) { }
+	
+	pointer address(reference x) const {
+		return &x;
+	}
+	
+	const_pointer address(const_reference x) const {
+		return &x;
+	}
+	
+	pointer allocate(size_type n, const void * = 0) {
+		return (pointer) SlabAllocator::global().allocate(n * sizeof(T));
+	}
+	
+	void deallocate(pointer p, size_type n) {
+		SlabAllocator::global().deallocate(p, n * sizeof(T));
+	}
+	
+	size_type max_size() const {
+		return size_t(-1) / sizeof(T);
+	}
+	
+	void construct(pointer p, const T &value) {
+		new ((void *) p) T(value);
+	}
+	
+	void destroy(pointer p) {
+		p->~T();
+	}
+	
+	bool operator==(const SlabStlAllocator &) const {
+		return true;
+	}
+	
+	bool operator!=(const SlabStlAllocator &) const {
+		return false;
+	}
+};
+
+/**
+ * Like ptr(), but allocates the shared_ptr's reference count with the
+ * global SlabAllocator. Use this together with SlabAllocated, so that
+ * creating a shared object doesn't call malloc() at all:
+ * @code
+ *   class Foo: public SlabAllocated { ... };
+ *   shared_ptr<Foo> foo = slabPtr(new Foo());
+ * @endcode
+ *
+ * @ingroup Support
+ */
+template<typename T> shared_ptr<T>
+slabPtr(T *pointer) {
+	return shared_ptr<T>(pointer, checked_deleter<T>(), SlabStlAllocator<T>());
+}
+
+/**
+ * A function object that calls a slab-allocated function object of type
+ * <tt>F</tt>, which it shares with its copies. It consists of a single
+ * shared_ptr, so it's small enough to be stored inside a
+ * <tt>boost::function</tt> without a heap allocation, and copying it merely
+ * increments a reference count. Use it to pass function objects with a lot
+ * of state to interfaces that take a <tt>boost::function</tt>:
+ * @code
+ *   struct Foo: public SlabAllocated { ...; void operator()() { ... } };
+ *   function<void ()> callback(SlabCallback<Foo>(new Foo(...)));
+ * @endcode
+ *
+ * @ingroup Support
+ */
+template<typename F>
+class SlabCallback {
+private:
+	shared_ptr<F> target;
+
+public:
+	/**
+	 * @param target A function object which was allocated with <tt>new</tt>.
+	 *               SlabCallback takes over its ownership.
+	 */
+	explicit SlabCallback(F *target)
+		: target(slabPtr(target)) { }
+	
+	void operator()() const {
+		(*target)();
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_SLAB_ALLOCATOR_H_ */
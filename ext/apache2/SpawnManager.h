@@ -22,13 +22,18 @@
 
 #include <string>
 #include <list>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <cstdio>
 #include <cstdarg>
 #include <unistd.h>
@@ -41,6 +46,10 @@
 #include "Exceptions.h"
 #include "Logging.h"
 #include "System.h"
+#include "InstrumentedMutex.h"
+#include "Metrics.h"
+#include "CgroupManager.h"
+#include "Utils.h"
 
 namespace Passenger {
 
@@ -78,22 +87,97 @@ using namespace boost;
  *
  * See the documentation of the spawn server for full implementation details.
  *
+ * <h2>Remote mode</h2>
+ * If a list of spawn agents is passed to the constructor, then no local spawn server
+ * is started. Instead, applications are spawned by spawn agents (see
+ * <tt>bin/passenger-spawn-agent</tt>) on other hosts, in a round-robin fashion. Spawn
+ * agents speak the same protocol as the spawn server, but over TCP, and the spawned
+ * application instances listen on TCP sockets. Right after connecting, we send the
+ * agent the shared secret that it was started with; the agent refuses the connection
+ * if the secret is wrong.
+ *
+ * Because file descriptors cannot be passed over TCP, a spawn agent keeps the owner
+ * pipes of the instances that it spawned. Instead, the owner pipe of a remotely
+ * spawned Application is a local pipe, which is watched by a heartbeat thread. Once
+ * the Application object is destroyed, the heartbeat thread tells the agent to
+ * release the instance, which then exits. The heartbeat thread also pings the agents
+ * periodically; an agent that doesn't hear from us for a while shuts down all
+ * instances that it spawned for us.
+ *
+ * Each agent has its own lock, which is held while we talk to it, and all network
+ * I/O has a timeout. The SpawnManager's own lock is never held during network
+ * I/O, so a slow or unreachable agent can't hold up spawns on, or pings to, the
+ * other agents.
+ *
  * @ingroup Support
  */
 class SpawnManager {
 private:
 	static const int SPAWN_SERVER_INPUT_FD = 3;
+	/** The interval at which spawn agents are pinged, in seconds. */
+	static const int HEARTBEAT_INTERVAL = 10;
+	/** The maximum time that a spawn agent may take to answer a ping, in milliseconds. */
+	static const int HEARTBEAT_TIMEOUT = 10000;
+	static const int HEARTBEAT_THREAD_STACK_SIZE = 1024 * 64;
+	/** The maximum time that connecting to a spawn agent may take, in milliseconds. */
+	static const unsigned int AGENT_CONNECT_TIMEOUT = 5000;
+	/**
+	 * The maximum time that a spawn agent may take to answer any other message,
+	 * including the time it takes to spawn an application, in seconds.
+	 */
+	static const int AGENT_IO_TIMEOUT = 120;
+	
+	/** A spawn agent on another host. Only used in remote mode. */
+	struct Agent {
+		string address;
+		/**
+		 * Protects the other members, and is held during an exchange of
+		 * messages with the agent. Never locked while the SpawnManager's
+		 * lock is held.
+		 */
+		boost::mutex lock;
+		MessageChannel channel;
+		int fd;
+		/** Incremented every time that we (re)connect to the agent. */
+		unsigned int generation;
+	};
+	typedef shared_ptr<Agent> AgentPtr;
+	
+	/**
+	 * An application instance that was spawned by a spawn agent. <tt>ownerPipe</tt>
+	 * is the reading end of the pipe whose writing end is owned by the
+	 * corresponding Application object.
+	 */
+	struct RemoteInstance {
+		unsigned int agent;
+		unsigned int generation;
+		pid_t pid;
+		int ownerPipe;
+	};
 
 	string spawnServerCommand;
 	string logFile;
 	string rubyCommand;
 	string user;
 	
-	boost::mutex lock;
+	InstrumentedMutex lock;
 	
 	MessageChannel channel;
 	pid_t pid;
 	bool serverNeedsRestart;
+	/** The control groups to place locally spawned instances in, or NULL. */
+	CgroupManagerPtr cgroups;
+	
+	/** The spawn agents. Only used in remote mode; never changes after construction. */
+	vector<AgentPtr> agents;
+	/** The secret that the spawn agents expect. Only used in remote mode. */
+	string agentSecret;
+	/** Protected by <tt>lock</tt>, like <tt>nextAgent</tt>. */
+	list<RemoteInstance> remoteInstances;
+	unsigned int nextAgent;
+	thread *heartbeatThread;
+	condition heartbeatSleeper;
+	bool done;
 
 	/**
 	 * Restarts the spawn server.
@@ -160,11 +244,24 @@ private:
 			dup2(STDERR_FILENO, STDOUT_FILENO);
 			dup2(fds[1], SPAWN_SERVER_INPUT_FD);
 			
+			// The signal mask is inherited across exec(), and the
+			// spawn server's children rely on being able to receive signals.
+			sigset_t signals;
+			sigemptyset(&signals);
+			sigprocmask(SIG_SETMASK, &signals, NULL);
+			
 			// Close all unnecessary file descriptors
 			for (long i = sysconf(_SC_OPEN_MAX) - 1; i > SPAWN_SERVER_INPUT_FD; i--) {
 				close(i);
 			}
 			
+			// Spawned instances join their control group themselves.
+			if (cgroups != NULL) {
+				setenv("PASSENGER_CGROUP_ROOT", cgroups->getRoot().c_str(), 1);
+			} else {
+				unsetenv("PASSENGER_CGROUP_ROOT");
+			}
+			
 			if (!user.empty()) {
 				struct passwd *entry = getpwnam(user.c_str());
 				if (entry != NULL) {
@@ -224,6 +321,8 @@ private:
 			}
 			channel = MessageChannel(fds[0]);
 			serverNeedsRestart = false;
+			MetricsRegistry::global().counter("passenger_spawn_server_starts_total",
+				"Number of times the spawn server was (re)started.").increment();
 			
 			#ifdef TESTING_SPAWN_MANAGER
 				if (nextRestartShouldFail) {
@@ -235,18 +334,14 @@ private:
 	}
 	
 	/**
-	 * Send the spawn command to the spawn server.
+	 * Send the spawn command over the given channel, and read the spawned
+	 * application's information into <tt>args</tt>.
 	 *
-	 * @param appRoot The application root of the application to spawn.
-	 * @param lowerPrivilege Whether to lower the application's privileges.
-	 * @param lowestUser The user to fallback to if lowering privilege fails.
-	 * @param environment The RAILS_ENV/RACK_ENV environment that should be used.
-	 * @param spawnMethod The spawn method to use.
-	 * @param appType The application type.
-	 * @return An Application smart pointer, representing the spawned application.
 	 * @throws SpawnException Something went wrong.
 	 */
-	ApplicationPtr sendSpawnCommand(
+	static void performSpawnCommand(
+		MessageChannel &channel,
+		vector<string> &args,
 		const string &appRoot,
 		bool lowerPrivilege,
 		const string &lowestUser,
@@ -254,9 +349,6 @@ private:
 		const string &spawnMethod,
 		const string &appType
 	) {
-		vector<string> args;
-		int ownerPipe;
-		
 		try {
 			channel.write("spawn_application",
 				appRoot.c_str(),
@@ -298,6 +390,41 @@ private:
 		} catch (const SystemException &e) {
 			throw SpawnException(string("Could not read from the spawn server: ") + e.sys());
 		}
+	}
+	
+	/**
+	 * Send the spawn command to the spawn server.
+	 *
+	 * @param appRoot The application root of the application to spawn.
+	 * @param lowerPrivilege Whether to lower the application's privileges.
+	 * @param lowestUser The user to fallback to if lowering privilege fails.
+	 * @param environment The RAILS_ENV/RACK_ENV environment that should be used.
+	 * @param spawnMethod The spawn method to use.
+	 * @param appType The application type.
+	 * @return An Application smart pointer, representing the spawned application.
+	 * @throws SpawnException Something went wrong.
+	 */
+	ApplicationPtr sendSpawnCommand(
+		const string &appRoot,
+		bool lowerPrivilege,
+		const string &lowestUser,
+		const string &environment,
+		const string &spawnMethod,
+		const string &appType
+	) {
+		vector<string> args;
+		int ownerPipe;
+		
+		if (cgroups != NULL) {
+			try {
+				cgroups->prepare(appRoot);
+			} catch (const SystemException &e) {
+				P_WARN("Cannot set up the control group of " << appRoot <<
+					": " << e.what());
+			}
+		}
+		performSpawnCommand(channel, args, appRoot, lowerPrivilege, lowestUser,
+			environment, spawnMethod, appType);
 		
 		try {
 			ownerPipe = channel.readFileDescriptor();
@@ -317,9 +444,16 @@ private:
 		}
 		
 		pid_t pid = atoi(args[0]);
-		bool usingAbstractNamespace = args[2] == "true";
+		Application::SocketType socketType;
 		
-		if (!usingAbstractNamespace) {
+		if (args[2] == "abstract") {
+			socketType = Application::ABSTRACT_UNIX_SOCKET;
+		} else if (args[2] == "tcp") {
+			socketType = Application::TCP_SOCKET;
+		} else {
+			socketType = Application::UNIX_SOCKET;
+		}
+		if (socketType == Application::UNIX_SOCKET) {
 			int ret;
 			do {
 				ret = chmod(args[1].c_str(), S_IRUSR | S_IWUSR);
@@ -328,8 +462,19 @@ private:
 				ret = chown(args[1].c_str(), getuid(), getgid());
 			} while (ret == -1 && errno == EINTR);
 		}
+		if (cgroups != NULL) {
+			// The instance normally joined its group right after it was
+			// forked. This is for when it couldn't, e.g. because it had
+			// already lowered its privileges.
+			try {
+				cgroups->addProcess(appRoot, pid);
+			} catch (const SystemException &e) {
+				P_WARN("Cannot place " << appRoot << " (PID " << pid <<
+					") in its control group: " << e.what());
+			}
+		}
 		return ApplicationPtr(new Application(appRoot, pid, args[1],
-			usingAbstractNamespace, ownerPipe));
+			socketType, ownerPipe));
 	}
 	
 	/**
@@ -398,6 +543,343 @@ private:
 		}
 	}
 	
+	/**
+	 * @pre The agent's lock is held.
+	 */
+	void disconnectAgent(Agent &agent) {
+		if (agent.fd != -1) {
+			P_WARN("Lost connection with spawn agent " << agent.address);
+			try {
+				agent.channel.close();
+			} catch (const SystemException &) {
+				// Nothing we can do about it.
+			}
+			agent.fd = -1;
+		}
+	}
+	
+	/**
+	 * Tell the given spawn agent to release the instance with the given PID.
+	 *
+	 * @pre The agent's lock is held.
+	 */
+	void releaseOnAgent(Agent &agent, const string &pid) {
+		try {
+			agent.channel.write("release", pid.c_str(), NULL);
+		} catch (const SystemException &) {
+			disconnectAgent(agent);
+		}
+	}
+	
+	/**
+	 * Connect to the given spawn agent and authenticate with the agent secret.
+	 * Reads from and writes to the agent's connection time out after
+	 * AGENT_IO_TIMEOUT seconds.
+	 *
+	 * @pre The agent's lock is held.
+	 * @throws SystemException Cannot connect to the agent.
+	 * @throws IOException The agent refused the connection.
+	 */
+	void connectToAgent(Agent &agent) {
+		int fd = connectToTcpServer(agent.address, AGENT_CONNECT_TIMEOUT);
+		MessageChannel channel(fd);
+		vector<string> args;
+		struct timeval timeout;
+		
+		timeout.tv_sec = AGENT_IO_TIMEOUT;
+		timeout.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		
+		try {
+			channel.write("secret", agentSecret.c_str(), NULL);
+			if (!channel.read(args)) {
+				throw IOException("The spawn agent " + agent.address +
+					" closed the connection.");
+			}
+			if (args.size() == 2 && args[0] == "error") {
+				throw IOException("The spawn agent " + agent.address +
+					" refused the connection: " + args[1]);
+			} else if (args.size() != 1 || args[0] != "ok") {
+				throw IOException("The spawn agent " + agent.address +
+					" sent an invalid message.");
+			}
+		} catch (...) {
+			try {
+				channel.close();
+			} catch (const SystemException &) {
+				// Nothing we can do about it.
+			}
+			throw;
+		}
+		agent.channel = channel;
+		agent.fd = fd;
+		agent.generation++;
+		P_DEBUG("Connected to spawn agent " << agent.address);
+	}
+	
+	/**
+	 * Spawn an application instance on the first spawn agent that's able to do so,
+	 * starting with the agent after the one that the previous spawn started with,
+	 * so that concurrent spawns are spread over the agents.
+	 *
+	 * @pre The SpawnManager's lock is not held.
+	 * @throws SpawnException Something went wrong.
+	 */
+	ApplicationPtr spawnOnAgent(
+		const string &appRoot,
+		bool lowerPrivilege,
+		const string &lowestUser,
+		const string &environment,
+		const string &spawnMethod,
+		const string &appType
+	) {
+		string lastError;
+		unsigned int firstAgent;
+		
+		{
+			InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+			firstAgent = nextAgent;
+			nextAgent = (nextAgent + 1) % agents.size();
+		}
+		for (unsigned int i = 0; i < agents.size(); i++) {
+			unsigned int index = (firstAgent + i) % agents.size();
+			Agent &agent(*agents[index]);
+			boost::mutex::scoped_lock al(agent.lock);
+			vector<string> args;
+			
+			try {
+				if (agent.fd == -1) {
+					connectToAgent(agent);
+				}
+				performSpawnCommand(agent.channel, args, appRoot, lowerPrivilege,
+					lowestUser, environment, spawnMethod, appType);
+			} catch (const SpawnException &e) {
+				if (e.hasErrorPage()) {
+					// The agent is fine, but the application isn't.
+					throw;
+				}
+				disconnectAgent(agent);
+				lastError = e.what();
+				continue;
+			} catch (const IOException &e) {
+				lastError = e.what();
+				continue;
+			} catch (const SystemException &e) {
+				lastError = e.what();
+				continue;
+			}
+			
+			if (args.size() != 3) {
+				disconnectAgent(agent);
+				lastError = "The spawn agent " + agent.address +
+					" sent an invalid message.";
+				continue;
+			}
+			if (args[2] != "tcp") {
+				// The agent is fine, but we can't reach the instance. Only
+				// release it: closing the connection would make the agent
+				// shut down all other instances that it spawned for us.
+				releaseOnAgent(agent, args[0]);
+				throw SpawnException("The spawn agent " + agent.address +
+					" spawned the application on a '" + args[2] + "' socket, "
+					"which cannot be reached from other hosts.");
+			}
+			
+			int fds[2];
+			if (InterruptableCalls::pipe(fds) == -1) {
+				int e = errno;
+				releaseOnAgent(agent, args[0]);
+				throw SpawnException(string("Cannot create a pipe: ") + strerror(e));
+			}
+			RemoteInstance instance;
+			instance.agent = index;
+			instance.generation = agent.generation;
+			instance.pid = atoi(args[0]);
+			instance.ownerPipe = fds[0];
+			{
+				InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+				remoteInstances.push_back(instance);
+			}
+			return ApplicationPtr(new Application(appRoot, instance.pid, args[1],
+				Application::TCP_SOCKET, fds[1]));
+		}
+		throw SpawnException("Could not spawn the application on any spawn agent: " +
+			lastError);
+	}
+	
+	/**
+	 * Move the instances whose Application objects have been destroyed
+	 * from <tt>remoteInstances</tt> to <tt>destroyed</tt>.
+	 *
+	 * @pre The lock is held.
+	 */
+	void collectDestroyedInstances(list<RemoteInstance> &destroyed) {
+		vector<struct pollfd> fds;
+		list<RemoteInstance>::iterator it;
+		unsigned int i;
+		
+		if (remoteInstances.empty()) {
+			return;
+		}
+		for (it = remoteInstances.begin(); it != remoteInstances.end(); it++) {
+			struct pollfd fd;
+			fd.fd = it->ownerPipe;
+			fd.events = POLLIN;
+			fd.revents = 0;
+			fds.push_back(fd);
+		}
+		if (InterruptableCalls::poll(&fds[0], fds.size(), 0) <= 0) {
+			return;
+		}
+		
+		it = remoteInstances.begin();
+		for (i = 0; i < fds.size(); i++) {
+			if (fds[i].revents == 0) {
+				it++;
+				continue;
+			}
+			InterruptableCalls::close(it->ownerPipe);
+			destroyed.push_back(*it);
+			it = remoteInstances.erase(it);
+		}
+	}
+	
+	/**
+	 * Tell the spawn agents to release the given instances. Instances whose
+	 * agent is busy, e.g. because it's spawning an application for us, are
+	 * left in the list, to be released later.
+	 *
+	 * @pre The lock is not held.
+	 */
+	void releaseInstances(list<RemoteInstance> &instances) {
+		list<RemoteInstance>::iterator it(instances.begin());
+		
+		while (it != instances.end()) {
+			Agent &agent(*agents[it->agent]);
+			boost::mutex::scoped_lock al(agent.lock, boost::try_to_lock);
+			if (!al.owns_lock()) {
+				it++;
+				continue;
+			}
+			if (agent.fd != -1 && agent.generation == it->generation) {
+				releaseOnAgent(agent, toString(it->pid));
+			}
+			it = instances.erase(it);
+		}
+	}
+	
+	/**
+	 * Ping all connected spawn agents, and wait for their answers at the
+	 * same time. Agents that don't answer within HEARTBEAT_TIMEOUT are
+	 * disconnected. Agents that are busy talking to us aren't pinged:
+	 * they know that we're alive.
+	 *
+	 * @pre The lock is not held.
+	 */
+	void pingAgents() {
+		vector<Agent *> pinged;
+		vector<struct pollfd> fds;
+		vector<AgentPtr>::iterator it;
+		unsigned int i, remaining;
+		
+		for (it = agents.begin(); it != agents.end(); it++) {
+			Agent &agent(**it);
+			struct pollfd fd;
+			
+			if (!agent.lock.try_lock()) {
+				continue;
+			}
+			if (agent.fd == -1) {
+				agent.lock.unlock();
+				continue;
+			}
+			try {
+				agent.channel.write("ping", NULL);
+			} catch (const SystemException &) {
+				disconnectAgent(agent);
+				agent.lock.unlock();
+				continue;
+			}
+			fd.fd = agent.fd;
+			fd.events = POLLIN;
+			fd.revents = 0;
+			fds.push_back(fd);
+			pinged.push_back(&agent);
+		}
+		
+		// Each agent is unlocked as soon as it has answered.
+		posix_time::ptime deadline(get_system_time() +
+			posix_time::milliseconds(HEARTBEAT_TIMEOUT));
+		remaining = pinged.size();
+		while (remaining > 0) {
+			posix_time::time_duration timeLeft(deadline - get_system_time());
+			if (timeLeft.is_negative()
+			 || InterruptableCalls::poll(&fds[0], fds.size(),
+			                             timeLeft.total_milliseconds()) <= 0) {
+				break;
+			}
+			for (i = 0; i < fds.size(); i++) {
+				if (fds[i].fd == -1 || fds[i].revents == 0) {
+					continue;
+				}
+				
+				Agent &agent(*pinged[i]);
+				vector<string> args;
+				try {
+					if (!agent.channel.read(args)
+					 || args.size() != 1 || args[0] != "pong") {
+						disconnectAgent(agent);
+					}
+				} catch (const SystemException &) {
+					disconnectAgent(agent);
+				}
+				agent.lock.unlock();
+				fds[i].fd = -1;
+				fds[i].revents = 0;
+				remaining--;
+			}
+		}
+		for (i = 0; i < fds.size(); i++) {
+			if (fds[i].fd != -1) {
+				disconnectAgent(*pinged[i]);
+				pinged[i]->lock.unlock();
+			}
+		}
+	}
+	
+	void heartbeatThreadMain() {
+		this_thread::disable_syscall_interruption dsi;
+		// Destroyed instances that haven't been released yet.
+		list<RemoteInstance> destroyed;
+		time_t lastPing = InterruptableCalls::time(NULL);
+		try {
+			while (true) {
+				{
+					InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+					if (!done) {
+						xtime xt;
+						xtime_get(&xt, TIME_UTC);
+						xt.sec += 1;
+						heartbeatSleeper.timed_wait(l, xt);
+					}
+					if (done) {
+						break;
+					}
+					collectDestroyedInstances(destroyed);
+				}
+				
+				releaseInstances(destroyed);
+				if (InterruptableCalls::time(NULL) - lastPing >= HEARTBEAT_INTERVAL) {
+					pingAgents();
+					lastPing = InterruptableCalls::time(NULL);
+				}
+			}
+		} catch (const exception &e) {
+			P_ERROR("Uncaught exception in the spawn agent heartbeat thread: " << e.what());
+		}
+	}
+	
 	IOException prependMessageToException(const IOException &e, const string &message) {
 		return IOException(message + ": " + e.what());
 	}
@@ -427,21 +909,50 @@ public:
 	 *             running as root. If the empty string is given, or if
 	 *             the <tt>user</tt> is not a valid username, then
 	 *             the spawn manager will be run as the current user.
+	 * @param agentAddresses The addresses ("host:port") of the spawn agents to use.
+	 *             If not empty, then the SpawnManager runs in remote mode, and
+	 *             all other parameters are ignored. See the class description.
+	 * @param agentSecret The shared secret that the spawn agents were started with.
 	 * @throws SystemException An error occured while trying to setup the spawn server.
 	 * @throws IOException The specified log file could not be opened.
 	 */
 	SpawnManager(const string &spawnServerCommand,
 	             const string &logFile = "",
 	             const string &rubyCommand = "ruby",
-	             const string &user = "") {
+	             const string &user = "",
+	             const vector<string> &agentAddresses = vector<string>(),
+	             const string &agentSecret = "")
+	        : lock("SpawnManager")
+	{
 		this->spawnServerCommand = spawnServerCommand;
 		this->logFile = logFile;
 		this->rubyCommand = rubyCommand;
 		this->user = user;
+		this->agentSecret = agentSecret;
 		pid = 0;
+		nextAgent = 0;
+		heartbeatThread = NULL;
+		done = false;
 		#ifdef TESTING_SPAWN_MANAGER
 			nextRestartShouldFail = false;
 		#endif
+		
+		if (!agentAddresses.empty()) {
+			vector<string>::const_iterator it;
+			for (it = agentAddresses.begin(); it != agentAddresses.end(); it++) {
+				AgentPtr agent(new Agent());
+				agent->address = *it;
+				agent->fd = -1;
+				agent->generation = 0;
+				agents.push_back(agent);
+			}
+			heartbeatThread = new thread(
+				boost::bind(&SpawnManager::heartbeatThreadMain, this),
+				HEARTBEAT_THREAD_STACK_SIZE
+			);
+			return;
+		}
+		
 		this_thread::disable_interruption di;
 		this_thread::disable_syscall_interruption dsi;
 		try {
@@ -454,6 +965,32 @@ public:
 	}
 	
 	~SpawnManager() throw() {
+		if (heartbeatThread != NULL) {
+			this_thread::disable_interruption di;
+			this_thread::disable_syscall_interruption dsi;
+			{
+				InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+				done = true;
+				heartbeatSleeper.notify_one();
+			}
+			heartbeatThread->join();
+			delete heartbeatThread;
+			
+			list<RemoteInstance>::iterator it;
+			for (it = remoteInstances.begin(); it != remoteInstances.end(); it++) {
+				InterruptableCalls::close(it->ownerPipe);
+			}
+			vector<AgentPtr>::iterator ait;
+			for (ait = agents.begin(); ait != agents.end(); ait++) {
+				if ((*ait)->fd != -1) {
+					try {
+						(*ait)->channel.close();
+					} catch (const SystemException &) {
+						// Ignore.
+					}
+				}
+			}
+		}
 		if (pid != 0) {
 			this_thread::disable_interruption di;
 			this_thread::disable_syscall_interruption dsi;
@@ -514,7 +1051,12 @@ public:
 		const string &spawnMethod = "smart",
 		const string &appType = "rails"
 	) {
-		boost::mutex::scoped_lock l(lock);
+		if (!agents.empty()) {
+			this_thread::disable_syscall_interruption dsi;
+			return spawnOnAgent(appRoot, lowerPrivilege, lowestUser,
+				environment, spawnMethod, appType);
+		}
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
 		try {
 			return sendSpawnCommand(appRoot, lowerPrivilege, lowestUser,
 				environment, spawnMethod, appType);
@@ -546,6 +1088,21 @@ public:
 	void reload(const string &appRoot) {
 		this_thread::disable_interruption di;
 		this_thread::disable_syscall_interruption dsi;
+		if (!agents.empty()) {
+			vector<AgentPtr>::iterator it;
+			for (it = agents.begin(); it != agents.end(); it++) {
+				Agent &agent(**it);
+				boost::mutex::scoped_lock al(agent.lock);
+				if (agent.fd != -1) {
+					try {
+						agent.channel.write("reload", appRoot.c_str(), NULL);
+					} catch (const SystemException &) {
+						disconnectAgent(agent);
+					}
+				}
+			}
+			return;
+		}
 		try {
 			return sendReloadCommand(appRoot);
 		} catch (const SystemException &e) {
@@ -554,8 +1111,33 @@ public:
 	}
 	
 	/**
-	 * Get the Process ID of the spawn server. This method is used in the unit tests
-	 * and should not be used directly.
+	 * Place the instances that are spawned from now on in per-application
+	 * control groups, or stop doing so if <tt>cgroups</tt> is NULL. Instances
+	 * that are spawned by spawn agents aren't placed, because they run on
+	 * other hosts.
+	 *
+	 * The spawn server is restarted if the root group changes, because it's
+	 * told the root group when it's started. Call this before spawning
+	 * anything, so that no spawned code is thrown away.
+	 *
+	 * @throws SystemException The spawn server could not be restarted.
+	 * @throws IOException The spawn server could not be restarted.
+	 */
+	void setCgroups(const CgroupManagerPtr &cgroups) {
+		this_thread::disable_syscall_interruption dsi;
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		string oldRoot((this->cgroups == NULL) ? "" : this->cgroups->getRoot());
+		string newRoot((cgroups == NULL) ? "" : cgroups->getRoot());
+		
+		this->cgroups = cgroups;
+		if (pid != 0 && oldRoot != newRoot) {
+			restartServer();
+		}
+	}
+	
+	/**
+	 * Get the Process ID of the spawn server, or 0 in remote mode. This method is
+	 * used in the unit tests and should not be used directly.
 	 */
 	pid_t getServerPid() const {
 		return pid;
@@ -31,6 +31,10 @@
 #include <sstream>
 #include <map>
 #include <list>
+#include <deque>
+#include <set>
+#include <vector>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -45,6 +49,16 @@
 #include "ApplicationPool.h"
 #include "Logging.h"
 #include "System.h"
+#include "InstrumentedMutex.h"
+#include "Metrics.h"
+#include "FlightRecorder.h"
+#include "SlabAllocator.h"
+#include "HashRing.h"
+#include "NumaTopology.h"
+#include "CgroupManager.h"
+#include "SharedInstanceTable.h"
+#include "MessageChannel.h"
+#include "Utils.h"
 #ifdef PASSENGER_USE_DUMMY_SPAWN_MANAGER
 	#include "DummySpawnManager.h"
 #else
@@ -94,17 +108,64 @@ private:
 	static const int DEFAULT_MAX_IDLE_TIME = 120;
 	static const int DEFAULT_MAX_POOL_SIZE = 20;
 	static const int DEFAULT_MAX_INSTANCES_PER_APP = 0;
+	static const unsigned int DEFAULT_MAX_REQUEST_QUEUE_SIZE = 100;
+	/**
+	 * The number of seconds after which a request that waits in line ranks
+	 * like a newly arrived request of the next higher priority class, so
+	 * that low priority requests aren't starved.
+	 */
+	static const unsigned int PRIORITY_AGING_TIME = 10;
 	static const int CLEANER_THREAD_STACK_SIZE = 1024 * 128;
+	static const int REPLENISHER_THREAD_STACK_SIZE = 1024 * 128;
+	static const unsigned int ASYNC_GET_THREADS = 8;
+	static const int ASYNC_GET_THREAD_STACK_SIZE = 1024 * 128;
 	static const unsigned int MAX_GET_ATTEMPTS = 10;
 	static const unsigned int GET_TIMEOUT = 5000; // In milliseconds.
+	/**
+	 * How often the cleaner thread looks for reservations in the shared
+	 * instance table that were left behind by crashed worker processes,
+	 * in seconds.
+	 */
+	static const unsigned int RECLAIM_INTERVAL = 10;
+	/**
+	 * How often a request that waits in line checks whether an instance
+	 * has become idle, in milliseconds, if the shared instance table is
+	 * used: worker processes don't wake up waiting requests when they
+	 * release an instance.
+	 */
+	static const unsigned int SHARED_TABLE_POLL_INTERVAL = 100;
+	/**
+	 * How often the cleaner thread checks the queue time of getAsync()
+	 * calls that wait in line, in milliseconds.
+	 */
+	static const unsigned int ASYNC_GET_CHECK_INTERVAL = 1000;
+	/**
+	 * For how long a remote instance or cluster node is skipped after a
+	 * failed connection attempt, in seconds. The time doubles with every
+	 * consecutive failure, up to MAX_RETRY_BACKOFF.
+	 */
+	static const unsigned int RETRY_BACKOFF = 2;
+	static const unsigned int MAX_RETRY_BACKOFF = 60;
+	/**
+	 * How often the cleaner thread reads the statistics of the applications'
+	 * control groups, in seconds.
+	 */
+	static const unsigned int CGROUP_STATS_INTERVAL = 2;
+	/** The maximum time that connecting to another cluster node may take, in milliseconds. */
+	static const unsigned int CLUSTER_CONNECT_TIMEOUT = 5000;
 
 	friend class ApplicationPoolServer;
 	struct AppContainer;
+	struct WaitingRequest;
 	
 	typedef shared_ptr<AppContainer> AppContainerPtr;
-	typedef list<AppContainerPtr> AppContainerList;
+	/* List nodes are created and destroyed on every get(), as containers
+	 * move in and out of inactiveApps. */
+	typedef list< AppContainerPtr, SlabStlAllocator<AppContainerPtr> > AppContainerList;
 	typedef shared_ptr<AppContainerList> AppContainerListPtr;
 	typedef map<string, AppContainerListPtr> ApplicationMap;
+	/* Requests with the same rank stay in order of arrival. */
+	typedef multimap<posix_time::ptime, WaitingRequest *> WaitQueue;
 	
 	struct AppContainer {
 		ApplicationPtr app;
@@ -112,11 +173,167 @@ private:
 		unsigned int sessions;
 		AppContainerList::iterator iterator;
 		AppContainerList::iterator ia_iterator;
+		/** The index of the NUMA node that the instance is pinned to, or -1. */
+		int numaNode;
+		/**
+		 * The table in which the instance is published, and its entry in it.
+		 * The entry is retired when the container is destroyed.
+		 */
+		SharedInstanceTablePtr sharedTable;
+		SharedInstanceTable::Handle sharedHandle;
+		
+		~AppContainer() {
+			if (sharedTable != NULL) {
+				sharedTable->retire(sharedHandle);
+			}
+		}
+		
+		void acquireShared() {
+			if (sharedTable != NULL) {
+				sharedTable->acquire(sharedHandle);
+			}
+		}
+		
+		void releaseShared() {
+			if (sharedTable != NULL) {
+				sharedTable->release(sharedHandle);
+			}
+		}
+		
+		/**
+		 * Release the reservation of a worker process that exited without
+		 * releasing it. Returns whether there was such a reservation.
+		 *
+		 * @pre The pool lock is held.
+		 */
+		bool reclaimShared() {
+			return sharedTable != NULL && sharedTable->reclaim(sharedHandle, sessions);
+		}
+		
+		/**
+		 * The number of sessions, including the ones that Apache worker
+		 * processes opened through the shared instance table.
+		 */
+		unsigned int totalSessions() const {
+			if (sharedTable != NULL) {
+				return std::max(sessions, sharedTable->getSessions(sharedHandle));
+			} else {
+				return sessions;
+			}
+		}
+		
+		/**
+		 * When a session was last closed, including the ones that Apache
+		 * worker processes opened through the shared instance table.
+		 */
+		time_t totalLastUsed() const {
+			if (sharedTable != NULL) {
+				return std::max(lastUsed, sharedTable->getLastUsed(sharedHandle));
+			} else {
+				return lastUsed;
+			}
+		}
+	};
+	
+	/**
+	 * Keeps track of whether a host that we connect to over the network is
+	 * down, so that requests don't each have to wait for a connection
+	 * attempt to time out. A host is down for a while after a failed
+	 * connection attempt; once that time has passed, a single request is
+	 * let through to find out whether it's back up.
+	 */
+	struct Liveness {
+		unsigned int failures;
+		time_t downUntil;
+		
+		Liveness() {
+			failures = 0;
+			downUntil = 0;
+		}
+		
+		/** The number of seconds that the host is down for after the last failure. */
+		unsigned int backoff() const {
+			unsigned int result = RETRY_BACKOFF;
+			for (unsigned int i = 1; i < failures && result < MAX_RETRY_BACKOFF; i++) {
+				result *= 2;
+			}
+			if (result > MAX_RETRY_BACKOFF) {
+				result = MAX_RETRY_BACKOFF;
+			}
+			return result;
+		}
+		
+		bool isDown(time_t now) const {
+			return failures > 0 && now < downUntil;
+		}
+		
+		/**
+		 * Returns whether a connection attempt may be made now. If the
+		 * host was down, then the caller makes the only attempt until
+		 * it reports back with failed() or succeeded().
+		 */
+		bool mayTry(time_t now) {
+			if (isDown(now)) {
+				return false;
+			} else {
+				if (failures > 0) {
+					downUntil = now + backoff();
+				}
+				return true;
+			}
+		}
+		
+		void failed(time_t now) {
+			failures++;
+			downUntil = now + backoff();
+		}
+		
+		void succeeded() {
+			failures = 0;
+			downUntil = 0;
+		}
+	};
+	
+	/**
+	 * An application instance that listens on a TCP socket, usually on
+	 * another host. Its life time is not managed by this pool, so it
+	 * doesn't count towards <tt>max</tt> and is never cleaned or evicted.
+	 */
+	struct RemoteInstance {
+		ApplicationPtr app;
+		unsigned int sessions;
+		Liveness liveness;
+	};
+	
+	typedef shared_ptr<RemoteInstance> RemoteInstancePtr;
+	typedef list<RemoteInstancePtr> RemoteInstanceList;
+	typedef map<string, RemoteInstanceList> RemoteInstanceMap;
+	
+	/** Time spent in the different phases of get(), for request tracing. */
+	struct GetTimings {
+		posix_time::time_duration lockWait;
+		posix_time::time_duration capacityWait;
+		posix_time::time_duration spawn;
+	};
+	
+	/** An application's share of the pool. See setAppShare(). */
+	struct AppShare {
+		unsigned int minInstances;
+		unsigned int weight;
+		
+		AppShare() {
+			minInstances = 0;
+			weight = 1;
+		}
 	};
 	
 	struct SharedData {
-		boost::mutex lock;
-		condition activeOrMaxChanged;
+		InstrumentedMutex lock;
+		/**
+		 * The pool that owns this data, or NULL if it has been destroyed.
+		 * Sessions may outlive the pool.
+		 */
+		StandardApplicationPool *pool;
 		
 		ApplicationMap apps;
 		unsigned int max;
@@ -126,11 +343,23 @@ private:
 		AppContainerList inactiveApps;
 		map<string, time_t> restartFileTimes;
 		map<string, unsigned int> appInstanceCount;
+		RemoteInstanceMap remoteInstances;
+		/** Cached references into the metrics registry, to save lookups in get(). */
+		map<string, LatencyHistogram *> getDurationHistograms;
+		
+		SharedData(): lock("StandardApplicationPool") {
+			pool = NULL;
+		}
 	};
 	
 	typedef shared_ptr<SharedData> SharedDataPtr;
 	
-	struct SessionCloseCallback {
+	/**
+	 * Called when a session is closed. Passed to Application::connect()
+	 * wrapped in a SlabCallback, so that opening a session doesn't allocate
+	 * anything with malloc().
+	 */
+	struct SessionCloseCallback: public SlabAllocated {
 		SharedDataPtr data;
 		weak_ptr<AppContainer> container;
 		
@@ -141,7 +370,7 @@ private:
 		}
 		
 		void operator()() {
-			boost::mutex::scoped_lock l(data->lock);
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
 			AppContainerPtr container(this->container.lock());
 			
 			if (container == NULL) {
@@ -151,23 +380,43 @@ private:
 			ApplicationMap::iterator it;
 			it = data->apps.find(container->app->getAppRoot());
 			if (it != data->apps.end()) {
-				AppContainerListPtr list(it->second);
+				AppContainerList &list(*it->second);
 				container->lastUsed = time(NULL);
 				container->sessions--;
+				container->releaseShared();
 				if (container->sessions == 0) {
-					list->erase(container->iterator);
-					list->push_front(container);
-					container->iterator = list->begin();
+					list.splice(list.begin(), list, container->iterator);
 					data->inactiveApps.push_back(container);
 					container->ia_iterator = data->inactiveApps.end();
 					container->ia_iterator--;
 					data->active--;
-					data->activeOrMaxChanged.notify_all();
+					if (data->pool != NULL) {
+						data->pool->wakeUpNextWaiter();
+					}
 				}
 			}
 		}
 	};
 
+	struct RemoteSessionCloseCallback: public SlabAllocated {
+		SharedDataPtr data;
+		weak_ptr<RemoteInstance> instance;
+		
+		RemoteSessionCloseCallback(SharedDataPtr data,
+		                           const weak_ptr<RemoteInstance> &instance) {
+			this->data = data;
+			this->instance = instance;
+		}
+		
+		void operator()() {
+			InstrumentedMutex::scoped_lock l(data->lock, P_LOCK_SITE);
+			RemoteInstancePtr instance(this->instance.lock());
+			if (instance != NULL) {
+				instance->sessions--;
+			}
+		}
+	};
+
 	#ifdef PASSENGER_USE_DUMMY_SPAWN_MANAGER
 		DummySpawnManager spawnManager;
 	#else
@@ -180,9 +429,99 @@ private:
 	unsigned int maxIdleTime;
 	condition cleanerThreadSleeper;
 	
+	/* Admission control settings. 0 means no limit. */
+	unsigned int maxRequestQueueSize;
+	unsigned int maxTotalQueuedRequests;
+	unsigned int maxRequestQueueTime;
+	/** The number of requests that are waiting in line for an instance. */
+	unsigned int waitingRequests;
+	/** The same, per application. Applications without waiting requests aren't in this map. */
+	map<string, unsigned int> appWaitingRequests;
+	/** The number of waiting requests whose callers already hold sessions. */
+	unsigned int waitingHolders;
+	/** The number of getAsync() calls that are waiting in line. */
+	unsigned int waitingAsyncGets;
+	/** The requests that are waiting in line, by rank (see WaitingRequest::rank). */
+	WaitQueue waitQueue;
+	/** Applications without an entry here have the default AppShare. */
+	map<string, AppShare> appShares;
+	unsigned int metricsCollectorId;
+	
+	/**
+	 * The replenisher thread makes spare connections to application
+	 * instances (see Application::replenishSpareConnections()), so that
+	 * get() doesn't have to connect. It doesn't use the pool lock: connecting
+	 * may block for a while.
+	 */
+	thread *replenisherThread;
+	boost::mutex replenishLock;
+	condition replenishNeeded;
+	/** Applications that need spare connections. Protected by replenishLock. */
+	vector< weak_ptr<Application> > replenishQueue;
+	/** Protected by replenishLock. */
+	bool replenisherDone;
+	
+	/** A getAsync() call that couldn't be served right away. */
+	struct AsyncGetRequest {
+		string appRoot;
+		bool lowerPrivilege;
+		string lowestUser;
+		string environment;
+		string spawnMethod;
+		string appType;
+		string traceId;
+		Priority priority;
+		SettablePendingGetPtr result;
+		posix_time::ptime begin;
+		/**
+		 * The call's place in line, or NULL if it isn't waiting in line.
+		 * Protected by the pool lock.
+		 */
+		WaitingRequest *waitingRequest;
+	};
+	
+	typedef shared_ptr<AsyncGetRequest> AsyncGetRequestPtr;
+	
+	/**
+	 * The threads that serve getAsync() calls which couldn't be served
+	 * right away. They're created on demand. They don't wait in line: a
+	 * call that has to is put in line without a thread, and is handed to
+	 * these threads once it's first in line. Everything here is protected
+	 * by asyncGetLock, which may be locked while the pool lock is held,
+	 * but not the other way around.
+	 */
+	boost::mutex asyncGetLock;
+	condition asyncGetQueued;
+	deque<AsyncGetRequestPtr> asyncGetQueue;
+	vector<thread *> asyncGetThreads;
+	unsigned int idleAsyncGetThreads;
+	bool asyncGetDone;
+	HashRing cluster;
+	string clusterSelf;
+	/** The applications that are shared among the cluster nodes. */
+	set<string> clusterApps;
+	string clusterSecret;
+	unsigned int clusterReplicas;
+	volatile unsigned int nextClusterOwner;
+	/** Protects clusterNodeLiveness. */
+	mutable boost::mutex clusterLock;
+	/** Whether the other cluster nodes are down, by cluster address. */
+	map<string, Liveness> clusterNodeLiveness;
+	NumaTopology numaTopology;
+	CgroupManagerPtr cgroups;
+	/**
+	 * The statistics of the applications' control groups, as read by the
+	 * cleaner thread, so that get() doesn't read files under the lock.
+	 * Protected by the pool lock.
+	 */
+	map<string, CgroupManager::Stats> cgroupStats;
+	SharedInstanceTablePtr sharedTable;
+	/** The table's statistics as of the last collectMetrics() call. */
+	unsigned long long reportedSharedReservations;
+	unsigned long long reportedSharedMisses;
+	
 	// Shortcuts for instance variables in SharedData. Saves typing in get().
-	boost::mutex &lock;
-	condition &activeOrMaxChanged;
+	InstrumentedMutex &lock;
 	ApplicationMap &apps;
 	unsigned int &max;
 	unsigned int &count;
@@ -191,6 +530,7 @@ private:
 	AppContainerList &inactiveApps;
 	map<string, time_t> &restartFileTimes;
 	map<string, unsigned int> &appInstanceCount;
+	RemoteInstanceMap &remoteInstances;
 	
 	/**
 	 * Verify that all the invariants are correct.
@@ -225,9 +565,7 @@ private:
 		return true;
 	}
 	
-	template<typename LockActionType>
-	string toString(LockActionType lockAction) const {
-		unique_lock<boost::mutex> l(lock, lockAction);
+	string toStringWithoutLock() const {
 		stringstream result;
 		
 		result << "----------- General information -----------" << endl;
@@ -244,6 +582,22 @@ private:
 			AppContainerList::const_iterator lit;
 			
 			result << it->first << ": " << endl;
+			map<string, AppShare>::const_iterator sit(appShares.find(it->first));
+			if (sit != appShares.end()) {
+				result << "  Minimum: " << sit->second.minInstances <<
+					"  Weight: " << sit->second.weight << endl;
+			}
+			map<string, CgroupManager::Stats>::const_iterator cit(cgroupStats.find(it->first));
+			if (cit != cgroupStats.end()) {
+				const CgroupManager::Stats &stats(cit->second);
+				result << "  Memory: " << stats.memoryCurrent / 1024 / 1024 << " MB";
+				if (stats.memoryMax != 0) {
+					result << " / " << stats.memoryMax / 1024 / 1024 << " MB";
+				}
+				result << "  CPU: " << stats.cpuUsage / 1000000 << " s";
+				result << "  Throttled: " << stats.cpuThrottled / 1000000 << " s";
+				result << "  OOM kills: " << stats.oomKills << endl;
+			}
 			for (lit = list->begin(); lit != list->end(); lit++) {
 				AppContainer *container = lit->get();
 				char buf[128];
@@ -251,256 +605,1566 @@ private:
 				snprintf(buf, sizeof(buf),
 						"PID: %-8lu  Sessions: %d",
 						(unsigned long) container->app->getPid(),
-						container->sessions);
-				result << "  " << buf << endl;
+						container->totalSessions());
+				result << "  " << buf;
+				if (container->numaNode != -1) {
+					result << "  NUMA node: " <<
+						numaTopology.getNode(container->numaNode).id;
+				}
+				result << endl;
+			}
+			result << endl;
+		}
+		
+		if (!remoteInstances.empty()) {
+			result << "----------- Remote instances -----------" << endl;
+			RemoteInstanceMap::const_iterator rit;
+			for (rit = remoteInstances.begin(); rit != remoteInstances.end(); rit++) {
+				RemoteInstanceList::const_iterator lit;
+				
+				result << rit->first << ": " << endl;
+				for (lit = rit->second.begin(); lit != rit->second.end(); lit++) {
+					char buf[128];
+					
+					snprintf(buf, sizeof(buf), "Address: %-24s  Sessions: %d%s",
+						(*lit)->app->getListenSocketName().c_str(),
+						(*lit)->sessions,
+						(*lit)->liveness.isDown(time(NULL)) ? "  (down)" : "");
+					result << "  " << buf << endl;
+				}
+				result << endl;
+			}
+		}
+		
+		if (!cluster.empty()) {
+			result << "----------- Cluster -----------" << endl;
+			result << "self     = " << clusterSelf << endl;
+			result << "replicas = " << clusterReplicas << endl;
+			vector<string>::const_iterator nit;
+			boost::mutex::scoped_lock cl(clusterLock);
+			for (nit = cluster.getNodes().begin(); nit != cluster.getNodes().end(); nit++) {
+				map<string, Liveness>::const_iterator lit(clusterNodeLiveness.find(*nit));
+				result << "  " << *nit;
+				if (lit != clusterNodeLiveness.end() && lit->second.isDown(time(NULL))) {
+					result << "  (down)";
+				}
+				result << endl;
 			}
 			result << endl;
 		}
 		return result.str();
 	}
 	
-	bool needsRestart(const string &appRoot) {
-		string restartFile(appRoot);
-		restartFile.append("/tmp/restart.txt");
+	/**
+	 * Registers a request as waiting in line for an idle instance or for
+	 * room in the pool, for as long as this object is alive.
+	 *
+	 * @pre The pool lock is held during construction and destruction.
+	 */
+	struct WaitingRequest {
+		StandardApplicationPool &pool;
+		/** Points to the application's entry in appWaitingRequests. */
+		map<string, unsigned int>::iterator it;
+		WaitQueue::iterator queueIterator;
+		/**
+		 * The request's place in line: its arrival time, moved forward by
+		 * PRIORITY_AGING_TIME seconds for every priority class.
+		 */
+		posix_time::ptime rank;
+		/** The number of sessions that the caller already holds. See getMultiple(). */
+		unsigned int ownSessions;
+		/** Notified by wakeUpNextWaiter() when this request is first in line. */
+		condition wakeup;
+		/**
+		 * The getAsync() call that this request was made for, if any. No
+		 * thread waits for such a request.
+		 */
+		AsyncGetRequestPtr async;
+		/** Whether the getAsync() call has been handed to an async get thread. */
+		bool dispatched;
 		
-		struct stat buf;
-		bool result;
-		int ret;
+		WaitingRequest(StandardApplicationPool &pool, const string &appRoot,
+		               Priority priority, const posix_time::ptime &arrival,
+		               unsigned int ownSessions)
+			: pool(pool)
+		{
+			rank = arrival - posix_time::seconds(PRIORITY_AGING_TIME * priority);
+			this->ownSessions = ownSessions;
+			dispatched = false;
+			if (ownSessions > 0) {
+				pool.waitingHolders++;
+			}
+			it = pool.appWaitingRequests.insert(make_pair(appRoot, 0u)).first;
+			it->second++;
+			pool.waitingRequests++;
+			queueIterator = pool.waitQueue.insert(make_pair(rank, this));
+		}
 		
-		do {
-			ret = stat(restartFile.c_str(), &buf);
-		} while (ret == -1 && errno == EINTR);
-		if (ret == 0) {
-			do {
-				ret = unlink(restartFile.c_str());
-			} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
-			if (ret == 0 || errno == ENOENT) {
-				restartFileTimes.erase(appRoot);
-				result = true;
-			} else {
-				map<string, time_t>::const_iterator it;
-				
-				it = restartFileTimes.find(appRoot);
-				if (it == restartFileTimes.end()) {
-					result = true;
-				} else {
-					result = buf.st_mtime != restartFileTimes[appRoot];
-				}
-				restartFileTimes[appRoot] = buf.st_mtime;
+		~WaitingRequest() {
+			bool wasFirst = queueIterator == pool.waitQueue.begin();
+			pool.waitQueue.erase(queueIterator);
+			pool.waitingRequests--;
+			if (ownSessions > 0) {
+				pool.waitingHolders--;
+			}
+			it->second--;
+			if (it->second == 0) {
+				pool.appWaitingRequests.erase(it);
+			}
+			// The next request in line may now proceed.
+			pool.wakeUpNextWaiter();
+			if (wasFirst && pool.sharedTable != NULL && !pool.waitQueue.empty()) {
+				// Let the new first request take over polling the table.
+				pool.waitQueue.begin()->second->wakeup.notify_one();
 			}
-		} else {
-			restartFileTimes.erase(appRoot);
-			result = false;
 		}
-		return result;
-	}
+		
+		const string &getAppRoot() const {
+			return it->first;
+		}
+	};
 	
-	void cleanerThreadMainLoop() {
-		this_thread::disable_syscall_interruption dsi;
-		unique_lock<boost::mutex> l(lock);
-		try {
-			while (!done && !this_thread::interruption_requested()) {
-				xtime xt;
-				xtime_get(&xt, TIME_UTC);
-				xt.sec += maxIdleTime + 1;
-				if (cleanerThreadSleeper.timed_wait(l, xt)) {
-					// Condition was woken up.
-					if (done) {
-						// StandardApplicationPool is being destroyed.
-						break;
-					} else {
-						// maxIdleTime changed.
-						continue;
-					}
-				}
-				
-				time_t now = InterruptableCalls::time(NULL);
-				AppContainerList::iterator it;
-				for (it = inactiveApps.begin(); it != inactiveApps.end(); it++) {
-					AppContainer &container(*it->get());
-					ApplicationPtr app(container.app);
-					AppContainerListPtr appList(apps[app->getAppRoot()]);
-					
-					if (now - container.lastUsed > (time_t) maxIdleTime) {
-						P_DEBUG("Cleaning idle app " << app->getAppRoot() <<
-							" (PID " << app->getPid() << ")");
-						appList->erase(container.iterator);
-						
-						AppContainerList::iterator prev = it;
-						prev--;
-						inactiveApps.erase(it);
-						it = prev;
-						
-						appInstanceCount[app->getAppRoot()]--;
-						
-						count--;
-					}
-					if (appList->empty()) {
-						apps.erase(app->getAppRoot());
-						appInstanceCount.erase(app->getAppRoot());
-						data->restartFileTimes.erase(app->getAppRoot());
-					}
+	/**
+	 * Returns the waiting request that may be served next: the first one
+	 * in line whose application canServe(). Returns NULL if none of them
+	 * may be served. canServe() is evaluated only once per application.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	WaitingRequest *headOfLine() {
+		WaitQueue::const_iterator it;
+		set<string> unservable;
+		
+		for (it = waitQueue.begin(); it != waitQueue.end(); it++) {
+			const string &appRoot(it->second->getAppRoot());
+			if (unservable.count(appRoot) == 0) {
+				if (canServe(appRoot)) {
+					return it->second;
 				}
+				unservable.insert(appRoot);
 			}
-		} catch (const exception &e) {
-			P_ERROR("Uncaught exception: " << e.what());
 		}
+		return NULL;
 	}
 	
 	/**
-	 * @throws boost::thread_interrupted
-	 * @throws SpawnException
-	 * @throws SystemException
+	 * Called whenever an instance or room in the pool may have become
+	 * available. Wakes up only the request that's first in line, or hands
+	 * it to an async get thread if it was made by getAsync(): the others
+	 * may not proceed before it does anyway, and are woken up when it
+	 * leaves the line.
+	 *
+	 * @pre The pool lock is held.
 	 */
-	pair<AppContainerPtr, AppContainerList *>
-	spawnOrUseExisting(
-		boost::mutex::scoped_lock &l,
-		const string &appRoot,
-		bool lowerPrivilege,
-		const string &lowestUser,
-		const string &environment,
-		const string &spawnMethod,
-		const string &appType
-	) {
-		this_thread::disable_interruption di;
-		this_thread::disable_syscall_interruption dsi;
-		AppContainerPtr container;
-		AppContainerList *list;
-		
-		try {
-			ApplicationMap::iterator it(apps.find(appRoot));
-			
-			if (it != apps.end() && needsRestart(appRoot)) {
-				AppContainerList::iterator it2;
-				list = it->second.get();
-				for (it2 = list->begin(); it2 != list->end(); it2++) {
-					container = *it2;
-					if (container->sessions == 0) {
-						inactiveApps.erase(container->ia_iterator);
-					} else {
-						active--;
-					}
-					it2--;
-					list->erase(container->iterator);
-					count--;
-				}
-				apps.erase(appRoot);
-				appInstanceCount.erase(appRoot);
-				spawnManager.reload(appRoot);
-				it = apps.end();
-				activeOrMaxChanged.notify_all();
+	void wakeUpNextWaiter() {
+		WaitingRequest *next = headOfLine();
+		if (next != NULL && next->async == NULL) {
+			next->wakeup.notify_one();
+		} else if (next != NULL) {
+			if (!next->dispatched && !done) {
+				next->dispatched = true;
+				// There's at least one async get thread; see waitInLine().
+				queueAsyncGet(next->async);
 			}
-			
-			if (it != apps.end()) {
-				list = it->second.get();
-				
-				if (list->front()->sessions == 0) {
-					container = list->front();
-					list->pop_front();
-					list->push_back(container);
-					container->iterator = list->end();
-					container->iterator--;
-					inactiveApps.erase(container->ia_iterator);
-					active++;
-					activeOrMaxChanged.notify_all();
-				} else if (count >= max || (
-					maxPerApp != 0 && appInstanceCount[appRoot] >= maxPerApp )
-					) {
-					AppContainerList::iterator it(list->begin());
-					AppContainerList::iterator smallest(list->begin());
-					it++;
-					for (; it != list->end(); it++) {
-						if ((*it)->sessions < (*smallest)->sessions) {
-							smallest = it;
-						}
-					}
-					container = *smallest;
-					list->erase(smallest);
-					list->push_back(container);
-					container->iterator = list->end();
-					container->iterator--;
-				} else {
-					container = ptr(new AppContainer());
-					{
-						this_thread::restore_interruption ri(di);
-						this_thread::restore_syscall_interruption rsi(dsi);
-						container->app = spawnManager.spawn(appRoot,
-							lowerPrivilege, lowestUser, environment,
-							spawnMethod, appType);
-					}
-					container->sessions = 0;
-					list->push_back(container);
-					container->iterator = list->end();
-					container->iterator--;
-					appInstanceCount[appRoot]++;
-					count++;
-					active++;
-					activeOrMaxChanged.notify_all();
-				}
-			} else {
-				while (!(
-					active < max &&
-					(maxPerApp == 0 || appInstanceCount[appRoot] < maxPerApp)
-				)) {
-					activeOrMaxChanged.wait(l);
-				}
-				if (count == max) {
-					container = inactiveApps.front();
-					inactiveApps.pop_front();
-					list = apps[container->app->getAppRoot()].get();
-					list->erase(container->iterator);
-					if (list->empty()) {
-						apps.erase(container->app->getAppRoot());
-						restartFileTimes.erase(container->app->getAppRoot());
-						appInstanceCount.erase(container->app->getAppRoot());
-					} else {
-						appInstanceCount[container->app->getAppRoot()]--;
-					}
-					count--;
-				}
-				container = ptr(new AppContainer());
-				{
-					this_thread::restore_interruption ri(di);
-					this_thread::restore_syscall_interruption rsi(dsi);
-					container->app = spawnManager.spawn(appRoot, lowerPrivilege, lowestUser,
-						environment, spawnMethod, appType);
+		} else if (waitingHolders > 0) {
+			// A caller that holds sessions may be waiting for room that
+			// only its own sessions take up. Let it find out.
+			WaitQueue::iterator it;
+			for (it = waitQueue.begin(); it != waitQueue.end(); it++) {
+				if (it->second->ownSessions > 0 && it->second->ownSessions >= active) {
+					it->second->wakeup.notify_one();
 				}
-				container->sessions = 0;
-				it = apps.find(appRoot);
-				if (it == apps.end()) {
-					list = new AppContainerList();
-					apps[appRoot] = ptr(list);
-					appInstanceCount[appRoot] = 1;
-				} else {
-					list = it->second.get();
+			}
+		}
+	}
+	
+	/**
+	 * Returns the number of requests for the given application that are
+	 * waiting in line.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	unsigned int queuedRequests(const string &appRoot) const {
+		map<string, unsigned int>::const_iterator it(appWaitingRequests.find(appRoot));
+		return (it == appWaitingRequests.end()) ? 0 : it->second;
+	}
+	
+	/**
+	 * @throws BusyException
+	 */
+	static void rejectRequest(const string &appRoot, const char *reason, const string &message) {
+		MetricsRegistry::global().counter("passenger_rejected_requests_total",
+			"Number of get() calls that were rejected by admission control.",
+			MetricsRegistry::label("app", appRoot) + "," +
+			MetricsRegistry::label("reason", reason)).increment();
+		throw BusyException(message);
+	}
+	
+	/**
+	 * Checks whether another request for the given application may be
+	 * queued, so that a single overloaded application can't tie up all
+	 * callers.
+	 *
+	 * @pre The pool lock is held.
+	 * @throws BusyException The request may not be queued.
+	 */
+	void admitQueuedRequest(const string &appRoot) const {
+		if (maxRequestQueueSize != 0 && queuedRequests(appRoot) >= maxRequestQueueSize) {
+			rejectRequest(appRoot, "queue_full", "The request queue of application '" +
+				appRoot + "' is full.");
+		}
+		if (maxTotalQueuedRequests != 0 && waitingRequests >= maxTotalQueuedRequests) {
+			rejectRequest(appRoot, "pool_queue_full", "Too many requests are queued "
+				"in the application pool.");
+		}
+	}
+	
+	/**
+	 * Returns the number of local instances of the given application.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	unsigned int instanceCount(const string &appRoot) const {
+		map<string, unsigned int>::const_iterator it(appInstanceCount.find(appRoot));
+		return (it == appInstanceCount.end()) ? 0 : it->second;
+	}
+	
+	AppShare shareOf(const string &appRoot) const {
+		map<string, AppShare>::const_iterator it(appShares.find(appRoot));
+		return (it == appShares.end()) ? AppShare() : it->second;
+	}
+	
+	/**
+	 * Whether application <tt>a</tt> has more instances per unit of weight
+	 * than application <tt>b</tt>.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	bool usesMoreThan(const string &a, const string &b) const {
+		return (unsigned long long) instanceCount(a) * shareOf(b).weight >
+			(unsigned long long) instanceCount(b) * shareOf(a).weight;
+	}
+	
+	/**
+	 * Returns the number of instances that are reserved for applications
+	 * other than the given one: the parts of their guaranteed minimums that
+	 * they haven't spawned yet.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	unsigned int reservedCapacity(const string &appRoot) const {
+		map<string, AppShare>::const_iterator it;
+		unsigned int result = 0;
+		for (it = appShares.begin(); it != appShares.end(); it++) {
+			unsigned int instances = instanceCount(it->first);
+			if (it->first != appRoot && instances < it->second.minInstances) {
+				result += it->second.minInstances - instances;
+			}
+		}
+		return result;
+	}
+	
+	/**
+	 * Returns the largest number of instances that the given application
+	 * can have at the same time: <tt>max</tt>, minus the capacity that's
+	 * reserved for other applications, and at most <tt>maxPerApp</tt>.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	unsigned int capacityFor(const string &appRoot) const {
+		unsigned int reserved = reservedCapacity(appRoot);
+		unsigned int result = (max > reserved) ? max - reserved : 0;
+		if (maxPerApp != 0 && maxPerApp < result) {
+			result = maxPerApp;
+		}
+		return result;
+	}
+	
+	/**
+	 * Whether an idle instance of the application <tt>victim</tt> may be shut
+	 * down to make room for an instance of <tt>appRoot</tt>: the victim keeps
+	 * its guaranteed minimum, and has more instances per unit of weight than
+	 * <tt>appRoot</tt>, so that neither can take the other's fair share.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	bool mayEvict(const string &victim, const string &appRoot) const {
+		return victim != appRoot
+			&& instanceCount(victim) > shareOf(victim).minInstances
+			&& usesMoreThan(victim, appRoot);
+	}
+	
+	/**
+	 * Whether an instance of the given application may be spawned or
+	 * activated without exceeding the pool's limits or taking capacity
+	 * that's reserved for other applications.
+	 *
+	 * @param victim Set to the idle instance that must be shut down first,
+	 *               or to NULL if none needs to be.
+	 * @pre The pool lock is held.
+	 */
+	bool hasRoomFor(const string &appRoot, AppContainerPtr &victim) {
+		victim.reset();
+		if (active >= max || (maxPerApp != 0 && instanceCount(appRoot) >= maxPerApp)) {
+			return false;
+		} else if (count + reservedCapacity(appRoot) < max) {
+			return true;
+		} else {
+			victim = selectEvictionVictim(appRoot);
+			return victim != NULL;
+		}
+	}
+	
+	bool hasRoomFor(const string &appRoot) {
+		AppContainerPtr victim;
+		return hasRoomFor(appRoot, victim);
+	}
+	
+	/**
+	 * Whether a get() request for the given application can be served
+	 * right away: one of its instances is idle, or there's room to spawn
+	 * another one.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	bool canServe(const string &appRoot) {
+		ApplicationMap::iterator it(apps.find(appRoot));
+		if (it == apps.end()) {
+			return hasRoomFor(appRoot);
+		} else {
+			return findIdle(*it->second) != it->second->end()
+				|| (!nearMemoryLimit(appRoot) && hasRoomFor(appRoot));
+		}
+	}
+	
+	static Counter &appCounter(const char *name, const char *help, const string &appRoot) {
+		return MetricsRegistry::global().counter(name, help,
+			MetricsRegistry::label("app", appRoot));
+	}
+	
+	static void observeSpawn(const string &appRoot, pid_t pid,
+	                         const posix_time::time_duration &duration) {
+		FlightRecorder::global().record(FlightRecorder::SPAWN_END, appRoot, pid,
+			duration.total_microseconds());
+		appCounter("passenger_spawns_total",
+			"Number of application instances spawned.",
+			appRoot).increment();
+		MetricsRegistry::global().histogram("passenger_spawn_duration_seconds",
+			"Time spent spawning application instances.",
+			MetricsRegistry::label("app", appRoot)
+		).observe(duration.total_microseconds());
+	}
+	
+	/**
+	 * Sets the pool's gauges in the global metrics registry. Called by the
+	 * registry right before the metrics are exported.
+	 */
+	void collectMetrics() {
+		MetricsRegistry &registry(MetricsRegistry::global());
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		ApplicationMap::const_iterator it;
+		
+		registry.gauge("passenger_pool_max",
+			"Maximum number of application instances.").set(max);
+		registry.gauge("passenger_pool_instances",
+			"Number of application instances.").set(count);
+		registry.gauge("passenger_pool_active_instances",
+			"Number of application instances with at least one open session.").set(active);
+		registry.gauge("passenger_pool_queued_requests",
+			"Number of requests that are queued for an application instance.").set(
+			waitingRequests);
+		registry.resetGauges("passenger_app_instances");
+		registry.resetGauges("passenger_app_sessions");
+		registry.resetGauges("passenger_app_cgroup_memory_bytes");
+		registry.resetGauges("passenger_app_cgroup_cpu_usage_microseconds");
+		registry.resetGauges("passenger_app_cgroup_oom_kills");
+		for (it = apps.begin(); it != apps.end(); it++) {
+			string label(MetricsRegistry::label("app", it->first));
+			AppContainerList::const_iterator lit;
+			unsigned int sessions = 0;
+			map<string, CgroupManager::Stats>::const_iterator cit(cgroupStats.find(it->first));
+			
+			if (cit != cgroupStats.end()) {
+				const CgroupManager::Stats &stats(cit->second);
+				registry.gauge("passenger_app_cgroup_memory_bytes",
+					"Memory usage of an application's control group.",
+					label).set(stats.memoryCurrent);
+				registry.gauge("passenger_app_cgroup_cpu_usage_microseconds",
+					"Total CPU time used by an application's control group.",
+					label).set(stats.cpuUsage);
+				registry.gauge("passenger_app_cgroup_oom_kills",
+					"Number of processes in an application's control group that "
+					"were killed because the group ran out of memory.",
+					label).set(stats.oomKills);
+			}
+			
+			for (lit = it->second->begin(); lit != it->second->end(); lit++) {
+				sessions += (*lit)->totalSessions();
+			}
+			registry.gauge("passenger_app_instances",
+				"Number of instances of an application.",
+				label).set(it->second->size());
+			registry.gauge("passenger_app_sessions",
+				"Number of open sessions of an application.",
+				label).set(sessions);
+		}
+		
+		RemoteInstanceMap::const_iterator rit;
+		registry.resetGauges("passenger_app_remote_instances");
+		for (rit = remoteInstances.begin(); rit != remoteInstances.end(); rit++) {
+			registry.gauge("passenger_app_remote_instances",
+				"Number of remote instances of an application.",
+				MetricsRegistry::label("app", rit->first)
+			).set(rit->second.size());
+		}
+		
+		if (sharedTable != NULL) {
+			unsigned long long reservations = sharedTable->getReservations();
+			unsigned long long misses = sharedTable->getMisses();
+			registry.counter("passenger_shared_table_reservations_total",
+				"Number of sessions that Apache worker processes opened "
+				"through the shared instance table."
+			).increment(reservations - reportedSharedReservations);
+			registry.counter("passenger_shared_table_misses_total",
+				"Number of times that Apache worker processes found no idle "
+				"instance in the shared instance table."
+			).increment(misses - reportedSharedMisses);
+			reportedSharedReservations = reservations;
+			reportedSharedMisses = misses;
+		}
+	}
+	
+	/**
+	 * Returns the get() duration histogram of the given application.
+	 * Must be called with the lock held.
+	 */
+	LatencyHistogram &getDurationHistogram(const string &appRoot) {
+		map<string, LatencyHistogram *>::iterator it(data->getDurationHistograms.find(appRoot));
+		if (it == data->getDurationHistograms.end()) {
+			LatencyHistogram *histogram = &MetricsRegistry::global().histogram(
+				"passenger_get_duration_seconds",
+				"Time spent in ApplicationPool::get(), including spawning.",
+				MetricsRegistry::label("app", appRoot));
+			data->getDurationHistograms[appRoot] = histogram;
+			return *histogram;
+		} else {
+			return *it->second;
+		}
+	}
+	
+	static bool hasFewerSessions(const RemoteInstancePtr &a, const RemoteInstancePtr &b) {
+		return a->sessions < b->sessions;
+	}
+	
+	/**
+	 * Open a session with one of the given remote instances, preferring the
+	 * instances with the fewest open sessions. The pool lock is released
+	 * while connecting, because connecting over the network may be slow.
+	 * Instances that couldn't be connected to are skipped for a while.
+	 *
+	 * @throws IOException None of the remote instances could be connected to,
+	 *                     or all of them are down.
+	 */
+	Application::SessionPtr getRemoteSession(
+		InstrumentedMutex::scoped_lock &l,
+		const string &appRoot,
+		const RemoteInstanceList &instances,
+		const posix_time::ptime &begin,
+		const string &traceId
+	) {
+		vector<RemoteInstancePtr> candidates(instances.begin(), instances.end());
+		vector<RemoteInstancePtr>::iterator it;
+		string lastError;
+		
+		stable_sort(candidates.begin(), candidates.end(), hasFewerSessions);
+		for (it = candidates.begin(); it != candidates.end(); it++) {
+			RemoteInstancePtr instance(*it);
+			
+			if (!instance->liveness.mayTry(time(NULL))) {
+				continue;
+			}
+			bool probing = instance->liveness.failures > 0;
+			instance->sessions++;
+			l.unlock();
+			try {
+				Application::SessionPtr session(instance->app->connect(
+					SlabCallback<RemoteSessionCloseCallback>(
+						new RemoteSessionCloseCallback(data, instance))));
+				if (probing) {
+					l.lock();
+					instance->liveness.succeeded();
+					l.unlock();
+				}
+				unsigned long long duration = (get_system_time() - begin).total_microseconds();
+				FlightRecorder::global().record(FlightRecorder::GET, appRoot,
+					session->getPid(), duration);
+				MetricsRegistry::global().histogram("passenger_get_duration_seconds",
+					"Time spent in ApplicationPool::get(), including spawning.",
+					MetricsRegistry::label("app", appRoot)
+				).observe(duration);
+				if (!traceId.empty()) {
+					P_DEBUG("Trace " << traceId << ": remote instance " <<
+						instance->app->getListenSocketName() << ", " <<
+						duration << "us");
+				}
+				return session;
+			} catch (const exception &e) {
+				l.lock();
+				instance->sessions--;
+				instance->liveness.failed(time(NULL));
+				FlightRecorder::global().record(FlightRecorder::CONNECT_FAILURE,
+					appRoot, instance->app->getPid());
+				appCounter("passenger_connect_retries_total",
+					"Number of failed attempts to connect to an application instance.",
+					appRoot).increment();
+				try {
+					const SystemException &syse =
+						dynamic_cast<const SystemException &>(e);
+					lastError = syse.sys();
+				} catch (const bad_cast &) {
+					lastError = e.what();
+				}
+				P_WARN("Cannot connect to remote instance " <<
+					instance->app->getListenSocketName() << " of '" <<
+					appRoot << "': " << lastError << "; skipping it for " <<
+					instance->liveness.backoff() << " seconds");
+			}
+		}
+		
+		string message;
+		if (lastError.empty()) {
+			message = "All remote instances of '" + appRoot + "' are down";
+		} else {
+			message = "Cannot connect to any remote instance of '" + appRoot +
+				"': " + lastError;
+		}
+		throw IOException(message);
+	}
+	
+	static void doNothing() { }
+	
+	/**
+	 * Ask the ApplicationPool server on another cluster node to open a session
+	 * with the given application. Once it has replied, that server relays the
+	 * connection to the application instance, so the connection itself is
+	 * used as the session stream.
+	 *
+	 * The privilege lowering parameters of get() aren't sent: the other node
+	 * spawns applications with its own settings.
+	 *
+	 * @throws SystemException The node could not be connected to.
+	 * @throws IOException The node closed the connection, sent garbage or
+	 *                     refused the request.
+	 * @throws SpawnException The node could not spawn the application.
+	 * @throws BusyException The node's pool is too busy.
+	 */
+	Application::SessionPtr getFromClusterNode(
+		const string &node,
+		const string &appRoot,
+		const string &environment,
+		const string &spawnMethod,
+		const string &appType,
+		const string &traceId,
+		Priority priority
+	) {
+		int fd = connectToTcpServer(node, CLUSTER_CONNECT_TIMEOUT);
+		vector<string> args;
+		
+		try {
+			MessageChannel channel(fd);
+			
+			channel.write("secret", clusterSecret.c_str(), NULL);
+			channel.write("get", appRoot.c_str(),
+				environment.c_str(),
+				spawnMethod.c_str(),
+				appType.c_str(),
+				traceId.c_str(),
+				Passenger::toString((int) priority).c_str(),
+				NULL);
+			if (!channel.read(args)) {
+				throw IOException("The cluster node " + node +
+					" unexpectedly closed the connection.");
+			}
+			if (args[0] == "SpawnException" && args.size() == 3) {
+				if (args[2] == "true") {
+					string errorPage;
+					
+					if (!channel.readScalar(errorPage)) {
+						throw IOException("The cluster node " + node +
+							" unexpectedly closed the connection.");
+					}
+					throw SpawnException(args[1], errorPage);
+				} else {
+					throw SpawnException(args[1]);
+				}
+			} else if (args[0] == "BusyException" && args.size() == 2) {
+				throw BusyException(args[1]);
+			} else if (args[0] == "IOException" && args.size() == 2) {
+				throw IOException(args[1]);
+			} else if (args[0] != "ok" || args.size() != 2) {
+				throw IOException("The cluster node " + node +
+					" returned an unknown message: " + Passenger::toString(args));
+			}
+		} catch (...) {
+			InterruptableCalls::close(fd);
+			throw;
+		}
+		return slabPtr(new Application::StandardSession(atoi(args[1]),
+			doNothing, fd));
+	}
+	
+	bool needsRestart(const string &appRoot) {
+		// Called on every get(), so avoid allocating a string.
+		char restartFile[PATH_MAX];
+		snprintf(restartFile, sizeof(restartFile), "%s/tmp/restart.txt",
+			appRoot.c_str());
+		
+		struct stat buf;
+		bool result;
+		int ret;
+		
+		do {
+			ret = stat(restartFile, &buf);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == 0) {
+			do {
+				ret = unlink(restartFile);
+			} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+			if (ret == 0 || errno == ENOENT) {
+				restartFileTimes.erase(appRoot);
+				result = true;
+			} else {
+				map<string, time_t>::const_iterator it;
+				
+				it = restartFileTimes.find(appRoot);
+				if (it == restartFileTimes.end()) {
+					result = true;
+				} else {
+					result = buf.st_mtime != restartFileTimes[appRoot];
+				}
+				restartFileTimes[appRoot] = buf.st_mtime;
+			}
+		} else {
+			restartFileTimes.erase(appRoot);
+			result = false;
+		}
+		return result;
+	}
+	
+	/**
+	 * Pin a newly spawned instance of the given application to a NUMA
+	 * node: the node with the fewest instances of that application, or if
+	 * that's a tie, the node with the fewest instances overall. Does nothing
+	 * if NUMA placement is disabled.
+	 */
+	void placeOnNumaNode(AppContainer &container, const string &appRoot) {
+		container.numaNode = -1;
+		// Instances on TCP sockets are spawned by spawn agents on other hosts.
+		if (numaTopology.size() < 2
+		 || container.app->getSocketType() == Application::TCP_SOCKET) {
+			return;
+		}
+		
+		vector<unsigned int> appInstances(numaTopology.size(), 0);
+		vector<unsigned int> allInstances(numaTopology.size(), 0);
+		ApplicationMap::const_iterator it;
+		for (it = apps.begin(); it != apps.end(); it++) {
+			AppContainerList::const_iterator lit;
+			for (lit = it->second->begin(); lit != it->second->end(); lit++) {
+				int node = (*lit)->numaNode;
+				if (node != -1) {
+					allInstances[node]++;
+					if (it->first == appRoot) {
+						appInstances[node]++;
+					}
+				}
+			}
+		}
+		
+		unsigned int best = 0;
+		for (unsigned int i = 1; i < numaTopology.size(); i++) {
+			if (appInstances[i] < appInstances[best] || (
+			    appInstances[i] == appInstances[best]
+			 && allInstances[i] < allInstances[best])) {
+				best = i;
+			}
+		}
+		try {
+			numaTopology.pin(container.app->getPid(), best);
+			container.numaNode = best;
+		} catch (const SystemException &e) {
+			P_WARN("Cannot pin " << appRoot << " (PID " <<
+				container.app->getPid() << ") to NUMA node " <<
+				numaTopology.getNode(best).id << ": " << e.what());
+		}
+	}
+	
+	/**
+	 * Whether the given application's control group is close to its memory
+	 * limit. Spawning another instance of such an application would only
+	 * make the kernel kill one of its instances, and shutting down one of
+	 * its idle instances relieves the pressure.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	bool nearMemoryLimit(const string &appRoot) const {
+		map<string, CgroupManager::Stats>::const_iterator it(cgroupStats.find(appRoot));
+		return it != cgroupStats.end() && it->second.nearMemoryLimit();
+	}
+	
+	/**
+	 * Read the statistics of the applications' control groups into
+	 * <tt>cgroupStats</tt>. The lock is released while reading.
+	 *
+	 * @pre The pool lock is held.
+	 * @post The pool lock is held.
+	 */
+	void refreshCgroupStats(InstrumentedMutex::scoped_lock &l) {
+		CgroupManagerPtr cgroups(this->cgroups);
+		vector<string> appRoots;
+		map<string, CgroupManager::Stats> stats;
+		ApplicationMap::const_iterator it;
+		bool changed = false;
+		
+		for (it = apps.begin(); it != apps.end(); it++) {
+			appRoots.push_back(it->first);
+		}
+		l.unlock();
+		for (unsigned int i = 0; i < appRoots.size(); i++) {
+			CgroupManager::Stats appStats;
+			if (cgroups->getStats(appRoots[i], appStats)) {
+				stats[appRoots[i]] = appStats;
+			}
+		}
+		l.lock();
+		if (this->cgroups != cgroups) {
+			// setCgroups() was called in the meantime.
+			return;
+		}
+		
+		for (unsigned int i = 0; i < appRoots.size() && !changed; i++) {
+			changed = nearMemoryLimit(appRoots[i]) !=
+				(stats.count(appRoots[i]) > 0 && stats[appRoots[i]].nearMemoryLimit());
+		}
+		cgroupStats.swap(stats);
+		if (changed) {
+			// Whether the applications may grow has changed.
+			wakeUpNextWaiter();
+		}
+	}
+	
+	/**
+	 * Returns the idle instance that should be shut down to make room for
+	 * an instance of the given application, or NULL if mayEvict() allows
+	 * none. Instances of applications that are close to their memory limit
+	 * are preferred. Otherwise, the victim is an instance of the application
+	 * with the most instances per unit of weight, and the least recently
+	 * used one of those.
+	 *
+	 * Instances that Apache worker processes are using through the shared
+	 * instance table are only chosen if all idle instances are in use. Such
+	 * an instance finishes its current request before it exits.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	AppContainerPtr selectEvictionVictim(const string &appRoot) const {
+		AppContainerList::const_iterator it;
+		AppContainerPtr victim;
+		int victimTier = -1;
+		
+		for (it = inactiveApps.begin(); it != inactiveApps.end(); it++) {
+			const string &victimRoot((*it)->app->getAppRoot());
+			int tier;
+			
+			if (!mayEvict(victimRoot, appRoot)) {
+				continue;
+			}
+			if ((*it)->totalSessions() > 0) {
+				tier = 0;
+			} else {
+				tier = nearMemoryLimit(victimRoot) ? 2 : 1;
+			}
+			if (tier > victimTier || (tier == victimTier
+			 && usesMoreThan(victimRoot, victim->app->getAppRoot()))) {
+				victim = *it;
+				victimTier = tier;
+			}
+		}
+		return victim;
+	}
+	
+	/**
+	 * Shut down the given idle instance to make room for another one.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	void evict(const AppContainerPtr &container) {
+		const string &appRoot(container->app->getAppRoot());
+		AppContainerList *list = apps[appRoot].get();
+		
+		inactiveApps.erase(container->ia_iterator);
+		list->erase(container->iterator);
+		count--;
+		FlightRecorder::global().record(FlightRecorder::EVICT,
+			appRoot, container->app->getPid());
+		appCounter("passenger_evictions_total",
+			"Number of idle application instances that were shut down "
+			"to make room for another application.",
+			appRoot).increment();
+		if (list->empty()) {
+			restartFileTimes.erase(appRoot);
+			appInstanceCount.erase(appRoot);
+			apps.erase(appRoot);
+		} else {
+			appInstanceCount[appRoot]--;
+		}
+	}
+	
+	/**
+	 * Returns the first instance in the given list without any sessions,
+	 * including the ones that Apache worker processes opened through the
+	 * shared instance table, or <tt>list.end()</tt> if there's none.
+	 */
+	static AppContainerList::iterator findIdle(AppContainerList &list) {
+		AppContainerList::iterator it;
+		for (it = list.begin(); it != list.end() && (*it)->sessions == 0; it++) {
+			if ((*it)->totalSessions() == 0) {
+				return it;
+			}
+		}
+		return list.end();
+	}
+	
+	/**
+	 * Publish a newly spawned instance in the shared instance table, if
+	 * there is one. Instances that listen on a Unix socket file aren't
+	 * published: the socket file is only accessible by the application's
+	 * user, so other processes usually can't connect to it.
+	 */
+	void publishShared(AppContainer &container) {
+		if (sharedTable == NULL) {
+			return;
+		}
+		if (container.app->getSocketType() == Application::UNIX_SOCKET) {
+			P_DEBUG("Not publishing " << container.app->getAppRoot() <<
+				" (PID " << container.app->getPid() << ") in the shared " <<
+				"instance table, because it listens on a Unix socket file");
+			return;
+		}
+		container.sharedTable = sharedTable;
+		container.sharedHandle = sharedTable->publish(
+			container.app->getAppRoot(), container.app->getPid(),
+			container.app->getListenSocketName(),
+			container.app->getSocketType());
+		if (!container.sharedHandle.valid()) {
+			P_DEBUG("Cannot publish " << container.app->getAppRoot() <<
+				" (PID " << container.app->getPid() << ") in the shared " <<
+				"instance table; it's only available through the server");
+		}
+	}
+	
+	void replenisherThreadMainLoop() {
+		this_thread::disable_syscall_interruption dsi;
+		vector< weak_ptr<Application> > queue;
+		boost::mutex::scoped_lock l(replenishLock);
+		
+		while (!replenisherDone && !this_thread::interruption_requested()) {
+			if (replenishQueue.empty()) {
+				replenishNeeded.wait(l);
+				continue;
+			}
+			
+			// Swap the queues instead of copying them, so that both keep
+			// their capacity and scheduling doesn't allocate memory.
+			queue.swap(replenishQueue);
+			l.unlock();
+			for (unsigned int i = 0; i < queue.size(); i++) {
+				ApplicationPtr app(queue[i].lock());
+				if (app != NULL) {
+					app->replenishSpareConnections();
+				}
+			}
+			queue.clear();
+			l.lock();
+		}
+	}
+	
+	/**
+	 * Let the replenisher thread make spare connections to the given
+	 * application instance, unless that has already been scheduled.
+	 */
+	void scheduleReplenish(const ApplicationPtr &app) {
+		if (app->scheduleReplenish()) {
+			boost::mutex::scoped_lock l(replenishLock);
+			replenishQueue.push_back(app);
+			replenishNeeded.notify_one();
+		}
+	}
+	
+	/**
+	 * Release the reservations in the shared instance table that were
+	 * left behind by worker processes that crashed or were killed.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	void reclaimSharedReservations() {
+		ApplicationMap::iterator it;
+		bool reclaimed = false;
+		
+		for (it = apps.begin(); it != apps.end(); it++) {
+			AppContainerList::iterator lit;
+			for (lit = it->second->begin(); lit != it->second->end(); lit++) {
+				if ((*lit)->reclaimShared()) {
+					P_WARN("Released a reservation of " << it->first << " (PID " <<
+						(*lit)->app->getPid() << ") that was left behind by " <<
+						"an Apache worker process that exited.");
+					appCounter("passenger_reclaimed_reservations_total",
+						"Number of shared instance table reservations that "
+						"were left behind by exited worker processes.",
+						it->first).increment();
+					reclaimed = true;
+				}
+			}
+		}
+		if (reclaimed) {
+			wakeUpNextWaiter();
+		}
+	}
+	
+	void cleanerThreadMainLoop() {
+		this_thread::disable_syscall_interruption dsi;
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		try {
+			posix_time::ptime lastRun(get_system_time());
+			while (!done && !this_thread::interruption_requested()) {
+				unsigned int interval;
+				if (cgroups != NULL && maxIdleTime + 1 > CGROUP_STATS_INTERVAL) {
+					interval = CGROUP_STATS_INTERVAL;
+				} else if (sharedTable != NULL && maxIdleTime + 1 > RECLAIM_INTERVAL) {
+					interval = RECLAIM_INTERVAL;
+				} else {
+					interval = maxIdleTime + 1;
+				}
+				posix_time::ptime nextRun(lastRun + posix_time::seconds(interval));
+				posix_time::ptime wakeup(nextRun);
+				if (waitingAsyncGets > 0 && (maxRequestQueueTime != 0 || sharedTable != NULL)) {
+					unsigned int checkInterval = ASYNC_GET_CHECK_INTERVAL;
+					if (sharedTable != NULL) {
+						checkInterval = SHARED_TABLE_POLL_INTERVAL;
+					}
+					posix_time::ptime nextCheck(get_system_time() +
+						posix_time::milliseconds(checkInterval));
+					if (nextCheck < wakeup) {
+						wakeup = nextCheck;
+					}
+				}
+				if (cleanerThreadSleeper.timed_wait(l, wakeup)) {
+					// Condition was woken up.
+					if (done) {
+						// StandardApplicationPool is being destroyed.
+						break;
+					} else {
+						// maxIdleTime changed, or a getAsync() call
+						// got in line.
+						continue;
+					}
+				}
+				
+				if (waitingAsyncGets > 0) {
+					checkAsyncGets();
+				}
+				if (get_system_time() < nextRun) {
+					continue;
+				}
+				lastRun = get_system_time();
+				
+				if (sharedTable != NULL) {
+					reclaimSharedReservations();
+				}
+				if (cgroups != NULL) {
+					refreshCgroupStats(l);
+					if (done) {
+						break;
+					}
+				}
+				
+				time_t now = InterruptableCalls::time(NULL);
+				AppContainerList::iterator it;
+				for (it = inactiveApps.begin(); it != inactiveApps.end(); it++) {
+					AppContainer &container(*it->get());
+					ApplicationPtr app(container.app);
+					AppContainerListPtr appList(apps[app->getAppRoot()]);
+					
+					if (now - container.totalLastUsed() > (time_t) maxIdleTime
+					 && container.totalSessions() == 0
+					 && appInstanceCount[app->getAppRoot()] >
+					    shareOf(app->getAppRoot()).minInstances) {
+						P_DEBUG("Cleaning idle app " << app->getAppRoot() <<
+							" (PID " << app->getPid() << ")");
+						appList->erase(container.iterator);
+						
+						AppContainerList::iterator prev = it;
+						prev--;
+						inactiveApps.erase(it);
+						it = prev;
+						
+						appInstanceCount[app->getAppRoot()]--;
+						
+						count--;
+						FlightRecorder::global().record(FlightRecorder::IDLE_CLEANUP,
+							app->getAppRoot(), app->getPid());
+						appCounter("passenger_idle_cleanups_total",
+							"Number of idle application instances that were shut down.",
+							app->getAppRoot()).increment();
+					}
+					if (appList->empty()) {
+						apps.erase(app->getAppRoot());
+						appInstanceCount.erase(app->getAppRoot());
+						data->restartFileTimes.erase(app->getAppRoot());
+					}
+				}
+			}
+		} catch (const exception &e) {
+			P_ERROR("Uncaught exception: " << e.what());
+		}
+	}
+	
+	/**
+	 * @param mayBlock Whether this may spawn an instance or wait in line
+	 *            for one. If not, and if that's needed, then a NULL
+	 *            container is returned.
+	 * @param ownSessions The number of sessions with instances of this
+	 *            application that the caller holds, and that thus won't
+	 *            be closed while it waits in line.
+	 * @param waitedInLine Whether the caller has already waited in line,
+	 *            and has been first in line since it last checked.
+	 * @throws boost::thread_interrupted
+	 * @throws SpawnException
+	 * @throws BusyException The request was rejected by admission control.
+	 * @throws SystemException
+	 */
+	pair<AppContainerPtr, AppContainerList *>
+	spawnOrUseExisting(
+		InstrumentedMutex::scoped_lock &l,
+		const string &appRoot,
+		bool lowerPrivilege,
+		const string &lowestUser,
+		const string &environment,
+		const string &spawnMethod,
+		const string &appType,
+		Priority priority,
+		GetTimings &timings,
+		bool mayBlock = true,
+		unsigned int ownSessions = 0,
+		bool waitedInLine = false
+	) {
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		AppContainerPtr container, victim;
+		AppContainerList *list;
+		
+		try {
+			ApplicationMap::iterator it(apps.find(appRoot));
+			
+			if (it != apps.end() && needsRestart(appRoot)) {
+				AppContainerList::iterator it2;
+				list = it->second.get();
+				for (it2 = list->begin(); it2 != list->end(); it2++) {
+					container = *it2;
+					if (container->sessions == 0) {
+						inactiveApps.erase(container->ia_iterator);
+					} else {
+						active--;
+					}
+					it2--;
+					list->erase(container->iterator);
+					count--;
+				}
+				apps.erase(appRoot);
+				appInstanceCount.erase(appRoot);
+				spawnManager.reload(appRoot);
+				FlightRecorder::global().record(FlightRecorder::RESTART, appRoot);
+				appCounter("passenger_restarts_total",
+					"Number of application restarts through restart.txt.",
+					appRoot).increment();
+				it = apps.end();
+				wakeUpNextWaiter();
+			}
+			
+			list = (it == apps.end()) ? NULL : it->second.get();
+			
+			// Get in line behind requests that are already waiting, even if
+			// there's room: they may not have woken up yet. Only an idle
+			// instance that no one waits for may be taken right away.
+			if (!waitedInLine && (!canServe(appRoot) || appWaitingRequests.count(appRoot) > 0
+			 || (waitingRequests > 0 && (list == NULL || findIdle(*list) == list->end())))) {
+				if (!mayBlock) {
+					return make_pair(AppContainerPtr(), (AppContainerList *) NULL);
+				}
+				posix_time::ptime waitBegin(get_system_time());
+				admitQueuedRequest(appRoot);
+				
+				WaitingRequest waitingRequest(*this, appRoot, priority, waitBegin, ownSessions);
+				unsigned int maxWait = maxRequestQueueTime;
+				posix_time::ptime deadline(waitBegin + posix_time::seconds(maxWait));
+				
+				WaitingRequest *next;
+				while ((next = headOfLine()) != &waitingRequest) {
+					if (done) {
+						throw IOException("The application pool is being destroyed.");
+					}
+					if (maxWait != 0 && get_system_time() >= deadline) {
+						rejectRequest(appRoot, "queue_timeout", "Application '" +
+							appRoot + "' didn't become available within " +
+							Passenger::toString(maxWait) + " seconds.");
+					}
+					if (ownSessions > 0 && sharedTable == NULL
+					 && active <= ownSessions && !canServe(appRoot)) {
+						// All active instances are the caller's, so no
+						// session will be closed that could make room.
+						rejectRequest(appRoot, "too_many_sessions", "Application '" +
+							appRoot + "' can't have " +
+							Passenger::toString(ownSessions + 1) +
+							" instances at the same time.");
+					}
+					if (sharedTable != NULL && waitingRequest.queueIterator == waitQueue.begin()) {
+						// Worker processes open and close sessions without
+						// telling us, so the first request in line polls the
+						// table on behalf of everyone.
+						if (next != NULL) {
+							next->wakeup.notify_one();
+						}
+						waitingRequest.wakeup.timed_wait(l, get_system_time() +
+							posix_time::milliseconds(SHARED_TABLE_POLL_INTERVAL));
+					} else if (maxWait == 0) {
+						waitingRequest.wakeup.wait(l);
+					} else {
+						waitingRequest.wakeup.timed_wait(l, deadline);
+					}
+				}
+				timings.capacityWait = get_system_time() - waitBegin;
+				it = apps.find(appRoot);
+			}
+			
+			AppContainerList::iterator idle;
+			if (it != apps.end()) {
+				list = it->second.get();
+				idle = findIdle(*list);
+			}
+			if (it != apps.end() && idle != list->end()) {
+				container = *idle;
+				list->splice(list->end(), *list, container->iterator);
+				inactiveApps.erase(container->ia_iterator);
+				active++;
+				wakeUpNextWaiter();
+			} else if (!mayBlock) {
+				return make_pair(AppContainerPtr(), (AppContainerList *) NULL);
+			} else {
+				// canServe() made sure that there's room.
+				hasRoomFor(appRoot, victim);
+				if (victim != NULL) {
+					// Grow towards this application's fair share.
+					evict(victim);
+					victim.reset();
+				}
+				posix_time::ptime spawnBegin(get_system_time());
+				FlightRecorder::global().record(FlightRecorder::SPAWN_START, appRoot);
+				container = ptr(new AppContainer());
+				{
+					this_thread::restore_interruption ri(di);
+					this_thread::restore_syscall_interruption rsi(dsi);
+					container->app = spawnManager.spawn(appRoot, lowerPrivilege, lowestUser,
+						environment, spawnMethod, appType);
+				}
+				timings.spawn = get_system_time() - spawnBegin;
+				observeSpawn(appRoot, container->app->getPid(), timings.spawn);
+				placeOnNumaNode(*container, appRoot);
+				publishShared(*container);
+				container->sessions = 0;
+				it = apps.find(appRoot);
+				if (it == apps.end()) {
+					list = new AppContainerList();
+					apps[appRoot] = ptr(list);
+					appInstanceCount[appRoot] = 1;
+				} else {
+					list = it->second.get();
 					appInstanceCount[appRoot]++;
 				}
-				list->push_back(container);
-				container->iterator = list->end();
-				container->iterator--;
-				count++;
-				active++;
-				activeOrMaxChanged.notify_all();
+				list->push_back(container);
+				container->iterator = list->end();
+				container->iterator--;
+				count++;
+				active++;
+				wakeUpNextWaiter();
+			}
+		} catch (const BusyException &) {
+			throw;
+		} catch (const SpawnException &e) {
+			FlightRecorder::global().record(FlightRecorder::SPAWN_ERROR, appRoot);
+			appCounter("passenger_spawn_errors_total",
+				"Number of failed spawn attempts.",
+				appRoot).increment();
+			string message("Cannot spawn application '");
+			message.append(appRoot);
+			message.append("': ");
+			message.append(e.what());
+			if (e.hasErrorPage()) {
+				throw SpawnException(message, e.getErrorPage());
+			} else {
+				throw SpawnException(message);
+			}
+		} catch (const exception &e) {
+			FlightRecorder::global().record(FlightRecorder::SPAWN_ERROR, appRoot);
+			appCounter("passenger_spawn_errors_total",
+				"Number of failed spawn attempts.",
+				appRoot).increment();
+			string message("Cannot spawn application '");
+			message.append(appRoot);
+			message.append("': ");
+			message.append(e.what());
+			throw SpawnException(message);
+		}
+		
+		return make_pair(container, list);
+	}
+	
+	/**
+	 * Opens a session with a local instance. Used by getLocal() and
+	 * for getAsync().
+	 *
+	 * @param mayBlock Whether this may spawn an instance or wait in line
+	 *            for one. If not, and if that's needed, then a NULL
+	 *            pointer is returned.
+	 * @param ownSessions See spawnOrUseExisting().
+	 * @param waitedInLine See spawnOrUseExisting().
+	 */
+	Application::SessionPtr openSession(
+		InstrumentedMutex::scoped_lock &l,
+		const string &appRoot,
+		bool lowerPrivilege,
+		const string &lowestUser,
+		const string &environment,
+		const string &spawnMethod,
+		const string &appType,
+		const string &traceId,
+		Priority priority,
+		const posix_time::ptime &begin,
+		GetTimings &timings,
+		bool mayBlock,
+		unsigned int ownSessions = 0,
+		bool waitedInLine = false
+	) {
+		unsigned int attempt = 0;
+		
+		RemoteInstanceMap::const_iterator rit(remoteInstances.find(appRoot));
+		if (rit != remoteInstances.end()) {
+			return getRemoteSession(l, appRoot, rit->second, begin, traceId);
+		}
+		
+		while (true) {
+			attempt++;
+			
+			pair<AppContainerPtr, AppContainerList *> p(
+				spawnOrUseExisting(l, appRoot, lowerPrivilege, lowestUser,
+					environment, spawnMethod, appType, priority, timings, mayBlock,
+					ownSessions, waitedInLine && attempt == 1)
+			);
+			if (p.first == NULL) {
+				return Application::SessionPtr();
+			}
+			AppContainerPtr &container(p.first);
+			AppContainerList &list(*p.second);
+
+			container->lastUsed = time(NULL);
+			container->sessions++;
+			container->acquireShared();
+			
+			P_ASSERT(verifyState(), Application::SessionPtr(),
+				"State is valid:\n" << toString(false));
+			try {
+				Application::SessionPtr session(
+					container->app->connect(SlabCallback<SessionCloseCallback>(
+						new SessionCloseCallback(data, container)))
+				);
+				if (sharedTable == NULL) {
+					// An instance that has accepted a spare connection
+					// doesn't accept connections from worker processes.
+					scheduleReplenish(container->app);
+				}
+				unsigned long long duration = (get_system_time() - begin).total_microseconds();
+				FlightRecorder::global().record(FlightRecorder::GET, appRoot,
+					session->getPid(), duration);
+				getDurationHistogram(appRoot).observe(duration);
+				if (!traceId.empty()) {
+					P_DEBUG("Trace " << traceId << ": lock wait " <<
+						timings.lockWait.total_microseconds() << "us, capacity wait " <<
+						timings.capacityWait.total_microseconds() << "us, spawn " <<
+						timings.spawn.total_microseconds() << "us, attempts " <<
+						attempt << ", PID " << session->getPid());
+				}
+				return session;
+			} catch (const exception &e) {
+				container->sessions--;
+				container->releaseShared();
+				FlightRecorder::global().record(FlightRecorder::CONNECT_FAILURE,
+					appRoot, container->app->getPid());
+				appCounter("passenger_connect_retries_total",
+					"Number of failed attempts to connect to an application instance.",
+					appRoot).increment();
+				if (attempt == MAX_GET_ATTEMPTS) {
+					string message("Cannot connect to an existing "
+						"application instance for '");
+					message.append(appRoot);
+					message.append("': ");
+					try {
+						const SystemException &syse =
+							dynamic_cast<const SystemException &>(e);
+						message.append(syse.sys());
+					} catch (const bad_cast &) {
+						message.append(e.what());
+					}
+					throw IOException(message);
+				} else {
+					list.erase(container->iterator);
+					if (list.empty()) {
+						apps.erase(appRoot);
+						appInstanceCount.erase(appRoot);
+					}
+					count--;
+					active--;
+					wakeUpNextWaiter();
+					P_ASSERT(verifyState(), Application::SessionPtr(),
+						"State is valid.");
+				}
+			}
+		}
+		// Never reached; shut up compiler warning
+		return Application::SessionPtr();
+	}
+	
+	/**
+	 * Puts a getAsync() call in line, without a thread that waits for it.
+	 * wakeUpNextWaiter() hands it to an async get thread once it's first
+	 * in line.
+	 *
+	 * @pre The pool lock is held.
+	 * @throws BusyException The call may not be queued.
+	 * @throws boost::thread_resource_error
+	 */
+	void waitInLine(const AsyncGetRequestPtr &request) {
+		admitQueuedRequest(request->appRoot);
+		{
+			boost::mutex::scoped_lock l(asyncGetLock);
+			if (asyncGetThreads.empty()) {
+				startAsyncGetThread();
+			}
+		}
+		request->waitingRequest = new WaitingRequest(*this, request->appRoot,
+			request->priority, request->begin, 0);
+		request->waitingRequest->async = request;
+		if (waitingAsyncGets == 0) {
+			// Let the cleaner thread check the call's queue time.
+			cleanerThreadSleeper.notify_one();
+		}
+		waitingAsyncGets++;
+		// It may be first in line already.
+		wakeUpNextWaiter();
+	}
+	
+	/**
+	 * Takes a getAsync() call out of line. The caller must hold a reference
+	 * to it, and set its result afterwards.
+	 *
+	 * @pre The pool lock is held, and the call is waiting in line.
+	 */
+	void leaveLine(AsyncGetRequest &request) {
+		WaitingRequest *waitingRequest = request.waitingRequest;
+		request.waitingRequest = NULL;
+		waitingAsyncGets--;
+		delete waitingRequest;
+	}
+	
+	/**
+	 * Opens a session for a getAsync() call if there's an idle instance
+	 * for it, and puts the call in line otherwise. Returns a NULL pointer
+	 * in the latter case.
+	 *
+	 * @pre The pool lock is held.
+	 * @throws BusyException The call may not be queued.
+	 */
+	Application::SessionPtr openSessionOrWaitInLine(InstrumentedMutex::scoped_lock &l,
+	                                                const AsyncGetRequestPtr &request) {
+		GetTimings timings;
+		Application::SessionPtr session(openSession(l, request->appRoot,
+			request->lowerPrivilege, request->lowestUser, request->environment,
+			request->spawnMethod, request->appType, request->traceId,
+			request->priority, request->begin, timings, false));
+		if (session == NULL) {
+			waitInLine(request);
+		}
+		return session;
+	}
+	
+	/**
+	 * Rejects the getAsync() calls that have waited in line for longer than
+	 * maxRequestQueueTime, and lets the first one in line proceed if worker
+	 * processes have closed sessions in the meantime. There's no thread
+	 * that waits for these calls to do so.
+	 *
+	 * @pre The pool lock is held.
+	 */
+	void checkAsyncGets() {
+		if (maxRequestQueueTime != 0) {
+			posix_time::ptime deadline(get_system_time() -
+				posix_time::seconds(maxRequestQueueTime));
+			vector<AsyncGetRequestPtr> expired;
+			WaitQueue::iterator it;
+			
+			for (it = waitQueue.begin(); it != waitQueue.end(); it++) {
+				WaitingRequest &waitingRequest(*it->second);
+				if (waitingRequest.async != NULL && !waitingRequest.dispatched
+				 && waitingRequest.async->begin <= deadline) {
+					expired.push_back(waitingRequest.async);
+				}
 			}
-		} catch (const SpawnException &e) {
-			string message("Cannot spawn application '");
-			message.append(appRoot);
-			message.append("': ");
-			message.append(e.what());
-			if (e.hasErrorPage()) {
-				throw SpawnException(message, e.getErrorPage());
+			for (unsigned int i = 0; i < expired.size(); i++) {
+				AsyncGetRequest &request(*expired[i]);
+				leaveLine(request);
+				try {
+					rejectRequest(request.appRoot, "queue_timeout", "Application '" +
+						request.appRoot + "' didn't become available within " +
+						Passenger::toString(maxRequestQueueTime) + " seconds.");
+				} catch (const BusyException &e) {
+					request.result->setException(e);
+				}
+			}
+		}
+		if (sharedTable != NULL) {
+			wakeUpNextWaiter();
+		}
+	}
+	
+	/**
+	 * Whether the given application has a restart.txt. Unlike needsRestart(),
+	 * this doesn't change anything.
+	 */
+	static bool restartFileExists(const string &appRoot) {
+		try {
+			return fileExists((appRoot + "/tmp/restart.txt").c_str());
+		} catch (const FileSystemException &) {
+			return true;
+		}
+	}
+	
+	/**
+	 * Hands a getAsync() call to the async get threads, and starts another
+	 * one if they're all busy.
+	 *
+	 * @throws boost::thread_resource_error No thread could be started, and
+	 *         there are none yet.
+	 */
+	void queueAsyncGet(const AsyncGetRequestPtr &request) {
+		boost::mutex::scoped_lock l(asyncGetLock);
+		asyncGetQueue.push_back(request);
+		if (idleAsyncGetThreads == 0 && asyncGetThreads.size() < ASYNC_GET_THREADS) {
+			try {
+				startAsyncGetThread();
+			} catch (const thread_resource_error &) {
+				if (asyncGetThreads.empty()) {
+					asyncGetQueue.pop_back();
+					throw;
+				}
+				// The existing threads will get to it.
+			}
+		}
+		asyncGetQueued.notify_one();
+	}
+	
+	/**
+	 * @pre asyncGetLock is held.
+	 * @throws boost::thread_resource_error
+	 */
+	void startAsyncGetThread() {
+		asyncGetThreads.push_back(new thread(
+			bind(&StandardApplicationPool::asyncGetThreadMainLoop, this),
+			ASYNC_GET_THREAD_STACK_SIZE
+		));
+	}
+	
+	/**
+	 * Serves a getAsync() call that getAsync() couldn't serve right away,
+	 * or that's first in line.
+	 */
+	void serveAsyncGet(const AsyncGetRequestPtr &request) {
+		Application::SessionPtr session;
+		
+		try {
+			InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+			
+			if (done) {
+				if (request->waitingRequest != NULL) {
+					leaveLine(*request);
+				}
+				throw IOException("The application pool is being destroyed.");
+			}
+			if (request->waitingRequest != NULL) {
+				if (headOfLine() == request->waitingRequest) {
+					GetTimings timings;
+					leaveLine(*request);
+					session = openSession(l, request->appRoot,
+						request->lowerPrivilege, request->lowestUser,
+						request->environment, request->spawnMethod,
+						request->appType, request->traceId,
+						request->priority, request->begin, timings,
+						true, 0, true);
+				} else {
+					// It's handed to us again once it's first in line.
+					request->waitingRequest->dispatched = false;
+				}
+			} else if (isLocal(request->appRoot)) {
+				session = openSessionOrWaitInLine(l, request);
 			} else {
-				throw SpawnException(message);
+				l.unlock();
+				session = get(request->appRoot, request->lowerPrivilege,
+					request->lowestUser, request->environment,
+					request->spawnMethod, request->appType,
+					request->traceId, request->priority);
+			}
+			if (l.owns_lock()) {
+				// Opening the session may have unlocked it already.
+				l.unlock();
+			}
+			if (session != NULL) {
+				request->result->setSession(session);
 			}
 		} catch (const exception &e) {
-			string message("Cannot spawn application '");
-			message.append(appRoot);
-			message.append("': ");
-			message.append(e.what());
-			throw SpawnException(message);
+			request->result->setException(e);
+		} catch (const thread_interrupted &) {
+			request->result->setException(IOException(
+				"The application pool is being destroyed."));
 		}
+	}
+	
+	void asyncGetThreadMainLoop() {
+		boost::mutex::scoped_lock l(asyncGetLock);
 		
-		return make_pair(container, list);
+		while (!asyncGetDone) {
+			if (asyncGetQueue.empty()) {
+				idleAsyncGetThreads++;
+				asyncGetQueued.wait(l);
+				idleAsyncGetThreads--;
+				continue;
+			}
+			
+			AsyncGetRequestPtr request(asyncGetQueue.front());
+			asyncGetQueue.pop_front();
+			l.unlock();
+			serveAsyncGet(request);
+			// Dropping the request may close its session, which locks
+			// the pool lock.
+			request.reset();
+			l.lock();
+		}
 	}
 	
 public:
@@ -521,20 +2185,25 @@ public:
 	 *             the <tt>user</tt> is not a valid username, then
 	 *             the spawn manager will be run as the current user.
 	 * @param rubyCommand The Ruby interpreter's command.
+	 * @param spawnAgents The addresses of the spawn agents to spawn applications
+	 *             with. If empty, applications are spawned locally. See SpawnManager.
+	 * @param spawnAgentSecret The shared secret that the spawn agents expect.
 	 * @throws SystemException An error occured while trying to setup the spawn server.
 	 * @throws IOException The specified log file could not be opened.
 	 */
 	StandardApplicationPool(const string &spawnServerCommand,
 	             const string &logFile = "",
 	             const string &rubyCommand = "ruby",
-	             const string &user = "")
+	             const string &user = "",
+	             const vector<string> &spawnAgents = vector<string>(),
+	             const string &spawnAgentSecret = "")
 	        :
 		#ifndef PASSENGER_USE_DUMMY_SPAWN_MANAGER
-		spawnManager(spawnServerCommand, logFile, rubyCommand, user),
+		spawnManager(spawnServerCommand, logFile, rubyCommand, user, spawnAgents,
+			spawnAgentSecret),
 		#endif
 		data(new SharedData()),
 		lock(data->lock),
-		activeOrMaxChanged(data->activeOrMaxChanged),
 		apps(data->apps),
 		max(data->max),
 		count(data->count),
@@ -542,32 +2211,227 @@ public:
 		maxPerApp(data->maxPerApp),
 		inactiveApps(data->inactiveApps),
 		restartFileTimes(data->restartFileTimes),
-		appInstanceCount(data->appInstanceCount)
+		appInstanceCount(data->appInstanceCount),
+		remoteInstances(data->remoteInstances)
 	{
 		detached = false;
 		done = false;
+		clusterReplicas = 1;
+		nextClusterOwner = 0;
+		reportedSharedReservations = 0;
+		reportedSharedMisses = 0;
 		max = DEFAULT_MAX_POOL_SIZE;
 		count = 0;
 		active = 0;
 		maxPerApp = DEFAULT_MAX_INSTANCES_PER_APP;
 		maxIdleTime = DEFAULT_MAX_IDLE_TIME;
+		maxRequestQueueSize = DEFAULT_MAX_REQUEST_QUEUE_SIZE;
+		maxTotalQueuedRequests = 0;
+		maxRequestQueueTime = 0;
+		waitingRequests = 0;
+		waitingHolders = 0;
+		waitingAsyncGets = 0;
+		data->pool = this;
 		cleanerThread = new thread(
 			bind(&StandardApplicationPool::cleanerThreadMainLoop, this),
 			CLEANER_THREAD_STACK_SIZE
 		);
+		replenisherDone = false;
+		idleAsyncGetThreads = 0;
+		asyncGetDone = false;
+		replenisherThread = new thread(
+			bind(&StandardApplicationPool::replenisherThreadMainLoop, this),
+			REPLENISHER_THREAD_STACK_SIZE
+		);
+		metricsCollectorId = MetricsRegistry::global().addCollector(
+			bind(&StandardApplicationPool::collectMetrics, this));
 	}
 	
 	virtual ~StandardApplicationPool() {
+		MetricsRegistry::global().removeCollector(metricsCollectorId);
 		if (!detached) {
 			this_thread::disable_interruption di;
 			{
-				boost::mutex::scoped_lock l(lock);
+				InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
 				done = true;
+				data->pool = NULL;
 				cleanerThreadSleeper.notify_one();
+				// Wakes up the requests that wait in line. getAsync()
+				// calls that do so without a thread are failed here,
+				// unless an async get thread is about to serve them.
+				vector<AsyncGetRequestPtr> asyncGets;
+				WaitQueue::iterator it;
+				for (it = waitQueue.begin(); it != waitQueue.end(); it++) {
+					if (it->second->async == NULL) {
+						it->second->wakeup.notify_one();
+					} else if (!it->second->dispatched) {
+						asyncGets.push_back(it->second->async);
+					}
+				}
+				for (unsigned int i = 0; i < asyncGets.size(); i++) {
+					leaveLine(*asyncGets[i]);
+					asyncGets[i]->result->setException(IOException(
+						"The application pool is being destroyed."));
+				}
+			}
+			{
+				boost::mutex::scoped_lock l(asyncGetLock);
+				asyncGetDone = true;
+				asyncGetQueued.notify_all();
+			}
+			for (unsigned int i = 0; i < asyncGetThreads.size(); i++) {
+				asyncGetThreads[i]->join();
+			}
+			while (!asyncGetQueue.empty()) {
+				AsyncGetRequestPtr request(asyncGetQueue.front());
+				asyncGetQueue.pop_front();
+				{
+					InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+					if (request->waitingRequest != NULL) {
+						leaveLine(*request);
+					}
+				}
+				request->result->setException(IOException(
+					"The application pool is being destroyed."));
 			}
 			cleanerThread->join();
+			{
+				boost::mutex::scoped_lock l(replenishLock);
+				replenisherDone = true;
+				replenishNeeded.notify_one();
+			}
+			replenisherThread->join();
+		} else {
+			data->pool = NULL;
 		}
 		delete cleanerThread;
+		delete replenisherThread;
+		for (unsigned int i = 0; i < asyncGetThreads.size(); i++) {
+			delete asyncGetThreads[i];
+		}
+	}
+	
+	/**
+	 * Make this pool a member of a cluster of pools, which share the
+	 * applications among each other. Each application is placed on
+	 * <tt>replicas</tt> of the cluster's nodes by consistent hashing of
+	 * its application root, and get() forwards requests for applications
+	 * that are placed elsewhere to one of the nodes that own them. The
+	 * other nodes are expected to serve getLocal() on their cluster
+	 * addresses; see ApplicationPoolServerExecutable.cpp. A node that
+	 * can't be reached is skipped for a while, like remote instances are;
+	 * if all nodes that own an application are down, it's served locally.
+	 *
+	 * Only the given applications are shared. Other applications are
+	 * always served locally, and the other nodes refuse to serve them.
+	 *
+	 * All nodes must be configured with the same list of nodes, the same
+	 * applications and the same secret. This method must be called before
+	 * the pool is used.
+	 *
+	 * @param self The cluster address of this node, which must be in <tt>nodes</tt>.
+	 * @param nodes The cluster addresses (host:port) of all nodes.
+	 * @param apps The application roots of the shared applications.
+	 * @param secret The secret with which requests are forwarded to other nodes.
+	 * @param replicas The number of nodes that each application is placed on.
+	 */
+	void setCluster(const string &self, const vector<string> &nodes,
+	                const set<string> &apps, const string &secret,
+	                unsigned int replicas = 1) {
+		vector<string>::const_iterator it;
+		
+		cluster = HashRing();
+		for (it = nodes.begin(); it != nodes.end(); it++) {
+			cluster.add(*it);
+		}
+		cluster.add(self);
+		clusterSelf = self;
+		clusterApps = apps;
+		clusterSecret = secret;
+		clusterReplicas = (replicas == 0) ? 1 : replicas;
+		clusterNodeLiveness.clear();
+	}
+	
+	/**
+	 * Place newly spawned application instances in per-application control
+	 * groups, or stop doing so if <tt>cgroups</tt> is NULL. The groups'
+	 * statistics are shown in status reports, and applications whose group
+	 * is close to its memory limit don't get more instances, and are the
+	 * first to lose an idle instance when room is needed for another
+	 * application. The statistics are read by the cleaner thread every
+	 * CGROUP_STATS_INTERVAL seconds.
+	 *
+	 * This method must be called before the pool is used, because it may
+	 * restart the spawn server; see SpawnManager::setCgroups().
+	 */
+	void setCgroups(const CgroupManagerPtr &cgroups) {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		this->cgroups = cgroups;
+		cgroupStats.clear();
+		spawnManager.setCgroups(cgroups);
+		// Let the cleaner thread start reading the groups' statistics.
+		cleanerThreadSleeper.notify_one();
+	}
+	
+	/**
+	 * Publish newly spawned application instances in the given shared
+	 * instance table, so that Apache worker processes can reserve them
+	 * without going through this pool. Any instances that are already in
+	 * the table, e.g. those of a previous ApplicationPool server process,
+	 * are retired. This method must be called before the pool is used.
+	 *
+	 * Sessions that worker processes open through the table count as
+	 * sessions of the instance: get() doesn't pick an instance that's in
+	 * use by a worker process if another one is idle, and busy instances
+	 * aren't cleaned up. Spare connections (see
+	 * Application::replenishSpareConnections()) are disabled, because an
+	 * instance that's waiting for a request on a spare connection doesn't
+	 * accept worker processes' connections.
+	 */
+	void setSharedInstanceTable(const SharedInstanceTablePtr &table) {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		table->reset();
+		sharedTable = table;
+		reportedSharedReservations = table->getReservations();
+		reportedSharedMisses = table->getMisses();
+	}
+	
+	/**
+	 * Pin newly spawned application instances to the nodes of the given
+	 * NUMA topology, balancing each application's instances over the nodes.
+	 * Placement is disabled if the topology has fewer than two nodes, which
+	 * is the default. Instances that are already running aren't moved.
+	 *
+	 * @see NumaTopology::detect()
+	 */
+	void setNumaTopology(const NumaTopology &topology) {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		numaTopology = topology;
+		ApplicationMap::iterator it;
+		for (it = apps.begin(); it != apps.end(); it++) {
+			AppContainerList::iterator lit;
+			for (lit = it->second->begin(); lit != it->second->end(); lit++) {
+				(*lit)->numaNode = -1;
+			}
+		}
+	}
+	
+	/**
+	 * Checks whether the given application is shared among the nodes of
+	 * this pool's cluster. See setCluster().
+	 */
+	bool isClusterApp(const string &appRoot) const {
+		return clusterApps.find(appRoot) != clusterApps.end();
+	}
+	
+	/**
+	 * Checks whether the given application is placed on this node. This is
+	 * always the case if this pool isn't a member of a cluster, or if the
+	 * application isn't shared among its nodes.
+	 */
+	bool isLocal(const string &appRoot) const {
+		return cluster.empty() || !isClusterApp(appRoot)
+			|| cluster.owns(clusterSelf, appRoot, clusterReplicas);
 	}
 	
 	virtual Application::SessionPtr get(
@@ -576,83 +2440,266 @@ public:
 		const string &lowestUser = "nobody",
 		const string &environment = "production",
 		const string &spawnMethod = "smart",
-		const string &appType = "rails"
+		const string &appType = "rails",
+		const string &traceId = "",
+		Priority priority = NORMAL_PRIORITY
+	) {
+		if (isLocal(appRoot)) {
+			return getLocal(appRoot, lowerPrivilege, lowestUser,
+				environment, spawnMethod, appType, traceId, priority);
+		}
+		
+		vector<string> owners(cluster.getNodes(appRoot, clusterReplicas));
+		unsigned int start = __sync_fetch_and_add(&nextClusterOwner, 1);
+		for (unsigned int i = 0; i < owners.size(); i++) {
+			const string &node(owners[(start + i) % owners.size()]);
+			bool probing;
+			{
+				boost::mutex::scoped_lock cl(clusterLock);
+				Liveness &liveness(clusterNodeLiveness[node]);
+				if (!liveness.mayTry(time(NULL))) {
+					continue;
+				}
+				probing = liveness.failures > 0;
+			}
+			try {
+				Application::SessionPtr session(getFromClusterNode(node,
+					appRoot, environment, spawnMethod, appType, traceId,
+					priority));
+				if (probing) {
+					boost::mutex::scoped_lock cl(clusterLock);
+					clusterNodeLiveness[node].succeeded();
+				}
+				MetricsRegistry::global().counter("passenger_cluster_forwarded_gets_total",
+					"Number of get() calls that were forwarded to another cluster node.",
+					MetricsRegistry::label("node", node)).increment();
+				if (!traceId.empty()) {
+					P_DEBUG("Trace " << traceId << ": forwarded to cluster node " <<
+						node << ", PID " << session->getPid());
+				}
+				return session;
+			} catch (const SystemException &e) {
+				P_WARN("Cannot forward a request for '" << appRoot <<
+					"' to cluster node " << node << ": " << e.sys());
+			} catch (const IOException &e) {
+				P_WARN("Cannot forward a request for '" << appRoot <<
+					"' to cluster node " << node << ": " << e.what());
+			}
+			MetricsRegistry::global().counter("passenger_cluster_forward_failures_total",
+				"Number of failed attempts to forward a get() call to another cluster node.",
+				MetricsRegistry::label("node", node)).increment();
+			boost::mutex::scoped_lock cl(clusterLock);
+			clusterNodeLiveness[node].failed(time(NULL));
+		}
+		
+		// None of the owners are reachable, or all of them are down:
+		// serve the application ourselves rather than failing the request.
+		return getLocal(appRoot, lowerPrivilege, lowestUser,
+			environment, spawnMethod, appType, traceId, priority);
+	}
+	
+	/**
+	 * Like get(), but always opens a session with a local instance, even if
+	 * the application is placed on other nodes of the cluster. This is what
+	 * other nodes' forwarded requests are served with.
+	 */
+	Application::SessionPtr getLocal(
+		const string &appRoot,
+		bool lowerPrivilege = true,
+		const string &lowestUser = "nobody",
+		const string &environment = "production",
+		const string &spawnMethod = "smart",
+		const string &appType = "rails",
+		const string &traceId = "",
+		Priority priority = NORMAL_PRIORITY
 	) {
 		using namespace boost::posix_time;
-		unsigned int attempt = 0;
-		ptime timeLimit(get_system_time() + millisec(GET_TIMEOUT));
-		unique_lock<boost::mutex> l(lock);
+		ptime begin(get_system_time());
+		GetTimings timings;
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		timings.lockWait = get_system_time() - begin;
+		return openSession(l, appRoot, lowerPrivilege, lowestUser, environment,
+			spawnMethod, appType, traceId, priority, begin, timings, true);
+	}
+	
+	/**
+	 * Like ApplicationPool::getMultiple(). Every session with a local
+	 * instance needs an instance of its own, so a request for more sessions
+	 * than the application can have instances would wait forever for its own
+	 * sessions to be closed. Such requests are rejected with a BusyException
+	 * instead, and so are requests whose sessions wait for room that only
+	 * their own sessions could free.
+	 */
+	virtual vector<Application::SessionPtr> getMultiple(
+		unsigned int count,
+		const string &appRoot,
+		bool lowerPrivilege = true,
+		const string &lowestUser = "nobody",
+		const string &environment = "production",
+		const string &spawnMethod = "smart",
+		const string &appType = "rails",
+		const string &traceId = "",
+		Priority priority = NORMAL_PRIORITY
+	) {
+		if (count == 0 || !isLocal(appRoot)) {
+			return ApplicationPool::getMultiple(count, appRoot, lowerPrivilege,
+				lowestUser, environment, spawnMethod, appType, traceId,
+				priority);
+		}
 		
-		while (true) {
-			attempt++;
-			
-			pair<AppContainerPtr, AppContainerList *> p(
-				spawnOrUseExisting(l, appRoot, lowerPrivilege, lowestUser,
-					environment, spawnMethod, appType)
-			);
-			AppContainerPtr &container(p.first);
-			AppContainerList &list(*p.second);
-
-			container->lastUsed = time(NULL);
-			container->sessions++;
-			
-			P_ASSERT(verifyState(), Application::SessionPtr(),
-				"State is valid:\n" << toString(false));
+		vector<Application::SessionPtr> result;
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		
+		if (remoteInstances.find(appRoot) == remoteInstances.end()
+		 && count > capacityFor(appRoot)) {
+			rejectRequest(appRoot, "too_many_sessions", "Application '" +
+				appRoot + "' can't have " + Passenger::toString(count) +
+				" instances at the same time.");
+		}
+		result.reserve(count);
+		try {
+			for (unsigned int i = 0; i < count; i++) {
+				posix_time::ptime begin(get_system_time());
+				GetTimings timings;
+				
+				// Sessions with remote instances are opened without the lock.
+				if (!l.owns_lock()) {
+					l.lock();
+				}
+				result.push_back(openSession(l, appRoot, lowerPrivilege,
+					lowestUser, environment, spawnMethod, appType, traceId,
+					priority, begin, timings, true, i));
+			}
+		} catch (...) {
+			// The sessions' destructors need the lock.
+			if (l.owns_lock()) {
+				l.unlock();
+			}
+			result.clear();
+			throw;
+		}
+		return result;
+	}
+	
+	/**
+	 * Opens a session for getAsync(): by default, the session is opened
+	 * right away if there's an idle instance. Otherwise the call waits in
+	 * line like get() does, but without a thread, until one of a few
+	 * background threads takes it from there once it's first in line. At
+	 * most ASYNC_GET_THREADS threads are used, no matter how many gets are
+	 * pending. They only block while spawning and connecting, and for
+	 * gets that are forwarded to other cluster nodes.
+	 */
+	virtual PendingGetPtr getAsync(
+		const string &appRoot,
+		bool lowerPrivilege = true,
+		const string &lowestUser = "nobody",
+		const string &environment = "production",
+		const string &spawnMethod = "smart",
+		const string &appType = "rails",
+		const string &traceId = "",
+		Priority priority = NORMAL_PRIORITY
+	) {
+		SettablePendingGetPtr result(new SettablePendingGet());
+		AsyncGetRequestPtr request(new AsyncGetRequest());
+		request->appRoot = appRoot;
+		request->lowerPrivilege = lowerPrivilege;
+		request->lowestUser = lowestUser;
+		request->environment = environment;
+		request->spawnMethod = spawnMethod;
+		request->appType = appType;
+		request->traceId = traceId;
+		request->priority = priority;
+		request->result = result;
+		request->begin = get_system_time();
+		request->waitingRequest = NULL;
+		
+		if (isLocal(appRoot) && !restartFileExists(appRoot)) {
+			Application::SessionPtr session;
 			try {
-				return container->app->connect(SessionCloseCallback(data, container));
-			} catch (const exception &e) {
-				container->sessions--;
-				if (attempt == MAX_GET_ATTEMPTS) {
-					string message("Cannot connect to an existing "
-						"application instance for '");
-					message.append(appRoot);
-					message.append("': ");
-					try {
-						const SystemException &syse =
-							dynamic_cast<const SystemException &>(e);
-						message.append(syse.sys());
-					} catch (const bad_cast &) {
-						message.append(e.what());
-					}
-					throw IOException(message);
-				} else {
-					list.erase(container->iterator);
-					if (list.empty()) {
-						apps.erase(appRoot);
-						appInstanceCount.erase(appRoot);
+				InstrumentedMutex::scoped_lock l(lock, boost::defer_lock, P_LOCK_SITE);
+				if (l.try_lock()) {
+					session = openSessionOrWaitInLine(l, request);
+					if (session == NULL) {
+						return result;
 					}
-					count--;
-					active--;
-					activeOrMaxChanged.notify_all();
-					P_ASSERT(verifyState(), Application::SessionPtr(),
-						"State is valid.");
 				}
+			} catch (const exception &e) {
+				result->setException(e);
+				return result;
+			}
+			if (session != NULL) {
+				result->setSession(session);
+				return result;
 			}
 		}
-		// Never reached; shut up compiler warning
-		return Application::SessionPtr();
+		
+		// The lock is busy, or restarting the application or forwarding
+		// the get may take a while.
+		queueAsyncGet(request);
+		return result;
 	}
 	
 	virtual void clear() {
-		boost::mutex::scoped_lock l(lock);
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
 		apps.clear();
 		inactiveApps.clear();
 		restartFileTimes.clear();
 		appInstanceCount.clear();
+		remoteInstances.clear();
 		count = 0;
 		active = 0;
 	}
 	
+	virtual void addRemoteInstance(const string &appRoot, const string &address) {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		RemoteInstanceList &list(remoteInstances[appRoot]);
+		RemoteInstanceList::const_iterator it;
+		
+		for (it = list.begin(); it != list.end(); it++) {
+			if ((*it)->app->getListenSocketName() == address) {
+				return;
+			}
+		}
+		
+		RemoteInstancePtr instance(new RemoteInstance());
+		instance->app = ptr(new Application(appRoot, 0, address,
+			Application::TCP_SOCKET, -1));
+		instance->sessions = 0;
+		list.push_back(instance);
+		P_DEBUG("Added remote instance " << address << " for " << appRoot);
+	}
+	
+	virtual void removeRemoteInstance(const string &appRoot, const string &address) {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		RemoteInstanceMap::iterator it(remoteInstances.find(appRoot));
+		
+		if (it != remoteInstances.end()) {
+			RemoteInstanceList::iterator lit;
+			for (lit = it->second.begin(); lit != it->second.end(); lit++) {
+				if ((*lit)->app->getListenSocketName() == address) {
+					it->second.erase(lit);
+					P_DEBUG("Removed remote instance " << address <<
+						" for " << appRoot);
+					break;
+				}
+			}
+			if (it->second.empty()) {
+				remoteInstances.erase(it);
+			}
+		}
+	}
+	
 	virtual void setMaxIdleTime(unsigned int seconds) {
-		boost::mutex::scoped_lock l(lock);
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
 		maxIdleTime = seconds;
 		cleanerThreadSleeper.notify_one();
 	}
 	
 	virtual void setMax(unsigned int max) {
-		boost::mutex::scoped_lock l(lock);
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
 		this->max = max;
-		activeOrMaxChanged.notify_all();
+		wakeUpNextWaiter();
 	}
 	
 	virtual unsigned int getActive() const {
@@ -664,24 +2711,62 @@ public:
 	}
 	
 	virtual void setMaxPerApp(unsigned int maxPerApp) {
-		boost::mutex::scoped_lock l(lock);
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
 		this->maxPerApp = maxPerApp;
-		activeOrMaxChanged.notify_all();
+		wakeUpNextWaiter();
+	}
+	
+	virtual void setRequestQueueLimits(unsigned int maxPerApp, unsigned int maxTotal,
+	                                   unsigned int maxTime) {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		maxRequestQueueSize = maxPerApp;
+		maxTotalQueuedRequests = maxTotal;
+		maxRequestQueueTime = maxTime;
+	}
+	
+	virtual void setAppShare(const string &appRoot, unsigned int minInstances,
+	                         unsigned int weight) {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		AppShare &share(appShares[appRoot]);
+		share.minInstances = minInstances;
+		share.weight = (weight == 0) ? 1 : weight;
+		wakeUpNextWaiter();
 	}
 	
 	virtual pid_t getSpawnServerPid() const {
 		return spawnManager.getServerPid();
 	}
 	
+	/**
+	 * Returns the PIDs of all local application instances in the pool, mapped
+	 * to their application roots. Instances that listen on TCP sockets are
+	 * skipped, because they may run on other hosts.
+	 */
+	map<pid_t, string> getApplicationPids() const {
+		InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+		map<pid_t, string> result;
+		ApplicationMap::const_iterator it;
+		for (it = apps.begin(); it != apps.end(); it++) {
+			AppContainerList::const_iterator lit;
+			for (lit = it->second->begin(); lit != it->second->end(); lit++) {
+				if ((*lit)->app->getSocketType() != Application::TCP_SOCKET) {
+					result[(*lit)->app->getPid()] = it->first;
+				}
+			}
+		}
+		return result;
+	}
+	
 	/**
 	 * Returns a textual description of the internal state of
 	 * the application pool.
 	 */
 	virtual string toString(bool lockMutex = true) const {
 		if (lockMutex) {
-			return toString(boost::adopt_lock);
+			InstrumentedMutex::scoped_lock l(lock, P_LOCK_SITE);
+			return toStringWithoutLock();
 		} else {
-			return toString(boost::defer_lock);
+			return toStringWithoutLock();
 		}
 	}
 };
@@ -18,6 +18,14 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include "System.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#ifdef __linux__
+	#include <sys/eventfd.h>
+#endif
 
 /*************************************
  * boost::this_thread
@@ -25,32 +33,68 @@
 
 using namespace boost;
 
-thread_specific_ptr<bool> this_thread::_syscalls_interruptable;
-
-
-bool
-this_thread::syscalls_interruptable() {
-	return _syscalls_interruptable.get() == NULL || *_syscalls_interruptable;
-}
+__thread bool this_thread::_syscalls_interruptable = true;
+__thread int this_thread::_interruption_fd = -1;
 
 
 /*************************************
- * Passenger
+ * Passenger::InterruptionChannel
  *************************************/
 
 using namespace Passenger;
 
-static bool interrupted = false;
+InterruptionChannel::InterruptionChannel() {
+	#ifdef __linux__
+		readFd = writeFd = eventfd(0, 0);
+		if (readFd == -1) {
+			throw thread_resource_error();
+		}
+	#else
+		int fds[2];
+		
+		if (::pipe(fds) == -1) {
+			throw thread_resource_error();
+		}
+		readFd = fds[0];
+		writeFd = fds[1];
+		fcntl(writeFd, F_SETFL, fcntl(writeFd, F_GETFL) | O_NONBLOCK);
+	#endif
+	// So that reset() doesn't block.
+	fcntl(readFd, F_SETFL, fcntl(readFd, F_GETFL) | O_NONBLOCK);
+}
 
-static void
-interruptionSignalHandler(int sig) {
-	interrupted = true;
+InterruptionChannel::~InterruptionChannel() {
+	::close(readFd);
+	if (writeFd != readFd) {
+		::close(writeFd);
+	}
 }
 
 void
-Passenger::setupSyscallInterruptionSupport() {
-	signal(INTERRUPTION_SIGNAL, interruptionSignalHandler);
-	siginterrupt(INTERRUPTION_SIGNAL, 1);
+InterruptionChannel::interrupt() {
+	// The channel is only read from by reset(), so it stays readable.
+	// A full pipe (EAGAIN) is readable too.
+	#ifdef __linux__
+		uint64_t value = 1;
+		while (::write(writeFd, &value, sizeof(value)) == -1 && errno == EINTR) {
+			// Retry.
+		}
+	#else
+		char x = 'x';
+		while (::write(writeFd, &x, 1) == -1 && errno == EINTR) {
+			// Retry.
+		}
+	#endif
+}
+
+void
+InterruptionChannel::reset() {
+	char buf[64];
+	ssize_t ret;
+	
+	do {
+		ret = ::read(readFd, buf, sizeof(buf));
+	} while (ret > 0 || (ret == -1 && errno == EINTR));
 }
 
 
@@ -58,6 +102,11 @@ Passenger::setupSyscallInterruptionSupport() {
  * Passenger::InterruptableCalls
  *************************************/
 
+/**
+ * Used in threads without an interruption channel: retries the call on EINTR
+ * if system call interruption is disabled, and throws thread_interrupted
+ * otherwise.
+ */
 #define CHECK_INTERRUPTION(error_expression, code) \
 	do { \
 		int _my_errno; \
@@ -72,9 +121,90 @@ Passenger::setupSyscallInterruptionSupport() {
 		errno = _my_errno; \
 	} while (false)
 
+/**
+ * Whether blocking calls should wait for the calling thread's interruption
+ * channel.
+ */
+static inline bool
+usesInterruptionChannel() {
+	return this_thread::_interruption_fd != -1 && this_thread::_syscalls_interruptable;
+}
+
+static inline bool
+wouldBlock(int e) {
+	return e == EAGAIN || e == EWOULDBLOCK;
+}
+
+/**
+ * Returns whether the given file descriptor is in non-blocking mode. Calls
+ * on such file descriptors must fail with EAGAIN instead of waiting.
+ */
+static bool
+isNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	return flags != -1 && (flags & O_NONBLOCK);
+}
+
+/**
+ * Wait until the given file descriptor is ready for the given events, or
+ * until the calling thread is interrupted.
+ *
+ * @throws thread_interrupted The calling thread has been interrupted.
+ */
+static void
+waitUntilReady(int fd, short events) {
+	struct pollfd fds[2];
+	int ret, e;
+	
+	fds[0].fd = fd;
+	fds[0].events = events;
+	fds[0].revents = 0;
+	fds[1].fd = this_thread::_interruption_fd;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+	do {
+		ret = ::poll(fds, 2, -1);
+	} while (ret == -1 && errno == EINTR);
+	e = errno;
+	if (ret > 0 && fds[1].revents != 0) {
+		throw thread_interrupted();
+	}
+	// If poll() failed, then the actual call will probably fail too,
+	// and report the error.
+	errno = e;
+}
+
+/**
+ * Perform a socket call without blocking, and if it would block, wait for the
+ * socket and try again. <tt>fallback</tt> is used for file descriptors that
+ * aren't sockets, after waiting for them.
+ */
+#define WAIT_FOR_INTERRUPTION(result_type, fd, events, nonblocking_code, fallback_code) \
+	do { \
+		result_type _ret = nonblocking_code; \
+		if (_ret != -1) { \
+			return _ret; \
+		} else if (errno == ENOTSOCK) { \
+			waitUntilReady(fd, events); \
+			do { \
+				_ret = fallback_code; \
+			} while (_ret == -1 && errno == EINTR); \
+			return _ret; \
+		} else if (errno != EINTR && !(wouldBlock(errno) && !isNonBlocking(fd))) { \
+			return _ret; \
+		} else if (errno != EINTR) { \
+			waitUntilReady(fd, events); \
+		} \
+	} while (true)
+
 ssize_t
 InterruptableCalls::read(int fd, void *buf, size_t count) {
 	ssize_t ret;
+	if (usesInterruptionChannel()) {
+		WAIT_FOR_INTERRUPTION(ssize_t, fd, POLLIN,
+			::recv(fd, buf, count, MSG_DONTWAIT),
+			::read(fd, buf, count));
+	}
 	CHECK_INTERRUPTION(
 		ret == -1,
 		ret = ::read(fd, buf, count)
@@ -85,6 +215,11 @@ InterruptableCalls::read(int fd, void *buf, size_t count) {
 ssize_t
 InterruptableCalls::write(int fd, const void *buf, size_t count) {
 	ssize_t ret;
+	if (usesInterruptionChannel()) {
+		WAIT_FOR_INTERRUPTION(ssize_t, fd, POLLOUT,
+			::send(fd, buf, count, MSG_DONTWAIT),
+			::write(fd, buf, count));
+	}
 	CHECK_INTERRUPTION(
 		ret == -1,
 		ret = ::write(fd, buf, count)
@@ -102,6 +237,16 @@ InterruptableCalls::close(int fd) {
 	return ret;
 }
 
+int
+InterruptableCalls::pipe(int filedes[2]) {
+	int ret;
+	CHECK_INTERRUPTION(
+		ret == -1,
+		ret = ::pipe(filedes)
+	);
+	return ret;
+}
+
 int
 InterruptableCalls::socketpair(int d, int type, int protocol, int sv[2]) {
 	int ret;
@@ -115,6 +260,11 @@ InterruptableCalls::socketpair(int d, int type, int protocol, int sv[2]) {
 ssize_t
 InterruptableCalls::recvmsg(int s, struct msghdr *msg, int flags) {
 	ssize_t ret;
+	if (usesInterruptionChannel()) {
+		WAIT_FOR_INTERRUPTION(ssize_t, s, POLLIN,
+			::recvmsg(s, msg, flags | MSG_DONTWAIT),
+			::recvmsg(s, msg, flags));
+	}
 	CHECK_INTERRUPTION(
 		ret == -1,
 		ret = ::recvmsg(s, msg, flags)
@@ -125,6 +275,11 @@ InterruptableCalls::recvmsg(int s, struct msghdr *msg, int flags) {
 ssize_t
 InterruptableCalls::sendmsg(int s, const struct msghdr *msg, int flags) {
 	ssize_t ret;
+	if (usesInterruptionChannel()) {
+		WAIT_FOR_INTERRUPTION(ssize_t, s, POLLOUT,
+			::sendmsg(s, msg, flags | MSG_DONTWAIT),
+			::sendmsg(s, msg, flags));
+	}
 	CHECK_INTERRUPTION(
 		ret == -1,
 		ret = ::sendmsg(s, msg, flags)
@@ -142,6 +297,59 @@ InterruptableCalls::shutdown(int s, int how) {
 	return ret;
 }
 
+int
+InterruptableCalls::accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
+	int ret;
+	if (usesInterruptionChannel() && !isNonBlocking(s)) {
+		waitUntilReady(s, POLLIN);
+		do {
+			ret = ::accept(s, addr, addrlen);
+		} while (ret == -1 && errno == EINTR);
+		return ret;
+	}
+	CHECK_INTERRUPTION(
+		ret == -1,
+		ret = ::accept(s, addr, addrlen)
+	);
+	return ret;
+}
+
+int
+InterruptableCalls::poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	int ret;
+	if (usesInterruptionChannel() && timeout != 0) {
+		// Poll for the interruption channel too, at the end of a copy
+		// of the given set.
+		struct pollfd smallSet[8];
+		std::vector<struct pollfd> largeSet;
+		struct pollfd *set = smallSet;
+		
+		if (nfds + 1 > sizeof(smallSet) / sizeof(struct pollfd)) {
+			largeSet.resize(nfds + 1);
+			set = &largeSet[0];
+		}
+		memcpy(set, fds, sizeof(struct pollfd) * nfds);
+		set[nfds].fd = this_thread::_interruption_fd;
+		set[nfds].events = POLLIN;
+		set[nfds].revents = 0;
+		do {
+			ret = ::poll(set, nfds + 1, timeout);
+		} while (ret == -1 && errno == EINTR);
+		if (ret > 0 && set[nfds].revents != 0) {
+			throw thread_interrupted();
+		}
+		for (nfds_t i = 0; i < nfds; i++) {
+			fds[i].revents = set[i].revents;
+		}
+		return ret;
+	}
+	CHECK_INTERRUPTION(
+		ret == -1,
+		ret = ::poll(fds, nfds, timeout)
+	);
+	return ret;
+}
+
 FILE *
 InterruptableCalls::fopen(const char *path, const char *mode) {
 	FILE *ret;
@@ -176,12 +384,34 @@ int
 InterruptableCalls::usleep(useconds_t usec) {
 	struct timespec spec;
 	spec.tv_sec = usec / 1000000;
-	spec.tv_nsec = usec % 1000000;
+	spec.tv_nsec = (usec % 1000000) * 1000;
 	return InterruptableCalls::nanosleep(&spec, NULL);
 }
 
 int
 InterruptableCalls::nanosleep(const struct timespec *req, struct timespec *rem) {
+	if (usesInterruptionChannel()) {
+		// Sleep by waiting for the interruption channel. Timeouts are
+		// rounded up to whole milliseconds.
+		struct pollfd fd;
+		int ret;
+		
+		fd.fd = this_thread::_interruption_fd;
+		fd.events = POLLIN;
+		fd.revents = 0;
+		ret = InterruptableCalls::poll(&fd, 0,
+			req->tv_sec * 1000 + (req->tv_nsec + 999999) / 1000000);
+		if (ret == -1) {
+			return -1;
+		} else {
+			if (rem != NULL) {
+				rem->tv_sec = 0;
+				rem->tv_nsec = 0;
+			}
+			return 0;
+		}
+	}
+	
 	struct timespec req2 = *req;
 	struct timespec rem2;
 	int ret, e;
@@ -223,6 +453,23 @@ InterruptableCalls::kill(pid_t pid, int sig) {
 pid_t
 InterruptableCalls::waitpid(pid_t pid, int *status, int options) {
 	pid_t ret;
+	if (usesInterruptionChannel() && !(options & WNOHANG)) {
+		// A process's exit can't be waited for with poll(), so check
+		// periodically, with exponential backoff.
+		useconds_t interval = 1000;
+		while (true) {
+			do {
+				ret = ::waitpid(pid, status, options | WNOHANG);
+			} while (ret == -1 && errno == EINTR);
+			if (ret != 0) {
+				return ret;
+			}
+			InterruptableCalls::usleep(interval);
+			if (interval < 100000) {
+				interval *= 2;
+			}
+		}
+	}
 	CHECK_INTERRUPTION(
 		ret == -1,
 		ret = ::waitpid(pid, status, options)
@@ -21,11 +21,13 @@
 #define _PASSENGER_SYSTEM_H_
 
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <poll.h>
 #include <unistd.h>
 #include <signal.h>
 #include <cstdio>
@@ -38,71 +40,169 @@
  * This file provides a framework for writing multithreading code that can
  * be interrupted, even when blocked on system calls or C library calls.
  *
- * One must first call Passenger::setupSysCallInterruptionSupport().
- * Then one may use the functions in Passenger::InterruptableCalls
- * as drop-in replacements for system calls or C library functions.
+ * One may use the functions in Passenger::InterruptableCalls as drop-in
+ * replacements for system calls or C library functions.
  * Thread::interrupt() and Thread::interruptAndJoin() should be used
  * for interrupting threads.
  *
+ * Each Thread has an interruption channel: an eventfd (or a pipe on systems
+ * without eventfd) that becomes readable when the thread is interrupted.
+ * In a Thread, the InterruptableCalls functions first try the call without
+ * blocking, which is a plain system call. Only if the call would block do
+ * they wait with poll() for the file descriptor and the interruption channel
+ * at the same time, and throw boost::thread_interrupted if the latter
+ * becomes readable. Signals aren't involved, so an interruption request
+ * can't get lost: it stays pending until the thread exits.
+ *
+ * In other threads, such as the web server's, the InterruptableCalls
+ * functions perform plain system calls, and throw boost::thread_interrupted
+ * if a call fails with EINTR because of a signal.
+ *
  * By default, interruptions are caught.
  */
 
 // This is one of the things that Java is good at and C++ sucks at. Sigh...
 
+namespace boost {
+namespace this_thread {
+
+	/**
+	 * @intern
+	 * Whether system calls should be interruptable in the calling thread.
+	 */
+	extern __thread bool _syscalls_interruptable;
+	
+	/**
+	 * @intern
+	 * The file descriptor of the calling thread's interruption channel, or
+	 * -1 if the calling thread isn't a Passenger::Thread.
+	 */
+	extern __thread int _interruption_fd;
+
+} // namespace this_thread
+} // namespace boost
+
 namespace Passenger {
 
 	using namespace boost;
 	
-	static const int INTERRUPTION_SIGNAL = SIGINT;
+	/**
+	 * A file descriptor that becomes readable, and stays readable, once
+	 * interrupt() has been called, until reset() is called. Used by Thread.
+	 */
+	class InterruptionChannel {
+	private:
+		int readFd;
+		int writeFd;
+		
+		InterruptionChannel(const InterruptionChannel &);
+		InterruptionChannel &operator=(const InterruptionChannel &);
+	
+	public:
+		/**
+		 * @throws boost::thread_resource_error The file descriptors cannot
+		 *         be created.
+		 */
+		InterruptionChannel();
+		~InterruptionChannel();
+		
+		int getFd() const {
+			return readFd;
+		}
+		
+		/** This is async-signal-safe and may be called any number of times. */
+		void interrupt();
+		
+		/** Make the file descriptor non-readable again. */
+		void reset();
+	};
+	
+	typedef shared_ptr<InterruptionChannel> InterruptionChannelPtr;
+	
+	/**
+	 * @intern
+	 * The main function of a Thread: makes the interruption channel known to
+	 * InterruptableCalls and then calls the user's function. It shares the
+	 * ownership of the channel, because a Thread object may be deleted while
+	 * its thread is still running.
+	 */
+	template <class F>
+	struct InterruptableThreadMain {
+		F func;
+		InterruptionChannelPtr channel;
+		
+		InterruptableThreadMain(const F &func, const InterruptionChannelPtr &channel)
+			: func(func), channel(channel) {}
+		
+		void operator()() {
+			this_thread::_interruption_fd = channel->getFd();
+			func();
+		}
+	};
 	
 	/**
-	 * Setup system call interruption support.
-	 * This function may only be called once. It installs a signal handler
-	 * for INTERRUPTION_SIGNAL, so one should not install a different signal
-	 * handler for that signal after calling this function.
+	 * @intern
+	 * Owns the interruption channel of a Thread. This is a base class of
+	 * Thread, so that the channel is created before the thread is started.
 	 */
-	void setupSyscallInterruptionSupport();
+	class InterruptionChannelOwner {
+	protected:
+		InterruptionChannelPtr interruptionChannel;
+		
+		InterruptionChannelOwner(): interruptionChannel(new InterruptionChannel()) {}
+	};
 	
 	/**
 	 * Thread class with system call interruption support.
 	 */
-	class Thread: public thread {
+	class Thread: private InterruptionChannelOwner, public thread {
 	public:
+		/**
+		 * @throws boost::thread_resource_error The thread or its interruption
+		 *         channel cannot be created.
+		 */
 		template <class F>
 		explicit Thread(F f, unsigned int stackSize = 0)
-			: thread(f, stackSize) {}
+			: InterruptionChannelOwner(),
+			  thread(InterruptableThreadMain<F>(f, interruptionChannel), stackSize) {}
 		
 		/**
 		 * Interrupt the thread. This method behaves just like
 		 * boost::thread::interrupt(), but will also respect the interruption
 		 * points defined in Passenger::InterruptableCalls.
 		 *
-		 * Note that an interruption request may get lost, depending on the
-		 * current execution point of the thread. Thus, one should call this
-		 * method in a loop, until a certain goal condition has been fulfilled.
-		 * interruptAndJoin() is a convenience method that implements this
-		 * pattern.
+		 * Unlike boost::thread::interrupt(), the interruption stays pending
+		 * after it has been delivered: every later interruptable call in the
+		 * thread throws boost::thread_interrupted too, unless system call
+		 * interruption is disabled.
 		 */
 		void interrupt() {
-			int ret;
-			
 			thread::interrupt();
-			do {
-				ret = pthread_kill(native_handle(),
-					INTERRUPTION_SIGNAL);
-			} while (ret == EINTR);
+			interruptionChannel->interrupt();
 		}
 		
 		/**
-		 * Keep interrupting the thread until it's done, then join it.
+		 * Interrupt the thread, then join it.
 		 *
 		 * @throws boost::thread_interrupted
 		 */
 		void interruptAndJoin() {
-			bool done = false;
-			while (!done) {
-				interrupt();
-				done = timed_join(posix_time::millisec(10));
+			interrupt();
+			join();
+		}
+		
+		/**
+		 * Clear a pending interruption, so that the thread can be reused
+		 * for other work (see ThreadPool). Must be called from within the
+		 * thread itself, and no other thread may call interrupt() at the
+		 * same time.
+		 */
+		void clearInterruption() {
+			interruptionChannel->reset();
+			try {
+				this_thread::interruption_point();
+			} catch (const thread_interrupted &) {
+				// The interruption request has been consumed.
 			}
 		}
 	};
@@ -117,11 +217,14 @@ namespace Passenger {
 		ssize_t read(int fd, void *buf, size_t count);
 		ssize_t write(int fd, const void *buf, size_t count);
 		int close(int fd);
+		int pipe(int filedes[2]);
 		
 		int socketpair(int d, int type, int protocol, int sv[2]);
 		ssize_t recvmsg(int s, struct msghdr *msg, int flags);
 		ssize_t sendmsg(int s, const struct msghdr *msg, int flags);
 		int shutdown(int s, int how);
+		int accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+		int poll(struct pollfd *fds, nfds_t nfds, int timeout);
 		
 		FILE *fopen(const char *path, const char *mode);
 		int fclose(FILE *fp);
@@ -140,19 +243,16 @@ namespace Passenger {
 namespace boost {
 namespace this_thread {
 
-	/**
-	 * @intern
-	 */
-	extern thread_specific_ptr<bool> _syscalls_interruptable;
-	
 	/**
 	 * Check whether system calls should be interruptable in
 	 * the calling thread.
 	 */
-	bool syscalls_interruptable();
+	inline bool syscalls_interruptable() {
+		return _syscalls_interruptable;
+	}
 	
 	class restore_syscall_interruption;
-
+	
 	/**
 	 * Create this struct on the stack to temporarily enable system
 	 * call interruption, until the object goes out of scope.
@@ -162,17 +262,12 @@ namespace this_thread {
 		bool lastValue;
 	public:
 		enable_syscall_interruption() {
-			if (_syscalls_interruptable.get() == NULL) {
-				lastValue = true;
-				_syscalls_interruptable.reset(new bool(true));
-			} else {
-				lastValue = *_syscalls_interruptable;
-				*_syscalls_interruptable = true;
-			}
+			lastValue = _syscalls_interruptable;
+			_syscalls_interruptable = true;
 		}
 		
 		~enable_syscall_interruption() {
-			*_syscalls_interruptable = lastValue;
+			_syscalls_interruptable = lastValue;
 		}
 	};
 	
@@ -188,17 +283,12 @@ namespace this_thread {
 		bool lastValue;
 	public:
 		disable_syscall_interruption() {
-			if (_syscalls_interruptable.get() == NULL) {
-				lastValue = true;
-				_syscalls_interruptable.reset(new bool(false));
-			} else {
-				lastValue = *_syscalls_interruptable;
-				*_syscalls_interruptable = false;
-			}
+			lastValue = _syscalls_interruptable;
+			_syscalls_interruptable = false;
 		}
 		
 		~disable_syscall_interruption() {
-			*_syscalls_interruptable = lastValue;
+			_syscalls_interruptable = lastValue;
 		}
 	};
 	
@@ -208,16 +298,15 @@ namespace this_thread {
 	 */
 	class restore_syscall_interruption {
 	private:
-		int lastValue;
+		bool lastValue;
 	public:
 		restore_syscall_interruption(const disable_syscall_interruption &intr) {
-			assert(_syscalls_interruptable.get() != NULL);
-			lastValue = *_syscalls_interruptable;
-			*_syscalls_interruptable = intr.lastValue;
+			lastValue = _syscalls_interruptable;
+			_syscalls_interruptable = intr.lastValue;
 		}
 		
 		~restore_syscall_interruption() {
-			*_syscalls_interruptable = lastValue;
+			_syscalls_interruptable = lastValue;
 		}
 	};
 
@@ -0,0 +1,281 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_THREAD_POOL_H_
+#define _PASSENGER_THREAD_POOL_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+#include <set>
+#include <vector>
+#include <exception>
+
+#include "System.h"
+#include "Logging.h"
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+/**
+ * A pool of reusable threads, for running tasks that may block for a long
+ * time, such as serving a connection. Every task gets its own thread: if
+ * there's no idle thread then a new one is created. When a task is done,
+ * its thread stays around for the next task, unless there are already
+ * <tt>maxIdle</tt> idle threads.
+ *
+ * Tasks can be interrupted through interruptAndWait(), which interrupts
+ * the task's thread just like Thread::interrupt() does. The interruption
+ * is cleared before the thread is reused.
+ *
+ * This class is fully thread-safe.
+ *
+ * @ingroup Support
+ */
+class ThreadPool {
+private:
+	struct Worker;
+
+public:
+	/** A task that has been submitted to a ThreadPool. */
+	class Task {
+	private:
+		friend class ThreadPool;
+		
+		function<void ()> func;
+		/** The worker that runs this task, or NULL if the task is done. */
+		Worker *worker;
+		
+		Task(const function<void ()> &func): func(func) {
+			worker = NULL;
+		}
+	};
+	
+	typedef shared_ptr<Task> TaskPtr;
+
+private:
+	struct Worker {
+		Thread *thread;
+		/** The task that this worker is running, or NULL if it's idle. */
+		TaskPtr task;
+		/** Notified when a task has been assigned, or when the pool is shutting down. */
+		condition taskAssigned;
+	};
+	
+	unsigned int stackSize;
+	unsigned int maxIdle;
+	boost::mutex lock;
+	/** All workers. */
+	set<Worker *> workers;
+	/** Workers that are waiting for a task. The back is the most recently used one. */
+	vector<Worker *> idle;
+	condition taskDone;
+	condition workerExited;
+	bool done;
+	
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator=(const ThreadPool &);
+	
+	/**
+	 * Create a new, idle worker.
+	 *
+	 * @pre The lock is held.
+	 * @throws boost::thread_resource_error
+	 */
+	Worker *createWorker() {
+		Worker *worker = new Worker();
+		try {
+			// The worker waits for the lock before it accesses
+			// worker->thread, so this assignment is safe.
+			worker->thread = new Thread(
+				boost::bind(&ThreadPool::workerMain, this, worker),
+				stackSize);
+		} catch (...) {
+			delete worker;
+			throw;
+		}
+		workers.insert(worker);
+		return worker;
+	}
+	
+	void workerMain(Worker *worker) {
+		boost::mutex::scoped_lock l(lock);
+		
+		while (true) {
+			while (worker->task == NULL && !done) {
+				worker->taskAssigned.wait(l);
+			}
+			if (worker->task == NULL) {
+				break;
+			}
+			
+			TaskPtr task(worker->task);
+			l.unlock();
+			try {
+				task->func();
+			} catch (const thread_interrupted &) {
+				// Interrupted by interruptAndWait().
+			} catch (const std::exception &e) {
+				P_WARN("Uncaught exception in a thread pool task: " << e.what());
+			}
+			l.lock();
+			
+			/* Tasks are only interrupted while holding the lock and while
+			 * the task isn't done. So after this, nobody will interrupt
+			 * this thread anymore on behalf of this task, and any pending
+			 * interruption can be safely cleared.
+			 */
+			task->worker = NULL;
+			task->func = function<void ()>();
+			worker->task.reset();
+			worker->thread->clearInterruption();
+			taskDone.notify_all();
+			
+			if (done || idle.size() >= maxIdle) {
+				break;
+			}
+			idle.push_back(worker);
+		}
+		
+		workers.erase(worker);
+		// Deleting the Thread object detaches the thread.
+		delete worker->thread;
+		delete worker;
+		workerExited.notify_all();
+	}
+
+	/**
+	 * Interrupt all running tasks, and wait until all threads have exited.
+	 */
+	void shutdown() {
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		boost::mutex::scoped_lock l(lock);
+		set<Worker *>::iterator it;
+		
+		done = true;
+		for (it = workers.begin(); it != workers.end(); it++) {
+			if ((*it)->task != NULL) {
+				(*it)->thread->interrupt();
+			}
+			(*it)->taskAssigned.notify_one();
+		}
+		while (!workers.empty()) {
+			workerExited.wait(l);
+		}
+	}
+
+public:
+	/**
+	 * Create a new ThreadPool.
+	 *
+	 * @param stackSize The stack size of the threads, in bytes, or 0 for
+	 *                  the system's default.
+	 * @param minIdle The number of threads to create right away, so that
+	 *                the first tasks don't have to wait for thread creation.
+	 * @param maxIdle The maximum number of idle threads to keep around.
+	 *                Must be at least <tt>minIdle</tt>.
+	 * @throws boost::thread_resource_error
+	 */
+	ThreadPool(unsigned int stackSize = 0, unsigned int minIdle = 0, unsigned int maxIdle = 16) {
+		this->stackSize = stackSize;
+		this->maxIdle = maxIdle;
+		done = false;
+		
+		try {
+			boost::mutex::scoped_lock l(lock);
+			for (unsigned int i = 0; i < minIdle; i++) {
+				idle.push_back(createWorker());
+			}
+		} catch (...) {
+			shutdown();
+			throw;
+		}
+	}
+	
+	/** Interrupts all running tasks, and waits until all threads have exited. */
+	~ThreadPool() {
+		shutdown();
+	}
+	
+	/**
+	 * Run the given function in one of the pool's threads.
+	 *
+	 * @return A handle which can be passed to interruptAndWait().
+	 * @throws boost::thread_resource_error A new thread is needed, but
+	 *         cannot be created.
+	 */
+	TaskPtr run(const function<void ()> &func) {
+		TaskPtr task(new Task(func));
+		boost::mutex::scoped_lock l(lock);
+		Worker *worker;
+		
+		if (idle.empty()) {
+			worker = createWorker();
+		} else {
+			worker = idle.back();
+			idle.pop_back();
+		}
+		task->worker = worker;
+		worker->task = task;
+		worker->taskAssigned.notify_one();
+		return task;
+	}
+	
+	/**
+	 * Interrupt the given task, and wait until it's done. Returns
+	 * immediately if the task is already done, or if it's called from
+	 * within the task itself.
+	 *
+	 * @throws boost::thread_interrupted
+	 */
+	void interruptAndWait(const TaskPtr &task) {
+		boost::mutex::scoped_lock l(lock);
+		if (task->worker == NULL || task->worker->thread->get_id() == this_thread::get_id()) {
+			return;
+		}
+		task->worker->thread->interrupt();
+		while (task->worker != NULL) {
+			taskDone.wait(l);
+		}
+	}
+	
+	/** Returns the total number of threads. */
+	unsigned int getThreadCount() {
+		boost::mutex::scoped_lock l(lock);
+		return workers.size();
+	}
+	
+	/** Returns the number of threads that are waiting for a task. */
+	unsigned int getIdleCount() {
+		boost::mutex::scoped_lock l(lock);
+		return idle.size();
+	}
+};
+
+typedef shared_ptr<ThreadPool> ThreadPoolPtr;
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_THREAD_POOL_H_ */
@@ -19,7 +19,16 @@
  */
 
 #include <cassert>
+#include <cctype>
+#include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include "Utils.h"
 
 #define SPAWN_SERVER_SCRIPT_NAME "passenger-spawn-server"
@@ -165,4 +174,281 @@ verifyWSGIDir(const string &dir) {
 	return fileExists(temp.c_str());
 }
 
+void
+appendHeader(string &buffer, const char *name, const char *value) {
+	buffer.append(name);
+	buffer.append(1, '\0');
+	buffer.append(value);
+	buffer.append(1, '\0');
+}
+
+void
+terminateHeaders(string &buffer) {
+	/*
+	 * If the last header value is an empty string, then the buffer
+	 * will end with "\0\0". For example, if 'SSLOptions +ExportCertData'
+	 * is set, and there's no client certificate, and 'SSL_CLIENT_CERT'
+	 * is the last header, then the buffer will end with:
+	 *
+	 *   "SSL_CLIENT_CERT\0\0"
+	 *
+	 * The data in the buffer will be processed by the RequestHandler class,
+	 * which is implemented in Ruby. But it uses Hash[*data.split("\0")] to
+	 * unserialize the data. Unfortunately String#split will not transform
+	 * the trailing "\0\0" into an empty string:
+	 *
+	 *   "SSL_CLIENT_CERT\0\0".split("\0")
+	 *   # => desired result: ["SSL_CLIENT_CERT", ""]
+	 *   # => actual result:  ["SSL_CLIENT_CERT"]
+	 *
+	 * When that happens, Hash[..] will raise an ArgumentError because
+	 * data.split("\0") does not return an array with a length that is a
+	 * multiple of 2.
+	 *
+	 * So here, we add a dummy header to prevent situations like that from
+	 * happening.
+	 */
+	buffer.append("_\0_\0", 4);
+}
+
+bool
+isValidTraceId(const char *id) {
+	size_t len = 0;
+	for (; id[len] != '\0'; len++) {
+		if (len == 64 || !(isalnum((unsigned char) id[len]) || strchr("-_.:@+=/", id[len]))) {
+			return false;
+		}
+	}
+	return len > 0;
+}
+
+string
+generateTraceId() {
+	static unsigned int counter = 0;
+	struct timeval tv;
+	char buf[25];
+	
+	/* The time in milliseconds, the PID and a per-process counter make the
+	 * ID unique as long as no process generates more than 2^24 IDs per
+	 * millisecond.
+	 */
+	gettimeofday(&tv, NULL);
+	snprintf(buf, sizeof(buf), "%010llx%08x%06x",
+		((unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000) & 0xffffffffffULL,
+		(unsigned int) getpid(),
+		__sync_fetch_and_add(&counter, 1) & 0xffffff);
+	return buf;
+}
+
+/**
+ * Resolve a "host:port" TCP address. The result must be freed with freeaddrinfo().
+ */
+static struct addrinfo *
+resolveTcpAddress(const string &address, bool passive) {
+	string host, port;
+	string::size_type sep = address.rfind(':');
+	
+	if (sep == string::npos) {
+		throw IOException("Invalid TCP address '" + address + "'");
+	}
+	host = address.substr(0, sep);
+	port = address.substr(sep + 1);
+	if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+		// IPv6 address.
+		host = host.substr(1, host.size() - 2);
+	}
+	
+	struct addrinfo hints, *res;
+	int ret;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (passive) {
+		hints.ai_flags = AI_PASSIVE;
+	}
+	ret = getaddrinfo((host.empty() || host == "*") ? NULL : host.c_str(),
+		port.c_str(), &hints, &res);
+	if (ret != 0) {
+		string message("Cannot resolve TCP address '");
+		message.append(address);
+		message.append("': ");
+		message.append(gai_strerror(ret));
+		throw IOException(message);
+	}
+	return res;
+}
+
+/**
+ * Connect the given socket to the given address. If <tt>timeout</tt> isn't 0,
+ * then give up after that many milliseconds.
+ *
+ * @return 0 on success, or an errno value.
+ */
+static int
+connectSocket(int fd, const struct sockaddr *addr, socklen_t addrlen, unsigned int timeout) {
+	int ret, flags = 0;
+	
+	if (timeout != 0) {
+		flags = fcntl(fd, F_GETFL);
+		if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			return errno;
+		}
+	}
+	do {
+		ret = ::connect(fd, addr, addrlen);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1 && (timeout == 0 || errno != EINPROGRESS)) {
+		return errno;
+	}
+	
+	if (ret == -1) {
+		struct pollfd pfd;
+		struct timeval now;
+		unsigned long long deadline;
+		int error;
+		socklen_t len = sizeof(error);
+		
+		gettimeofday(&now, NULL);
+		deadline = (unsigned long long) now.tv_sec * 1000 + now.tv_usec / 1000 + timeout;
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		do {
+			unsigned long long current;
+			gettimeofday(&now, NULL);
+			current = (unsigned long long) now.tv_sec * 1000 + now.tv_usec / 1000;
+			pfd.revents = 0;
+			ret = poll(&pfd, 1, (current < deadline) ? (int) (deadline - current) : 0);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == 0) {
+			return ETIMEDOUT;
+		} else if (ret == -1) {
+			return errno;
+		}
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+			return errno;
+		} else if (error != 0) {
+			return error;
+		}
+		if (fcntl(fd, F_SETFL, flags) == -1) {
+			return errno;
+		}
+	} else if (timeout != 0 && fcntl(fd, F_SETFL, flags) == -1) {
+		return errno;
+	}
+	return 0;
+}
+
+int
+connectToTcpServer(const string &address, unsigned int timeout) {
+	struct addrinfo *res = resolveTcpAddress(address, false);
+	struct addrinfo *current;
+	int ret, fd = -1, e = 0;
+	
+	// Try all addresses that the host resolves to, e.g. both its
+	// IPv6 and its IPv4 address.
+	for (current = res; current != NULL && fd == -1; current = current->ai_next) {
+		do {
+			fd = ::socket(current->ai_family, SOCK_STREAM, 0);
+		} while (fd == -1 && errno == EINTR);
+		if (fd == -1) {
+			e = errno;
+			continue;
+		}
+		e = connectSocket(fd, current->ai_addr, current->ai_addrlen, timeout);
+		if (e != 0) {
+			do {
+				ret = close(fd);
+			} while (ret == -1 && errno == EINTR);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd == -1) {
+		throw SystemException("Cannot connect to TCP socket '" + address + "'", e);
+	}
+	
+	// Messages are usually sent in a single write, so Nagle's
+	// algorithm would only add latency.
+	int optval = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	return fd;
+}
+
+int
+createTcpServer(const string &address, unsigned int backlogSize) {
+	struct addrinfo *res = resolveTcpAddress(address, true);
+	int ret, fd, e;
+	
+	do {
+		fd = ::socket(res->ai_family, SOCK_STREAM, 0);
+	} while (fd == -1 && errno == EINTR);
+	if (fd == -1) {
+		e = errno;
+		freeaddrinfo(res);
+		throw SystemException("Cannot create a new unconnected TCP socket", e);
+	}
+	
+	int optval = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	ret = ::bind(fd, res->ai_addr, res->ai_addrlen);
+	if (ret != -1) {
+		ret = ::listen(fd, backlogSize);
+	}
+	e = errno;
+	freeaddrinfo(res);
+	if (ret == -1) {
+		do {
+			ret = close(fd);
+		} while (ret == -1 && errno == EINTR);
+		throw SystemException("Cannot listen on TCP socket '" + address + "'", e);
+	}
+	return fd;
+}
+
+string
+readSecretFile(const string &filename) {
+	FILE *f = fopen(filename.c_str(), "r");
+	char buf[1024];
+	size_t ret;
+	string result;
+	
+	if (f == NULL) {
+		int e = errno;
+		throw FileSystemException("Cannot open the secret file '" + filename + "'",
+			e, filename);
+	}
+	while ((ret = fread(buf, 1, sizeof(buf), f)) > 0) {
+		result.append(buf, ret);
+	}
+	if (ferror(f)) {
+		int e = errno;
+		fclose(f);
+		throw FileSystemException("Cannot read the secret file '" + filename + "'",
+			e, filename);
+	}
+	fclose(f);
+	
+	while (!result.empty() && isspace((unsigned char) result[result.size() - 1])) {
+		result.erase(result.size() - 1);
+	}
+	if (result.empty()) {
+		throw ConfigurationException("The secret file '" + filename + "' is empty.");
+	}
+	return result;
+}
+
+bool
+secretsEqual(const string &secret1, const string &secret2) {
+	unsigned char difference = 0;
+	
+	if (secret1.size() != secret2.size()) {
+		return false;
+	}
+	for (string::size_type i = 0; i < secret1.size(); i++) {
+		difference |= secret1[i] ^ secret2[i];
+	}
+	return difference == 0;
+}
+
 } // namespace Passenger
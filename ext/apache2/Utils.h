@@ -200,6 +200,88 @@ bool verifyRackDir(const string &dir);
  */
 bool verifyWSGIDir(const string &dir);
 
+/**
+ * Append a CGI header to the given buffer, in the format that the request
+ * handlers expect: the name and the value, each followed by a null byte.
+ *
+ * @ingroup Support
+ */
+void appendHeader(string &buffer, const char *name, const char *value);
+
+/**
+ * Terminate a buffer of headers that was built with appendHeader(). The result
+ * can be sent to a request handler with Application::Session::sendHeaders().
+ *
+ * @ingroup Support
+ */
+void terminateHeaders(string &buffer);
+
+/**
+ * Check whether the given string is acceptable as a request trace ID, e.g.
+ * one that was received from a client or a proxy server: it must consist of
+ * 1 to 64 alphanumeric characters or characters from "-_.:@+=/".
+ *
+ * @ingroup Support
+ */
+bool isValidTraceId(const char *id);
+
+/**
+ * Generate a new request trace ID. Trace IDs consist of 24 hexadecimal
+ * characters, and are unique among the IDs generated on the same machine.
+ * This function is thread-safe.
+ *
+ * @ingroup Support
+ */
+string generateTraceId();
+
+/**
+ * Connect to the TCP server at the given address, which must be in the form
+ * of "host:port". IPv6 addresses must be enclosed in brackets, e.g. "[::1]:80".
+ * If the host resolves to multiple addresses, then they're tried in turn.
+ * Nagle's algorithm is disabled on the resulting socket.
+ *
+ * @param timeout The maximum time, in milliseconds, to wait for the connection
+ *                to each address, or 0 to wait as long as the operating system
+ *                does. A timeout results in a SystemException with ETIMEDOUT.
+ * @return The file descriptor of the connected socket.
+ * @throws IOException The address is invalid or cannot be resolved.
+ * @throws SystemException Something went wrong while connecting.
+ * @ingroup Support
+ */
+int connectToTcpServer(const string &address, unsigned int timeout = 0);
+
+/**
+ * Create a TCP server socket which listens on the given address, in the same
+ * form as for connectToTcpServer(). Use "*" or an empty host to listen on
+ * all interfaces.
+ *
+ * @return The file descriptor of the server socket.
+ * @throws IOException The address is invalid or cannot be resolved.
+ * @throws SystemException Something went wrong while creating the socket.
+ * @ingroup Support
+ */
+int createTcpServer(const string &address, unsigned int backlogSize = 128);
+
+/**
+ * Read a shared secret, e.g. the one with which cluster nodes authenticate
+ * each other, from the given file. Trailing whitespace, such as the final
+ * newline, isn't part of the secret.
+ *
+ * @throws FileSystemException The file cannot be read.
+ * @throws ConfigurationException The file doesn't contain a secret.
+ * @ingroup Support
+ */
+string readSecretFile(const string &filename);
+
+/**
+ * Check whether two secrets are equal, in an amount of time that doesn't
+ * depend on how many of their characters are equal. This way, a client
+ * can't guess a secret one character at a time by timing failed attempts.
+ *
+ * @ingroup Support
+ */
+bool secretsEqual(const string &secret1, const string &secret2);
+
 /**
  * Represents a temporary file. The associated file is automatically
  * deleted upon object destruction.
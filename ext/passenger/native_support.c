@@ -21,7 +21,9 @@
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -248,6 +250,52 @@ close_all_file_descriptors(VALUE self, VALUE exceptions) {
 	return Qnil;
 }
 
+/*
+ * call-seq: enable_transparent_hugepages
+ *
+ * Ask the kernel to back the heap and the large anonymous mappings of this
+ * process with transparent hugepages. Child processes inherit this. Only
+ * memory that is mapped at the time of the call is affected.
+ *
+ * - Returns: Whether any memory was marked. Always false on systems without
+ *   transparent hugepage support.
+ */
+static VALUE
+enable_transparent_hugepages(VALUE self) {
+	#ifdef MADV_HUGEPAGE
+		FILE *maps = fopen("/proc/self/maps", "r");
+		char line[1024];
+		int result = 0;
+		
+		if (maps == NULL) {
+			return Qfalse;
+		}
+		while (fgets(line, sizeof(line), maps) != NULL) {
+			unsigned long begin, end;
+			char perms[5], path[512];
+			int fields;
+			
+			path[0] = '\0';
+			fields = sscanf(line, "%lx-%lx %4s %*s %*s %*s %511s",
+				&begin, &end, perms, path);
+			if (fields < 3 || strcmp(perms, "rw-p") != 0) {
+				continue;
+			}
+			/* Anonymous mappings smaller than a hugepage can't be backed by one. */
+			if (strcmp(path, "[heap]") == 0
+			 || (path[0] == '\0' && end - begin >= 2 * 1024 * 1024)) {
+				if (madvise((void *) begin, end - begin, MADV_HUGEPAGE) == 0) {
+					result = 1;
+				}
+			}
+		}
+		fclose(maps);
+		return result ? Qtrue : Qfalse;
+	#else
+		return Qfalse;
+	#endif
+}
+
 void
 Init_native_support() {
 	struct sockaddr_un addr;
@@ -265,6 +313,7 @@ Init_native_support() {
 	rb_define_singleton_method(mNativeSupport, "create_unix_socket", create_unix_socket, 2);
 	rb_define_singleton_method(mNativeSupport, "accept", f_accept, 1);
 	rb_define_singleton_method(mNativeSupport, "close_all_file_descriptors", close_all_file_descriptors, 1);
+	rb_define_singleton_method(mNativeSupport, "enable_transparent_hugepages", enable_transparent_hugepages, 0);
 	
 	/* The maximum length of a Unix socket path, including terminating null. */
 	rb_define_const(mNativeSupport, "UNIX_PATH_MAX", INT2NUM(sizeof(addr.sun_path)));
@@ -103,27 +103,41 @@ class AbstractRequestHandler
 	CONTENT_LENGTH      = 'CONTENT_LENGTH'      # :nodoc:
 	HTTP_CONTENT_LENGTH = 'HTTP_CONTENT_LENGTH' # :nodoc:
 	X_POWERED_BY        = 'X-Powered-By'        # :nodoc:
+	PASSENGER_TRACE_ID  = 'PASSENGER_TRACE_ID'  # :nodoc:
+	PASSENGER_LOG_TRACE = 'PASSENGER_LOG_TRACE' # :nodoc:
+	TRACE_TIME_FORMAT   = '%Y-%m-%d %H:%M:%S'   # :nodoc:
 	
 	# The name of the socket on which the request handler accepts
-	# new connections. This is either a Unix socket filename, or
-	# the name for an abstract namespace Unix socket.
+	# new connections. This is either a Unix socket filename, the
+	# name for an abstract namespace Unix socket, or a TCP address
+	# in the form of "host:port".
 	#
 	# If +socket_name+ refers to an abstract namespace Unix socket,
 	# then the name does _not_ contain a leading null byte.
 	#
-	# See also using_abstract_namespace?
+	# See also socket_type.
 	attr_reader :socket_name
+	
+	# The type of the socket on which the request handler accepts new
+	# connections: "unix", "abstract" or "tcp". See Application#listen_socket_type.
+	attr_reader :socket_type
 
 	# Create a new RequestHandler with the given owner pipe.
 	# +owner_pipe+ must be the readable part of a pipe IO object.
+	#
+	# The request handler listens on a Unix socket, unless the environment
+	# variable PASSENGER_TCP_LISTEN_ADDRESS is set to a host address, in
+	# which case it listens on a random TCP port on that address.
 	def initialize(owner_pipe)
-		if abstract_namespace_sockets_allowed?
-			@using_abstract_namespace = create_unix_socket_on_abstract_namespace
+		if tcp_listen_address
+			create_tcp_socket(tcp_listen_address)
 		else
-			@using_abstract_namespace = false
-		end
-		if !@using_abstract_namespace
-			create_unix_socket_on_filesystem
+			if abstract_namespace_sockets_allowed? && create_unix_socket_on_abstract_namespace
+				@socket_type = "abstract"
+			else
+				create_unix_socket_on_filesystem
+				@socket_type = "unix"
+			end
 		end
 		@owner_pipe = owner_pipe
 		@previous_signal_handlers = {}
@@ -134,14 +148,14 @@ class AbstractRequestHandler
 	def cleanup
 		@socket.close rescue nil
 		@owner_pipe.close rescue nil
-		if !using_abstract_namespace?
+		if @socket_type == "unix"
 			File.unlink(@socket_name) rescue nil
 		end
 	end
 	
 	# Returns whether socket_name refers to an abstract namespace Unix socket.
 	def using_abstract_namespace?
-		return @using_abstract_namespace
+		return @socket_type == "abstract"
 	end
 	
 	# Enter the request handler's main loop.
@@ -160,7 +174,13 @@ class AbstractRequestHandler
 				begin
 					headers, input = parse_request(client)
 					if headers
-						process_request(headers, input, client)
+						if headers[PASSENGER_LOG_TRACE]
+							started_at = Time.now
+							process_request(headers, input, client)
+							log_trace(headers[PASSENGER_TRACE_ID], started_at)
+						else
+							process_request(headers, input, client)
+						end
 					end
 				rescue IOError, SocketError, SystemCallError => e
 					print_exception("Passenger RequestHandler", e)
@@ -228,6 +248,18 @@ private
 		end
 	end
 
+	def create_tcp_socket(address)
+		@socket = TCPServer.new(address, 0)
+		@socket.listen(BACKLOG_SIZE)
+		port = @socket.addr[1]
+		if address.include?(":")
+			@socket_name = "[#{address}]:#{port}"
+		else
+			@socket_name = "#{address}:#{port}"
+		end
+		@socket_type = "tcp"
+	end
+
 	# Reset signal handlers to their default handler, and install some
 	# special handlers for a few signals. The previous signal handlers
 	# will be put back by calling revert_signal_handlers.
@@ -315,6 +347,28 @@ private
 		return data
 	end
 	
+	# Log when the request with the given trace ID was processed, so that it
+	# can be correlated with mod_passenger's log entries for the same request.
+	def log_trace(trace_id, started_at)
+		finished_at = Time.now
+		STDERR.puts(sprintf("[ pid=%d ] Trace %s: processing started at %s.%06d, " <<
+			"finished at %s.%06d, took %dus",
+			Process.pid, trace_id,
+			started_at.strftime(TRACE_TIME_FORMAT), started_at.usec,
+			finished_at.strftime(TRACE_TIME_FORMAT), finished_at.usec,
+			((finished_at - started_at) * 1000000).to_i))
+		STDERR.flush
+	end
+	
+	def tcp_listen_address
+		address = ENV['PASSENGER_TCP_LISTEN_ADDRESS']
+		if address.nil? || address.empty?
+			return nil
+		else
+			return address
+		end
+	end
+	
 	def abstract_namespace_sockets_allowed?
 		return !ENV['PASSENGER_NO_ABSTRACT_NAMESPACE_SOCKETS'] ||
 			ENV['PASSENGER_NO_ABSTRACT_NAMESPACE_SOCKETS'].empty?
@@ -29,10 +29,17 @@ class Application
 	# The process ID of this application instance.
 	attr_reader :pid
 	
-	# The name of the Unix socket on which the application instance will accept
-	# new connections.
+	# The name of the socket on which the application instance will accept
+	# new connections. See listen_socket_type for its format.
 	attr_reader :listen_socket_name
 	
+	# The type of the listen socket:
+	# - "unix": _listen_socket_name_ is a Unix socket filename.
+	# - "abstract": _listen_socket_name_ is the name of a Unix socket in the
+	#   abstract namespace, without the leading null byte.
+	# - "tcp": _listen_socket_name_ is a TCP address in the form of "host:port".
+	attr_reader :listen_socket_type
+	
 	# The owner pipe of the application instance (an IO object). Please see
 	# RequestHandler for a description of the owner pipe.
 	attr_reader :owner_pipe
@@ -79,11 +86,11 @@ class Application
 
 	# Creates a new instance of Application. The parameters correspond with the attributes
 	# of the same names. No exceptions will be thrown.
-	def initialize(app_root, pid, listen_socket_name, using_abstract_namespace, owner_pipe)
+	def initialize(app_root, pid, listen_socket_name, listen_socket_type, owner_pipe)
 		@app_root = app_root
 		@pid = pid
 		@listen_socket_name = listen_socket_name
-		@using_abstract_namespace = using_abstract_namespace
+		@listen_socket_type = listen_socket_type
 		@owner_pipe = owner_pipe
 	end
 	
@@ -93,7 +100,7 @@ class Application
 	# Note that at the moment, only Linux seems to support abstract namespace Unix
 	# sockets.
 	def using_abstract_namespace?
-		return @using_abstract_namespace
+		return @listen_socket_type == "abstract"
 	end
 	
 	# Close the connection with the application instance. If there are no other
@@ -98,13 +98,13 @@ class ApplicationSpawner < AbstractServer
 	# - ApplicationSpawner::Error: The ApplicationSpawner server exited unexpectedly.
 	def spawn_application
 		server.write("spawn_application")
-		pid, socket_name, using_abstract_namespace = server.read
+		pid, socket_name, socket_type = server.read
 		if pid.nil?
 			raise IOError, "Connection closed"
 		end
 		owner_pipe = server.recv_io
 		return Application.new(@app_root, pid, socket_name,
-			using_abstract_namespace == "true", owner_pipe)
+			socket_type, owner_pipe)
 	rescue SystemCallError, IOError, SocketError => e
 		raise Error, "The application spawner server exited unexpectedly"
 	end
@@ -128,6 +128,7 @@ class ApplicationSpawner < AbstractServer
 		a, b = UNIXSocket.pair
 		pid = safe_fork(self.class.to_s) do
 			safe_fork('application') do
+				join_cgroup_if_requested(@app_root)
 				begin
 					a.close
 					channel = MessageChannel.new(b)
@@ -158,13 +159,13 @@ class ApplicationSpawner < AbstractServer
 		unmarshal_and_raise_errors(channel)
 		
 		# No exception was raised, so spawning succeeded.
-		pid, socket_name, using_abstract_namespace = channel.read
+		pid, socket_name, socket_type = channel.read
 		if pid.nil?
 			raise IOError, "Connection closed"
 		end
 		owner_pipe = channel.recv_io
 		return Application.new(@app_root, pid, socket_name,
-			using_abstract_namespace == "true", owner_pipe)
+			socket_type, owner_pipe)
 	end
 	
 	# Overrided from AbstractServer#start.
@@ -210,6 +211,7 @@ protected
 				lower_privilege('config/environment.rb', @lowest_user)
 			end
 			preload_application
+			enable_transparent_hugepages_if_requested
 		end
 	end
 	
@@ -272,6 +274,7 @@ private
 		# Double fork to prevent zombie processes.
 		pid = safe_fork(self.class.to_s) do
 			safe_fork('application') do
+				join_cgroup_if_requested(@app_root)
 				begin
 					start_request_handler(client)
 				rescue SignalException => e
@@ -300,7 +303,7 @@ private
 			
 			handler = RequestHandler.new(reader)
 			channel.write(Process.pid, handler.socket_name,
-				handler.using_abstract_namespace?)
+				handler.socket_type)
 			channel.send_io(writer)
 			writer.close
 			channel.close
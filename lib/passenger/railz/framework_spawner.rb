@@ -139,13 +139,13 @@ class FrameworkSpawner < AbstractServer
 			if result[0] == 'exception'
 				raise unmarshal_exception(server.read_scalar)
 			else
-				pid, listen_socket_name, using_abstract_namespace = server.read
+				pid, listen_socket_name, socket_type = server.read
 				if pid.nil?
 					raise IOError, "Connection closed"
 				end
 				owner_pipe = server.recv_io
 				return Application.new(app_root, pid, listen_socket_name,
-					using_abstract_namespace == "true", owner_pipe)
+					socket_type, owner_pipe)
 			end
 		rescue SystemCallError, IOError, SocketError => e
 			raise Error, "The framework spawner server exited unexpectedly"
@@ -203,6 +203,7 @@ protected
 		end
 		begin
 			preload_rails
+			enable_transparent_hugepages_if_requested
 		rescue StandardError, ScriptError, NoMemoryError => e
 			client.write('exception')
 			client.write_scalar(marshal_exception(e))
@@ -293,7 +294,7 @@ private
 				return
 			end
 			client.write('success')
-			client.write(app.pid, app.listen_socket_name, app.using_abstract_namespace?)
+			client.write(app.pid, app.listen_socket_name, app.listen_socket_type)
 			client.send_io(app.owner_pipe)
 			app.close
 		end
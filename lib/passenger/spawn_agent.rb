@@ -0,0 +1,206 @@
+#  Phusion Passenger - http://www.modrails.com/
+#  Copyright (C) 2008  Phusion
+#
+#  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License along
+#  with this program; if not, write to the Free Software Foundation, Inc.,
+#  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+require 'socket'
+require 'timeout'
+require 'passenger/message_channel'
+require 'passenger/spawn_manager'
+require 'passenger/utils'
+module Passenger
+
+# A daemon that spawns applications on behalf of Phusion Passenger
+# installations on other hosts. It's started by bin/passenger-spawn-agent,
+# and used by the Apache module when PassengerSpawnAgent is configured.
+#
+# The agent listens on a TCP socket. For every connection, it forks a
+# SpawnAgent::Session process, which acts as a spawn server (see SpawnManager)
+# for that connection. The differences with a normal spawn server are:
+# - The client must first send a 'secret' message with the secret that the agent
+#   was started with. The agent replies with 'ok', or with an 'error' message
+#   and closes the connection if the secret is wrong.
+# - Applications are always spawned with lowered privileges, and fall back to
+#   the agent's lowest user instead of to a user that the client chooses. The
+#   client is a host on the network, not a trusted parent process.
+# - Spawned applications listen on TCP sockets on the agent's address, instead
+#   of on Unix sockets.
+# - Owner pipes cannot be passed over TCP, so the session process keeps them.
+#   The client releases an application with the 'release' message. When the
+#   connection is closed, all applications that were spawned through it are
+#   released.
+# - The client must send 'ping' messages, which are answered with 'pong'. If
+#   the client is silent for longer than the heartbeat timeout, then the
+#   connection is closed, as if the client had died.
+#
+# The secret is sent in plain text and the connection isn't encrypted, so the
+# agent may only listen on a private network.
+class SpawnAgent
+	include Utils
+	
+	DEFAULT_PORT = 4100
+	DEFAULT_HEARTBEAT_TIMEOUT = 60
+	DEFAULT_LOWEST_USER = "nobody"
+	# The time, in seconds, that a client may take to send the secret.
+	HANDSHAKE_TIMEOUT = 10
+	
+	# Acts as a spawn server for a single connection. See the description
+	# of SpawnAgent.
+	class Session < SpawnManager
+		def initialize(heartbeat_timeout, lowest_user)
+			super()
+			@heartbeat_timeout = heartbeat_timeout
+			@lowest_user = lowest_user
+			@owner_pipes = {}
+			@last_activity = Time.now
+			@busy = false
+			define_message_handler(:release, :handle_release)
+			define_message_handler(:ping, :handle_ping)
+		end
+	
+	protected
+		def initialize_server
+			main_thread = Thread.current
+			@watchdog_thread = Thread.new do
+				watchdog_thread_main(main_thread)
+			end
+		end
+		
+		def finalize_server
+			@watchdog_thread.kill
+			@owner_pipes.each_value do |pipe|
+				pipe.close rescue nil
+			end
+			@owner_pipes.clear
+		end
+	
+	private
+		def handle_spawn_application(app_root, lower_privilege, lowest_user, *args)
+			@busy = true
+			super(app_root, "true", @lowest_user, *args)
+		ensure
+			@busy = false
+			@last_activity = Time.now
+		end
+		
+		def handle_reload(app_root)
+			@last_activity = Time.now
+			super
+		end
+		
+		def handle_release(pid)
+			@last_activity = Time.now
+			pipe = @owner_pipes.delete(pid.to_i)
+			pipe.close if pipe
+		end
+		
+		def handle_ping
+			@last_activity = Time.now
+			client.write('pong')
+		end
+		
+		def send_owner_pipe(app)
+			@owner_pipes[app.pid] = app.owner_pipe.dup
+		end
+		
+		def watchdog_thread_main(main_thread)
+			while true
+				sleep 1
+				if !@busy && Time.now - @last_activity > @heartbeat_timeout
+					# Makes the main loop exit.
+					main_thread.raise(Interrupt)
+					break
+				end
+			end
+		end
+	end
+	
+	# Create a new SpawnAgent, which will listen on the given address and port.
+	# Spawned applications will listen on random ports on the same address.
+	#
+	# Clients must authenticate with _secret_. Applications whose privileges
+	# cannot be lowered to their owner are run as _lowest_user_.
+	def initialize(address, secret, port = DEFAULT_PORT,
+	               heartbeat_timeout = DEFAULT_HEARTBEAT_TIMEOUT,
+	               lowest_user = DEFAULT_LOWEST_USER)
+		if secret.nil? || secret.empty?
+			raise ArgumentError, "The spawn agent secret may not be empty."
+		end
+		@address = address
+		@secret = secret
+		@port = port
+		@heartbeat_timeout = heartbeat_timeout
+		@lowest_user = lowest_user
+	end
+	
+	# Accept connections until the process is terminated.
+	def start
+		ENV['PASSENGER_TCP_LISTEN_ADDRESS'] = @address
+		server = TCPServer.new(@address, @port)
+		while true
+			client = server.accept
+			pid = safe_fork('spawn agent session') do
+				server.close
+				$0 = "Passenger spawn agent session (#{client.peeraddr[3]})"
+				if authenticate(client)
+					session = Session.new(@heartbeat_timeout, @lowest_user)
+					session.start_synchronously(client)
+					session.cleanup
+				end
+			end
+			client.close
+			Process.detach(pid)
+		end
+	end
+
+private
+	# Read the client's 'secret' message and reply to it. Returns whether
+	# the client sent the right secret.
+	def authenticate(client)
+		channel = MessageChannel.new(client)
+		name, secret = Timeout.timeout(HANDSHAKE_TIMEOUT) do
+			channel.read
+		end
+		if name == 'secret' && secrets_equal?(secret.to_s, @secret)
+			channel.write('ok')
+			return true
+		else
+			STDERR.puts("*** Spawn agent client #{client.peeraddr[3]} " <<
+				"sent a wrong secret; closing the connection.")
+			channel.write('error', 'Wrong spawn agent secret.')
+			return false
+		end
+	rescue Timeout::Error
+		return false
+	end
+	
+	# Compare two secrets in a time that doesn't depend on how many of
+	# their characters match.
+	def secrets_equal?(secret1, secret2)
+		if secret1.size != secret2.size
+			return false
+		end
+		bytes1 = secret1.unpack('C*')
+		bytes2 = secret2.unpack('C*')
+		result = 0
+		bytes1.each_with_index do |byte, i|
+			result |= byte ^ bytes2[i]
+		end
+		return result == 0
+	end
+end
+
+end # module Passenger
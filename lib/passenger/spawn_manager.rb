@@ -284,8 +284,8 @@ private
 		if app
 			begin
 				client.write('ok')
-				client.write(app.pid, app.listen_socket_name, app.using_abstract_namespace?)
-				client.send_io(app.owner_pipe)
+				client.write(app.pid, app.listen_socket_name, app.listen_socket_type)
+				send_owner_pipe(app)
 			rescue Errno::EPIPE
 				# The Apache module may be interrupted during a spawn command,
 				# in which case it will close the connection. We ignore this error.
@@ -299,6 +299,12 @@ private
 		reload(app_root)
 	end
 	
+	# Pass the owner pipe of the given spawned application to the client,
+	# which thereby becomes responsible for the application's life time.
+	def send_owner_pipe(app)
+		client.send_io(app.owner_pipe)
+	end
+	
 	def cleaner_thread_main
 		@lock.synchronize do
 			while true
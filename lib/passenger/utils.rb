@@ -81,6 +81,45 @@ protected
 		groupname && Etc.getgrnam(groupname)
 	end
 	
+	# Back the memory that has been preloaded so far with transparent
+	# hugepages, if the PASSENGER_TRANSPARENT_HUGEPAGES environment variable
+	# is set (see the PassengerTransparentHugepages option). This saves TLB
+	# misses in the spawned processes, at the cost of copying 2 MB instead of
+	# 4 KB when a copy-on-write page is written to.
+	def enable_transparent_hugepages_if_requested
+		if ENV['PASSENGER_TRANSPARENT_HUGEPAGES'] && defined?(NativeSupport)
+			NativeSupport.enable_transparent_hugepages
+		end
+	end
+	
+	# Move the current process into the control group of the given application,
+	# if the PASSENGER_CGROUP_ROOT environment variable is set (see the
+	# PassengerCgroupRoot option). This must be called right after forking an
+	# application instance, before the application is loaded: memory stays
+	# charged to the group that the process was in when it allocated it. The
+	# group is named like CgroupManager::getGroupDir() in the C++ code, and the
+	# ApplicationPool server sets it up before spawning. If the process can't
+	# join the group, e.g. because it has already lowered its privileges, then
+	# the ApplicationPool server moves it once it has been spawned.
+	def join_cgroup_if_requested(app_root)
+		root = ENV['PASSENGER_CGROUP_ROOT']
+		return if root.nil? || root.empty?
+		name = ""
+		app_root.unpack('C*').each do |byte|
+			char = byte.chr
+			if char =~ /\A[a-zA-Z0-9._]\z/
+				name << char
+			else
+				name << sprintf("%%%02X", byte)
+			end
+		end
+		File.open("#{root}/app-#{name}/cgroup.procs", "w") do |f|
+			f.write(Process.pid.to_s)
+		end
+	rescue SystemCallError, IOError
+		# The ApplicationPool server will move us.
+	end
+	
 	def close_all_io_objects_for_fds(file_descriptors_to_close)
 		ObjectSpace.each_object do |o|
 			if o.is_a?(IO)
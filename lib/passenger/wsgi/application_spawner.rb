@@ -44,6 +44,7 @@ class ApplicationSpawner
 		# Double fork in order to prevent zombie processes.
 		pid = safe_fork(self.class.to_s) do
 			safe_fork(self.class.to_s) do
+				join_cgroup_if_requested(app_root)
 				a.close
 				run(MessageChannel.new(b), app_root, lower_privilege, lowest_user, environment)
 			end
@@ -52,13 +53,13 @@ class ApplicationSpawner
 		Process.waitpid(pid) rescue nil
 		
 		channel = MessageChannel.new(a)
-		pid, socket_name, using_abstract_namespace = channel.read
+		pid, socket_name, socket_type = channel.read
 		if pid.nil?
 			raise IOError, "Connection closed"
 		end
 		owner_pipe = channel.recv_io
 		return Application.new(@app_root, pid, socket_name,
-			using_abstract_namespace == "true", owner_pipe)
+			socket_type, owner_pipe)
 	end
 
 private
@@ -70,21 +71,37 @@ private
 			lower_privilege('passenger_wsgi.py', lowest_user)
 		end
 		
-		socket_file = "/tmp/passenger_wsgi.#{Process.pid}.#{rand 10000000}"
-		server = UNIXServer.new(socket_file)
+		# Like the Ruby request handlers, listen on TCP if we're asked to,
+		# e.g. by a spawn agent.
+		address = ENV['PASSENGER_TCP_LISTEN_ADDRESS']
+		if address.nil? || address.empty?
+			socket_name = "/tmp/passenger_wsgi.#{Process.pid}.#{rand 10000000}"
+			socket_type = "unix"
+			server = UNIXServer.new(socket_name)
+		else
+			server = TCPServer.new(address, 0)
+			if address.include?(":")
+				socket_name = "[#{address}]:#{server.addr[1]}"
+			else
+				socket_name = "#{address}:#{server.addr[1]}"
+			end
+			socket_type = "tcp"
+		end
 		begin
 			reader, writer = IO.pipe
-			channel.write(Process.pid, socket_file, "false")
+			channel.write(Process.pid, socket_name, socket_type)
 			channel.send_io(writer)
 			writer.close
 			channel.close
 			
 			NativeSupport.close_all_file_descriptors([0, 1, 2, server.fileno,
 				reader.fileno])
-			exec(REQUEST_HANDLER, socket_file, server.fileno.to_s,
-				reader.fileno.to_s)
+			exec(REQUEST_HANDLER, socket_name, server.fileno.to_s,
+				reader.fileno.to_s, socket_type)
 		rescue
-			File.unlink(socket_file)
+			if socket_type == "unix"
+				File.unlink(socket_name)
+			end
 			raise
 		end
 	end
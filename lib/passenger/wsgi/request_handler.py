@@ -1,9 +1,10 @@
 #!/usr/bin/env python
-import socket, os, random, sys, struct, select, imp
+import socket, os, random, sys, struct, select, imp, time
 import exceptions, traceback
 
 class RequestHandler:
 	def __init__(self, socket_file, server, owner_pipe, app):
+		# socket_file is None if the server socket isn't a Unix socket file.
 		self.socket_file = socket_file
 		self.server = server
 		self.owner_pipe = owner_pipe
@@ -11,10 +12,11 @@ class RequestHandler:
 	
 	def cleanup(self):
 		self.server.close()
-		try:
-			os.remove(self.socket_file)
-		except:
-			pass
+		if self.socket_file is not None:
+			try:
+				os.remove(self.socket_file)
+			except:
+				pass
 	
 	def main_loop(self):
 		done = False
@@ -26,7 +28,12 @@ class RequestHandler:
 					break
 				try:
 					env, input_stream = self.parse_request(client)
-					self.process_request(env, input_stream, client)
+					if 'PASSENGER_LOG_TRACE' in env:
+						started_at = time.time()
+						self.process_request(env, input_stream, client)
+						self.log_trace(env.get('PASSENGER_TRACE_ID'), started_at)
+					else:
+						self.process_request(env, input_stream, client)
 				except KeyboardInterrupt:
 					done = True
 				except Exception, e:
@@ -40,6 +47,20 @@ class RequestHandler:
 		except KeyboardInterrupt:
 			pass
 
+	def log_trace(self, trace_id, started_at):
+		# Log when the request with the given trace ID was processed, so that it
+		# can be correlated with mod_passenger's log entries for the same request.
+		finished_at = time.time()
+		sys.stderr.write("[ pid=%d ] Trace %s: processing started at %s, "
+			"finished at %s, took %dus\n" % (os.getpid(), trace_id,
+			self.format_time(started_at), self.format_time(finished_at),
+			int((finished_at - started_at) * 1000000)))
+		sys.stderr.flush()
+	
+	def format_time(self, t):
+		return "%s.%06d" % (time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(t)),
+			int((t - int(t)) * 1000000))
+	
 	def accept_connection(self):
 		result = select.select([self.owner_pipe, self.server.fileno()], [], [])[0]
 		if self.server.fileno() in result:
@@ -125,9 +146,18 @@ class RequestHandler:
 				result.close()
 
 if __name__ == "__main__":
-	socket_file = sys.argv[1]
-	server = socket.fromfd(int(sys.argv[2]), socket.AF_UNIX, socket.SOCK_STREAM)
+	socket_name = sys.argv[1]
 	owner_pipe = int(sys.argv[3])
+	if len(sys.argv) > 4 and sys.argv[4] == "tcp":
+		if socket_name.startswith("["):
+			family = socket.AF_INET6
+		else:
+			family = socket.AF_INET
+		socket_file = None
+	else:
+		family = socket.AF_UNIX
+		socket_file = socket_name
+	server = socket.fromfd(int(sys.argv[2]), family, socket.SOCK_STREAM)
 	
 	app_module = imp.load_source('passenger_wsgi', 'passenger_wsgi.py')
 	
@@ -1,6 +1,11 @@
 #include "tut.h"
 #include "ApplicationPoolServer.h"
+#include "MessageChannel.h"
 #include "Utils.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include <cstring>
 #include <unistd.h>
 #include <errno.h>
@@ -43,6 +48,46 @@ namespace tut {
 	};
 
 	DEFINE_TEST_GROUP(ApplicationPoolServerTest);
+	
+	/**
+	 * Returns a local TCP address on which nothing is listening.
+	 */
+	static string findFreeTcpAddress() {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		int fd = createTcpServer("127.0.0.1:0");
+		
+		getsockname(fd, (struct sockaddr *) &addr, &len);
+		close(fd);
+		return "127.0.0.1:" + toString(ntohs(addr.sin_port));
+	}
+	
+	/**
+	 * Forwards a get() request to the cluster address of an ApplicationPool
+	 * server, like another cluster node does, and returns the reply.
+	 */
+	static vector<string> sendClusterRequest(const string &address,
+	                                         const string &secret,
+	                                         const string &appRoot) {
+		vector<string> args;
+		int fd = -1;
+		
+		// The server starts listening in the background.
+		for (int i = 0; i < 50 && fd == -1; i++) {
+			try {
+				fd = connectToTcpServer(address);
+			} catch (const SystemException &) {
+				usleep(100000);
+			}
+		}
+		MessageChannel channel(fd);
+		channel.write("secret", secret.c_str(), NULL);
+		channel.write("get", appRoot.c_str(), "production", "smart",
+			"rails", "", "1", NULL);
+		channel.read(args);
+		close(fd);
+		return args;
+	}
 
 	TEST_METHOD(1) {
 		// Constructor and destructor should not crash or block indefinitely.
@@ -98,5 +143,52 @@ namespace tut {
 		server = ApplicationPoolServerPtr();
 		ensure_equals(countOpenFileDescriptors(), initialFileDescriptors);
 	}
+	
+	TEST_METHOD(6) {
+		// The cluster address refuses requests with a wrong secret, and
+		// requests for applications that aren't shared.
+		TempFile secretFile(false);
+		string address(findFreeTcpAddress());
+		vector<string> reply;
+		
+		fputs("s3cret\n", secretFile.handle);
+		fflush(secretFile.handle);
+		server = ptr(new ApplicationPoolServer(
+			"../ext/apache2/ApplicationPoolServerExecutable",
+			"stub/spawn_server.rb", "", "ruby", "", "", "",
+			address, "", 1, "stub/railsapp", secretFile.filename));
+		
+		reply = sendClusterRequest(address, "wrong", "stub/railsapp");
+		ensure_equals(reply.size(), 2u);
+		ensure_equals(reply[0], "IOException");
+		ensure_equals(reply[1], "Wrong cluster secret.");
+		
+		reply = sendClusterRequest(address, "s3cret", "stub/minimal-railsapp");
+		ensure_equals(reply.size(), 2u);
+		ensure_equals(reply[0], "IOException");
+		ensure(reply[1].find("isn't shared") != string::npos);
+	}
+	
+	TEST_METHOD(7) {
+		// Clients connect directly to instances in the shared instance
+		// table without removing their Unix socket files.
+		string filename("/tmp/passenger_test." + toString(getpid()));
+		struct sockaddr_un addr;
+		struct stat buf;
+		int listener, fd;
+		
+		listener = socket(PF_UNIX, SOCK_STREAM, 0);
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, filename.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(filename.c_str());
+		ensure(::bind(listener, (const sockaddr *) &addr, sizeof(addr)) == 0);
+		listen(listener, 1);
+		
+		fd = Application::connectToInstance(filename, Application::UNIX_SOCKET);
+		close(fd);
+		ensure("The socket file still exists", stat(filename.c_str(), &buf) == 0);
+		unlink(filename.c_str());
+		close(listener);
+	}
 }
-
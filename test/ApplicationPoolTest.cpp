@@ -5,6 +5,10 @@
 #include <cstdlib>
 #include <cerrno>
 #include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
 
 /**
  * This file is used as a template to test the different ApplicationPool implementations.
@@ -45,6 +49,33 @@
 		}
 		return result;
 	}
+	
+	/**
+	 * Create a TCP server socket on 127.0.0.1, on a random port. If
+	 * <tt>listening</tt> is false, the socket is closed again, and the
+	 * returned address will refuse connections.
+	 */
+	static int createTcpServer(string &address, bool listening = true) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		int fd = socket(PF_INET, SOCK_STREAM, 0);
+		
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+		addr.sin_port = 0;
+		::bind(fd, (const sockaddr *) &addr, sizeof(addr));
+		if (listening) {
+			::listen(fd, 10);
+		}
+		getsockname(fd, (sockaddr *) &addr, &len);
+		address = "127.0.0.1:" + toString(ntohs(addr.sin_port));
+		if (!listening) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
 
 	TEST_METHOD(1) {
 		// Calling ApplicationPool.get() once should return a valid Session.
@@ -118,13 +149,55 @@
 		ensure_equals(pool->getCount(), 2u);
 	}
 	
+	struct TestThread1 {
+		ApplicationPoolPtr pool;
+		Application::SessionPtr &m_session;
+		bool &m_done;
+		string m_appRoot;
+		
+		TestThread1(const ApplicationPoolPtr &pool,
+			Application::SessionPtr &session,
+			bool &done,
+			const string &appRoot = "stub/minimal-railsapp")
+		: m_session(session), m_done(done), m_appRoot(appRoot) {
+			this->pool = pool;
+			done = false;
+		}
+		
+		void operator()() {
+			m_session = pool->get(m_appRoot);
+			m_done = true;
+		}
+	};
+	
 	TEST_METHOD(7) {
 		// If we call get() even though the pool is already full
 		// (active == max), and the application root is already
 		// in the pool, then the pool must wait until there's an
 		// inactive application.
 		pool->setMax(1);
-		// TODO: How do we test this?
+		Application::SessionPtr session1(pool->get("stub/railsapp"));
+		Application::SessionPtr session2;
+		bool done;
+		
+		thread *thr = new thread(TestThread1(pool2, session2, done, "stub/railsapp"));
+		usleep(500000);
+		ensure("ApplicationPool is waiting", !done);
+		pid_t pid = session1->getPid();
+		session1.reset();
+		
+		// Wait at most 10 seconds.
+		time_t begin = time(NULL);
+		while (!done && time(NULL) - begin < 10) {
+			usleep(100000);
+		}
+		
+		ensure("Session 2 is openend", done);
+		ensure_equals("The idle instance was used", session2->getPid(), pid);
+		ensure_equals(pool->getCount(), 1u);
+		
+		thr->join();
+		delete thr;
 	}
 	
 	TEST_METHOD(8) {
@@ -147,25 +220,6 @@
 			// Should not throw.
 		}
 	}
-	
-	struct TestThread1 {
-		ApplicationPoolPtr pool;
-		Application::SessionPtr &m_session;
-		bool &m_done;
-		
-		TestThread1(const ApplicationPoolPtr &pool,
-			Application::SessionPtr &session,
-			bool &done)
-		: m_session(session), m_done(done) {
-			this->pool = pool;
-			done = false;
-		}
-		
-		void operator()() {
-			m_session = pool->get("stub/minimal-railsapp");
-			m_done = true;
-		}
-	};
 
 	TEST_METHOD(9) {
 		// If we call get() even though the pool is already full
@@ -348,5 +402,207 @@
 		pool->setMaxPerApp(1);
 		// TODO: how do we test this?
 	}
+	
+	TEST_METHOD(18) {
+		// Requests for an application with remote instances should be
+		// forwarded to a remote instance that accepts connections,
+		// without spawning anything.
+		string deadAddress, address;
+		createTcpServer(deadAddress, false);
+		int server = createTcpServer(address);
+		
+		pool->addRemoteInstance("stub/railsapp", deadAddress);
+		pool->addRemoteInstance("stub/railsapp", address);
+		pool->addRemoteInstance("stub/railsapp", address);
+		Application::SessionPtr session(pool->get("stub/railsapp"));
+		session->sendHeaders(createRequestHeaders());
+		session->shutdownWriter();
+		
+		int client = accept(server, NULL, NULL);
+		ensure("The remote instance received a connection", client != -1);
+		ensure("The request was received", readAll(client).find("/foo/new") != string::npos);
+		ensure_equals("Nothing was spawned", pool->getCount(), 0u);
+		close(client);
+		session.reset();
+		
+		pool->removeRemoteInstance("stub/railsapp", address);
+		try {
+			pool->get("stub/railsapp");
+			fail("IOException expected");
+		} catch (const IOException &) {
+			// Success.
+		}
+		close(server);
+	}
+	
+	TEST_METHOD(19) {
+		// getMultiple() opens the given number of sessions at once, and
+		// destroying all of them at once must release them properly.
+		string address;
+		int server = createTcpServer(address);
+		
+		pool->addRemoteInstance("stub/railsapp", address);
+		vector<Application::SessionPtr> sessions(pool->getMultiple(3, "stub/railsapp"));
+		ensure_equals(sessions.size(), 3u);
+		for (unsigned int i = 0; i < sessions.size(); i++) {
+			ensure("Session " + toString(i) + " has a stream",
+				sessions[i]->getStream() != -1);
+		}
+		sessions.clear();
+		
+		ensure_equals(pool->getMultiple(0, "stub/railsapp").size(), 0u);
+		Application::SessionPtr session(pool->get("stub/railsapp"));
+		ensure("The pool still works", session->getStream() != -1);
+		ensure_equals("Nothing was spawned", pool->getCount(), 0u);
+		session.reset();
+		pool->removeRemoteInstance("stub/railsapp", address);
+		close(server);
+	}
+	
+	TEST_METHOD(20) {
+		// getAsync() returns a PendingGet whose file descriptor becomes
+		// readable once the session can be obtained without blocking.
+		string address;
+		int server = createTcpServer(address);
+		
+		pool->addRemoteInstance("stub/railsapp", address);
+		PendingGetPtr pendingGet(pool->getAsync("stub/railsapp"));
+		struct pollfd pfd;
+		pfd.fd = pendingGet->getFd();
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		ensure_equals("The PendingGet becomes ready", poll(&pfd, 1, 5000), 1);
+		ensure(pendingGet->isReady());
+		Application::SessionPtr session(pendingGet->get());
+		ensure("The session has a stream", session->getStream() != -1);
+		session.reset();
+		pendingGet.reset();
+		
+		// Destroying a PendingGet without calling get() must not
+		// prevent the pool from being used afterwards.
+		pool->getAsync("stub/railsapp");
+		session = pool->get("stub/railsapp");
+		ensure("The pool still works", session->getStream() != -1);
+		ensure_equals("Nothing was spawned", pool->getCount(), 0u);
+		session.reset();
+		pool->removeRemoteInstance("stub/railsapp", address);
+		close(server);
+	}
+	
+	TEST_METHOD(21) {
+		// Requests beyond the per-application queue limit are rejected
+		// immediately with a BusyException.
+		pool->setMax(1);
+		pool->setRequestQueueLimits(1, 0, 0);
+		Application::SessionPtr session1(pool->get("stub/railsapp"));
+		Application::SessionPtr session2;
+		bool done;
+		
+		thread *thr = new thread(TestThread1(pool2, session2, done, "stub/railsapp"));
+		usleep(500000);
+		ensure("The second request is queued", !done);
+		try {
+			pool->get("stub/railsapp");
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			// Success.
+		}
+		session1.reset();
+		thr->join();
+		delete thr;
+		ensure("The queued request was served", done);
+		ensure_equals("Nothing else was spawned", pool->getCount(), 1u);
+	}
+	
+	TEST_METHOD(22) {
+		// A request that waits for room in the pool for longer than the
+		// maximum queue time is rejected with a BusyException.
+		pool->setMax(1);
+		pool->setRequestQueueLimits(0, 0, 1);
+		Application::SessionPtr session(pool->get("stub/railsapp"));
+		time_t begin = time(NULL);
+		try {
+			pool2->get("stub/minimal-railsapp");
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			ensure("The request waited for at most a few seconds",
+				time(NULL) - begin <= 3);
+		}
+		session.reset();
+		ensure_equals(pool->getCount(), 1u);
+	}
 
+	TEST_METHOD(23) {
+		// When the pool is full, an application may only take an idle
+		// instance away from another application that has more instances
+		// per unit of weight.
+		pool->setMax(2);
+		Application::SessionPtr session1(pool->get("stub/railsapp"));
+		Application::SessionPtr session2(pool2->get("stub/railsapp"));
+		session1.reset();
+		session2.reset();
+		session1 = pool->get("stub/railsapp2");
+		session1.reset();
+		ensure_equals("One instance of railsapp was evicted", pool->getCount(), 2u);
+		
+		session1 = pool->get("stub/railsapp");
+		bool done;
+		thread *thr = new thread(TestThread1(pool2, session2, done, "stub/railsapp"));
+		usleep(500000);
+		ensure("railsapp didn't evict railsapp2's only instance", !done);
+		ensure_equals(pool->getCount(), 2u);
+		session1.reset();
+		thr->join();
+		delete thr;
+		session2.reset();
+		
+		pool->setAppShare("stub/railsapp", 0, 2);
+		session1 = pool->get("stub/railsapp");
+		session2 = pool2->get("stub/railsapp");
+		ensure_equals("railsapp grew to its weighted share",
+			pool->getActive(), 2u);
+		ensure_equals(pool->getCount(), 2u);
+	}
+
+	TEST_METHOD(24) {
+		// getMultiple() rejects requests for more sessions with local
+		// instances than the application can have instances at the same
+		// time, instead of waiting forever for its own sessions.
+		pool->setMax(2);
+		vector<Application::SessionPtr> sessions(pool->getMultiple(2, "stub/railsapp"));
+		ensure_equals(sessions.size(), 2u);
+		ensure_equals(pool->getActive(), 2u);
+		sessions.clear();
+		try {
+			pool->getMultiple(3, "stub/railsapp");
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			// Success.
+		}
+		pool->setMaxPerApp(1);
+		try {
+			pool->getMultiple(2, "stub/railsapp");
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			// Success.
+		}
+		ensure_equals("No sessions were left open", pool->getActive(), 0u);
+	}
+	
+	TEST_METHOD(25) {
+		// getMultiple() also fails if its sessions wait for room that
+		// only its own sessions could free: here, railsapp may not take
+		// railsapp2's only instance.
+		pool->setMax(2);
+		pool->get("stub/railsapp2");
+		time_t begin = time(NULL);
+		try {
+			pool->getMultiple(2, "stub/railsapp");
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			ensure("It failed right away", time(NULL) - begin <= 1);
+		}
+		ensure_equals("No sessions were left open", pool->getActive(), 0u);
+		ensure_equals(pool->getCount(), 2u);
+	}
 #endif /* USE_TEMPLATE */
@@ -0,0 +1,195 @@
+#include "tut.h"
+#include "CgroupManager.h"
+#include "Utils.h"
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct CgroupManagerTest {
+		string root;
+		
+		CgroupManagerTest() {
+			root = "/tmp/passenger-test-cgroup." + toString(getpid());
+			mkdir(root.c_str(), 0700);
+		}
+		
+		~CgroupManagerTest() {
+			system(("rm -rf " + root).c_str());
+		}
+		
+		void writeFile(const string &filename, const char *contents) {
+			FILE *f = fopen(filename.c_str(), "w");
+			fputs(contents, f);
+			fclose(f);
+		}
+		
+		string readFile(const string &filename) {
+			ifstream file(filename.c_str());
+			string line;
+			getline(file, line);
+			return line;
+		}
+		
+		/** Returns the mount point of the cgroup v2 hierarchy, or "" if there's none. */
+		string findCgroup2Mount() {
+			ifstream mounts("/proc/self/mounts");
+			string device, dir, type, rest;
+			while (mounts >> device >> dir >> type && getline(mounts, rest)) {
+				if (type == "cgroup2") {
+					return dir;
+				}
+			}
+			return "";
+		}
+	};
+	
+	DEFINE_TEST_GROUP(CgroupManagerTest);
+	
+	TEST_METHOD(1) {
+		// setup() refuses a directory that isn't part of a cgroup v2 hierarchy.
+		CgroupManager cgroups(root);
+		try {
+			cgroups.setup();
+			fail("IOException expected");
+		} catch (const IOException &) {
+			// Success.
+		}
+	}
+	
+	TEST_METHOD(2) {
+		// setup() enables the controllers for the application groups.
+		CgroupManager cgroups(root);
+		writeFile(root + "/cgroup.controllers", "cpu memory\n");
+		cgroups.setup();
+		ensure_equals(readFile(root + "/cgroup.subtree_control"), "+memory");
+	}
+	
+	TEST_METHOD(3) {
+		// Every application gets its own group.
+		CgroupManager cgroups("/cg");
+		ensure_equals(cgroups.getGroupDir("/webapps/foo_1.0"),
+			"/cg/app-%2Fwebapps%2Ffoo_1.0");
+		ensure("Different application roots get different groups",
+			cgroups.getGroupDir("/a/b") != cgroups.getGroupDir("/a-b"));
+	}
+	
+	TEST_METHOD(4) {
+		// attach() creates the application's group, applies the limits,
+		// and moves the process into it.
+		CgroupManager cgroups(root, 50, 256 * 1024 * 1024);
+		string dir(cgroups.getGroupDir("/webapps/foo"));
+		cgroups.attach("/webapps/foo", 1234);
+		ensure_equals(readFile(dir + "/cpu.weight"), "50");
+		ensure_equals(readFile(dir + "/memory.max"), "268435456");
+		ensure_equals(readFile(dir + "/cgroup.procs"), "1234");
+		
+		// Attaching another process to an existing group works too.
+		cgroups.attach("/webapps/foo", 1235);
+		ensure_equals(readFile(dir + "/cgroup.procs"), "1235");
+	}
+	
+	TEST_METHOD(5) {
+		// attach() lifts the memory limit if none is configured.
+		CgroupManager cgroups(root);
+		string dir(cgroups.getGroupDir("/webapps/foo"));
+		cgroups.attach("/webapps/foo", 1234);
+		ensure_equals(readFile(dir + "/memory.max"), "max");
+		struct stat buf;
+		ensure("The CPU weight is left alone",
+			stat((dir + "/cpu.weight").c_str(), &buf) == -1);
+	}
+	
+	TEST_METHOD(6) {
+		// getStats() reads the group's statistics.
+		CgroupManager cgroups(root);
+		CgroupManager::Stats stats;
+		string dir(cgroups.getGroupDir("/webapps/foo"));
+		
+		ensure("Nonexistant groups have no statistics",
+			!cgroups.getStats("/webapps/foo", stats));
+		
+		mkdir(dir.c_str(), 0700);
+		writeFile(dir + "/memory.current", "95000\n");
+		writeFile(dir + "/memory.max", "100000\n");
+		writeFile(dir + "/cpu.stat", "usage_usec 5000\nuser_usec 4000\n"
+			"system_usec 1000\nnr_periods 0\nnr_throttled 0\nthrottled_usec 300\n");
+		writeFile(dir + "/memory.events", "low 0\nhigh 0\nmax 2\noom 1\noom_kill 1\n");
+		ensure(cgroups.getStats("/webapps/foo", stats));
+		ensure_equals(stats.memoryCurrent, 95000ull);
+		ensure_equals(stats.memoryMax, 100000ull);
+		ensure_equals(stats.cpuUsage, 5000ull);
+		ensure_equals(stats.cpuThrottled, 300ull);
+		ensure_equals(stats.oomKills, 1ull);
+		ensure("Near the memory limit", stats.nearMemoryLimit());
+		
+		writeFile(dir + "/memory.max", "max\n");
+		ensure(cgroups.getStats("/webapps/foo", stats));
+		ensure_equals(stats.memoryMax, 0ull);
+		ensure("Groups without a limit are never near it", !stats.nearMemoryLimit());
+	}
+	
+	TEST_METHOD(7) {
+		// Test with the real cgroup v2 hierarchy, if we're allowed to create
+		// groups in it and the memory controller is available.
+		string mount(findCgroup2Mount());
+		if (mount.empty()) {
+			return;
+		}
+		CgroupManager cgroups(mount + "/passenger-test." + toString(getpid()));
+		try {
+			cgroups.setup();
+		} catch (const exception &) {
+			rmdir(cgroups.getRoot().c_str());
+			return;
+		}
+		
+		pid_t pid = fork();
+		if (pid == 0) {
+			pause();
+			_exit(0);
+		}
+		
+		string dir(cgroups.getGroupDir("/webapps/foo"));
+		CgroupManager::Stats stats;
+		cgroups.attach("/webapps/foo", pid);
+		bool found = cgroups.getStats("/webapps/foo", stats);
+		string procs(readFile(dir + "/cgroup.procs"));
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		rmdir(dir.c_str());
+		rmdir(cgroups.getRoot().c_str());
+		
+		ensure_equals(procs, toString(pid));
+		ensure("The group has statistics", found);
+	}
+	
+	TEST_METHOD(8) {
+		// prepare() sets up the application's group without moving
+		// anything into it, so that spawned processes can join it
+		// themselves; addProcess() only moves the process.
+		CgroupManager cgroups(root, 50, 256 * 1024 * 1024);
+		string dir(cgroups.getGroupDir("/webapps/foo"));
+		struct stat buf;
+		
+		cgroups.prepare("/webapps/foo");
+		ensure_equals(readFile(dir + "/cpu.weight"), "50");
+		ensure_equals(readFile(dir + "/memory.max"), "268435456");
+		ensure("Nothing was moved into the group",
+			stat((dir + "/cgroup.procs").c_str(), &buf) == -1);
+		
+		writeFile(dir + "/memory.max", "max");
+		cgroups.addProcess("/webapps/foo", 1234);
+		ensure_equals(readFile(dir + "/cgroup.procs"), "1234");
+		ensure_equals("The limits weren't reapplied",
+			readFile(dir + "/memory.max"), "max");
+	}
+}
@@ -0,0 +1,83 @@
+#include "tut.h"
+#include "FlightRecorder.h"
+#include <string>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct FlightRecorderTest {
+		bool contains(const string &str, const string &substr) {
+			return str.find(substr) != string::npos;
+		}
+	};
+	
+	DEFINE_TEST_GROUP(FlightRecorderTest);
+	
+	TEST_METHOD(1) {
+		// The capacity is rounded up to a power of 2.
+		FlightRecorder recorder(5);
+		ensure_equals(recorder.capacity(), 8u);
+		ensure(recorder.getEvents().empty());
+	}
+	
+	TEST_METHOD(2) {
+		// Recorded events are returned oldest first, with all their fields.
+		FlightRecorder recorder(8);
+		recorder.record(FlightRecorder::SPAWN_START, "/foo");
+		recorder.record(FlightRecorder::SPAWN_END, "/foo", 1234, 5000);
+		vector<FlightRecorder::Event> events(recorder.getEvents());
+		ensure_equals(events.size(), 2u);
+		ensure_equals(events[0].type, FlightRecorder::SPAWN_START);
+		ensure_equals(string(events[0].app), "/foo");
+		ensure_equals(events[0].pid, (pid_t) 0);
+		ensure_equals(events[1].type, FlightRecorder::SPAWN_END);
+		ensure_equals(events[1].pid, (pid_t) 1234);
+		ensure_equals(events[1].duration, 5000ULL);
+		ensure(events[0].time <= events[1].time);
+	}
+	
+	TEST_METHOD(3) {
+		// When the buffer is full, the oldest events are overwritten.
+		FlightRecorder recorder(4);
+		for (int i = 1; i <= 10; i++) {
+			recorder.record(FlightRecorder::GET, "/foo", i);
+		}
+		vector<FlightRecorder::Event> events(recorder.getEvents());
+		ensure_equals(events.size(), 4u);
+		ensure_equals(events[0].pid, (pid_t) 7);
+		ensure_equals(events[3].pid, (pid_t) 10);
+		
+		events = recorder.getEvents(2);
+		ensure_equals(events.size(), 2u);
+		ensure_equals(events[0].pid, (pid_t) 9);
+		ensure_equals(events[1].pid, (pid_t) 10);
+	}
+	
+	TEST_METHOD(4) {
+		// Long application keys are truncated at the front.
+		FlightRecorder recorder(4);
+		string app(100, 'x');
+		app.append("/the-end");
+		recorder.record(FlightRecorder::EVICT, app);
+		vector<FlightRecorder::Event> events(recorder.getEvents());
+		string stored(events[0].app);
+		ensure_equals(stored.size(), (string::size_type) FlightRecorder::APP_KEY_SIZE - 1);
+		ensure_equals(stored, app.substr(app.size() - stored.size()));
+	}
+	
+	TEST_METHOD(5) {
+		// toString() shows the event types, PIDs and application keys.
+		FlightRecorder recorder(4);
+		recorder.record(FlightRecorder::CONNECT_FAILURE, "/foo", 1234);
+		recorder.record(FlightRecorder::RESTART, "/bar");
+		string result(recorder.toString());
+		ensure(contains(result, "Recent pool events"));
+		ensure(contains(result, "connect_failure"));
+		ensure(contains(result, "PID: 1234"));
+		ensure(contains(result, "/foo\n"));
+		ensure(contains(result, "restart"));
+		ensure(contains(result, "/bar\n"));
+		ensure(!contains(recorder.toString(1), "/foo"));
+	}
+}
@@ -0,0 +1,107 @@
+#include "tut.h"
+#include "HashRing.h"
+#include <string>
+#include <map>
+#include <cstdio>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct HashRingTest {
+		static string key(unsigned int i) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "/webapps/app%u", i);
+			return buf;
+		}
+	};
+	
+	DEFINE_TEST_GROUP(HashRingTest);
+	
+	TEST_METHOD(1) {
+		// An empty ring has no owners.
+		HashRing ring;
+		ensure(ring.empty());
+		ensure(ring.getNodes("/foo", 1).empty());
+		ensure_equals(ring.getNode("/foo"), "");
+	}
+	
+	TEST_METHOD(2) {
+		// getNodes() returns distinct nodes, and no more nodes than there are.
+		HashRing ring;
+		ring.add("a:1");
+		ring.add("b:1");
+		ring.add("c:1");
+		ring.add("c:1");
+		ensure_equals(ring.getNodes().size(), 3u);
+		
+		vector<string> owners(ring.getNodes("/foo", 2));
+		ensure_equals(owners.size(), 2u);
+		ensure(owners[0] != owners[1]);
+		ensure_equals(owners[0], ring.getNode("/foo"));
+		ensure_equals(ring.getNodes("/foo", 10).size(), 3u);
+		ensure(ring.owns(owners[1], "/foo", 2));
+	}
+	
+	TEST_METHOD(3) {
+		// The mapping doesn't depend on the order in which nodes are added.
+		HashRing ring1, ring2;
+		ring1.add("a:1");
+		ring1.add("b:1");
+		ring1.add("c:1");
+		ring2.add("c:1");
+		ring2.add("a:1");
+		ring2.add("b:1");
+		for (unsigned int i = 0; i < 200; i++) {
+			ensure(ring1.getNodes(key(i), 2) == ring2.getNodes(key(i), 2));
+		}
+	}
+	
+	TEST_METHOD(4) {
+		// Keys are spread reasonably evenly over the nodes.
+		HashRing ring;
+		map<string, unsigned int> counts;
+		ring.add("a:1");
+		ring.add("b:1");
+		ring.add("c:1");
+		ring.add("d:1");
+		for (unsigned int i = 0; i < 4000; i++) {
+			counts[ring.getNode(key(i))]++;
+		}
+		ensure_equals(counts.size(), 4u);
+		for (map<string, unsigned int>::iterator it = counts.begin(); it != counts.end(); it++) {
+			ensure("Node " + it->first + " owns a fair share of the keys",
+				it->second > 700 && it->second < 1300);
+		}
+	}
+	
+	TEST_METHOD(5) {
+		// Adding a node only moves keys to that node, and removing
+		// it again restores the original mapping.
+		HashRing ring;
+		map<string, string> before;
+		unsigned int moved = 0;
+		
+		ring.add("a:1");
+		ring.add("b:1");
+		ring.add("c:1");
+		for (unsigned int i = 0; i < 1000; i++) {
+			before[key(i)] = ring.getNode(key(i));
+		}
+		
+		ring.add("d:1");
+		for (unsigned int i = 0; i < 1000; i++) {
+			string owner(ring.getNode(key(i)));
+			if (owner != before[key(i)]) {
+				ensure_equals(owner, "d:1");
+				moved++;
+			}
+		}
+		ensure("Some keys moved to the new node", moved > 100 && moved < 400);
+		
+		ring.remove("d:1");
+		for (unsigned int i = 0; i < 1000; i++) {
+			ensure_equals(ring.getNode(key(i)), before[key(i)]);
+		}
+	}
+}
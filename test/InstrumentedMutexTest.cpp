@@ -0,0 +1,73 @@
+#include "tut.h"
+#include "InstrumentedMutex.h"
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+using namespace boost;
+
+namespace tut {
+	struct InstrumentedMutexTest {
+	};
+
+	DEFINE_TEST_GROUP(InstrumentedMutexTest);
+	
+	static void lockAndSleep(InstrumentedMutex *mutex) {
+		InstrumentedMutex::scoped_lock l(*mutex, "sleeper");
+		usleep(20000);
+	}
+
+	TEST_METHOD(1) {
+		// An uninstrumented mutex has no statistics.
+		InstrumentedMutex mutex("test", false);
+		{
+			InstrumentedMutex::scoped_lock l(mutex, P_LOCK_SITE);
+		}
+		ensure(!mutex.isInstrumented());
+		ensure_equals(mutex.statistics(), "");
+	}
+	
+	TEST_METHOD(2) {
+		// Acquisitions and call sites are recorded.
+		InstrumentedMutex mutex("test", true);
+		{
+			InstrumentedMutex::scoped_lock l(mutex, "first site");
+		}
+		{
+			InstrumentedMutex::scoped_lock l(mutex, "second site");
+		}
+		string stats(mutex.statistics());
+		ensure("Name is reported", stats.find("test: acquisitions=2 contended=0") == 0);
+		ensure("First site is reported", stats.find("first site") != string::npos);
+		ensure("Second site is reported", stats.find("second site") != string::npos);
+	}
+	
+	TEST_METHOD(3) {
+		// Contention is recorded, and the longest holder comes first.
+		InstrumentedMutex mutex("test", true);
+		thread thr(boost::bind(lockAndSleep, &mutex));
+		usleep(5000);
+		{
+			InstrumentedMutex::scoped_lock l(mutex, "waiter");
+		}
+		thr.join();
+		string stats(mutex.statistics());
+		ensure("Contention is recorded", stats.find("contended=1") != string::npos);
+		ensure("Sleeper is the longest holder",
+			stats.find("sleeper") < stats.find("waiter"));
+	}
+	
+	TEST_METHOD(4) {
+		// It works with boost::condition.
+		InstrumentedMutex mutex("test", true);
+		condition cond;
+		InstrumentedMutex::scoped_lock l(mutex, "waiter");
+		ensure("Timed out", !cond.timed_wait(l, get_system_time() + posix_time::millisec(10)));
+		ensure(l.owns_lock());
+		l.unlock();
+		ensure("Relocking is recorded",
+			mutex.statistics().find("acquisitions=2") != string::npos);
+	}
+}
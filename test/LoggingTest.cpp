@@ -0,0 +1,76 @@
+#include "tut.h"
+#include "Logging.h"
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <sstream>
+
+using namespace Passenger;
+using namespace std;
+using namespace boost;
+
+namespace tut {
+	struct LoggingTest {
+		ostream *oldLogStream;
+		stringstream output;
+		
+		LoggingTest() {
+			oldLogStream = _logStream;
+			_logStream = &output;
+		}
+		
+		~LoggingTest() {
+			stopAsyncLogging();
+			_logStream = oldLogStream;
+		}
+		
+		unsigned int countOccurrences(const string &str, const string &substr) {
+			unsigned int result = 0;
+			string::size_type pos = 0;
+			while ((pos = str.find(substr, pos)) != string::npos) {
+				result++;
+				pos += substr.size();
+			}
+			return result;
+		}
+	};
+	
+	DEFINE_TEST_GROUP(LoggingTest);
+	
+	static void logMessages(unsigned int id, unsigned int count) {
+		for (unsigned int i = 0; i < count; i++) {
+			P_WARN("message " << id << "-" << i);
+		}
+	}
+	
+	TEST_METHOD(1) {
+		// Synchronous logging writes the message immediately.
+		P_WARN("hello " << 123);
+		ensure(output.str().find("\n  hello 123\n") != string::npos);
+	}
+	
+	TEST_METHOD(2) {
+		// Asynchronous logging writes all messages after stopAsyncLogging(),
+		// in order.
+		startAsyncLogging(64);
+		P_WARN("first");
+		P_WARN("second " << string(1000, 'x'));
+		stopAsyncLogging();
+		string str(output.str());
+		ensure(str.find("\n  first\n") != string::npos);
+		ensure(str.find("\n  second " + string(1000, 'x') + "\n") != string::npos);
+		ensure(str.find("first") < str.find("second"));
+	}
+	
+	TEST_METHOD(3) {
+		// Records from multiple threads are either written or counted as dropped.
+		thread_group threads;
+		startAsyncLogging(16);
+		for (unsigned int i = 0; i < 4; i++) {
+			threads.create_thread(boost::bind(logMessages, i, 1000));
+		}
+		threads.join_all();
+		unsigned long long dropped = getDroppedLogRecords();
+		stopAsyncLogging();
+		ensure_equals(countOccurrences(output.str(), "\n  message ") + dropped, 4000u);
+	}
+}
@@ -0,0 +1,78 @@
+#include "tut.h"
+#include "MemorySampler.h"
+#include <boost/bind.hpp>
+#include <cstdio>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+using namespace boost;
+
+namespace tut {
+	struct MemorySamplerTest {
+		map<pid_t, string> pids;
+		
+		map<pid_t, string> listProcesses() {
+			return pids;
+		}
+	};
+
+	DEFINE_TEST_GROUP(MemorySamplerTest);
+	
+	TEST_METHOD(1) {
+		// parseSmaps() adds up the fields of all mappings, including
+		// a last line that isn't terminated by a newline.
+		const char *filename = "/tmp/passenger_test_smaps.txt";
+		FILE *f = fopen(filename, "w");
+		fputs("00400000-0040c000 r-xp 00000000 08:01 123  /bin/cat\n"
+			"Size:                 48 kB\n"
+			"Rss:                  40 kB\n"
+			"Pss:                  20 kB\n"
+			"Private_Dirty:         0 kB\n"
+			"0060b000-0060c000 rw-p 0000b000 08:01 123  /bin/cat\n"
+			"Size:                  4 kB\n"
+			"Rss:                   4 kB\n"
+			"Pss:                   4 kB\n"
+			"Private_Dirty:         4 kB", f);
+		fclose(f);
+		
+		MemoryUsage usage;
+		bool result = parseSmaps(filename, usage);
+		unlink(filename);
+		ensure(result);
+		ensure_equals(usage.rss, 44u);
+		ensure_equals(usage.pss, 24u);
+		ensure_equals(usage.privateDirty, 4u);
+		ensure(!parseSmaps(filename, usage));
+	}
+	
+	TEST_METHOD(2) {
+		// readMemoryUsage() works on our own process, but not on
+		// nonexistant processes.
+		MemoryUsage usage;
+		ensure(readMemoryUsage(getpid(), usage));
+		ensure(usage.rss > 0);
+		ensure(usage.vmSize >= usage.rss);
+		ensure(!readMemoryUsage((pid_t) 999999999, usage));
+	}
+	
+	TEST_METHOD(3) {
+		// The sampler keeps a bounded history per process, and forgets
+		// processes that are no longer listed.
+		MemorySampler sampler(bind(&MemorySamplerTest::listProcesses, this), 1, 2);
+		pids[getpid()] = "test process";
+		sampler.sample();
+		sampler.sample();
+		sampler.sample();
+		
+		MemorySampler::ProcessPtr process(sampler.getProcess(getpid()));
+		ensure(process != NULL);
+		ensure_equals(process->description, "test process");
+		ensure_equals(process->samples.size(), 2u);
+		ensure(sampler.toString().find("test process") != string::npos);
+		
+		pids.clear();
+		sampler.sample();
+		ensure(sampler.getProcess(getpid()) == NULL);
+	}
+}
@@ -309,4 +309,29 @@ namespace tut {
 			waitpid(pid, NULL, 0);
 		}
 	}
+	
+	TEST_METHOD(13) {
+		// Messages built with appendMessage() can be sent together with
+		// writeRaw(), and read back one by one.
+		vector<string> args;
+		list<string> message;
+		string buffer;
+		
+		message.push_back("close");
+		message.push_back("1");
+		message.push_back("2");
+		MessageChannel::appendMessage(buffer, message);
+		message.clear();
+		message.push_back("getCount");
+		MessageChannel::appendMessage(buffer, message);
+		writer.writeRaw(buffer);
+		
+		ensure(reader.read(args));
+		ensure_equals(args.size(), 3u);
+		ensure_equals(args[0], "close");
+		ensure_equals(args[2], "2");
+		ensure(reader.read(args));
+		ensure_equals(args.size(), 1u);
+		ensure_equals(args[0], "getCount");
+	}
 }
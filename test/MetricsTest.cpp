@@ -0,0 +1,131 @@
+#include "tut.h"
+#include "Metrics.h"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+using namespace boost;
+
+namespace tut {
+	struct MetricsTest {
+		MetricsRegistry registry;
+		unsigned int collected;
+		
+		MetricsTest() {
+			collected = 0;
+		}
+		
+		void collect() {
+			collected++;
+			registry.gauge("test_collected", "Collector invocations.").set(collected * 10);
+		}
+		
+		void slowCollect(volatile bool *running, volatile bool *finished) {
+			*running = true;
+			usleep(200000);
+			*finished = true;
+		}
+		
+		void exportMetrics() {
+			registry.toString();
+		}
+		
+		bool contains(const string &str, const string &substr) {
+			return str.find(substr) != string::npos;
+		}
+	};
+	
+	DEFINE_TEST_GROUP(MetricsTest);
+	
+	TEST_METHOD(1) {
+		// Metrics with the same name and labels are the same object.
+		Counter &c1 = registry.counter("test_total", "Test.", "app=\"foo\"");
+		Counter &c2 = registry.counter("test_total", "Test.", "app=\"foo\"");
+		Counter &c3 = registry.counter("test_total", "Test.", "app=\"bar\"");
+		ensure_equals(&c1, &c2);
+		ensure(&c1 != &c3);
+		c1.increment();
+		c2.increment(2);
+		ensure_equals(c1.get(), 3ULL);
+		ensure_equals(c3.get(), 0ULL);
+	}
+	
+	TEST_METHOD(2) {
+		// Counters and gauges are exported with their HELP and TYPE lines.
+		registry.counter("test_total", "A counter.", "app=\"foo\"").increment(5);
+		registry.gauge("test_gauge", "A gauge.").set(-3);
+		string result(registry.toString());
+		ensure(contains(result, "# HELP test_total A counter.\n"));
+		ensure(contains(result, "# TYPE test_total counter\n"));
+		ensure(contains(result, "test_total{app=\"foo\"} 5\n"));
+		ensure(contains(result, "# TYPE test_gauge gauge\n"));
+		ensure(contains(result, "test_gauge -3\n"));
+	}
+	
+	TEST_METHOD(3) {
+		// Histograms are exported with cumulative buckets, in seconds.
+		LatencyHistogram &h = registry.histogram("test_seconds", "A histogram.");
+		h.observe(500);      // 0.0005 sec
+		h.observe(1000);     // 0.001 sec: still in the first bucket.
+		h.observe(200000);   // 0.2 sec
+		h.observe(100000000); // 100 sec: only in +Inf.
+		ensure_equals(h.getCount(), 4ULL);
+		string result(registry.toString());
+		ensure(contains(result, "# TYPE test_seconds histogram\n"));
+		ensure(contains(result, "test_seconds_bucket{le=\"0.001000\"} 2\n"));
+		ensure(contains(result, "test_seconds_bucket{le=\"0.100000\"} 2\n"));
+		ensure(contains(result, "test_seconds_bucket{le=\"0.250000\"} 3\n"));
+		ensure(contains(result, "test_seconds_bucket{le=\"60.000000\"} 3\n"));
+		ensure(contains(result, "test_seconds_bucket{le=\"+Inf\"} 4\n"));
+		ensure(contains(result, "test_seconds_sum 100.201500\n"));
+		ensure(contains(result, "test_seconds_count 4\n"));
+	}
+	
+	TEST_METHOD(4) {
+		// Labels are escaped, and merged with the "le" label of histograms.
+		ensure_equals(MetricsRegistry::label("app", "a\"b\\c\nd"),
+			"app=\"a\\\"b\\\\c\\nd\"");
+		registry.histogram("test_seconds", "A histogram.",
+			MetricsRegistry::label("app", "/foo")).observe(1);
+		string result(registry.toString());
+		ensure(contains(result, "test_seconds_bucket{app=\"/foo\",le=\"0.001000\"} 1\n"));
+		ensure(contains(result, "test_seconds_count{app=\"/foo\"} 1\n"));
+	}
+	
+	TEST_METHOD(5) {
+		// Collectors are called before exporting, until they're removed.
+		unsigned int id = registry.addCollector(bind(&MetricsTest::collect, this));
+		ensure(contains(registry.toString(), "test_collected 10\n"));
+		ensure(contains(registry.toString(), "test_collected 20\n"));
+		registry.removeCollector(id);
+		ensure(contains(registry.toString(), "test_collected 20\n"));
+		ensure_equals(collected, 2u);
+	}
+	
+	TEST_METHOD(6) {
+		// resetGauges() sets all gauges with the given name to 0.
+		registry.gauge("test_gauge", "A gauge.", "app=\"foo\"").set(3);
+		registry.gauge("test_gauge", "A gauge.", "app=\"bar\"").set(4);
+		registry.gauge("other_gauge", "Another gauge.").set(5);
+		registry.resetGauges("test_gauge");
+		ensure_equals(registry.gauge("test_gauge", "A gauge.", "app=\"foo\"").get(), 0LL);
+		ensure_equals(registry.gauge("test_gauge", "A gauge.", "app=\"bar\"").get(), 0LL);
+		ensure_equals(registry.gauge("other_gauge", "Another gauge.").get(), 5LL);
+	}
+	
+	TEST_METHOD(7) {
+		// removeCollector() waits until the collector is done running.
+		volatile bool running = false, finished = false;
+		unsigned int id = registry.addCollector(bind(&MetricsTest::slowCollect,
+			this, &running, &finished));
+		boost::thread thr(bind(&MetricsTest::exportMetrics, this));
+		while (!running) {
+			usleep(1000);
+		}
+		registry.removeCollector(id);
+		ensure("The collector has finished", finished);
+		thr.join();
+	}
+}
@@ -0,0 +1,104 @@
+#include "tut.h"
+#include "NumaTopology.h"
+#include "Utils.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sched.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct NumaTopologyTest {
+		string root;
+		
+		NumaTopologyTest() {
+			root = "/tmp/passenger-test-numa." + toString(getpid());
+			mkdir(root.c_str(), 0700);
+		}
+		
+		~NumaTopologyTest() {
+			system(("rm -rf " + root).c_str());
+		}
+		
+		/** Adds a node to the fake sysfs topology. */
+		void addNode(const string &name, const char *cpuList) {
+			string dir(root + "/" + name);
+			mkdir(dir.c_str(), 0700);
+			FILE *f = fopen((dir + "/cpulist").c_str(), "w");
+			fputs(cpuList, f);
+			fclose(f);
+		}
+	};
+	
+	DEFINE_TEST_GROUP(NumaTopologyTest);
+	
+	TEST_METHOD(1) {
+		// parseCpuList() understands single CPUs and ranges.
+		vector<unsigned int> cpus;
+		ensure(NumaTopology::parseCpuList("0-2,5,8-9\n", cpus));
+		ensure_equals(cpus.size(), 6u);
+		ensure_equals(cpus[0], 0u);
+		ensure_equals(cpus[2], 2u);
+		ensure_equals(cpus[3], 5u);
+		ensure_equals(cpus[5], 9u);
+		
+		cpus.clear();
+		ensure("An empty list is valid", NumaTopology::parseCpuList("\n", cpus));
+		ensure(cpus.empty());
+	}
+	
+	TEST_METHOD(2) {
+		// parseCpuList() rejects malformed lists.
+		vector<unsigned int> cpus;
+		ensure(!NumaTopology::parseCpuList("a", cpus));
+		ensure(!NumaTopology::parseCpuList("3-1", cpus));
+		ensure(!NumaTopology::parseCpuList("1-", cpus));
+		ensure(!NumaTopology::parseCpuList("1x", cpus));
+	}
+	
+	TEST_METHOD(3) {
+		// detect() reads the nodes sorted by ID, and skips nodes without
+		// CPUs and entries that aren't nodes.
+		addNode("node10", "4-5\n");
+		addNode("node2", "0-3\n");
+		addNode("node3", "\n");
+		addNode("nodefoo", "6\n");
+		addNode("cpu0", "7\n");
+		
+		NumaTopology topology(NumaTopology::detect(root));
+		ensure_equals(topology.size(), 2u);
+		ensure_equals(topology.getNode(0).id, 2u);
+		ensure_equals(topology.getNode(0).cpus.size(), 4u);
+		ensure_equals(topology.getNode(1).id, 10u);
+		ensure_equals(topology.getNode(1).cpus.size(), 2u);
+	}
+	
+	TEST_METHOD(4) {
+		// A nonexistant directory results in an empty topology.
+		ensure_equals(NumaTopology::detect(root + "/nonexistant").size(), 0u);
+	}
+	
+	TEST_METHOD(5) {
+		// pin() sets the CPU affinity of the given process.
+		cpu_set_t original, pinned;
+		unsigned int cpu = 0;
+		
+		ensure(sched_getaffinity(0, sizeof(original), &original) == 0);
+		while (!CPU_ISSET(cpu, &original)) {
+			cpu++;
+		}
+		addNode("node0", toString(cpu).c_str());
+		NumaTopology topology(NumaTopology::detect(root));
+		
+		topology.pin(getpid(), 0);
+		ensure(sched_getaffinity(0, sizeof(pinned), &pinned) == 0);
+		sched_setaffinity(0, sizeof(original), &original);
+		ensure_equals(CPU_COUNT(&pinned), 1);
+		ensure(CPU_ISSET(cpu, &pinned));
+	}
+}
@@ -0,0 +1,153 @@
+#include "tut.h"
+#include "SharedInstanceTable.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct SharedInstanceTableTest {
+		SharedInstanceTable table;
+		
+		SharedInstanceTableTest(): table(4) {
+		}
+		
+		SharedInstanceTable::Handle publish(const string &appRoot, pid_t pid) {
+			return table.publish(appRoot, pid, "/tmp/socket." + toString(pid),
+				Application::UNIX_SOCKET);
+		}
+	};
+	
+	DEFINE_TEST_GROUP(SharedInstanceTableTest);
+	
+	TEST_METHOD(1) {
+		// A published instance can be reserved once, and again after
+		// it has been released.
+		SharedInstanceTable::Instance instance, instance2;
+		SharedInstanceTable::Handle handle(publish("/foo", 1234));
+		
+		ensure(handle.valid());
+		ensure(table.reserve("/foo", instance));
+		ensure_equals(instance.pid, 1234);
+		ensure_equals(string(instance.socketName), "/tmp/socket.1234");
+		ensure_equals(instance.socketType, Application::UNIX_SOCKET);
+		ensure_equals(table.getSessions(handle), 1u);
+		ensure("A busy instance can't be reserved", !table.reserve("/foo", instance2));
+		
+		table.releaseReservation(instance.handle);
+		ensure_equals(table.getSessions(handle), 0u);
+		ensure(table.getLastUsed(handle) != 0);
+		ensure(table.reserve("/foo", instance2));
+		ensure_equals(table.getReservations(), 2ull);
+		ensure_equals(table.getMisses(), 1ull);
+	}
+	
+	TEST_METHOD(2) {
+		// Only instances of the requested application are reserved.
+		SharedInstanceTable::Instance instance;
+		publish("/foo", 1);
+		publish("/bar", 2);
+		ensure(table.reserve("/bar", instance));
+		ensure_equals(instance.pid, 2);
+		ensure(!table.reserve("/bar", instance));
+		ensure(!table.reserve("/baz", instance));
+	}
+	
+	TEST_METHOD(3) {
+		// acquire() adds a session, so that the instance can't be reserved.
+		SharedInstanceTable::Instance instance;
+		SharedInstanceTable::Handle handle(publish("/foo", 1));
+		table.acquire(handle);
+		ensure(!table.reserve("/foo", instance));
+		table.release(handle);
+		ensure(table.reserve("/foo", instance));
+	}
+	
+	TEST_METHOD(4) {
+		// A retired instance can't be reserved, and releasing an old
+		// reservation doesn't affect the instance that reuses its slot.
+		SharedInstanceTable::Instance instance;
+		SharedInstanceTable::Handle handle(publish("/foo", 1));
+		
+		ensure(table.reserve("/foo", instance));
+		table.retire(handle);
+		ensure_equals(table.getSessions(handle), 0u);
+		ensure(!table.reserve("/foo", instance));
+		
+		SharedInstanceTable::Handle handle2(publish("/foo", 2));
+		ensure_equals(handle2.slot, handle.slot);
+		ensure(handle2.generation != handle.generation);
+		table.acquire(handle2);
+		table.releaseReservation(instance.handle);
+		ensure_equals(table.getSessions(handle2), 1u);
+	}
+	
+	TEST_METHOD(5) {
+		// Nothing is published if the table is full, or if the instance
+		// can't be connected to through the table.
+		for (int i = 1; i <= 4; i++) {
+			ensure(publish("/foo", i).valid());
+		}
+		ensure(!publish("/foo", 5).valid());
+		table.reset();
+		ensure(publish("/foo", 5).valid());
+		ensure(!table.publish("/foo", 6, "127.0.0.1:1234",
+			Application::TCP_SOCKET).valid());
+		ensure(!publish(string(SharedInstanceTable::APP_ROOT_SIZE, 'x'), 7).valid());
+	}
+	
+	TEST_METHOD(6) {
+		// The table is shared with child processes, and can be attached
+		// to through its file descriptor.
+		SharedInstanceTable::Handle handle(publish("/foo", 1));
+		pid_t pid = fork();
+		if (pid == 0) {
+			SharedInstanceTable::Instance instance;
+			_exit(table.reserve("/foo", instance) ? 0 : 1);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		ensure(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		ensure_equals(table.getSessions(handle), 1u);
+		
+		SharedInstanceTablePtr other(SharedInstanceTable::attach(dup(table.getFd())));
+		ensure_equals(other->capacity(), 4u);
+		ensure_equals(other->getSessions(handle), 1u);
+	}
+	
+	TEST_METHOD(7) {
+		// reclaim() releases the reservation of a process that exited
+		// without releasing it, but not the sessions of the caller.
+		SharedInstanceTable::Handle handle(publish("/foo", 1));
+		pid_t pid = fork();
+		if (pid == 0) {
+			SharedInstanceTable::Instance instance;
+			_exit(table.reserve("/foo", instance) ? 0 : 1);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		ensure(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		table.acquire(handle);
+		ensure_equals(table.getSessions(handle), 2u);
+		
+		ensure(table.reclaim(handle, 1));
+		ensure_equals(table.getSessions(handle), 1u);
+		ensure("Nothing is left to reclaim", !table.reclaim(handle, 1));
+		table.release(handle);
+		ensure_equals(table.getSessions(handle), 0u);
+	}
+	
+	TEST_METHOD(8) {
+		// reclaim() leaves the reservations of live processes alone.
+		SharedInstanceTable::Instance instance;
+		SharedInstanceTable::Handle handle(publish("/foo", 1));
+		ensure(table.reserve("/foo", instance));
+		ensure(!table.reclaim(handle, 0));
+		ensure_equals(table.getSessions(handle), 1u);
+		table.releaseReservation(instance.handle);
+		ensure(table.reserve("/foo", instance));
+	}
+}
@@ -0,0 +1,142 @@
+#include "tut.h"
+#include "SlabAllocator.h"
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <list>
+#include <vector>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct SlabAllocatorTest {
+		struct Object: public SlabAllocated {
+			int *destructed;
+			char padding[40];
+			
+			Object(int *destructed) {
+				this->destructed = destructed;
+			}
+			
+			virtual ~Object() {
+				(*destructed)++;
+			}
+		};
+		
+		struct Callback: public SlabAllocated {
+			int *called;
+			int *destructed;
+			
+			Callback(int *called, int *destructed) {
+				this->called = called;
+				this->destructed = destructed;
+			}
+			
+			~Callback() {
+				(*destructed)++;
+			}
+			
+			void operator()() {
+				(*called)++;
+			}
+		};
+		
+		static void allocateMany(SlabAllocator *allocator, bool *failed) {
+			vector<void *> blocks;
+			for (unsigned int i = 0; i < 20000; i++) {
+				int *block = (int *) allocator->allocate(sizeof(int) * 4);
+				*block = i;
+				blocks.push_back(block);
+				if (i % 3 == 0) {
+					int *first = (int *) blocks.front();
+					if (*first != (int) (i - blocks.size() + 1)) {
+						*failed = true;
+					}
+					allocator->deallocate(first, sizeof(int) * 4);
+					blocks.erase(blocks.begin());
+				}
+			}
+			for (unsigned int i = 0; i < blocks.size(); i++) {
+				allocator->deallocate(blocks[i], sizeof(int) * 4);
+			}
+		}
+	};
+	
+	DEFINE_TEST_GROUP(SlabAllocatorTest);
+	
+	TEST_METHOD(1) {
+		// Freed blocks are reused by later allocations of the same size class.
+		SlabAllocator allocator;
+		void *a = allocator.allocate(20);
+		void *b = allocator.allocate(30);
+		ensure(a != b);
+		ensure_equals((size_t) a % SlabAllocator::GRANULARITY, 0u);
+		allocator.deallocate(a, 20);
+		ensure_equals(allocator.allocate(32), a);
+		ensure_equals(allocator.getSlabMemory() / SlabAllocator::SLAB_SIZE, 1u);
+	}
+	
+	TEST_METHOD(2) {
+		// Allocations larger than MAX_SIZE don't use slabs.
+		SlabAllocator allocator;
+		void *block = allocator.allocate(SlabAllocator::MAX_SIZE + 1);
+		ensure_equals(allocator.getSlabMemory(), 0u);
+		allocator.deallocate(block, SlabAllocator::MAX_SIZE + 1);
+	}
+	
+	TEST_METHOD(3) {
+		// SlabAllocated objects are constructed and destroyed normally.
+		int destructed = 0;
+		Object *object = new Object(&destructed);
+		delete object;
+		ensure_equals(destructed, 1);
+		
+		shared_ptr<Object> shared(slabPtr(new Object(&destructed)));
+		shared_ptr<Object> copy(shared);
+		shared.reset();
+		ensure_equals(destructed, 1);
+		copy.reset();
+		ensure_equals(destructed, 2);
+	}
+	
+	TEST_METHOD(4) {
+		// SlabStlAllocator works with node-based containers.
+		list< int, SlabStlAllocator<int> > l;
+		for (int i = 0; i < 1000; i++) {
+			l.push_back(i);
+		}
+		l.splice(l.end(), l, l.begin());
+		ensure_equals(l.front(), 1);
+		ensure_equals(l.back(), 0);
+		ensure_equals(l.size(), 1000u);
+	}
+	
+	TEST_METHOD(5) {
+		// SlabCallback shares the callback between copies, and destroys it
+		// when the last copy is destroyed.
+		int called = 0, destructed = 0;
+		{
+			function<void ()> f(SlabCallback<Callback>(new Callback(&called, &destructed)));
+			function<void ()> g(f);
+			f();
+			g();
+			f = function<void ()>();
+			ensure_equals(destructed, 0);
+		}
+		ensure_equals(called, 2);
+		ensure_equals(destructed, 1);
+	}
+	
+	TEST_METHOD(6) {
+		// The allocator is thread-safe.
+		SlabAllocator allocator;
+		bool failed = false;
+		thread_group threads;
+		for (int i = 0; i < 4; i++) {
+			threads.create_thread(boost::bind(allocateMany, &allocator, &failed));
+		}
+		threads.join_all();
+		ensure("No block was handed out twice", !failed);
+	}
+}
@@ -1,6 +1,10 @@
 #include "tut.h"
 #include "SpawnManager.h"
+#include <boost/thread.hpp>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <signal.h>
 #include <cstring>
 #include <unistd.h>
@@ -16,6 +20,110 @@ namespace tut {
 	};
 
 	DEFINE_TEST_GROUP(SpawnManagerTest);
+	
+	/**
+	 * A fake spawn agent, which serves a single connection. It expects the secret
+	 * "s3cret", and pretends to spawn an application instance with PID
+	 * <tt>firstPid</tt>, <tt>firstPid + 1</tt>, etc. for every spawn request, and
+	 * records the PIDs of released instances. The first <tt>unixSpawns</tt>
+	 * instances pretend to listen on a Unix socket. Every spawn takes
+	 * <tt>spawnDelay</tt> milliseconds.
+	 */
+	struct FakeSpawnAgent {
+		int serverFd;
+		string address;
+		pid_t firstPid;
+		boost::mutex lock;
+		vector<string> released;
+		unsigned int unixSpawns;
+		unsigned int spawnDelay;
+		boost::thread *thr;
+		
+		FakeSpawnAgent(pid_t firstPid) {
+			struct sockaddr_in addr;
+			socklen_t len = sizeof(addr);
+			
+			serverFd = socket(PF_INET, SOCK_STREAM, 0);
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+			addr.sin_port = 0;
+			::bind(serverFd, (const sockaddr *) &addr, sizeof(addr));
+			::listen(serverFd, 10);
+			getsockname(serverFd, (sockaddr *) &addr, &len);
+			address = "127.0.0.1:" + toString(ntohs(addr.sin_port));
+			this->firstPid = firstPid;
+			unixSpawns = 0;
+			spawnDelay = 0;
+			thr = new boost::thread(boost::bind(&FakeSpawnAgent::threadMain, this));
+		}
+		
+		~FakeSpawnAgent() {
+			thr->join();
+			delete thr;
+			close(serverFd);
+		}
+		
+		void threadMain() {
+			int fd = accept(serverFd, NULL, NULL);
+			MessageChannel channel(fd);
+			vector<string> args;
+			pid_t pid = firstPid;
+			
+			try {
+				if (!channel.read(args)) {
+					channel.close();
+					return;
+				}
+				if (args.size() != 2 || args[0] != "secret" || args[1] != "s3cret") {
+					channel.write("error", "Wrong spawn agent secret.", NULL);
+					channel.close();
+					return;
+				}
+				channel.write("ok", NULL);
+				while (channel.read(args)) {
+					if (args[0] == "spawn_application") {
+						unsigned int delay;
+						{
+							boost::mutex::scoped_lock l(lock);
+							delay = spawnDelay;
+						}
+						usleep(delay * 1000);
+						boost::mutex::scoped_lock l(lock);
+						channel.write("ok", NULL);
+						if (unixSpawns > 0) {
+							unixSpawns--;
+							channel.write(toString(pid).c_str(), "/tmp/foo", "unix", NULL);
+						} else {
+							channel.write(toString(pid).c_str(), "127.0.0.1:4000", "tcp", NULL);
+						}
+						pid++;
+					} else if (args[0] == "ping") {
+						channel.write("pong", NULL);
+					} else if (args[0] == "release") {
+						boost::mutex::scoped_lock l(lock);
+						released.push_back(args[1]);
+					}
+				}
+			} catch (const exception &) {
+				// Connection lost.
+			}
+			channel.close();
+		}
+		
+		bool waitForRelease(const string &pid) {
+			for (int i = 0; i < 50; i++) {
+				{
+					boost::mutex::scoped_lock l(lock);
+					if (find(released.begin(), released.end(), pid) != released.end()) {
+						return true;
+					}
+				}
+				usleep(100000);
+			}
+			return false;
+		}
+	};
 
 	TEST_METHOD(1) {
 		// Spawning an application should return a valid Application object.
@@ -61,4 +169,130 @@ namespace tut {
 			}
 		}
 	}
+	
+	TEST_METHOD(4) {
+		// In remote mode, applications should be spawned on the spawn agents
+		// in a round-robin fashion, and the agent should be told to release
+		// an instance once its Application object is destroyed.
+		FakeSpawnAgent agent1(1000), agent2(2000);
+		vector<string> addresses;
+		addresses.push_back(agent1.address);
+		addresses.push_back(agent2.address);
+		{
+			SpawnManager remoteManager("", "", "ruby", "", addresses, "s3cret");
+			ensure_equals("No local spawn server is started",
+				remoteManager.getServerPid(), 0);
+			
+			ApplicationPtr app1(remoteManager.spawn("."));
+			ApplicationPtr app2(remoteManager.spawn("."));
+			ApplicationPtr app3(remoteManager.spawn("."));
+			ensure_equals(app1->getPid(), 1000);
+			ensure_equals(app2->getPid(), 2000);
+			ensure_equals(app3->getPid(), 1001);
+			ensure_equals(app1->getSocketType(), Application::TCP_SOCKET);
+			ensure_equals(app1->getListenSocketName(), "127.0.0.1:4000");
+			
+			app2.reset();
+			ensure("The instance was released", agent2.waitForRelease("2000"));
+		}
+	}
+	
+	TEST_METHOD(5) {
+		// In remote mode, if a spawn agent cannot be reached then the next one
+		// should be tried. If none can be reached, a SpawnException is thrown.
+		FakeSpawnAgent agent(1000);
+		int deadSocket = socket(PF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+		::bind(deadSocket, (const sockaddr *) &addr, sizeof(addr));
+		getsockname(deadSocket, (sockaddr *) &addr, &len);
+		close(deadSocket);
+		
+		vector<string> addresses;
+		addresses.push_back("127.0.0.1:" + toString(ntohs(addr.sin_port)));
+		addresses.push_back(agent.address);
+		{
+			SpawnManager remoteManager("", "", "ruby", "", addresses, "s3cret");
+			ensure_equals(remoteManager.spawn(".")->getPid(), 1000);
+		}
+		
+		addresses.pop_back();
+		SpawnManager deadManager("", "", "ruby", "", addresses, "s3cret");
+		try {
+			deadManager.spawn(".");
+			fail("SpawnException expected");
+		} catch (const SpawnException &) {
+			// Success.
+		}
+	}
+	
+	TEST_METHOD(6) {
+		// In remote mode, a spawn agent that rejects our secret should
+		// not be used.
+		FakeSpawnAgent agent(1000);
+		vector<string> addresses;
+		addresses.push_back(agent.address);
+		SpawnManager remoteManager("", "", "ruby", "", addresses, "wrong");
+		try {
+			remoteManager.spawn(".");
+			fail("SpawnException expected");
+		} catch (const SpawnException &e) {
+			ensure(string(e.what()).find("Wrong spawn agent secret.") != string::npos);
+		}
+	}
+	
+	TEST_METHOD(7) {
+		// If a spawn agent spawns an instance that doesn't listen on TCP,
+		// then the instance is released, but the connection with the agent
+		// stays alive, so that the agent keeps the other instances running.
+		FakeSpawnAgent agent(1000);
+		vector<string> addresses;
+		addresses.push_back(agent.address);
+		{
+			SpawnManager remoteManager("", "", "ruby", "", addresses, "s3cret");
+			ApplicationPtr app1(remoteManager.spawn("."));
+			{
+				boost::mutex::scoped_lock l(agent.lock);
+				agent.unixSpawns = 1;
+			}
+			try {
+				remoteManager.spawn(".");
+				fail("SpawnException expected");
+			} catch (const SpawnException &) {
+				// Success.
+			}
+			ensure("The unreachable instance was released", agent.waitForRelease("1001"));
+			ensure_equals(remoteManager.spawn(".")->getPid(), 1002);
+			ensure_equals(app1->getPid(), 1000);
+		}
+	}
+	
+	static void spawnInBackground(SpawnManager *manager, ApplicationPtr *app) {
+		*app = manager->spawn(".");
+	}
+	
+	TEST_METHOD(8) {
+		// In remote mode, a spawn agent that's slow to spawn an application
+		// doesn't hold up spawns on the other agents.
+		FakeSpawnAgent agent1(1000), agent2(2000);
+		vector<string> addresses;
+		addresses.push_back(agent1.address);
+		addresses.push_back(agent2.address);
+		agent1.spawnDelay = 2000;
+		{
+			SpawnManager remoteManager("", "", "ruby", "", addresses, "s3cret");
+			ApplicationPtr slowApp;
+			boost::thread thr(boost::bind(spawnInBackground, &remoteManager, &slowApp));
+			usleep(200000);
+			
+			time_t begin = time(NULL);
+			ensure_equals(remoteManager.spawn(".")->getPid(), 2000);
+			ensure("The spawn didn't wait for the slow agent", time(NULL) - begin <= 1);
+			thr.join();
+			ensure_equals(slowApp->getPid(), 1000);
+		}
+	}
 }
@@ -1,6 +1,9 @@
 #include "tut.h"
 #include "StandardApplicationPool.h"
 #include "Utils.h"
+#include "MessageChannel.h"
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 using namespace Passenger;
 
@@ -13,9 +16,337 @@ namespace tut {
 			pool2 = pool;
 		}
 	};
-
+	
 	DEFINE_TEST_GROUP(StandardApplicationPoolTest);
-
+	
 	#define USE_TEMPLATE
 	#include "ApplicationPoolTest.cpp"
+	
+	/**
+	 * Returns the application roots that the cluster tests share among
+	 * the cluster nodes.
+	 */
+	static set<string> clusterApps() {
+		set<string> result;
+		for (unsigned int i = 0; i < 100; i++) {
+			result.insert("stub/app" + toString(i));
+		}
+		return result;
+	}
+	
+	/**
+	 * Returns an application root which is placed on another cluster
+	 * node than <tt>self</tt> by the given pool.
+	 */
+	static string findNonLocalApp(StandardApplicationPool &pool) {
+		for (unsigned int i = 0; ; i++) {
+			string appRoot("stub/app" + toString(i));
+			if (!pool.isLocal(appRoot)) {
+				return appRoot;
+			}
+		}
+	}
+	
+	/**
+	 * Acts like the ApplicationPool server of another cluster node: accepts
+	 * a single forwarded get() request, replies with a fake PID, and then
+	 * echoes the session data back.
+	 */
+	static void fakeClusterNode(int server, string *secret, string *appRoot) {
+		int fd = accept(server, NULL, NULL);
+		MessageChannel channel(fd);
+		vector<string> args;
+		
+		channel.read(args);
+		*secret = args[1];
+		channel.read(args);
+		*appRoot = (args.size() == 7) ? args[1] : "";
+		channel.write("ok", "1234", NULL);
+		channel.writeRaw(readAll(fd));
+		close(fd);
+	}
+	
+	TEST_METHOD(30) {
+		// Requests for applications that are placed on another
+		// cluster node are forwarded to that node.
+		StandardApplicationPool &spool(static_cast<StandardApplicationPool &>(*pool));
+		string address, secret, forwardedAppRoot;
+		int server = createTcpServer(address);
+		vector<string> nodes;
+		
+		nodes.push_back(address);
+		spool.setCluster("127.0.0.1:1", nodes, clusterApps(), "s3cret");
+		string appRoot(findNonLocalApp(spool));
+		boost::thread thr(boost::bind(fakeClusterNode, server, &secret,
+			&forwardedAppRoot));
+		
+		Application::SessionPtr session(pool->get(appRoot));
+		ensure_equals(session->getPid(), (pid_t) 1234);
+		MessageChannel(session->getStream()).writeRaw("hello");
+		session->shutdownWriter();
+		ensure_equals(readAll(session->getStream()), "hello");
+		thr.join();
+		ensure_equals("The secret was sent", secret, "s3cret");
+		ensure_equals(forwardedAppRoot, appRoot);
+		ensure_equals("Nothing was spawned", pool->getCount(), 0u);
+		close(server);
+	}
+	
+	TEST_METHOD(31) {
+		// If none of the nodes that own an application are reachable,
+		// then the application is served locally.
+		StandardApplicationPool &spool(static_cast<StandardApplicationPool &>(*pool));
+		string deadAddress, address;
+		createTcpServer(deadAddress, false);
+		int server = createTcpServer(address);
+		vector<string> nodes;
+		
+		nodes.push_back(deadAddress);
+		spool.setCluster("127.0.0.1:1", nodes, clusterApps(), "s3cret");
+		string appRoot(findNonLocalApp(spool));
+		pool->addRemoteInstance(appRoot, address);
+		
+		Application::SessionPtr session(pool->get(appRoot));
+		int client = accept(server, NULL, NULL);
+		ensure("The local pool was used", client != -1);
+		close(client);
+		close(server);
+	}
+	
+	static void doNothing() { }
+	
+	static int createUnixServer(const string &filename) {
+		struct sockaddr_un addr;
+		int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+		
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, filename.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(filename.c_str());
+		::bind(fd, (const struct sockaddr *) &addr, sizeof(addr));
+		listen(fd, 16);
+		return fd;
+	}
+	
+	TEST_METHOD(32) {
+		// Spare connections to an application instance are handed out by
+		// connect() in the order in which they were made, and connections
+		// that the instance has closed are skipped.
+		string filename("/tmp/passenger-test-spare." + toString(getpid()));
+		int server = createUnixServer(filename);
+		ApplicationPtr app(new Application("stub/railsapp", 1234, filename,
+			Application::UNIX_SOCKET, -1));
+		
+		ensure(app->scheduleReplenish());
+		ensure("It was already scheduled", !app->scheduleReplenish());
+		app->replenishSpareConnections();
+		ensure(app->scheduleReplenish());
+		int spare = accept(server, NULL, NULL);
+		
+		Application::SessionPtr session(app->connect(doNothing));
+		MessageChannel(session->getStream()).writeRaw("hello");
+		session->shutdownWriter();
+		ensure_equals("The spare connection was used", readAll(spare), "hello");
+		close(spare);
+		session.reset();
+		
+		app->replenishSpareConnections();
+		close(accept(server, NULL, NULL));
+		session = app->connect(doNothing);
+		int client = accept(server, NULL, NULL);
+		MessageChannel(session->getStream()).writeRaw("world");
+		session->shutdownWriter();
+		ensure_equals("A new connection was made", readAll(client), "world");
+		close(client);
+		session.reset();
+		
+		app.reset();
+		close(server);
+	}
+	
+	static void getWithPriority(ApplicationPoolPtr pool, string appRoot,
+	                            ApplicationPool::Priority priority,
+	                            boost::mutex *lock, vector<ApplicationPool::Priority> *served) {
+		Application::SessionPtr session(pool->get(appRoot, true, "nobody",
+			"production", "smart", "rails", "", priority));
+		boost::mutex::scoped_lock l(*lock);
+		served->push_back(priority);
+	}
+	
+	TEST_METHOD(33) {
+		// When room becomes available in the pool, a waiting request with
+		// a higher priority is served before an older one with a lower
+		// priority.
+		boost::mutex lock;
+		vector<ApplicationPool::Priority> served;
+		
+		pool->setMax(1);
+		Application::SessionPtr session(pool->get("stub/railsapp"));
+		boost::thread low(boost::bind(getWithPriority, pool,
+			string("stub/railsapp2"), ApplicationPool::LOW_PRIORITY,
+			&lock, &served));
+		usleep(100000);
+		boost::thread high(boost::bind(getWithPriority, pool,
+			string("stub/minimal-railsapp"), ApplicationPool::HIGH_PRIORITY,
+			&lock, &served));
+		usleep(100000);
+		session.reset();
+		low.join();
+		high.join();
+		ensure_equals(served.size(), 2u);
+		ensure_equals("The high priority request was served first",
+			served[0], ApplicationPool::HIGH_PRIORITY);
+	}
+	
+	TEST_METHOD(34) {
+		// When all instances of an application are busy and it can't
+		// grow, its requests wait in the pool, and are handed the next
+		// idle instance in order of priority.
+		boost::mutex lock;
+		vector<ApplicationPool::Priority> served;
+		
+		pool->setMax(1);
+		Application::SessionPtr session(pool->get("stub/railsapp"));
+		boost::thread low(boost::bind(getWithPriority, pool,
+			string("stub/railsapp"), ApplicationPool::LOW_PRIORITY,
+			&lock, &served));
+		usleep(100000);
+		boost::thread high(boost::bind(getWithPriority, pool,
+			string("stub/railsapp"), ApplicationPool::HIGH_PRIORITY,
+			&lock, &served));
+		usleep(100000);
+		ensure_equals("Both requests wait", served.size(), 0u);
+		session.reset();
+		low.join();
+		high.join();
+		ensure_equals(served.size(), 2u);
+		ensure_equals("The high priority request was served first",
+			served[0], ApplicationPool::HIGH_PRIORITY);
+		ensure_equals(pool->getCount(), 1u);
+	}
+	
+	TEST_METHOD(35) {
+		// Applications that aren't shared among the cluster nodes are
+		// always served locally.
+		StandardApplicationPool &spool(static_cast<StandardApplicationPool &>(*pool));
+		vector<string> nodes;
+		
+		nodes.push_back("127.0.0.1:2");
+		spool.setCluster("127.0.0.1:1", nodes, clusterApps(), "s3cret");
+		string appRoot(findNonLocalApp(spool));
+		spool.setCluster("127.0.0.1:1", nodes, set<string>(), "s3cret");
+		ensure(spool.isLocal(appRoot));
+	}
+	
+	TEST_METHOD(36) {
+		// A remote instance that can't be connected to is skipped
+		// for a while.
+		StandardApplicationPool &spool(static_cast<StandardApplicationPool &>(*pool));
+		string deadAddress, address;
+		createTcpServer(deadAddress, false);
+		int server = createTcpServer(address);
+		Counter &failures(MetricsRegistry::global().counter(
+			"passenger_connect_retries_total",
+			"Number of failed attempts to connect to an application instance.",
+			MetricsRegistry::label("app", "stub/railsapp")));
+		
+		pool->addRemoteInstance("stub/railsapp", deadAddress);
+		pool->addRemoteInstance("stub/railsapp", address);
+		unsigned long long failuresBefore = failures.get();
+		for (unsigned int i = 0; i < 3; i++) {
+			Application::SessionPtr session(pool->get("stub/railsapp"));
+			close(accept(server, NULL, NULL));
+		}
+		ensure_equals("The dead instance was tried once",
+			failures.get(), failuresBefore + 1);
+		ensure("It's shown as down", spool.toString().find("(down)") != string::npos);
+		
+		pool->removeRemoteInstance("stub/railsapp", address);
+		try {
+			pool->get("stub/railsapp");
+			fail("IOException expected");
+		} catch (const IOException &) {
+			ensure_equals("The dead instance wasn't tried again",
+				failures.get(), failuresBefore + 1);
+		}
+		close(server);
+	}
+	
+	TEST_METHOD(37) {
+		// A cluster node that can't be reached is skipped for a while,
+		// and its applications are served locally in the meantime.
+		StandardApplicationPool &spool(static_cast<StandardApplicationPool &>(*pool));
+		string deadAddress, address;
+		createTcpServer(deadAddress, false);
+		int server = createTcpServer(address);
+		vector<string> nodes;
+		
+		nodes.push_back(deadAddress);
+		spool.setCluster("127.0.0.1:1", nodes, clusterApps(), "s3cret");
+		string appRoot(findNonLocalApp(spool));
+		pool->addRemoteInstance(appRoot, address);
+		Counter &failures(MetricsRegistry::global().counter(
+			"passenger_cluster_forward_failures_total",
+			"Number of failed attempts to forward a get() call to another cluster node.",
+			MetricsRegistry::label("node", deadAddress)));
+		
+		unsigned long long failuresBefore = failures.get();
+		for (unsigned int i = 0; i < 3; i++) {
+			Application::SessionPtr session(pool->get(appRoot));
+			close(accept(server, NULL, NULL));
+		}
+		ensure_equals("The dead node was tried once",
+			failures.get(), failuresBefore + 1);
+		ensure("It's shown as down", spool.toString().find("(down)") != string::npos);
+		close(server);
+	}
+	
+	TEST_METHOD(38) {
+		// getAsync() calls that wait for a busy application don't hold
+		// up those for other applications, no matter how many there are.
+		vector<PendingGetPtr> pendingGets;
+		struct pollfd pfd;
+		
+		pool->setMax(2);
+		pool->setMaxPerApp(1);
+		Application::SessionPtr session(pool->get("stub/railsapp"));
+		for (unsigned int i = 0; i < 20; i++) {
+			pendingGets.push_back(pool->getAsync("stub/railsapp"));
+		}
+		PendingGetPtr other(pool->getAsync("stub/minimal-railsapp"));
+		pfd.fd = other->getFd();
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		ensure_equals("The other application is served", poll(&pfd, 1, 5000), 1);
+		other->get();
+		ensure("The busy application's gets wait", !pendingGets[0]->isReady());
+		
+		session.reset();
+		pfd.fd = pendingGets[0]->getFd();
+		ensure_equals("The first one is served once the instance is idle",
+			poll(&pfd, 1, 5000), 1);
+		session = pendingGets[0]->get();
+		ensure("The others keep waiting", !pendingGets[1]->isReady());
+	}
+	
+	TEST_METHOD(39) {
+		// getAsync() calls that wait in line are rejected once they've
+		// waited for longer than the maximum request queue time.
+		struct pollfd pfd;
+		
+		pool->setMax(1);
+		pool->setRequestQueueLimits(0, 0, 1);
+		Application::SessionPtr session(pool->get("stub/railsapp"));
+		PendingGetPtr pendingGet(pool->getAsync("stub/railsapp"));
+		pfd.fd = pendingGet->getFd();
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		ensure_equals("The get is rejected in time", poll(&pfd, 1, 5000), 1);
+		try {
+			pendingGet->get();
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			// Success.
+		}
+	}
 }
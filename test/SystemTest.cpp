@@ -0,0 +1,143 @@
+#include "tut.h"
+#include "System.h"
+#include <boost/bind.hpp>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct SystemTest {
+		int fds[2];
+		volatile bool interrupted;
+		string received;
+		
+		SystemTest() {
+			socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+			interrupted = false;
+		}
+		
+		~SystemTest() {
+			close(fds[0]);
+			close(fds[1]);
+		}
+		
+		void readOnce() {
+			char buf[32];
+			try {
+				ssize_t ret = InterruptableCalls::read(fds[0], buf, sizeof(buf));
+				if (ret > 0) {
+					received.assign(buf, ret);
+				}
+			} catch (const thread_interrupted &) {
+				interrupted = true;
+			}
+		}
+		
+		void readWithoutInterruption() {
+			this_thread::disable_syscall_interruption dsi;
+			readOnce();
+		}
+		
+		void waitForChild(pid_t pid) {
+			int status;
+			if (InterruptableCalls::waitpid(pid, &status, 0) == pid) {
+				received = WEXITSTATUS(status) == 3 ? "exited" : "wrong status";
+			}
+		}
+		
+		void sleepLong() {
+			try {
+				InterruptableCalls::usleep(60 * 1000000);
+			} catch (const thread_interrupted &) {
+				interrupted = true;
+			}
+		}
+	};
+	
+	DEFINE_TEST_GROUP(SystemTest);
+	
+	TEST_METHOD(1) {
+		// A Thread that is blocked in a read can be interrupted.
+		Thread thr(boost::bind(&SystemTest::readOnce, this));
+		usleep(20000);
+		thr.interruptAndJoin();
+		ensure(interrupted);
+	}
+	
+	TEST_METHOD(2) {
+		// Reading data that is already available works in a Thread,
+		// for sockets as well as for pipes.
+		write(fds[1], "hello", 5);
+		Thread thr(boost::bind(&SystemTest::readOnce, this));
+		thr.join();
+		ensure(!interrupted);
+		ensure_equals(received, "hello");
+		
+		int p[2];
+		pipe(p);
+		close(fds[0]);
+		fds[0] = p[0];
+		Thread thr2(boost::bind(&SystemTest::readOnce, this));
+		usleep(20000);
+		write(p[1], "world", 5);
+		thr2.join();
+		close(p[1]);
+		ensure(!interrupted);
+		ensure_equals(received, "world");
+	}
+	
+	TEST_METHOD(3) {
+		// An interruption that is requested before the thread blocks
+		// isn't lost.
+		{
+			this_thread::disable_syscall_interruption dsi;
+			Thread thr(boost::bind(&SystemTest::sleepLong, this));
+			thr.interrupt();
+			thr.join();
+		}
+		ensure(interrupted);
+	}
+	
+	TEST_METHOD(4) {
+		// A read with system call interruption disabled isn't interrupted.
+		Thread thr(boost::bind(&SystemTest::readWithoutInterruption, this));
+		usleep(20000);
+		thr.interrupt();
+		usleep(20000);
+		write(fds[1], "hello", 5);
+		thr.join();
+		ensure(!interrupted);
+		ensure_equals(received, "hello");
+	}
+	
+	TEST_METHOD(5) {
+		// In a thread that is not a Thread, InterruptableCalls are plain
+		// blocking system calls.
+		write(fds[1], "hello", 5);
+		readOnce();
+		ensure_equals(received, "hello");
+		
+		pid_t pid = fork();
+		if (pid == 0) {
+			_exit(3);
+		}
+		int status;
+		ensure_equals(InterruptableCalls::waitpid(pid, &status, 0), pid);
+		ensure_equals(WEXITSTATUS(status), 3);
+	}	
+	TEST_METHOD(6) {
+		// waitpid() works in a Thread.
+		pid_t pid = fork();
+		if (pid == 0) {
+			usleep(20000);
+			_exit(3);
+		}
+		Thread thr(boost::bind(&SystemTest::waitForChild, this, pid));
+		thr.join();
+		ensure_equals(received, "exited");
+	}
+}
@@ -0,0 +1,123 @@
+#include "tut.h"
+#include "ThreadPool.h"
+#include <boost/bind.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct ThreadPoolTest {
+		int fds[2];
+		volatile int runs;
+		volatile bool interrupted;
+		string received;
+		
+		ThreadPoolTest() {
+			socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+			runs = 0;
+			interrupted = false;
+		}
+		
+		~ThreadPoolTest() {
+			close(fds[0]);
+			close(fds[1]);
+		}
+		
+		void increment() {
+			__sync_fetch_and_add(&runs, 1);
+		}
+		
+		void readOnce() {
+			char buf[32];
+			try {
+				ssize_t ret = InterruptableCalls::read(fds[0], buf, sizeof(buf));
+				if (ret > 0) {
+					received.assign(buf, ret);
+				}
+			} catch (const thread_interrupted &) {
+				interrupted = true;
+			}
+		}
+		
+		void waitUntilIdle(ThreadPool &pool, unsigned int count) {
+			for (int i = 0; i < 500 && pool.getIdleCount() != count; i++) {
+				usleep(10000);
+			}
+		}
+	};
+	
+	DEFINE_TEST_GROUP(ThreadPoolTest);
+	
+	TEST_METHOD(1) {
+		// Tasks are run, and a finished task's thread is reused.
+		ThreadPool pool(1024 * 128);
+		pool.run(boost::bind(&ThreadPoolTest::increment, this));
+		waitUntilIdle(pool, 1);
+		pool.run(boost::bind(&ThreadPoolTest::increment, this));
+		waitUntilIdle(pool, 1);
+		ensure_equals(runs, 2);
+		ensure_equals(pool.getThreadCount(), 1u);
+	}
+	
+	TEST_METHOD(2) {
+		// The constructor creates minIdle threads right away.
+		ThreadPool pool(1024 * 128, 3, 5);
+		ensure_equals(pool.getThreadCount(), 3u);
+		ensure_equals(pool.getIdleCount(), 3u);
+	}
+	
+	TEST_METHOD(3) {
+		// At most maxIdle threads are kept around once their tasks are done.
+		ThreadPool pool(1024 * 128, 0, 1);
+		ThreadPool::TaskPtr task1(pool.run(boost::bind(&ThreadPoolTest::readOnce, this)));
+		ThreadPool::TaskPtr task2(pool.run(boost::bind(&ThreadPoolTest::readOnce, this)));
+		ensure_equals(pool.getThreadCount(), 2u);
+		pool.interruptAndWait(task1);
+		pool.interruptAndWait(task2);
+		for (int i = 0; i < 500 && pool.getThreadCount() != 1; i++) {
+			usleep(10000);
+		}
+		ensure_equals(pool.getThreadCount(), 1u);
+		ensure_equals(pool.getIdleCount(), 1u);
+	}
+	
+	TEST_METHOD(4) {
+		// interruptAndWait() interrupts a blocked task, and the interruption
+		// doesn't affect the next task that runs in the same thread.
+		ThreadPool pool(1024 * 128);
+		ThreadPool::TaskPtr task(pool.run(boost::bind(&ThreadPoolTest::readOnce, this)));
+		usleep(20000);
+		pool.interruptAndWait(task);
+		ensure("The task was interrupted", interrupted);
+		
+		interrupted = false;
+		pool.run(boost::bind(&ThreadPoolTest::readOnce, this));
+		write(fds[1], "hello", 5);
+		waitUntilIdle(pool, 1);
+		ensure("The next task was not interrupted", !interrupted);
+		ensure_equals(received, "hello");
+		ensure_equals(pool.getThreadCount(), 1u);
+	}
+	
+	TEST_METHOD(5) {
+		// interruptAndWait() on a finished task returns immediately.
+		ThreadPool pool(1024 * 128);
+		ThreadPool::TaskPtr task(pool.run(boost::bind(&ThreadPoolTest::increment, this)));
+		waitUntilIdle(pool, 1);
+		pool.interruptAndWait(task);
+		ensure_equals(runs, 1);
+	}
+	
+	TEST_METHOD(6) {
+		// Destroying the pool interrupts running tasks.
+		{
+			ThreadPool pool(1024 * 128, 2, 2);
+			pool.run(boost::bind(&ThreadPoolTest::readOnce, this));
+			usleep(20000);
+		}
+		ensure("The task was interrupted", interrupted);
+	}
+}
@@ -1,5 +1,10 @@
 #include "tut.h"
 #include "Utils.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <cstring>
 #include <unistd.h>
 #include <limits.h>
 
@@ -21,6 +26,13 @@ namespace tut {
 	};
 
 	DEFINE_TEST_GROUP(UtilsTest);
+	
+	static string localAddress(int serverFd) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		getsockname(serverFd, (struct sockaddr *) &addr, &len);
+		return "127.0.0.1:" + toString(ntohs(addr.sin_port));
+	}
 
 	/***** Test split() *****/
 
@@ -98,4 +110,123 @@ namespace tut {
 		setenv("PATH", binpath.c_str(), 1);
 		ensure("Spawn server is found.", !findSpawnServer().empty());
 	}
+	
+	
+	/**** Test appendHeader() and terminateHeaders() ****/
+	
+	TEST_METHOD(11) {
+		// Headers are serialized as null-terminated name/value pairs,
+		// followed by a dummy header.
+		string buffer;
+		appendHeader(buffer, "REQUEST_METHOD", "GET");
+		appendHeader(buffer, "QUERY_STRING", "");
+		terminateHeaders(buffer);
+		ensure_equals(buffer, string("REQUEST_METHOD\0GET\0QUERY_STRING\0\0_\0_\0",
+			sizeof("REQUEST_METHOD\0GET\0QUERY_STRING\0\0_\0_\0") - 1));
+	}
+	
+	
+	/**** Test isValidTraceId() and generateTraceId() ****/
+	
+	TEST_METHOD(12) {
+		// Trace IDs from untrusted sources are validated.
+		ensure(isValidTraceId("abc-123_XYZ.foo:bar@baz+q=/"));
+		ensure(!isValidTraceId(""));
+		ensure(!isValidTraceId("foo bar"));
+		ensure(!isValidTraceId("foo\r\nX-Injected: yes"));
+		ensure(isValidTraceId(string(64, 'a').c_str()));
+		ensure(!isValidTraceId(string(65, 'a').c_str()));
+	}
+	
+	TEST_METHOD(13) {
+		// Generated trace IDs are valid and unique.
+		string first(generateTraceId());
+		string second(generateTraceId());
+		ensure_equals(first.size(), 24u);
+		ensure(isValidTraceId(first.c_str()));
+		ensure(first != second);
+	}
+	
+	
+	/**** Test readSecretFile() and secretsEqual() ****/
+	
+	TEST_METHOD(14) {
+		// Trailing whitespace isn't part of a secret, and empty or
+		// missing secret files are rejected.
+		TempFile file(false);
+		fputs(" s3cret x\n\n", file.handle);
+		fflush(file.handle);
+		ensure_equals(readSecretFile(file.filename), " s3cret x");
+		
+		TempFile emptyFile(false);
+		fputs(" \n", emptyFile.handle);
+		fflush(emptyFile.handle);
+		try {
+			readSecretFile(emptyFile.filename);
+			fail("ConfigurationException expected");
+		} catch (const ConfigurationException &) {
+			// Success.
+		}
+		try {
+			readSecretFile("/nonexistant/secret");
+			fail("FileSystemException expected");
+		} catch (const FileSystemException &) {
+			// Success.
+		}
+	}
+	
+	TEST_METHOD(15) {
+		ensure(secretsEqual("s3cret", "s3cret"));
+		ensure(!secretsEqual("s3cret", "s3creT"));
+		ensure(!secretsEqual("s3cret", "s3cre"));
+		ensure(!secretsEqual("", "s3cret"));
+		ensure(secretsEqual("", ""));
+	}
+	
+	/**** Test connectToTcpServer() ****/
+	
+	TEST_METHOD(16) {
+		// connectToTcpServer() with a timeout connects to a listening
+		// server, and fails immediately if nothing is listening.
+		int serverFd = createTcpServer("127.0.0.1:0");
+		string address(localAddress(serverFd));
+		int fd = connectToTcpServer(address, 1000);
+		close(fd);
+		close(serverFd);
+		try {
+			connectToTcpServer(address, 1000);
+			fail("SystemException expected");
+		} catch (const SystemException &e) {
+			ensure_equals(e.code(), ECONNREFUSED);
+		}
+	}
+	
+	TEST_METHOD(17) {
+		// connectToTcpServer() gives up after the timeout if the server
+		// doesn't accept the connection, e.g. because its backlog is full.
+		int serverFd = createTcpServer("127.0.0.1:0", 1);
+		string address(localAddress(serverFd));
+		vector<int> fds;
+		struct timeval start, end;
+		bool timedOut = false;
+		
+		for (int i = 0; i < 10 && !timedOut; i++) {
+			gettimeofday(&start, NULL);
+			try {
+				fds.push_back(connectToTcpServer(address, 200));
+			} catch (const SystemException &e) {
+				gettimeofday(&end, NULL);
+				ensure_equals(e.code(), ETIMEDOUT);
+				ensure("It doesn't wait much longer than the timeout",
+					(end.tv_sec - start.tv_sec) * 1000 +
+					(end.tv_usec - start.tv_usec) / 1000 < 1000);
+				timedOut = true;
+			}
+		}
+		for (unsigned int i = 0; i < fds.size(); i++) {
+			close(fds[i]);
+		}
+		close(serverFd);
+		ensure("A connection timed out", timedOut);
+	}
 }